@@ -0,0 +1,101 @@
+#include "arena.h"
+
+typedef struct http_arena_chunk
+{
+    struct http_arena_chunk*    next;
+    _Alignas(HTTP_ARENA_ALIGN) char data[];
+} http_arena_chunk_t;
+
+static void _http_arena_free_extra(http_arena_t* self)
+{
+    http_arena_chunk_t* chunk;
+    while ((chunk = self->extra) != NULL)
+    {
+        self->extra = chunk->next;
+        self->mem->free(chunk);
+    }
+}
+
+void http_arena_pool_init(http_arena_pool_t* pool, const auto_api_memory_t* mem, size_t block_size)
+{
+    pool->mem = mem;
+    pool->block_size = (block_size + HTTP_ARENA_ALIGN - 1) & ~(size_t)(HTTP_ARENA_ALIGN - 1);
+    mpsc_queue_init(&pool->idle);
+}
+
+void http_arena_pool_exit(http_arena_pool_t* pool)
+{
+    mpsc_node_t* node;
+    while ((node = mpsc_queue_pop(&pool->idle)) != NULL)
+    {
+        pool->mem->free(container_of(node, http_arena_t, node));
+    }
+}
+
+http_arena_t* http_arena_acquire(http_arena_pool_t* pool)
+{
+    http_arena_t* self;
+    mpsc_node_t* node = mpsc_queue_pop(&pool->idle);
+
+    if (node != NULL)
+    {
+        self = container_of(node, http_arena_t, node);
+    }
+    else
+    {
+        self = pool->mem->malloc(sizeof(http_arena_t) + pool->block_size);
+        self->pool = pool;
+        self->mem = pool->mem;
+        self->extra = NULL;
+        self->size = pool->block_size;
+        self->used = 0;
+    }
+
+    atomic_init(&self->refcnt, 1);
+    return self;
+}
+
+void* http_arena_alloc(http_arena_t* self, size_t size)
+{
+    size_t pos = (self->used + HTTP_ARENA_ALIGN - 1) & ~(size_t)(HTTP_ARENA_ALIGN - 1);
+
+    if (pos <= self->size && size <= self->size - pos)
+    {
+        self->used = pos + size;
+        return self->data + pos;
+    }
+
+    /* Too large for what is left, give it a chunk of its own. */
+    http_arena_chunk_t* chunk = self->mem->malloc(sizeof(http_arena_chunk_t) + size);
+    chunk->next = self->extra;
+    self->extra = chunk;
+    return chunk->data;
+}
+
+void http_arena_ref(http_arena_t* self)
+{
+    atomic_fetch_add_explicit(&self->refcnt, 1, memory_order_relaxed);
+}
+
+void http_arena_release(http_arena_t* self)
+{
+    if (atomic_fetch_sub_explicit(&self->refcnt, 1, memory_order_acq_rel) != 1)
+    {
+        return;
+    }
+
+    _http_arena_free_extra(self);
+    self->used = 0;
+
+    if (self->pool == NULL)
+    {
+        self->mem->free(self);
+        return;
+    }
+    mpsc_queue_push(&self->pool->idle, &self->node);
+}
+
+void http_arena_detach(http_arena_t* self)
+{
+    self->pool = NULL;
+}
@@ -0,0 +1,105 @@
+#ifndef __AUTO_MONGOOSE_ARENA_H__
+#define __AUTO_MONGOOSE_ARENA_H__
+
+#include <autodo.h>
+#include "mpsc.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Alignment of every allocation from arena.
+ */
+#define HTTP_ARENA_ALIGN    16
+
+struct http_arena_chunk;
+
+/**
+ * @brief Pool of idle arenas.
+ *
+ * Arenas are taken by one thread and may be given back by any thread, so a
+ * warmed up pool serves requests without touching the heap.
+ */
+typedef struct http_arena_pool
+{
+    const auto_api_memory_t*    mem;        /**< Memory API. */
+    size_t                      block_size; /**< Inline size of each arena. */
+    mpsc_queue_t                idle;       /**< Idle #http_arena_t. */
+} http_arena_pool_t;
+
+/**
+ * @brief Bump allocator that is reset in one step.
+ */
+typedef struct http_arena
+{
+    mpsc_node_t                 node;       /**< Node for #http_arena_pool_t::idle */
+    http_arena_pool_t*          pool;       /**< Owner pool, NULL if detached. */
+    const auto_api_memory_t*    mem;        /**< Memory API. */
+    atomic_int                  refcnt;     /**< Arena is reset when it drops to zero. */
+    struct http_arena_chunk*    extra;      /**< Allocations that did not fit inline. */
+    size_t                      size;       /**< Size of #http_arena_t::data */
+    size_t                      used;       /**< Bytes used in #http_arena_t::data */
+    _Alignas(HTTP_ARENA_ALIGN) char data[];
+} http_arena_t;
+
+/**
+ * @brief Initialize pool.
+ * @param[out] pool     Pool.
+ * @param[in] mem       Memory API.
+ * @param[in] block_size    Inline size of each arena. Allocations beyond that
+ *   still work, but each one costs a heap allocation.
+ */
+void http_arena_pool_init(http_arena_pool_t* pool, const auto_api_memory_t* mem, size_t block_size);
+
+/**
+ * @brief Release all idle arenas.
+ * @warning Arenas still in use must be detached before.
+ * @param[in] pool      Pool.
+ */
+void http_arena_pool_exit(http_arena_pool_t* pool);
+
+/**
+ * @brief Get an empty arena with one reference.
+ * @warning Only one thread may acquire from a pool.
+ * @param[in] pool      Pool.
+ * @return              Arena.
+ */
+http_arena_t* http_arena_acquire(http_arena_pool_t* pool);
+
+/**
+ * @brief Allocate \p size bytes from arena.
+ * @warning Only one thread at a time may allocate from an arena.
+ * @param[in] self      Arena.
+ * @param[in] size      Size in bytes.
+ * @return              Memory aligned to #HTTP_ARENA_ALIGN. It lives until
+ *   the arena is reset.
+ */
+void* http_arena_alloc(http_arena_t* self, size_t size);
+
+/**
+ * @brief Add a reference.
+ * @note MT-Safe
+ * @param[in] self      Arena.
+ */
+void http_arena_ref(http_arena_t* self);
+
+/**
+ * @brief Drop a reference. The last one resets arena and gives it back to
+ *   its pool.
+ * @note MT-Safe
+ * @param[in] self      Arena.
+ */
+void http_arena_release(http_arena_t* self);
+
+/**
+ * @brief Make arena free itself on last release instead of going back to
+ *   its pool, so the pool can be destroyed first.
+ * @param[in] self      Arena.
+ */
+void http_arena_detach(http_arena_t* self);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
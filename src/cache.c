@@ -0,0 +1,228 @@
+#include "cache.h"
+#include <stddef.h>
+#include <string.h>
+
+/**
+ * @brief Number of shards, each with its own lock.
+ */
+#define HTTP_CACHE_SHARDS   16
+
+typedef struct http_cache_shard
+{
+    auto_sem_t*         lock;       /**< Lock for everything below. */
+    auto_map_t          entries;    /**< #http_cache_entry_t by key. */
+    auto_list_t         lru;        /**< Filled #http_cache_entry_t, most recently used first. */
+    size_t              bytes;      /**< Total size of cached responses. */
+} http_cache_shard_t;
+
+struct http_cache
+{
+    const auto_api_t*   api;
+    size_t              max_bytes;  /**< Max total size of cached responses per shard. */
+    http_cache_shard_t  shards[HTTP_CACHE_SHARDS];
+};
+
+/**
+ * @brief FNV-1a.
+ */
+static uint64_t _http_cache_hash(const char* key, size_t len)
+{
+    size_t i;
+    uint64_t h = 14695981039346656037ULL;
+    for (i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static int _http_cache_cmp_entry(const auto_map_node_t* key1,
+    const auto_map_node_t* key2, void* arg)
+{
+    (void)arg;
+    http_cache_entry_t* e1 = container_of(key1, http_cache_entry_t, node);
+    http_cache_entry_t* e2 = container_of(key2, http_cache_entry_t, node);
+
+    if (e1->hash != e2->hash)
+    {
+        return e1->hash < e2->hash ? -1 : 1;
+    }
+    if (e1->key_len != e2->key_len)
+    {
+        return e1->key_len < e2->key_len ? -1 : 1;
+    }
+    return memcmp(e1->key, e2->key, e1->key_len);
+}
+
+void http_cache_entry_release(http_cache_entry_t* entry)
+{
+    if (atomic_fetch_sub(&entry->refcnt, 1) != 1)
+    {
+        return;
+    }
+
+    if (entry->data != NULL)
+    {
+        entry->api->memory->free(entry->data);
+    }
+    entry->api->memory->free(entry->key);
+    entry->api->memory->free(entry);
+}
+
+/**
+ * @brief Drop \p entry from \p shard.
+ * @warning Must hold #http_cache_shard_t::lock
+ */
+static void _http_cache_evict(const auto_api_t* api, http_cache_shard_t* shard, http_cache_entry_t* entry)
+{
+    api->map->erase(&shard->entries, &entry->node);
+    if (!entry->filling)
+    {
+        api->list->erase(&shard->lru, &entry->lru);
+        shard->bytes -= entry->len;
+    }
+    http_cache_entry_release(entry);
+}
+
+http_cache_t* http_cache_create(const auto_api_t* api, size_t max_bytes)
+{
+    size_t i;
+    http_cache_t* self = api->memory->calloc(1, sizeof(http_cache_t));
+
+    self->api = api;
+    self->max_bytes = max_bytes / HTTP_CACHE_SHARDS;
+    for (i = 0; i < HTTP_CACHE_SHARDS; i++)
+    {
+        http_cache_shard_t* shard = &self->shards[i];
+        shard->lock = api->sem->create(1);
+        api->map->init(&shard->entries, _http_cache_cmp_entry, NULL);
+        api->list->init(&shard->lru);
+    }
+
+    return self;
+}
+
+void http_cache_destroy(http_cache_t* self, http_cache_drop_cb drop)
+{
+    size_t i;
+    auto_map_node_t* it;
+    auto_list_node_t* node;
+    const auto_api_t* api = self->api;
+
+    for (i = 0; i < HTTP_CACHE_SHARDS; i++)
+    {
+        http_cache_shard_t* shard = &self->shards[i];
+        while ((it = api->map->begin(&shard->entries)) != NULL)
+        {
+            http_cache_entry_t* entry = container_of(it, http_cache_entry_t, node);
+            while ((node = api->list->pop_front(&entry->waiters)) != NULL)
+            {
+                drop(container_of(node, http_cache_waiter_t, node));
+            }
+            _http_cache_evict(api, shard, entry);
+        }
+        api->sem->destroy(shard->lock);
+    }
+
+    api->memory->free(self);
+}
+
+int http_cache_lookup(http_cache_t* self, const char* key, size_t key_len, uint64_t now,
+    http_cache_waiter_t* waiter, http_cache_entry_t** entry)
+{
+    auto_map_node_t* it;
+    http_cache_entry_t tmp, *hit;
+    const auto_api_t* api = self->api;
+
+    tmp.hash = _http_cache_hash(key, key_len);
+    tmp.key = (char*)key;
+    tmp.key_len = key_len;
+    http_cache_shard_t* shard = &self->shards[tmp.hash % HTTP_CACHE_SHARDS];
+
+    api->sem->wait(shard->lock);
+    if ((it = api->map->find(&shard->entries, &tmp.node)) != NULL)
+    {
+        hit = container_of(it, http_cache_entry_t, node);
+        if (hit->filling)
+        {
+            if (waiter != NULL)
+            {
+                api->list->push_back(&hit->waiters, &waiter->node);
+            }
+            api->sem->post(shard->lock);
+            return HTTP_CACHE_WAIT;
+        }
+        if (hit->expire > now)
+        {
+            api->list->erase(&shard->lru, &hit->lru);
+            api->list->push_front(&shard->lru, &hit->lru);
+            atomic_fetch_add(&hit->refcnt, 1);
+            api->sem->post(shard->lock);
+            *entry = hit;
+            return HTTP_CACHE_HIT;
+        }
+        _http_cache_evict(api, shard, hit);
+    }
+    if (waiter == NULL)
+    {
+        api->sem->post(shard->lock);
+        return HTTP_CACHE_MISS;
+    }
+
+    /* Placeholder, so misses that follow wait for this one. */
+    hit = api->memory->calloc(1, sizeof(http_cache_entry_t));
+    atomic_init(&hit->refcnt, 2);
+    hit->api = api;
+    hit->hash = tmp.hash;
+    hit->key = api->memory->malloc(key_len);
+    memcpy(hit->key, key, key_len);
+    hit->key_len = key_len;
+    hit->filling = 1;
+    api->list->init(&hit->waiters);
+    api->map->insert(&shard->entries, &hit->node);
+    api->sem->post(shard->lock);
+
+    *entry = hit;
+    return HTTP_CACHE_MISS;
+}
+
+void http_cache_fill(http_cache_t* self, http_cache_entry_t* entry, const char* data, size_t len,
+    uint64_t expire, auto_list_t* waiters)
+{
+    char* copy = NULL;
+    const auto_api_t* api = self->api;
+    http_cache_shard_t* shard = &self->shards[entry->hash % HTTP_CACHE_SHARDS];
+
+    /* Copy without lock, other poll threads go on. */
+    if (data != NULL && len <= self->max_bytes)
+    {
+        copy = api->memory->malloc(len);
+        memcpy(copy, data, len);
+    }
+
+    api->sem->wait(shard->lock);
+    api->list->migrate(waiters, &entry->waiters);
+    if (copy == NULL)
+    {
+        _http_cache_evict(api, shard, entry);
+    }
+    else
+    {
+        entry->filling = 0;
+        entry->data = copy;
+        entry->len = len;
+        entry->expire = expire;
+        api->list->push_front(&shard->lru, &entry->lru);
+        shard->bytes += len;
+
+        while (shard->bytes > self->max_bytes)
+        {
+            http_cache_entry_t* victim = container_of(api->list->end(&shard->lru), http_cache_entry_t, lru);
+            _http_cache_evict(api, shard, victim);
+        }
+    }
+    api->sem->post(shard->lock);
+
+    http_cache_entry_release(entry);
+}
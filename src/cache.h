@@ -0,0 +1,125 @@
+#ifndef __AUTO_MONGOOSE_CACHE_H__
+#define __AUTO_MONGOOSE_CACHE_H__
+
+#include <autodo.h>
+#include <stdatomic.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Result of http_cache_lookup().
+ */
+typedef enum http_cache_rc
+{
+    HTTP_CACHE_HIT,         /**< Response is cached. */
+    HTTP_CACHE_MISS,        /**< Nothing cached, nobody is producing it. */
+    HTTP_CACHE_WAIT,        /**< Response is being produced for another request. */
+} http_cache_rc_t;
+
+/**
+ * @brief Request waiting for a response another request produces.
+ */
+typedef struct http_cache_waiter
+{
+    auto_list_node_t            node;       /**< Node for #http_cache_entry_t::waiters */
+} http_cache_waiter_t;
+
+/**
+ * @brief Cached response, or a placeholder while it is produced.
+ */
+typedef struct http_cache_entry
+{
+    auto_map_node_t             node;       /**< Node for shard map. */
+    auto_list_node_t            lru;        /**< Node for shard LRU list. */
+    atomic_int                  refcnt;     /**< One for the cache, one for each user. */
+    const auto_api_t*           api;
+
+    uint64_t                    hash;       /**< Hash of key. */
+    char*                       key;        /**< Key, not NUL terminated. */
+    size_t                      key_len;
+
+    int                         filling;    /**< Response is being produced. */
+    auto_list_t                 waiters;    /**< #http_cache_waiter_t while filling. */
+
+    uint64_t                    expire;     /**< When it goes stale, in nanoseconds. */
+    char*                       data;       /**< Serialized response. */
+    size_t                      len;        /**< Length of #http_cache_entry_t::data */
+} http_cache_entry_t;
+
+struct http_cache;
+typedef struct http_cache http_cache_t;
+
+/**
+ * @brief Called for each waiter left in cache when it is destroyed.
+ */
+typedef void (*http_cache_drop_cb)(http_cache_waiter_t* waiter);
+
+/**
+ * @brief Create a response cache.
+ *
+ * Keys are spread over shards with a lock each, so poll threads seldom wait
+ * for each other.
+ *
+ * @param[in] api       autodo API.
+ * @param[in] max_bytes Max total size of cached responses.
+ * @return              Cache object.
+ */
+http_cache_t* http_cache_create(const auto_api_t* api, size_t max_bytes);
+
+/**
+ * @brief Destroy cache.
+ *
+ * Entries still referenced stay alive until released.
+ *
+ * @param[in] self      Cache object.
+ * @param[in] drop      Called for each waiter not answered.
+ */
+void http_cache_destroy(http_cache_t* self, http_cache_drop_cb drop);
+
+/**
+ * @brief Look up \p key.
+ *
+ * With a \p waiter, a miss inserts a placeholder the caller must fill with
+ * http_cache_fill(), and a response being produced queues \p waiter on it.
+ * Without one, nothing changes.
+ *
+ * @note MT-Safe
+ * @param[in] self      Cache object.
+ * @param[in] key       Key.
+ * @param[in] key_len   Length of \p key.
+ * @param[in] now       Current time in nanoseconds.
+ * @param[in] waiter    Waiter, or NULL.
+ * @param[out] entry    Entry with a reference for caller on #HTTP_CACHE_HIT,
+ *   and on #HTTP_CACHE_MISS if \p waiter is given.
+ * @return              #http_cache_rc_t
+ */
+int http_cache_lookup(http_cache_t* self, const char* key, size_t key_len, uint64_t now,
+    http_cache_waiter_t* waiter, http_cache_entry_t** entry);
+
+/**
+ * @brief Finish placeholder \p entry got from a miss, and drop caller reference.
+ * @note MT-Safe
+ * @param[in] self      Cache object.
+ * @param[in] entry     Placeholder.
+ * @param[in] data      Response to cache, copied. NULL if it must not be
+ *   cached, which removes the placeholder.
+ * @param[in] len       Length of \p data.
+ * @param[in] expire    When response goes stale, in nanoseconds.
+ * @param[out] waiters  Receives #http_cache_waiter_t that waited for it.
+ */
+void http_cache_fill(http_cache_t* self, http_cache_entry_t* entry, const char* data, size_t len,
+    uint64_t expire, auto_list_t* waiters);
+
+/**
+ * @brief Drop a reference.
+ * @note MT-Safe
+ * @param[in] entry     Entry.
+ */
+void http_cache_entry_release(http_cache_entry_t* entry);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,828 @@
+#include "http_client.h"
+#include <mongoose.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#if !defined(_WIN32)
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+/**
+ * @brief Poll timeout of manager thread in milliseconds.
+ *
+ * New requests wake it through wakeup channel, so this only decides how
+ * often timeouts are checked.
+ */
+#define HTTP_CLIENT_POLL_TIMEOUT    100
+
+/**
+ * @brief Default request timeout in milliseconds.
+ */
+#define HTTP_CLIENT_TIMEOUT         30000
+
+/**
+ * @brief Pseudo-index of upvalue \p i of running C function.
+ */
+#define HTTP_CLIENT_UPVALUE_INDEX(i)    (AUTO_LUA_REGISTRYINDEX - (i))
+
+/**
+ * @brief Request from lua, owned by manager thread until it is finished.
+ */
+typedef struct http_client_job
+{
+    auto_list_node_t            node;       /**< Node for #http_client_t::inbox or #http_client_host_t::queue */
+    auto_coroutine_t*           waiter;     /**< Coroutine waiting for response. */
+
+    char*                       key;        /**< Pool key, scheme and authority of URL. */
+    char*                       req;        /**< Serialized request. */
+    size_t                      req_len;    /**< Length of #http_client_job_t::req */
+    uint64_t                    deadline;   /**< mg_millis() the request fails at. */
+    int                         idempotent; /**< Method may be sent twice. */
+    int                         retried;    /**< Already sent again on a fresh connection. */
+
+    char*                       error;      /**< Why request failed, NULL if it did not. */
+    int                         status;     /**< Response status. */
+    char*                       resp;       /**< Response head followed by body. */
+    size_t                      head_len;   /**< Length of head in #http_client_job_t::resp */
+    size_t                      body_len;   /**< Length of body in #http_client_job_t::resp */
+} http_client_job_t;
+
+/**
+ * @brief Keep-alive pool of one upstream, only touched by manager thread.
+ */
+typedef struct http_client_host
+{
+    auto_map_node_t             node;       /**< Node for #http_client_t::hosts */
+    char*                       key;        /**< Scheme and authority. */
+    auto_list_t                 idle;       /**< #http_client_conn_t waiting for a request, most recent first. */
+    auto_list_t                 queue;      /**< #http_client_job_t waiting for a connection. */
+    unsigned                    conn_cnt;   /**< Connections open or opening. */
+} http_client_host_t;
+
+/**
+ * @brief Upstream connection, only touched by manager thread.
+ */
+typedef struct http_client_conn
+{
+    auto_list_node_t            node;       /**< Node for #http_client_host_t::idle */
+    struct http_client*         client;
+    http_client_host_t*         host;       /**< Pool it belongs to. */
+    struct mg_connection*       c;
+    http_client_job_t*          job;        /**< Request in flight, NULL if none. */
+    int                         idle;       /**< In #http_client_host_t::idle */
+    int                         reused;     /**< A response came on it before. */
+    uint64_t                    idle_since; /**< mg_millis() it went idle. */
+    char*                       error;      /**< Last error reported by mongoose. */
+} http_client_conn_t;
+
+typedef struct http_client
+{
+    auto_async_t*               async;      /**< Resumes waiters in lua. */
+    auto_thread_t*              thread;     /**< Manager thread, NULL until first request. */
+    struct mg_mgr               mgr;
+    atomic_int                  looping;    /**< Manager thread keeps running. */
+
+    int                         wakeup_fd;  /**< Write end of wakeup channel, -1 if not available. */
+    atomic_int                  wakeup_pending; /**< A wakeup byte is in flight. */
+
+    auto_sem_t*                 inbox_lock; /**< Lock for #http_client_t::inbox */
+    auto_list_t                 inbox;      /**< #http_client_job_t not seen by manager yet. */
+    auto_map_t                  hosts;      /**< #http_client_host_t, only touched by manager thread. */
+
+    atomic_uint                 max_conns;  /**< Max connections per host. */
+    atomic_uint                 max_idle;   /**< Max idle connections kept per host. */
+    atomic_ullong               idle_timeout;   /**< Milliseconds an idle connection is kept. */
+} http_client_t;
+
+/**
+ * @brief Growable buffer.
+ */
+typedef struct http_client_buf
+{
+    char*                       buf;
+    size_t                      len;
+    size_t                      cap;
+} http_client_buf_t;
+
+static const auto_api_t* api;
+
+static void _http_client_buf_add(http_client_buf_t* b, const char* data, size_t len)
+{
+    if (b->len + len > b->cap)
+    {
+        size_t cap = b->cap != 0 ? b->cap : 512;
+        while (cap < b->len + len)
+        {
+            cap *= 2;
+        }
+        b->buf = api->memory->realloc(b->buf, cap);
+        b->cap = cap;
+    }
+    memcpy(b->buf + b->len, data, len);
+    b->len += len;
+}
+
+static void _http_client_buf_str(http_client_buf_t* b, const char* str)
+{
+    _http_client_buf_add(b, str, strlen(str));
+}
+
+static char* _http_client_strdup(const char* str)
+{
+    size_t len = strlen(str) + 1;
+    char* copy = api->memory->malloc(len);
+    memcpy(copy, str, len);
+    return copy;
+}
+
+static void _http_client_job_free(http_client_job_t* job)
+{
+    api->memory->free(job->key);
+    if (job->req != NULL)
+    {
+        api->memory->free(job->req);
+    }
+    if (job->error != NULL)
+    {
+        api->memory->free(job->error);
+    }
+    if (job->resp != NULL)
+    {
+        api->memory->free(job->resp);
+    }
+    api->memory->free(job);
+}
+
+/**
+ * @brief Interrupt mg_mgr_poll() of manager thread.
+ * @note MT-Safe
+ */
+static void _http_client_wakeup(http_client_t* client)
+{
+    if (client->wakeup_fd < 0 || atomic_exchange(&client->wakeup_pending, 1) != 0)
+    {
+        return;
+    }
+    send(client->wakeup_fd, "w", 1, 0);
+}
+
+static void _http_client_wake_lua(struct lua_State* L, void* arg)
+{
+    http_client_job_t* job = arg;
+    (void)L;
+
+    api->coroutine->set_state(job->waiter, AUTO_COROUTINE_BUSY);
+}
+
+/**
+ * @brief Hand finished \p job back to its coroutine.
+ */
+static void _http_client_finish(http_client_t* client, http_client_job_t* job)
+{
+    /* Nobody is left to resume when shutting down. */
+    if (!atomic_load(&client->looping) || !api->async->call_in_lua(client->async, _http_client_wake_lua, job))
+    {
+        _http_client_job_free(job);
+    }
+}
+
+static void _http_client_fail(http_client_t* client, http_client_job_t* job, const char* error)
+{
+    job->error = _http_client_strdup(error);
+    _http_client_finish(client, job);
+}
+
+static void _http_client_ev(struct mg_connection* c, int ev, void* ev_data, void* fn_data);
+
+static void _http_client_send(http_client_conn_t* conn, http_client_job_t* job)
+{
+    /* Request is kept, it may be sent again on a fresh connection. */
+    conn->job = job;
+    mg_send(conn->c, job->req, job->req_len);
+}
+
+/**
+ * @brief Start queued requests of \p host on idle or new connections.
+ */
+static void _http_client_dispatch(http_client_t* client, http_client_host_t* host)
+{
+    auto_list_node_t* it;
+    unsigned max_conns = atomic_load_explicit(&client->max_conns, memory_order_relaxed);
+
+    while ((it = api->list->begin(&host->queue)) != NULL)
+    {
+        http_client_job_t* job = container_of(it, http_client_job_t, node);
+        http_client_conn_t* conn;
+
+        if ((it = api->list->pop_front(&host->idle)) != NULL)
+        {
+            api->list->erase(&host->queue, &job->node);
+            conn = container_of(it, http_client_conn_t, node);
+            conn->idle = 0;
+            _http_client_send(conn, job);
+            continue;
+        }
+        if (host->conn_cnt >= max_conns)
+        {
+            break;
+        }
+
+        api->list->erase(&host->queue, &job->node);
+        conn = api->memory->calloc(1, sizeof(http_client_conn_t));
+        conn->client = client;
+        conn->host = host;
+        if ((conn->c = mg_http_connect(&client->mgr, host->key, _http_client_ev, conn)) == NULL)
+        {
+            api->memory->free(conn);
+            _http_client_fail(client, job, "cannot connect");
+            continue;
+        }
+        host->conn_cnt++;
+
+        /* Mongoose sends it once connected. */
+        _http_client_send(conn, job);
+    }
+}
+
+/**
+ * @brief Tell if connection may carry another request after \p hm.
+ */
+static int _http_client_keep_alive(struct mg_http_message* hm)
+{
+    struct mg_str* connection = mg_http_get_header(hm, "Connection");
+    struct mg_str* te = mg_http_get_header(hm, "Transfer-Encoding");
+
+    /* Body ended with the connection. */
+    if (mg_http_get_header(hm, "Content-Length") == NULL && te == NULL)
+    {
+        return 0;
+    }
+    if (connection != NULL && mg_vcasecmp(connection, "close") == 0)
+    {
+        return 0;
+    }
+    if (mg_vcmp(&hm->proto, "HTTP/1.0") == 0)
+    {
+        return connection != NULL && mg_vcasecmp(connection, "keep-alive") == 0;
+    }
+    return 1;
+}
+
+static void _http_client_on_response(http_client_conn_t* conn, struct mg_http_message* hm)
+{
+    http_client_t* client = conn->client;
+    http_client_host_t* host = conn->host;
+    http_client_job_t* job = conn->job;
+
+    if (job == NULL)
+    {
+        /* Nothing was asked. */
+        conn->c->is_closing = 1;
+        return;
+    }
+
+    job->status = mg_http_status(hm);
+    job->head_len = hm->head.len;
+    job->body_len = hm->body.len;
+    job->resp = api->memory->malloc(job->head_len + job->body_len);
+    memcpy(job->resp, hm->head.ptr, job->head_len);
+    memcpy(job->resp + job->head_len, hm->body.ptr, job->body_len);
+
+    conn->job = NULL;
+    conn->reused = 1;
+    if (_http_client_keep_alive(hm)
+        && api->list->size(&host->idle) < atomic_load_explicit(&client->max_idle, memory_order_relaxed))
+    {
+        /* Most recent first, so surplus connections age out at the tail. */
+        conn->idle = 1;
+        conn->idle_since = (uint64_t)mg_millis();
+        api->list->push_front(&host->idle, &conn->node);
+    }
+    else
+    {
+        conn->c->is_draining = 1;
+    }
+
+    _http_client_finish(client, job);
+    _http_client_dispatch(client, host);
+}
+
+static void _http_client_on_poll(http_client_conn_t* conn)
+{
+    http_client_t* client = conn->client;
+    uint64_t now = (uint64_t)mg_millis();
+
+    if (conn->job != NULL && now >= conn->job->deadline)
+    {
+        _http_client_fail(client, conn->job, "timeout");
+        conn->job = NULL;
+        conn->c->is_closing = 1;
+    }
+    else if (conn->idle
+        && now - conn->idle_since >= atomic_load_explicit(&client->idle_timeout, memory_order_relaxed))
+    {
+        conn->c->is_closing = 1;
+    }
+}
+
+static void _http_client_on_close(http_client_conn_t* conn)
+{
+    http_client_t* client = conn->client;
+    http_client_host_t* host = conn->host;
+    http_client_job_t* job = conn->job;
+
+    if (conn->idle)
+    {
+        api->list->erase(&host->idle, &conn->node);
+    }
+    host->conn_cnt--;
+
+    if (job != NULL)
+    {
+        /* Upstream may have dropped a keep-alive connection just as it was reused. */
+        if (conn->reused && conn->c->recv.len == 0 && job->idempotent && !job->retried
+            && atomic_load(&client->looping))
+        {
+            job->retried = 1;
+            api->list->push_front(&host->queue, &job->node);
+        }
+        else
+        {
+            _http_client_fail(client, job, conn->error != NULL ? conn->error : "connection closed");
+        }
+    }
+
+    if (conn->error != NULL)
+    {
+        api->memory->free(conn->error);
+    }
+    api->memory->free(conn);
+
+    if (atomic_load(&client->looping))
+    {
+        _http_client_dispatch(client, host);
+    }
+}
+
+static void _http_client_ev(struct mg_connection* c, int ev, void* ev_data, void* fn_data)
+{
+    http_client_conn_t* conn = fn_data;
+    (void)c;
+
+    switch (ev)
+    {
+    case MG_EV_ERROR:
+        if (conn->error != NULL)
+        {
+            api->memory->free(conn->error);
+        }
+        conn->error = _http_client_strdup(ev_data);
+        break;
+
+    case MG_EV_HTTP_MSG:
+        _http_client_on_response(conn, ev_data);
+        break;
+
+    case MG_EV_POLL:
+        _http_client_on_poll(conn);
+        break;
+
+    case MG_EV_CLOSE:
+        _http_client_on_close(conn);
+        break;
+
+    default:
+        break;
+    }
+}
+
+static int _http_client_cmp_host(const auto_map_node_t* key1,
+    const auto_map_node_t* key2, void* arg)
+{
+    (void)arg;
+    http_client_host_t* h1 = container_of(key1, http_client_host_t, node);
+    http_client_host_t* h2 = container_of(key2, http_client_host_t, node);
+    return strcmp(h1->key, h2->key);
+}
+
+static http_client_host_t* _http_client_host(http_client_t* client, const char* key)
+{
+    http_client_host_t tmp, *host;
+    tmp.key = (char*)key;
+
+    auto_map_node_t* it = api->map->find(&client->hosts, &tmp.node);
+    if (it != NULL)
+    {
+        return container_of(it, http_client_host_t, node);
+    }
+
+    host = api->memory->calloc(1, sizeof(http_client_host_t));
+    host->key = _http_client_strdup(key);
+    api->list->init(&host->idle);
+    api->list->init(&host->queue);
+    api->map->insert(&client->hosts, &host->node);
+    return host;
+}
+
+static void _http_client_host_free(http_client_host_t* host)
+{
+    auto_list_node_t* it;
+    while ((it = api->list->pop_front(&host->queue)) != NULL)
+    {
+        _http_client_job_free(container_of(it, http_client_job_t, node));
+    }
+    api->memory->free(host->key);
+    api->memory->free(host);
+}
+
+/**
+ * @brief Fail queued requests that timed out, and forget hosts with nothing
+ *   left.
+ */
+static void _http_client_expire(http_client_t* client)
+{
+    auto_list_node_t* it, *next;
+    auto_map_node_t* host_it, *host_next;
+    uint64_t now = (uint64_t)mg_millis();
+
+    for (host_it = api->map->begin(&client->hosts); host_it != NULL; host_it = host_next)
+    {
+        http_client_host_t* host = container_of(host_it, http_client_host_t, node);
+        host_next = api->map->next(host_it);
+
+        for (it = api->list->begin(&host->queue); it != NULL; it = next)
+        {
+            http_client_job_t* job = container_of(it, http_client_job_t, node);
+            next = api->list->next(it);
+            if (now >= job->deadline)
+            {
+                api->list->erase(&host->queue, &job->node);
+                _http_client_fail(client, job, "timeout");
+            }
+        }
+
+        if (host->conn_cnt == 0 && api->list->size(&host->queue) == 0)
+        {
+            api->map->erase(&client->hosts, &host->node);
+            _http_client_host_free(host);
+        }
+    }
+}
+
+static void _http_client_on_wakeup(struct mg_connection* c, int ev, void* ev_data, void* fn_data)
+{
+    auto_list_t jobs;
+    auto_list_node_t* it;
+    http_client_t* client = fn_data;
+    (void)ev_data;
+
+    if (ev != MG_EV_READ)
+    {
+        return;
+    }
+    c->recv.len = 0;
+
+    /* Reset before taking inbox, so anything queued after wakes us again. */
+    atomic_store(&client->wakeup_pending, 0);
+    api->list->init(&jobs);
+    api->sem->wait(client->inbox_lock);
+    api->list->migrate(&jobs, &client->inbox);
+    api->sem->post(client->inbox_lock);
+
+    while ((it = api->list->pop_front(&jobs)) != NULL)
+    {
+        http_client_job_t* job = container_of(it, http_client_job_t, node);
+        http_client_host_t* host = _http_client_host(client, job->key);
+        api->list->push_back(&host->queue, &job->node);
+        _http_client_dispatch(client, host);
+    }
+}
+
+static void _http_client_body(void* arg)
+{
+    http_client_t* client = arg;
+
+    while (atomic_load(&client->looping))
+    {
+        mg_mgr_poll(&client->mgr, HTTP_CLIENT_POLL_TIMEOUT);
+        _http_client_expire(client);
+    }
+}
+
+/**
+ * @brief Start manager thread, unless it runs already.
+ */
+static void _http_client_start(struct lua_State* L, http_client_t* client)
+{
+    if (client->thread != NULL)
+    {
+        return;
+    }
+
+    mg_mgr_init(&client->mgr);
+    atomic_init(&client->wakeup_pending, 0);
+    client->wakeup_fd = mg_mkpipe(&client->mgr, _http_client_on_wakeup, client, false);
+
+    client->async = api->async->create(api->lua->newthread(L));
+    api->lua->pop(L, 1);
+
+    atomic_store(&client->looping, 1);
+    client->thread = api->thread->create(_http_client_body, client);
+}
+
+static int _http_client_gc(struct lua_State* L)
+{
+    auto_list_node_t* it;
+    auto_map_node_t* host_it;
+    http_client_t* client = api->lua->touserdata(L, 1);
+
+    if (client->thread != NULL)
+    {
+        atomic_store(&client->looping, 0);
+        _http_client_wakeup(client);
+        api->thread->join(client->thread);
+        client->thread = NULL;
+
+        api->async->destroy(client->async);
+        client->async = NULL;
+
+        /* Closing connections frees requests in flight. */
+        mg_mgr_free(&client->mgr);
+        if (client->wakeup_fd >= 0)
+        {
+#if defined(_WIN32)
+            closesocket(client->wakeup_fd);
+#else
+            close(client->wakeup_fd);
+#endif
+            client->wakeup_fd = -1;
+        }
+
+        while ((host_it = api->map->begin(&client->hosts)) != NULL)
+        {
+            api->map->erase(&client->hosts, host_it);
+            _http_client_host_free(container_of(host_it, http_client_host_t, node));
+        }
+    }
+
+    while ((it = api->list->pop_front(&client->inbox)) != NULL)
+    {
+        _http_client_job_free(container_of(it, http_client_job_t, node));
+    }
+    if (client->inbox_lock != NULL)
+    {
+        api->sem->destroy(client->inbox_lock);
+        client->inbox_lock = NULL;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Serialize request described by table at index 1. Raises error on
+ *   bad arguments.
+ */
+static http_client_job_t* _http_client_new_job(struct lua_State* L)
+{
+    size_t body_len = 0;
+    const char* body = NULL;
+    const char* method = "GET";
+    int has_host = 0;
+    http_client_buf_t b = { NULL, 0, 0 };
+
+    if (api->lua->getfield(L, 1, "url") != AUTO_LUA_TSTRING)
+    {
+        api->lua->L_error(L, "http_request: url is required");
+    }
+    const char* url = api->lua->tostring(L, -1);
+    if (strncmp(url, "http://", 7) != 0)
+    {
+        api->lua->L_error(L, "http_request: only http:// urls are supported");
+    }
+    const char* authority = url + 7;
+    size_t authority_len = strcspn(authority, "/?#");
+    const char* path = authority + authority_len;
+    if (authority_len == 0)
+    {
+        api->lua->L_error(L, "http_request: url has no host");
+    }
+
+    if (api->lua->getfield(L, 1, "method") == AUTO_LUA_TSTRING)
+    {
+        method = api->lua->tostring(L, -1);
+    }
+    if (api->lua->getfield(L, 1, "body") == AUTO_LUA_TSTRING)
+    {
+        body = api->lua->tolstring(L, -1, &body_len);
+    }
+
+    http_client_job_t* job = api->memory->calloc(1, sizeof(http_client_job_t));
+    job->idempotent = strcmp(method, "POST") != 0 && strcmp(method, "PATCH") != 0;
+
+    _http_client_buf_str(&b, method);
+    _http_client_buf_str(&b, " ");
+    if (*path != '/')
+    {
+        _http_client_buf_str(&b, "/");
+    }
+    _http_client_buf_add(&b, path, strcspn(path, "#"));
+    _http_client_buf_str(&b, " HTTP/1.1\r\n");
+
+    /* headers: { name, value, ... } */
+    if (api->lua->getfield(L, 1, "headers") == AUTO_LUA_TTABLE)
+    {
+        int64_t i, cnt = api->lua->L_len(L, -1);
+        for (i = 1; i + 1 <= cnt; i += 2)
+        {
+            size_t name_len, value_len;
+            api->lua->geti(L, -1, i);
+            api->lua->geti(L, -2, i + 1);
+            const char* name = api->lua->tolstring(L, -2, &name_len);
+            const char* value = api->lua->tolstring(L, -1, &value_len);
+            if (name != NULL && value != NULL && strcasecmp(name, "Content-Length") != 0)
+            {
+                has_host = has_host || strcasecmp(name, "Host") == 0;
+                _http_client_buf_add(&b, name, name_len);
+                _http_client_buf_str(&b, ": ");
+                _http_client_buf_add(&b, value, value_len);
+                _http_client_buf_str(&b, "\r\n");
+            }
+            api->lua->pop(L, 2);
+        }
+    }
+    api->lua->pop(L, 1);
+
+    if (!has_host)
+    {
+        _http_client_buf_str(&b, "Host: ");
+        _http_client_buf_add(&b, authority, authority_len);
+        _http_client_buf_str(&b, "\r\n");
+    }
+    if (body != NULL)
+    {
+        char tmp[64];
+        snprintf(tmp, sizeof(tmp), "Content-Length: %llu\r\n", (unsigned long long)body_len);
+        _http_client_buf_str(&b, tmp);
+    }
+    _http_client_buf_str(&b, "\r\n");
+    if (body != NULL)
+    {
+        _http_client_buf_add(&b, body, body_len);
+    }
+    job->req = b.buf;
+    job->req_len = b.len;
+
+    job->key = api->memory->malloc(7 + authority_len + 1);
+    memcpy(job->key, url, 7 + authority_len);
+    job->key[7 + authority_len] = '\0';
+
+    int64_t timeout = HTTP_CLIENT_TIMEOUT;
+    if (api->lua->getfield(L, 1, "timeout_ms") == AUTO_LUA_TNUMBER && api->lua->tointeger(L, -1) > 0)
+    {
+        timeout = api->lua->tointeger(L, -1);
+    }
+    job->deadline = (uint64_t)mg_millis() + (uint64_t)timeout;
+
+    return job;
+}
+
+static int _http_client_request_k(struct lua_State* L, int status, void* ctx)
+{
+    int i;
+    http_client_job_t* job = ctx;
+    struct mg_http_message hm;
+    (void)status;
+
+    if (job->error != NULL)
+    {
+        api->lua->pushnil(L);
+        api->lua->pushstring(L, job->error);
+        _http_client_job_free(job);
+        return 2;
+    }
+
+    api->lua->pushinteger(L, job->status);
+    api->lua->pushlstring(L, job->resp + job->head_len, job->body_len);
+
+    /* Headers keyed by lower case name. */
+    api->lua->newtable(L);
+    if (mg_http_parse(job->resp, job->head_len, &hm) > 0)
+    {
+        for (i = 0; i < MG_MAX_HTTP_HEADERS && hm.headers[i].name.len != 0; i++)
+        {
+            size_t j;
+            char name[128];
+            size_t name_len = hm.headers[i].name.len < sizeof(name) ? hm.headers[i].name.len : sizeof(name);
+            for (j = 0; j < name_len; j++)
+            {
+                char ch = hm.headers[i].name.ptr[j];
+                name[j] = (ch >= 'A' && ch <= 'Z') ? (char)(ch - 'A' + 'a') : ch;
+            }
+            api->lua->pushlstring(L, name, name_len);
+            api->lua->pushlstring(L, hm.headers[i].value.ptr, hm.headers[i].value.len);
+            api->lua->settable(L, -3);
+        }
+    }
+
+    _http_client_job_free(job);
+    return 3;
+}
+
+/**
+ * @brief `mongoose.http_request{ url, method, headers, body, timeout_ms }`
+ *
+ * The calling coroutine waits for the response, so this raises outside of
+ * one. Route and websocket callbacks of `mongoose.http_server` each run in
+ * their own coroutine and may call it directly.
+ *
+ * Returns status, body and headers keyed by lower case name, or nil and an
+ * error such as "timeout".
+ */
+static int _http_client_request(struct lua_State* L)
+{
+    http_client_t* client = api->lua->touserdata(L, HTTP_CLIENT_UPVALUE_INDEX(1));
+    api->lua->L_checktype(L, 1, AUTO_LUA_TTABLE);
+
+    auto_coroutine_t* waiter = api->coroutine->find(L);
+    if (waiter == NULL)
+    {
+        return api->lua->L_error(L, "http_request() must be called in a coroutine");
+    }
+
+    http_client_job_t* job = _http_client_new_job(L);
+    job->waiter = waiter;
+    _http_client_start(L, client);
+
+    api->sem->wait(client->inbox_lock);
+    api->list->push_back(&client->inbox, &job->node);
+    api->sem->post(client->inbox_lock);
+    _http_client_wakeup(client);
+
+    /* Resumed by _http_client_wake_lua(). */
+    api->coroutine->set_state(waiter, AUTO_COROUTINE_WAIT);
+    return api->lua->yieldk(L, 0, job, _http_client_request_k);
+}
+
+/**
+ * @brief `mongoose.http_client_options{ max_conns_per_host, max_idle_per_host, idle_timeout_ms }`
+ */
+static int _http_client_options(struct lua_State* L)
+{
+    http_client_t* client = api->lua->touserdata(L, HTTP_CLIENT_UPVALUE_INDEX(1));
+    api->lua->L_checktype(L, 1, AUTO_LUA_TTABLE);
+
+    if (api->lua->getfield(L, 1, "max_conns_per_host") == AUTO_LUA_TNUMBER && api->lua->tointeger(L, -1) > 0)
+    {
+        atomic_store(&client->max_conns, (unsigned)api->lua->tointeger(L, -1));
+    }
+    api->lua->pop(L, 1);
+
+    if (api->lua->getfield(L, 1, "max_idle_per_host") == AUTO_LUA_TNUMBER && api->lua->tointeger(L, -1) >= 0)
+    {
+        atomic_store(&client->max_idle, (unsigned)api->lua->tointeger(L, -1));
+    }
+    api->lua->pop(L, 1);
+
+    if (api->lua->getfield(L, 1, "idle_timeout_ms") == AUTO_LUA_TNUMBER && api->lua->tointeger(L, -1) > 0)
+    {
+        atomic_store(&client->idle_timeout, (unsigned long long)api->lua->tointeger(L, -1));
+    }
+    api->lua->pop(L, 1);
+
+    return 0;
+}
+
+void http_client_register(const auto_api_t* auto_api, struct lua_State* L)
+{
+    api = auto_api;
+
+    static const auto_luaL_Reg s_http_client_meta[] = {
+        { "__gc",       _http_client_gc },
+        { NULL,         NULL },
+    };
+
+    http_client_t* client = api->lua->newuserdatauv(L, sizeof(http_client_t), 0);
+    memset(client, 0, sizeof(*client));
+    client->wakeup_fd = -1;
+    client->inbox_lock = api->sem->create(1);
+    api->list->init(&client->inbox);
+    api->map->init(&client->hosts, _http_client_cmp_host, NULL);
+    atomic_init(&client->looping, 0);
+    atomic_init(&client->max_conns, 16);
+    atomic_init(&client->max_idle, 16);
+    atomic_init(&client->idle_timeout, 60 * 1000);
+
+    if (api->lua->L_newmetatable(L, "__auto_http_client") != 0)
+    {
+        api->lua->L_setfuncs(L, s_http_client_meta, 0);
+    }
+    api->lua->setmetatable(L, -2);
+
+    api->lua->pushvalue(L, -1);
+    api->lua->pushcclosure(L, _http_client_request, 1);
+    api->lua->setfield(L, -3, "http_request");
+    api->lua->pushcclosure(L, _http_client_options, 1);
+    api->lua->setfield(L, -2, "http_client_options");
+}
@@ -0,0 +1,32 @@
+#ifndef __AUTO_MONGOOSE_HTTP_CLIENT_H__
+#define __AUTO_MONGOOSE_HTTP_CLIENT_H__
+
+#include <autodo.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Add `http_request` and `http_client_options` to module table on
+ *   top of stack of \p L.
+ *
+ * Both share one client. Its manager thread starts on the first request and
+ * stops when the module table is collected.
+ *
+ * `mongoose.http_request{ url, method, headers, body, timeout_ms }` must be
+ * called from a coroutine. It yields until the response is complete and
+ * returns status, body and a table of headers, or nil and an error message.
+ *
+ * `mongoose.http_client_options{ max_conns_per_host, max_idle_per_host,
+ * idle_timeout_ms }` changes limits of the keep-alive pools.
+ *
+ * @param[in] api       autodo API.
+ * @param[in] L         Lua VM.
+ */
+void http_client_register(const auto_api_t* api, struct lua_State* L);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -1,7 +1,26 @@
 #define _GNU_SOURCE
 #include <autodo.h>
 #include <mongoose.h>
+#include <errno.h>
 #include <string.h>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+#include "arena.h"
+#include "cache.h"
+#include "http_client.h"
+#include "metrics.h"
+#include "mpsc.h"
+#include "proxy.h"
+#include "ratelimit.h"
+#include "router.h"
+#include "static_file.h"
+#include "upload.h"
+#include "websocket.h"
+#include "wheel.h"
 
 /**
  * @brief Get array size.
@@ -10,37 +29,429 @@
  */
 #define ARRAY_SIZE(x)   (sizeof(x) / sizeof(x[0]))
 
+/**
+ * @brief Max number of poll threads.
+ */
+#define HTTP_SERVER_MAX_THREADS 256
+
+/**
+ * @brief Poll timeout in milliseconds.
+ *
+ * Cross thread work wakes poll thread through wakeup channel, so this only
+ * decides how often an idle poll thread runs housekeeping.
+ */
+#define HTTP_SERVER_POLL_TIMEOUT    100
+
+/**
+ * @brief Tick of connection timers in milliseconds.
+ *
+ * Timers are advanced at least once per poll, so a finer tick would not make
+ * them more precise.
+ */
+#define HTTP_SERVER_TIMER_TICK      HTTP_SERVER_POLL_TIMEOUT
+
+/**
+ * @brief Inline size of per-request arena.
+ *
+ * Request head, body, captures and response of a typical request fit in it.
+ * Larger ones still work, with a heap allocation for the excess.
+ */
+#define HTTP_SERVER_ARENA_SIZE      (16 * 1024)
+
+/**
+ * @brief Pseudo-index of upvalue \p i of running C function.
+ */
+#define HTTP_SERVER_UPVALUE_INDEX(i)    (AUTO_LUA_REGISTRYINDEX - (i))
+
+/**
+ * @brief Max bytes of websocket frames waiting for one connection.
+ *
+ * A client that falls further behind is disconnected, instead of holding
+ * on to every broadcast sent since.
+ */
+#define HTTP_SERVER_WS_MAX_QUEUE    (8 * 1024 * 1024)
+
+/**
+ * @brief Max body bytes in one event of a streamed upload.
+ *
+ * It fits in a request arena together with the event record.
+ */
+#define HTTP_SERVER_BODY_CHUNK      (8 * 1024)
+
+/**
+ * @brief Send buffer level above which pieces of a streamed response wait.
+ */
+#define HTTP_SERVER_SEND_HIGH_WATER (64 * 1024)
+
+/**
+ * @brief Bytes of a streamed response queued for poll thread above which
+ *   `req:write()` waits.
+ */
+#define HTTP_SERVER_WRITE_HIGH_WATER    (256 * 1024)
+
+/**
+ * @brief Max length of a response cache key. Requests with longer keys are
+ *   not cached.
+ */
+#define HTTP_SERVER_CACHE_KEY_MAX   2048
+
+/**
+ * @brief Response to connections and requests turned away on overload.
+ */
+#define HTTP_SERVER_UNAVAILABLE \
+    "HTTP/1.1 503 Service Unavailable\r\n" \
+    "Retry-After: 1\r\n" \
+    "Content-Length: 20\r\n\r\n" \
+    "Service Unavailable\n"
+
+/**
+ * @brief Response caching of a route.
+ */
+typedef struct http_server_route_cache
+{
+    uint64_t                ttl;            /**< Nanoseconds a response is served from cache, 0 if not cached. */
+    char**                  vary;           /**< Request headers that select a variant of response. */
+    size_t                  vary_cnt;       /**< Number of elements in #http_server_route_cache_t::vary */
+} http_server_route_cache_t;
+
+/**
+ * @brief A route.
+ *
+ * Created and freed in lua, read by poll threads through the route table
+ * they loaded. Once removed it stays alive until no poll thread can see it
+ * and no event points at it.
+ */
 typedef struct http_server_router
 {
-    auto_map_node_t         node;
+    auto_map_node_t         node;           /**< Node for #http_server_t::routers */
+    auto_list_node_t        retire_node;    /**< Node for #http_server_t::retired_routes */
+    uint64_t                retired;        /**< Epoch it was removed in, 0 while in use. */
+    atomic_long             users;          /**< Pending events and websocket connections pointing at it. */
+    int                     method;         /**< #http_router_method_t it answers. */
+    int                     priority;       /**< Priority against other routes. */
     struct
     {
-        int                 ref_cb;         /**< Reference for callback function. */
-        char*               prefix;         /**< Route prefix */
+        int                 ref_cb;         /**< Reference for callback function, or handler table of websocket. */
         char*               raw;            /**< Route string. */
-        auto_regex_code_t*  url_pattern;
-        size_t              group_cnt;
-        size_t*             groups;
+        int                 websocket;      /**< Route upgrades to websocket. */
+        int                 stream;         /**< Body is streamed to callback. */
+        int                 raw_uuid;       /**< `<uuid>` captures are passed as 16 raw bytes. */
     } data;
+    http_server_route_cache_t cache;        /**< Response caching. */
+    http_ratelimit_rule_t   rate_limit;     /**< Requests per client to this route. */
+    http_proxy_t*           proxy;          /**< Upstreams requests are relayed to, NULL if route calls lua. */
+    http_metrics_route_t*   metrics;        /**< Metrics of this route. */
 } http_server_router_t;
 
-typedef struct http_server_msg_helper
+/**
+ * @brief Immutable snapshot of routes, read by poll threads without locks.
+ */
+typedef struct http_server_table
+{
+    auto_list_node_t        node;           /**< Node for #http_server_t::retired_tables */
+    http_router_t*          router;         /**< Compiled index of routes. */
+    int                     stream_routes;  /**< Number of routes that stream body. */
+    uint64_t                retired;        /**< Epoch it was replaced in, 0 while published. */
+} http_server_table_t;
+
+struct http_server_s;
+struct http_server_reactor;
+
+/**
+ * @brief What a #http_server_pending_t carries to lua.
+ */
+typedef enum http_server_event
+{
+    HTTP_SERVER_EVENT_REQUEST,              /**< Routed request. */
+    HTTP_SERVER_EVENT_WS_OPEN,              /**< Websocket upgraded, request head is kept. */
+    HTTP_SERVER_EVENT_WS_MSG,               /**< Websocket message in #http_server_pending_t::hm body. */
+    HTTP_SERVER_EVENT_WS_CLOSE,             /**< Websocket closed. */
+    HTTP_SERVER_EVENT_BODY,                 /**< Piece of streamed body in #http_server_pending_t::hm body. */
+} http_server_event_t;
+
+/**
+ * @brief Routed request on its way to lua.
+ *
+ * The request head and body are copied into #http_server_pending_t::data, so
+ * the poll thread can go on with the connection while lua works on it.
+ *
+ * It lives in its own arena together with the response, and everything is
+ * reset in one step once both lua and the poll thread are done with it.
+ */
+typedef struct http_server_pending
+{
+    mpsc_node_t             node;           /**< Node for #http_server_t::inbox */
+    http_arena_t*           arena;          /**< Arena this record lives in. */
+    http_server_event_t     type;           /**< Event type. */
+    int                     ws_op;          /**< Websocket opcode of #HTTP_SERVER_EVENT_WS_MSG */
+    int                     body_end;       /**< #HTTP_SERVER_EVENT_BODY is last one: 1 if complete, -1 if aborted. */
+    auto_list_node_t        body_node;      /**< Node for #http_server_request_t::chunks */
+    http_upload_t*          upload;         /**< Streamed body of request, holds a reference. */
+    http_cache_waiter_t     cache_waiter;   /**< Waits for another request to fill response cache. */
+    http_cache_entry_t*     cache_entry;    /**< Cache placeholder this request fills, holds a reference. */
+    struct http_server_s*   server;         /**< Owner server. */
+    struct http_server_reactor* reactor;    /**< Reactor the connection belongs to. */
+    http_server_router_t*   router;         /**< Matched route, counted in its `users` until dispatched. */
+    http_metrics_route_t*   metrics;        /**< Metrics of matched route, outlives it. */
+    uint64_t                cache_ttl;      /**< #http_server_route_cache_t::ttl of matched route. */
+    int                     raw_uuid;       /**< Copy of route `raw_uuid`. */
+    unsigned long           conn_id;        /**< Connection ID. */
+    unsigned long           seq;            /**< Request sequence in connection. */
+    uint64_t                start;          /**< When request was parsed. */
+    uint64_t                dispatch;       /**< When route callback was called. */
+    http_router_match_t     match;          /**< Capture groups, relative to uri. */
+    struct mg_http_message  hm;             /**< Points into #http_server_pending_t::data */
+    char                    data[];         /**< Request head and body. */
+} http_server_pending_t;
+
+/**
+ * @brief Flow control of a streamed response, shared by lua and poll thread.
+ */
+typedef struct http_server_outflow
+{
+    atomic_int              refcnt;         /**< Freed when it drops to zero. */
+    atomic_size_t           queued;         /**< Bytes written in lua and not handed to send buffer yet. */
+    atomic_int              waiting;        /**< Lua waits for #http_server_outflow_t::queued to drop. */
+    atomic_int              closed;         /**< Connection is gone. */
+    auto_coroutine_t*       waiter;         /**< Coroutine waiting in `req:write()`, only touched in lua. */
+} http_server_outflow_t;
+
+/**
+ * @brief Serialized response waiting to be sent by poll thread.
+ */
+typedef struct http_server_reply
+{
+    auto_list_node_t        node;
+    http_arena_t*           arena;          /**< Arena of request, holds a reference. NULL if reply is on heap. */
+    http_server_outflow_t*  flow;           /**< Streamed response it belongs to, holds a reference. */
+    int                     partial;        /**< More of the same response follows. */
+    int                     close;          /**< Close connection once sent. */
+    unsigned long           conn_id;        /**< Connection ID. */
+    unsigned long           seq;            /**< Request sequence in connection. */
+    uint64_t                start;          /**< When request was parsed. */
+    size_t                  len;            /**< Response length in bytes. */
+    char                    buf[];          /**< Response data. */
+} http_server_reply_t;
+
+/**
+ * @brief Request answered by poll thread itself, waiting for replies before
+ *   it.
+ */
+typedef struct http_server_parked
+{
+    auto_list_node_t        node;
+    unsigned long           seq;            /**< Request sequence in connection. */
+    size_t                  len;            /**< Request length in bytes. */
+    char                    buf[];          /**< Request head and body. */
+} http_server_parked_t;
+
+/**
+ * @brief Connection state, only touched by poll thread.
+ */
+typedef struct http_server_conn
+{
+    auto_map_node_t         node;           /**< Node for #http_server_t::conns */
+    unsigned long           id;             /**< Connection ID. */
+    struct mg_connection*   c;              /**< Mongoose connection. */
+    struct http_server_reactor* reactor;    /**< Reactor the connection belongs to. */
+    unsigned long           req_seq;        /**< Sequence for next routed request. */
+    unsigned long           send_seq;       /**< Sequence of next response to send. */
+    auto_list_t             held;           /**< #http_server_reply_t not sent yet. */
+    auto_list_t             parked;         /**< #http_server_parked_t in request order. */
+    http_static_stream_t    stream;         /**< Static file being sent. */
+    http_server_router_t*   ws_router;      /**< Websocket route, counted in its `users`. NULL if not upgraded. */
+    http_ws_queue_t         ws_out;         /**< Websocket frames not written yet. */
+    int                     ws_closing;     /**< Close once #http_server_conn_t::ws_out is written. */
+    mg_event_handler_t      http_pfn;       /**< Mongoose HTTP protocol handler. */
+    mg_event_handler_t      file_pfn;       /**< Mongoose handler sending a file, NULL if none. */
+    http_upload_t*          upload;         /**< Body being streamed, holds a reference. */
+    size_t                  head_len;       /**< Head of current request was checked, until it is handled. */
+    int                     rate_taken;     /**< Current request already took its client token. */
+    auto_list_t             proxies;        /**< #http_server_exchange_t in request order. */
+    http_wheel_timer_t      timer;          /**< Timer in #http_server_reactor_t::timers */
+    int                     timer_kind;     /**< #http_metrics_timeout_t the timer runs for, -1 if none. */
+    int                     refused;        /**< Close once replies up to the refusal are out. */
+} http_server_conn_t;
+
+struct http_server_exchange;
+
+/**
+ * @brief Connection to an upstream of a proxy route, only touched by poll
+ *   thread.
+ */
+typedef struct http_server_upconn
+{
+    auto_list_node_t        node;           /**< Node for #http_proxy_upstream_t::idle while idle. */
+    http_proxy_t*           proxy;          /**< Proxy, holds a reference. */
+    http_proxy_upstream_t*  upstream;       /**< Upstream it is connected to. */
+    struct http_server_reactor* reactor;    /**< Reactor the connection belongs to. */
+    struct mg_connection*   c;              /**< Mongoose connection. */
+    int                     idle;           /**< Waits in idle list for next request. */
+    int                     reused;         /**< Carried a response before. */
+    int                     connected;      /**< TCP connection is established. */
+    uint64_t                idle_since;     /**< mg_millis() it became idle. */
+    struct http_server_exchange* exchange;   /**< Request it carries, NULL if idle. */
+} http_server_upconn_t;
+
+/**
+ * @brief Request relayed to an upstream, only touched by poll thread.
+ *
+ * Response bytes go from the receive buffer of the upstream connection to the
+ * send buffer of the client as they arrive, once all responses before it are
+ * sent.
+ */
+typedef struct http_server_exchange
+{
+    auto_list_node_t        node;           /**< Node for #http_server_conn_t::proxies */
+    http_proxy_t*           proxy;          /**< Proxy, holds a reference. */
+    http_proxy_upstream_t*  upstream;       /**< Upstream of current attempt, counted in its `active`. */
+    http_server_conn_t*     down;           /**< Client connection. */
+    http_server_upconn_t*   upconn;         /**< Upstream connection, NULL once it is gone. */
+    unsigned long           seq;            /**< Request sequence in client connection. */
+    uint64_t                start;          /**< When request was parsed. */
+    uint64_t                progress;       /**< mg_millis() of last progress. */
+    unsigned                tries;          /**< Attempts after the first one. */
+    int                     idempotent;     /**< Request may be sent again. */
+    int                     head_only;      /**< Request is HEAD. */
+    size_t                  relayed;        /**< Response bytes handed to client. */
+    http_proxy_frame_t      frame;          /**< Where response ends. */
+    struct mg_iobuf         rest;           /**< Response bytes left when upstream connection closed. */
+    size_t                  req_len;        /**< Length of #http_server_exchange_t::req */
+    char                    req[];          /**< Request as sent upstream. */
+} http_server_exchange_t;
+
+/**
+ * @brief Websocket frame for a set of connections of one reactor.
+ */
+typedef struct http_server_ws_cmd
+{
+    auto_list_node_t        node;           /**< Node for #http_server_reactor_t::ws_cmds */
+    http_ws_frame_t*        frame;          /**< Frame to send, holds a reference. */
+    int                     close;          /**< Close connections after the frame. */
+    size_t                  conn_cnt;       /**< Number of connections. */
+    unsigned long           conn_ids[];     /**< Connection IDs. */
+} http_server_ws_cmd_t;
+
+/**
+ * @brief Request object that lives in lua.
+ */
+typedef struct http_server_request
+{
+    auto_list_node_t        node;           /**< Node for #http_server_t::requests */
+    struct http_server_s*   server;         /**< Owner server, NULL if server is gone. */
+    http_server_pending_t*  pending;        /**< Request data, owned by this object. */
+    int                     status;         /**< Response status code. */
+    int                     finished;       /**< Response is sent. */
+
+    auto_map_node_t         upload_node;    /**< Node for #http_server_t::uploads while body is coming. */
+    http_upload_t*          upload;         /**< Streamed body, NULL if body is in #http_server_request_t::pending */
+    struct http_server_reactor* reactor;    /**< Reactor of connection, key of #http_server_request_t::upload_node */
+    unsigned long           conn_id;        /**< Connection ID, key of #http_server_request_t::upload_node */
+    auto_list_t             chunks;         /**< #HTTP_SERVER_EVENT_BODY not read yet. */
+    int                     body_state;     /**< 0 while body is coming, 1 if complete, -1 if aborted. */
+    auto_coroutine_t*       waiter;         /**< Coroutine waiting in `req:read()`. */
+
+    http_server_outflow_t*  flow;           /**< Streamed response, NULL if not started. */
+} http_server_request_t;
+
+/**
+ * @brief Websocket object that lives in lua.
+ */
+typedef struct http_server_ws
+{
+    auto_map_node_t         node;           /**< Node for #http_server_t::websockets */
+    struct http_server_s*   server;         /**< Owner server, NULL if closed or server is gone. */
+    struct http_server_reactor* reactor;    /**< Reactor the connection belongs to. */
+    unsigned long           conn_id;        /**< Connection ID. */
+    int                     ref_self;       /**< Keeps object alive while open. */
+    auto_list_t             subs;           /**< #http_server_sub_t */
+} http_server_ws_t;
+
+/**
+ * @brief Broadcast topic, only touched in lua.
+ */
+typedef struct http_server_topic
+{
+    auto_map_node_t         node;           /**< Node for #http_server_t::topics */
+    char*                   name;           /**< Topic name. */
+    auto_list_t             subs;           /**< #http_server_sub_t */
+} http_server_topic_t;
+
+/**
+ * @brief Subscription of a websocket to a topic.
+ */
+typedef struct http_server_sub
+{
+    auto_list_node_t        topic_node;     /**< Node for #http_server_topic_t::subs */
+    auto_list_node_t        ws_node;        /**< Node for #http_server_ws_t::subs */
+    http_server_topic_t*    topic;
+    http_server_ws_t*       ws;
+} http_server_sub_t;
+
+/**
+ * @brief Connections of one reactor a broadcast goes to.
+ */
+typedef struct http_server_fanout
+{
+    size_t                  cnt;            /**< Number of connections. */
+    http_server_ws_cmd_t*   cmd;            /**< Command being filled. */
+} http_server_fanout_t;
+
+/**
+ * @brief A poll thread with its own mongoose manager.
+ */
+typedef struct http_server_reactor
 {
-    int                     ret;
-    struct mg_connection*   c;
-    struct mg_http_message* hm;
-    http_server_router_t*   router;
-} http_server_msg_helper_t;
+    struct http_server_s*   server;         /**< Owner server. */
+    struct mg_mgr           mgr;
+    auto_thread_t*          thread;
+
+    auto_map_t              conns;          /**< #http_server_conn_t */
+    http_wheel_t            timers;         /**< Timeouts of #http_server_reactor_t::conns */
+
+    auto_sem_t*             reply_lock;     /**< Lock for #http_server_reactor_t::replies and #http_server_reactor_t::ws_cmds */
+    auto_list_t             replies;        /**< #http_server_reply_t */
+    auto_list_t             ws_cmds;        /**< #http_server_ws_cmd_t */
+
+    http_arena_pool_t       arenas;         /**< Arenas for requests of this reactor. */
+    http_metrics_thread_t*  metrics;        /**< Metrics written by this reactor. */
+    atomic_ullong           epoch;          /**< #http_server_t::epoch seen at start of current poll. */
+
+    int                     wakeup_fd;      /**< Write end of wakeup channel, -1 if not available. */
+    atomic_int              wakeup_pending; /**< A wakeup byte is in flight. */
+} http_server_reactor_t;
 
 typedef struct http_server_s
 {
-    struct mg_mgr   mgr;
+    http_server_reactor_t*  reactors;
+    unsigned        reactor_cnt;
 
     int             looping;        /**< looping flag */
-    auto_thread_t*  thread;
     auto_async_t*   async;
 
-    auto_map_t      routers;        /**< #http_server_router_t */
+    auto_map_t      routers;        /**< #http_server_router_t in use, only touched in lua. */
+    _Atomic(http_server_table_t*) table;    /**< Compiled #http_server_t::routers, read by poll threads. */
+    atomic_ullong   epoch;          /**< Bumped each time a table is replaced. */
+    auto_list_t     retired_tables; /**< #http_server_table_t poll threads may still read. */
+    auto_list_t     retired_routes; /**< #http_server_router_t removed and not freed yet. */
+
+    auto_list_t     requests;       /**< #http_server_request_t that still alive in lua. */
+
+    auto_map_t      websockets;     /**< #http_server_ws_t that are open, only touched in lua. */
+    auto_map_t      topics;         /**< #http_server_topic_t, only touched in lua. */
+    http_server_fanout_t* fanout;   /**< Broadcast scratch, one per reactor. */
+
+    auto_map_t      uploads;        /**< #http_server_request_t with body still coming, only touched in lua. */
+
+    http_static_t*  static_files;   /**< Cache for #http_server_t::options::serve_dir, can be NULL. */
+    http_cache_t*   cache;          /**< Responses of routes with `cache` option. */
+    http_ratelimit_t* rate_limits;  /**< Token buckets of server and route `rate_limit`. */
+    http_metrics_t* metrics;
+    http_metrics_gauges_t* gauges;  /**< Gauges of #http_server_t::metrics */
+    atomic_int      connections;    /**< Connections open on all reactors. */
+
+    mpsc_queue_t    inbox;          /**< #http_server_pending_t waiting for lua. */
+    atomic_int      inbox_armed;    /**< A drain is scheduled in lua. */
 
     struct
     {
@@ -48,6 +459,44 @@ typedef struct http_server_s
         char*           listen_url;
         char*           serve_dir;
         char*           ssi_pattern;
+        char*           metrics_url;    /**< Path that serves metrics, or NULL. */
+        unsigned        batch_size;     /**< Max handlers started per drain. */
+        uint64_t        batch_budget;   /**< Max drain time in nanoseconds. */
+        unsigned        threads;        /**< Number of poll threads. */
+        uint64_t        max_body_size;  /**< Larger request bodies get 413, 0 if no limit. */
+        unsigned        max_connections;/**< Connections beyond get 503 and are closed, 0 if no limit. */
+        unsigned        max_inflight;   /**< Requests for lua beyond get 503 while this many are in it, 0 if no limit. */
+        uint64_t        max_queue_delay;/**< Requests for lua get 503 once it lags this many nanoseconds, 0 if no limit. */
+        uint64_t        idle_timeout;   /**< Milliseconds a connection may wait for next request, 0 if no limit. */
+        uint64_t        header_timeout; /**< Milliseconds to receive a request once it started, 0 if no limit. */
+        uint64_t        write_timeout;  /**< Milliseconds a response may make no progress, 0 if no limit. */
+
+        struct
+        {
+            int         enabled;
+            size_t      max_bytes;      /**< Max total size of cached files. */
+            size_t      max_entries;    /**< Max number of cached files. */
+            size_t      max_file_size;  /**< Larger files are sent by sendfile() instead. */
+        } static_cache;
+
+        struct
+        {
+            size_t      max_bytes;      /**< Max total size of cached responses. */
+        } response_cache;
+
+        struct
+        {
+            http_ratelimit_rule_t rule; /**< Requests per client to whole server. */
+            size_t      max_clients;    /**< Max number of buckets tracked. */
+        } rate_limit;
+
+        struct
+        {
+            int         enabled;        /**< Implies #http_server_t::options::static_cache */
+            size_t      min_size;       /**< Smaller files are sent as is. */
+            char**      mime_types;     /**< MIME types to compress, NULL for defaults. */
+            size_t      mime_type_cnt;
+        } compress;
     } options;
 } http_server_t;
 
@@ -61,36 +510,72 @@ static void _http_server_destroy_route(struct lua_State* L, http_server_router_t
         router->data.ref_cb = AUTO_LUA_NOREF;
     }
 
-    if (router->data.prefix != NULL)
-    {
-        free(router->data.prefix);
-        router->data.prefix = NULL;
-    }
-
     if (router->data.raw != NULL)
     {
         free(router->data.raw);
         router->data.raw = NULL;
     }
 
-    if (router->data.url_pattern != NULL)
+    /* Upstream connections hold their own reference. */
+    if (router->proxy != NULL)
     {
-        api->regex->destroy(router->data.url_pattern);
-        router->data.url_pattern = NULL;
+        http_proxy_release(router->proxy);
+        router->proxy = NULL;
     }
 
-    if (router->data.groups != NULL)
+    size_t i;
+    for (i = 0; i < router->cache.vary_cnt; i++)
     {
-        free(router->data.groups);
-        router->data.groups = NULL;
+        free(router->cache.vary[i]);
     }
+    free(router->cache.vary);
 
     free(router);
 }
 
+static void _http_server_outflow_release(http_server_outflow_t* flow)
+{
+    if (atomic_fetch_sub_explicit(&flow->refcnt, 1, memory_order_acq_rel) == 1)
+    {
+        api->memory->free(flow);
+    }
+}
+
+static void _http_server_reply_release(http_server_reply_t* reply)
+{
+    if (reply->flow != NULL)
+    {
+        _http_server_outflow_release(reply->flow);
+    }
+    if (reply->arena != NULL)
+    {
+        http_arena_release(reply->arena);
+    }
+    else
+    {
+        api->memory->free(reply);
+    }
+}
+
+static void _http_server_cleanup_reply_list(auto_list_t* replies)
+{
+    auto_list_node_t* it;
+    while ((it = api->list->pop_front(replies)) != NULL)
+    {
+        _http_server_reply_release(container_of(it, http_server_reply_t, node));
+    }
+}
+
+static void _http_server_destroy_table(http_server_table_t* table)
+{
+    http_router_destroy(table->router);
+    free(table);
+}
+
 static void _http_server_cleanup_routers(struct lua_State* L, http_server_t* server)
 {
     auto_map_node_t* node;
+    auto_list_node_t* it;
     while ((node = api->map->begin(&server->routers)) != NULL)
     {
         http_server_router_t* router = container_of(node, http_server_router_t, node);
@@ -98,17 +583,154 @@ static void _http_server_cleanup_routers(struct lua_State* L, http_server_t* ser
 
         _http_server_destroy_route(L, router);
     }
+    while ((it = api->list->pop_front(&server->retired_routes)) != NULL)
+    {
+        _http_server_destroy_route(L, container_of(it, http_server_router_t, retire_node));
+    }
+
+    while ((it = api->list->pop_front(&server->retired_tables)) != NULL)
+    {
+        _http_server_destroy_table(container_of(it, http_server_table_t, node));
+    }
+    if (server->table != NULL)
+    {
+        _http_server_destroy_table(server->table);
+        server->table = NULL;
+    }
+}
+
+static void _http_server_cleanup_ws_cmds(auto_list_t* cmds)
+{
+    auto_list_node_t* it;
+    while ((it = api->list->pop_front(cmds)) != NULL)
+    {
+        http_server_ws_cmd_t* cmd = container_of(it, http_server_ws_cmd_t, node);
+        http_ws_frame_release(cmd->frame);
+        free(cmd);
+    }
+}
+
+/**
+ * @brief Remove \p sub, and its topic if nobody is left.
+ */
+static void _http_server_ws_unsubscribe(http_server_t* server, http_server_sub_t* sub)
+{
+    http_server_topic_t* topic = sub->topic;
+
+    api->list->erase(&topic->subs, &sub->topic_node);
+    api->list->erase(&sub->ws->subs, &sub->ws_node);
+    free(sub);
+
+    if (api->list->size(&topic->subs) == 0)
+    {
+        api->map->erase(&server->topics, &topic->node);
+        free(topic->name);
+        free(topic);
+    }
+}
+
+/**
+ * @brief Forget \p ws once its connection is closed or server is gone.
+ */
+static void _http_server_ws_detach(struct lua_State* L, http_server_ws_t* ws)
+{
+    auto_list_node_t* it;
+    http_server_t* server = ws->server;
+
+    if (server == NULL)
+    {
+        return;
+    }
+
+    while ((it = api->list->begin(&ws->subs)) != NULL)
+    {
+        _http_server_ws_unsubscribe(server, container_of(it, http_server_sub_t, ws_node));
+    }
+    api->map->erase(&server->websockets, &ws->node);
+    ws->server = NULL;
+
+    api->lua->L_unref(L, AUTO_LUA_REGISTRYINDEX, ws->ref_self);
+    ws->ref_self = AUTO_LUA_NOREF;
+}
+
+/**
+ * @brief Interrupt mg_mgr_poll() of \p reactor.
+ * @note MT-Safe
+ */
+static void _http_server_wakeup(http_server_reactor_t* reactor)
+{
+    if (reactor->wakeup_fd < 0 || atomic_exchange(&reactor->wakeup_pending, 1) != 0)
+    {
+        return;
+    }
+    send(reactor->wakeup_fd, "w", 1, 0);
+}
+
+/**
+ * @brief Stop waiting for streamed body of \p req.
+ *
+ * Chunks not read are dropped, and poll thread discards the rest of body if
+ * it is still coming.
+ */
+static void _http_server_request_end_body(http_server_request_t* req, int state)
+{
+    auto_list_node_t* it;
+
+    if (req->upload == NULL)
+    {
+        return;
+    }
+
+    while ((it = api->list->pop_front(&req->chunks)) != NULL)
+    {
+        http_arena_release(container_of(it, http_server_pending_t, body_node)->arena);
+    }
+
+    if (req->body_state == 0)
+    {
+        req->body_state = state;
+        if (req->server != NULL)
+        {
+            api->map->erase(&req->server->uploads, &req->upload_node);
+            if (http_upload_abandon(req->upload))
+            {
+                _http_server_wakeup(req->reactor);
+            }
+        }
+    }
+
+    if (req->waiter != NULL)
+    {
+        api->coroutine->set_state(req->waiter, AUTO_COROUTINE_BUSY);
+        req->waiter = NULL;
+    }
+
+    http_upload_release(req->upload);
+    req->upload = NULL;
+}
+
+static void _http_server_cache_drop(http_cache_waiter_t* waiter)
+{
+    http_arena_release(container_of(waiter, http_server_pending_t, cache_waiter)->arena);
 }
 
 static int _http_server_gc(struct lua_State* L)
 {
+    unsigned i;
     http_server_t* server = api->lua->touserdata(L, 1);
 
     server->looping = 0;
-    if (server->thread != NULL)
+    for (i = 0; i < server->reactor_cnt; i++)
     {
-        api->thread->join(server->thread);
-        server->thread = NULL;
+        _http_server_wakeup(&server->reactors[i]);
+    }
+    for (i = 0; i < server->reactor_cnt; i++)
+    {
+        if (server->reactors[i].thread != NULL)
+        {
+            api->thread->join(server->reactors[i].thread);
+            server->reactors[i].thread = NULL;
+        }
     }
 
     if (server->async != NULL)
@@ -117,9 +739,101 @@ static int _http_server_gc(struct lua_State* L)
         server->async = NULL;
     }
 
+    mpsc_node_t* pending_node;
+    while ((pending_node = mpsc_queue_pop(&server->inbox)) != NULL)
+    {
+        http_server_pending_t* pending = container_of(pending_node, http_server_pending_t, node);
+        if (pending->upload != NULL)
+        {
+            http_upload_release(pending->upload);
+        }
+        if (pending->cache_entry != NULL)
+        {
+            http_cache_entry_release(pending->cache_entry);
+        }
+        http_arena_release(pending->arena);
+    }
+
     _http_server_cleanup_routers(L, server);
 
-    mg_mgr_free(&server->mgr);
+    /* Requests still alive in lua must not touch us anymore. */
+    auto_list_node_t* it;
+    while ((it = api->list->pop_front(&server->requests)) != NULL)
+    {
+        http_server_request_t* req = container_of(it, http_server_request_t, node);
+        _http_server_request_end_body(req, -1);
+        if (req->flow != NULL && req->flow->waiter != NULL)
+        {
+            atomic_store(&req->flow->closed, 1);
+            api->coroutine->set_state(req->flow->waiter, AUTO_COROUTINE_BUSY);
+            req->flow->waiter = NULL;
+        }
+        if (req->pending->cache_entry != NULL)
+        {
+            http_cache_entry_release(req->pending->cache_entry);
+            req->pending->cache_entry = NULL;
+        }
+        req->server = NULL;
+        http_arena_detach(req->pending->arena);
+    }
+
+    /* Requests waiting for a response that never comes. */
+    if (server->cache != NULL)
+    {
+        http_cache_destroy(server->cache, _http_server_cache_drop);
+        server->cache = NULL;
+    }
+
+    auto_map_node_t* ws_node;
+    while ((ws_node = api->map->begin(&server->websockets)) != NULL)
+    {
+        _http_server_ws_detach(L, container_of(ws_node, http_server_ws_t, node));
+    }
+
+    for (i = 0; i < server->reactor_cnt; i++)
+    {
+        http_server_reactor_t* reactor = &server->reactors[i];
+
+        /* Closing connections also closes their streams. */
+        mg_mgr_free(&reactor->mgr);
+        if (reactor->wakeup_fd >= 0)
+        {
+#if defined(_WIN32)
+            closesocket(reactor->wakeup_fd);
+#else
+            close(reactor->wakeup_fd);
+#endif
+            reactor->wakeup_fd = -1;
+        }
+
+        _http_server_cleanup_reply_list(&reactor->replies);
+        _http_server_cleanup_ws_cmds(&reactor->ws_cmds);
+        api->sem->destroy(reactor->reply_lock);
+        reactor->reply_lock = NULL;
+
+        http_arena_pool_exit(&reactor->arenas);
+    }
+    free(server->reactors);
+    server->reactors = NULL;
+    server->reactor_cnt = 0;
+    free(server->fanout);
+    server->fanout = NULL;
+
+    if (server->static_files != NULL)
+    {
+        http_static_destroy(server->static_files);
+        server->static_files = NULL;
+    }
+    if (server->rate_limits != NULL)
+    {
+        http_ratelimit_destroy(server->rate_limits);
+        server->rate_limits = NULL;
+    }
+    if (server->metrics != NULL)
+    {
+        http_metrics_destroy(server->metrics);
+        server->metrics = NULL;
+    }
 
     if (server->options.name != NULL)
     {
@@ -136,229 +850,4321 @@ static int _http_server_gc(struct lua_State* L)
         free(server->options.serve_dir);
         server->options.serve_dir = NULL;
     }
+    if (server->options.ssi_pattern != NULL)
+    {
+        free(server->options.ssi_pattern);
+        server->options.ssi_pattern = NULL;
+    }
+    if (server->options.metrics_url != NULL)
+    {
+        free(server->options.metrics_url);
+        server->options.metrics_url = NULL;
+    }
+    if (server->options.compress.mime_types != NULL)
+    {
+        size_t j;
+        for (j = 0; j < server->options.compress.mime_type_cnt; j++)
+        {
+            free(server->options.compress.mime_types[j]);
+        }
+        free(server->options.compress.mime_types);
+        server->options.compress.mime_types = NULL;
+        server->options.compress.mime_type_cnt = 0;
+    }
+
+    return 0;
+}
+
+static http_server_conn_t* _http_server_find_conn(http_server_reactor_t* reactor, unsigned long conn_id)
+{
+    http_server_conn_t tmp;
+    tmp.id = conn_id;
+
+    auto_map_node_t* it = api->map->find(&reactor->conns, &tmp.node);
+    return it != NULL ? container_of(it, http_server_conn_t, node) : NULL;
+}
+
+/**
+ * @brief Let go of route of \p pending once it is not needed anymore.
+ * @note MT-Safe
+ */
+static void _http_server_pending_unroute(http_server_pending_t* pending)
+{
+    if (pending->router != NULL)
+    {
+        atomic_fetch_sub_explicit(&pending->router->users, 1, memory_order_release);
+        pending->router = NULL;
+    }
+}
+
+static void _http_server_outflow_wake(struct lua_State* L, void* arg)
+{
+    http_server_outflow_t* flow = arg;
+    (void)L;
+
+    if (flow->waiter != NULL)
+    {
+        api->coroutine->set_state(flow->waiter, AUTO_COROUTINE_BUSY);
+        flow->waiter = NULL;
+    }
+    _http_server_outflow_release(flow);
+}
+
+/**
+ * @brief Account \p n bytes of \p flow leaving poll thread, and resume
+ *   writer once enough is gone.
+ */
+static void _http_server_outflow_sent(http_server_t* server, http_server_outflow_t* flow, size_t n)
+{
+    size_t left = atomic_fetch_sub_explicit(&flow->queued, n, memory_order_acq_rel) - n;
+    if (left > HTTP_SERVER_WRITE_HIGH_WATER / 2 || !server->looping
+        || atomic_exchange(&flow->waiting, 0) == 0)
+    {
+        return;
+    }
+
+    atomic_fetch_add(&flow->refcnt, 1);
+    if (!api->async->call_in_lua(server->async, _http_server_outflow_wake, flow))
+    {
+        _http_server_outflow_release(flow);
+    }
+}
+
+/**
+ * @brief Drop \p reply whose connection is gone.
+ */
+static void _http_server_reply_drop(http_server_t* server, http_server_reply_t* reply)
+{
+    if (reply->flow != NULL)
+    {
+        atomic_store(&reply->flow->closed, 1);
+        _http_server_outflow_sent(server, reply->flow, reply->len);
+    }
+    _http_server_reply_release(reply);
+}
+
+/**
+ * @brief Run the timer of \p conn for the state it is in.
+ *
+ * The timer is only touched when state changes, so a connection that keeps
+ * trickling a request still times out.
+ */
+static void _http_server_conn_timer(http_server_conn_t* conn)
+{
+    int kind = -1;
+    uint64_t timeout = 0;
+    struct mg_connection* c = conn->c;
+    http_server_t* server = conn->reactor->server;
+
+    if (c->send.len != 0 || conn->ws_out.cnt != 0 || http_static_stream_active(&conn->stream))
+    {
+        kind = HTTP_METRICS_TIMEOUT_WRITE;
+        timeout = server->options.write_timeout;
+    }
+    else if (conn->ws_router != NULL || conn->upload != NULL || conn->send_seq != conn->req_seq)
+    {
+        /* Lua decides how long these take. */
+    }
+    else if (c->recv.len != 0)
+    {
+        kind = HTTP_METRICS_TIMEOUT_HEADER;
+        timeout = server->options.header_timeout;
+    }
+    else
+    {
+        kind = HTTP_METRICS_TIMEOUT_IDLE;
+        timeout = server->options.idle_timeout;
+    }
+
+    if (timeout == 0)
+    {
+        kind = -1;
+    }
+    if (kind == conn->timer_kind)
+    {
+        return;
+    }
+
+    conn->timer_kind = kind;
+    if (kind < 0)
+    {
+        http_wheel_cancel(&conn->timer);
+        return;
+    }
+    http_wheel_schedule(&conn->reactor->timers, &conn->timer, timeout);
+}
+
+static void _http_server_proxy_kick(http_server_conn_t* conn);
+static void _http_server_serve_local(http_server_conn_t* conn, struct mg_http_message* hm);
+static void _http_server_conn_send(http_server_conn_t* conn, const char* data, size_t len);
+
+/**
+ * @brief Tell if a response of \p conn may go straight to the send buffer.
+ */
+static int _http_server_conn_idle(http_server_conn_t* conn)
+{
+    return conn->send_seq == conn->req_seq && api->list->size(&conn->held) == 0
+        && !http_static_stream_active(&conn->stream) && conn->file_pfn == NULL;
+}
+
+/**
+ * @brief Answer parked request of \p conn if it is due.
+ * @return  Boolean, true if one was answered.
+ */
+static int _http_server_conn_unpark(http_server_conn_t* conn)
+{
+    struct mg_http_message hm;
+    auto_list_node_t* it = api->list->begin(&conn->parked);
+    if (it == NULL)
+    {
+        return 0;
+    }
+
+    http_server_parked_t* parked = container_of(it, http_server_parked_t, node);
+    if (parked->seq != conn->send_seq)
+    {
+        return 0;
+    }
+
+    api->list->erase(&conn->parked, it);
+    mg_http_parse(parked->buf, parked->len, &hm);
+    _http_server_serve_local(conn, &hm);
+    conn->send_seq++;
+    api->memory->free(parked);
+    return 1;
+}
+
+/**
+ * @brief Send \p len bytes of \p buf on \p c.
+ *
+ * Replies live in the arena of their request, which mongoose cannot take as
+ * send buffer. So with nothing buffered before it, a reply is written to the
+ * socket from where it is, and only what the socket does not take is copied.
+ */
+static void _http_server_send_reply(struct mg_connection* c, const char* buf, size_t len)
+{
+#if !defined(_WIN32)
+    if (!c->is_tls && c->send.len == 0)
+    {
+        ssize_t n = send((int)(size_t)c->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            c->is_closing = 1;
+            return;
+        }
+        if (n > 0)
+        {
+            buf += n;
+            len -= (size_t)n;
+        }
+    }
+#endif
+
+    /* Send buffer keeps its capacity, so this does not allocate once warmed up. */
+    if (len != 0)
+    {
+        mg_send(c, buf, len);
+    }
+}
+
+/**
+ * @brief Send held replies of \p conn that are due.
+ *
+ * Lua may finish pipelined requests in any order, so replies that arrive
+ * early are held until all replies before them are sent. A file body in
+ * flight holds them too, and a full send buffer holds pieces of a streamed
+ * response.
+ */
+static void _http_server_conn_flush_held(http_server_conn_t* conn)
+{
+    auto_list_node_t* it;
+
+    while (!http_static_stream_active(&conn->stream) && conn->file_pfn == NULL)
+    {
+        http_server_reply_t* reply = NULL;
+        for (it = api->list->begin(&conn->held); it != NULL; it = api->list->next(it))
+        {
+            http_server_reply_t* held = container_of(it, http_server_reply_t, node);
+            if (held->seq == conn->send_seq)
+            {
+                api->list->erase(&conn->held, it);
+                reply = held;
+                break;
+            }
+        }
+
+        if (reply == NULL && _http_server_conn_unpark(conn))
+        {
+            continue;
+        }
+        if (reply == NULL)
+        {
+            if (conn->refused && conn->send_seq == conn->req_seq)
+            {
+                conn->c->is_draining = 1;
+            }
+            /* Next response may be coming from an upstream. */
+            _http_server_proxy_kick(conn);
+            return;
+        }
+        if (reply->partial && conn->c->send.len >= HTTP_SERVER_SEND_HIGH_WATER)
+        {
+            /* Picked up again on MG_EV_WRITE. */
+            api->list->push_front(&conn->held, &reply->node);
+            return;
+        }
+
+        _http_server_send_reply(conn->c, reply->buf, reply->len);
+        if (reply->flow != NULL)
+        {
+            _http_server_outflow_sent(conn->reactor->server, reply->flow, reply->len);
+        }
+        if (!reply->partial)
+        {
+            http_metrics_hist_record(&conn->reactor->metrics->response, api->misc->hrtime() - reply->start);
+            conn->send_seq++;
+        }
+        if (reply->close)
+        {
+            conn->c->is_draining = 1;
+        }
+        _http_server_reply_release(reply);
+    }
+}
+
+/**
+ * @brief Send \p reply on \p conn in request order.
+ */
+static void _http_server_conn_deliver(http_server_conn_t* conn, http_server_reply_t* reply)
+{
+    api->list->push_back(&conn->held, &reply->node);
+    _http_server_conn_flush_held(conn);
+    _http_server_conn_timer(conn);
+}
+
+static void _http_server_ws_pump(http_server_conn_t* conn)
+{
+    http_ws_queue_pump(conn->c, &conn->ws_out);
+    if (conn->ws_closing && conn->ws_out.cnt == 0)
+    {
+        conn->c->is_draining = 1;
+    }
+}
+
+/**
+ * @brief Queue frame of \p cmd on each of its connections.
+ *
+ * Every connection gets a reference to the same frame, nothing is copied.
+ */
+static void _http_server_ws_deliver(http_server_reactor_t* reactor, http_server_ws_cmd_t* cmd)
+{
+    size_t i;
+    for (i = 0; i < cmd->conn_cnt; i++)
+    {
+        http_server_conn_t* conn = _http_server_find_conn(reactor, cmd->conn_ids[i]);
+        if (conn == NULL || conn->ws_router == NULL || conn->ws_closing)
+        {
+            continue;
+        }
+
+        if (conn->ws_out.bytes + cmd->frame->len > HTTP_SERVER_WS_MAX_QUEUE)
+        {
+            conn->c->is_closing = 1;
+            continue;
+        }
+
+        http_ws_queue_push(&conn->ws_out, cmd->frame);
+        conn->ws_closing = cmd->close;
+        _http_server_ws_pump(conn);
+        _http_server_conn_timer(conn);
+    }
+
+    http_ws_frame_release(cmd->frame);
+    free(cmd);
+}
+
+static void _http_server_flush_replies(http_server_reactor_t* reactor)
+{
+    auto_list_t replies, ws_cmds;
+    auto_list_node_t* it;
+
+    api->list->init(&replies);
+    api->list->init(&ws_cmds);
+
+    api->sem->wait(reactor->reply_lock);
+    api->list->migrate(&replies, &reactor->replies);
+    api->list->migrate(&ws_cmds, &reactor->ws_cmds);
+    api->sem->post(reactor->reply_lock);
+
+    while ((it = api->list->pop_front(&ws_cmds)) != NULL)
+    {
+        _http_server_ws_deliver(reactor, container_of(it, http_server_ws_cmd_t, node));
+    }
+
+    while ((it = api->list->pop_front(&replies)) != NULL)
+    {
+        http_server_reply_t* reply = container_of(it, http_server_reply_t, node);
+        http_server_conn_t* conn = _http_server_find_conn(reactor, reply->conn_id);
+
+        /* Connection might be closed before lua reply. */
+        if (conn == NULL)
+        {
+            _http_server_reply_drop(reactor->server, reply);
+            continue;
+        }
+
+        _http_server_conn_deliver(conn, reply);
+    }
+}
+
+static void _http_server_on_wakeup(struct mg_connection* c, int ev, void* ev_data, void* fn_data)
+{
+    http_server_reactor_t* reactor = fn_data;
+    (void)ev_data;
+
+    if (ev == MG_EV_READ)
+    {
+        c->recv.len = 0;
+
+        /* Reset before flush, so anything queued after flush wakes us again. */
+        atomic_store(&reactor->wakeup_pending, 0);
+        _http_server_flush_replies(reactor);
+    }
+}
+
+static void _http_server_body(void* arg)
+{
+    http_server_reactor_t* reactor = arg;
+
+    while (reactor->server->looping)
+    {
+        /* Tables loaded in previous poll are not used anymore. */
+        atomic_store(&reactor->epoch, atomic_load(&reactor->server->epoch));
+        mg_mgr_poll(&reactor->mgr, HTTP_SERVER_POLL_TIMEOUT);
+        _http_server_flush_replies(reactor);
+    }
+}
+
+static const char* _http_server_status_str(int status)
+{
+    switch (status)
+    {
+    case 100: return "Continue";
+    case 101: return "Switching Protocols";
+    case 200: return "OK";
+    case 201: return "Created";
+    case 202: return "Accepted";
+    case 204: return "No Content";
+    case 206: return "Partial Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 303: return "See Other";
+    case 304: return "Not Modified";
+    case 307: return "Temporary Redirect";
+    case 308: return "Permanent Redirect";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 408: return "Request Timeout";
+    case 409: return "Conflict";
+    case 413: return "Payload Too Large";
+    case 415: return "Unsupported Media Type";
+    case 429: return "Too Many Requests";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    default:  return "Unknown";
+    }
+}
+
+/**
+ * @brief Queue a serialized response for the poll thread that owns the
+ *   connection.
+ * @param[in] pending   Request to reply.
+ * @param[in] reply     Response, allocated from arena of \p pending, or
+ *   from heap with NULL arena.
+ */
+static void _http_server_queue_reply(const http_server_pending_t* pending, http_server_reply_t* reply)
+{
+    http_server_reactor_t* reactor = pending->reactor;
+    if (reply->arena != NULL)
+    {
+        http_arena_ref(reply->arena);
+    }
+    reply->conn_id = pending->conn_id;
+    reply->seq = pending->seq;
+    reply->start = pending->start;
+
+    api->sem->wait(reactor->reply_lock);
+    api->list->push_back(&reactor->replies, &reply->node);
+    api->sem->post(reactor->reply_lock);
+
+    _http_server_wakeup(reactor);
+}
+
+/**
+ * @brief Make a heap reply holding #HTTP_SERVER_UNAVAILABLE.
+ */
+static http_server_reply_t* _http_server_new_unavailable(void)
+{
+    http_server_reply_t* reply = api->memory->malloc(sizeof(http_server_reply_t) + sizeof(HTTP_SERVER_UNAVAILABLE));
+    reply->arena = NULL;
+    reply->flow = NULL;
+    reply->partial = 0;
+    reply->close = 0;
+    reply->len = sizeof(HTTP_SERVER_UNAVAILABLE) - 1;
+    memcpy(reply->buf, HTTP_SERVER_UNAVAILABLE, reply->len);
+    return reply;
+}
+
+static void _http_server_post(http_server_t* server, http_server_pending_t* pending);
+
+/**
+ * @brief Copy response \p data into arena of \p pending.
+ */
+static http_server_reply_t* _http_server_copy_reply(http_server_pending_t* pending, const char* data, size_t len)
+{
+    http_server_reply_t* reply = http_arena_alloc(pending->arena, sizeof(http_server_reply_t) + len);
+    reply->arena = pending->arena;
+    reply->flow = NULL;
+    reply->partial = 0;
+    reply->close = 0;
+    reply->len = len;
+    memcpy(reply->buf, data, len);
+    return reply;
+}
+
+/**
+ * @brief Tell if a response with \p status may be reused, as heuristically
+ *   cacheable in RFC 9111.
+ */
+static int _http_server_cache_status(int status)
+{
+    switch (status)
+    {
+    case 200: case 203: case 204: case 300: case 301: case 308:
+    case 404: case 405: case 410: case 414: case 501:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief Settle response cache placeholder of \p pending, if it has one.
+ *
+ * Requests that waited for it share the response, cacheable or not, as it was
+ * produced while they waited. Without a complete response, like a streamed
+ * one, they go to lua on their own.
+ *
+ * @param[in] pending   Request that filled placeholder.
+ * @param[in] data      Whole serialized response, or NULL.
+ * @param[in] len       Length of \p data.
+ * @param[in] status    Status code of response.
+ */
+static void _http_server_cache_settle(http_server_pending_t* pending, const char* data, size_t len, int status)
+{
+    auto_list_t waiters;
+    auto_list_node_t* it;
+    http_server_t* server = pending->server;
+    http_cache_entry_t* entry = pending->cache_entry;
+
+    if (entry == NULL)
+    {
+        return;
+    }
+    pending->cache_entry = NULL;
+
+    api->list->init(&waiters);
+    http_cache_fill(server->cache, entry, data != NULL && _http_server_cache_status(status) ? data : NULL, len,
+        api->misc->hrtime() + pending->cache_ttl, &waiters);
+
+    while ((it = api->list->pop_front(&waiters)) != NULL)
+    {
+        http_server_pending_t* waiter = container_of(it, http_server_pending_t, cache_waiter.node);
+        if (data == NULL)
+        {
+            _http_server_post(server, waiter);
+            continue;
+        }
+
+        http_metrics_route_status(waiter->metrics, status);
+        _http_server_pending_unroute(waiter);
+        _http_server_queue_reply(waiter, _http_server_copy_reply(waiter, data, len));
+        http_arena_release(waiter->arena);
+    }
+}
+
+/**
+ * @brief Tell if header \p name: \p value must not be sent.
+ *
+ * Framing is always generated, and CR, LF or NUL would let a handler forge
+ * headers or split the response.
+ */
+static int _http_server_header_refused(const char* name, size_t name_len, const char* value, size_t value_len)
+{
+    size_t i;
+
+    if (name == NULL || value == NULL || name_len == 0)
+    {
+        return 1;
+    }
+    if ((name_len == 14 && strncasecmp(name, "Content-Length", 14) == 0)
+        || (name_len == 17 && strncasecmp(name, "Transfer-Encoding", 17) == 0))
+    {
+        return 1;
+    }
+    for (i = 0; i < name_len; i++)
+    {
+        if (name[i] == '\r' || name[i] == '\n' || name[i] == '\0' || name[i] == ':')
+        {
+            return 1;
+        }
+    }
+    for (i = 0; i < value_len; i++)
+    {
+        if (value[i] == '\r' || value[i] == '\n' || value[i] == '\0')
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Serialize status line and headers of \p req.
+ *
+ * They go into one buffer in the request arena, with room for the body, which
+ * the poll thread copies into the send buffer.
+ *
+ * @param[in] L         Lua VM.
+ * @param[in] req       Request.
+ * @param[in] hdr_idx   Index of header table, or 0 if no header. It is an
+ *   array of name/value.
+ * @param[in] framing   Last header, which tells how body is framed.
+ * @param[in] body_cap  Room to leave for body.
+ * @return              Reply holding head only.
+ */
+static http_server_reply_t* _http_server_serialize_head(struct lua_State* L, http_server_request_t* req,
+    int hdr_idx, const char* framing, size_t body_cap)
+{
+    int64_t i, hdr_cnt = 0;
+    size_t len, pos;
+    char* buf;
+    http_server_reply_t* reply;
+    const char* status_str = _http_server_status_str(req->status);
+
+    if (hdr_idx != 0)
+    {
+        hdr_cnt = api->lua->L_len(L, hdr_idx);
+    }
+
+    /* Status line + framing + `\r\n\r\n` */
+    int line_len = snprintf(NULL, 0, "HTTP/1.1 %d %s\r\n", req->status, status_str);
+    len = (size_t)line_len + strlen(framing) + 4 + 1;
+    for (i = 1; i + 1 <= hdr_cnt; i += 2)
+    {
+        size_t name_len = 0, value_len = 0;
+        api->lua->geti(L, hdr_idx, i);
+        api->lua->geti(L, hdr_idx, i + 1);
+        const char* name = api->lua->tolstring(L, -2, &name_len);
+        const char* value = api->lua->tolstring(L, -1, &value_len);
+        if (!_http_server_header_refused(name, name_len, value, value_len))
+        {
+            len += name_len + 2 + value_len + 2;
+        }
+        api->lua->pop(L, 2);
+    }
+
+    reply = http_arena_alloc(req->pending->arena, sizeof(http_server_reply_t) + len + body_cap);
+    reply->arena = req->pending->arena;
+    reply->flow = NULL;
+    reply->partial = 0;
+    reply->close = 0;
+
+    buf = reply->buf;
+    pos = (size_t)snprintf(buf, len, "HTTP/1.1 %d %s\r\n", req->status, status_str);
+    for (i = 1; i + 1 <= hdr_cnt; i += 2)
+    {
+        size_t name_len = 0, value_len = 0;
+        api->lua->geti(L, hdr_idx, i);
+        api->lua->geti(L, hdr_idx, i + 1);
+        const char* name = api->lua->tolstring(L, -2, &name_len);
+        const char* value = api->lua->tolstring(L, -1, &value_len);
+        if (_http_server_header_refused(name, name_len, value, value_len))
+        {
+            api->lua->pop(L, 2);
+            continue;
+        }
+
+        memcpy(buf + pos, name, name_len);
+        pos += name_len;
+        memcpy(buf + pos, ": ", 2);
+        pos += 2;
+        memcpy(buf + pos, value, value_len);
+        pos += value_len;
+        memcpy(buf + pos, "\r\n", 2);
+        pos += 2;
+
+        api->lua->pop(L, 2);
+    }
+    pos += snprintf(buf + pos, len - pos, "%s\r\n\r\n", framing);
+
+    reply->len = pos;
+    return reply;
+}
+
+/**
+ * @brief Queue a piece of streamed response of \p req.
+ *
+ * Pieces live on heap, so a long stream does not grow the request arena.
+ *
+ * @param[in] req       Request.
+ * @param[in] data      Body bytes.
+ * @param[in] len       Length of \p data.
+ * @param[in] last      End response after this piece.
+ */
+static void _http_server_stream_chunk(http_server_request_t* req, const char* data, size_t len, int last)
+{
+    static const char s_last_chunk[] = "0\r\n\r\n";
+    size_t pos = 0;
+
+    /* `%zx\r\n` + data + `\r\n` + last chunk */
+    http_server_reply_t* reply = api->memory->malloc(sizeof(http_server_reply_t) + 16 + 2 + len + 2
+        + sizeof(s_last_chunk));
+    reply->arena = NULL;
+    reply->flow = req->flow;
+    reply->partial = !last;
+    reply->close = 0;
+
+    if (len != 0)
+    {
+        pos = snprintf(reply->buf, 16 + 2 + 1, "%zx\r\n", len);
+        memcpy(reply->buf + pos, data, len);
+        pos += len;
+        memcpy(reply->buf + pos, "\r\n", 2);
+        pos += 2;
+    }
+    if (last)
+    {
+        memcpy(reply->buf + pos, s_last_chunk, sizeof(s_last_chunk) - 1);
+        pos += sizeof(s_last_chunk) - 1;
+    }
+    reply->len = pos;
+
+    atomic_fetch_add(&req->flow->refcnt, 1);
+    atomic_fetch_add(&req->flow->queued, pos);
+    _http_server_queue_reply(req->pending, reply);
+}
+
+/**
+ * @brief Send head of a streamed response, with chunked transfer encoding.
+ */
+static void _http_server_stream_begin(struct lua_State* L, http_server_request_t* req)
+{
+    http_server_outflow_t* flow = api->memory->calloc(1, sizeof(http_server_outflow_t));
+    atomic_init(&flow->refcnt, 1);
+    atomic_init(&flow->queued, 0);
+    atomic_init(&flow->waiting, 0);
+    atomic_init(&flow->closed, 0);
+    req->flow = flow;
+
+    /* A streamed response is never cached. */
+    _http_server_cache_settle(req->pending, NULL, 0, 0);
+    http_metrics_route_status(req->pending->metrics, req->status);
+
+    int hdr_idx = 0;
+    if (api->lua->getiuservalue(L, 1, 1) == AUTO_LUA_TTABLE)
+    {
+        hdr_idx = api->lua->gettop(L);
+    }
+    http_server_reply_t* reply = _http_server_serialize_head(L, req, hdr_idx, "Transfer-Encoding: chunked", 0);
+    api->lua->pop(L, 1);
+
+    reply->flow = flow;
+    reply->partial = 1;
+    atomic_fetch_add(&flow->refcnt, 1);
+    atomic_fetch_add(&flow->queued, reply->len);
+    _http_server_queue_reply(req->pending, reply);
+}
+
+/**
+ * @brief End streamed response of \p req.
+ * @param[in] req       Request.
+ * @param[in] body      Last piece of body.
+ * @param[in] body_len  Length of \p body.
+ * @param[in] abort     Close connection instead, so client sees response is
+ *   incomplete.
+ */
+static void _http_server_stream_end(http_server_request_t* req, const char* body, size_t body_len, int abort)
+{
+    req->finished = 1;
+    if (req->server == NULL)
+    {
+        return;
+    }
+
+    atomic_fetch_sub(&req->server->gauges->inflight, 1);
+    http_metrics_hist_record(&req->pending->metrics->handler,
+        api->misc->hrtime() - req->pending->dispatch);
+
+    if (!abort)
+    {
+        _http_server_stream_chunk(req, body, body_len, 1);
+        return;
+    }
+
+    http_server_reply_t* reply = api->memory->malloc(sizeof(http_server_reply_t));
+    reply->arena = NULL;
+    reply->flow = NULL;
+    reply->partial = 0;
+    reply->close = 1;
+    reply->len = 0;
+    _http_server_queue_reply(req->pending, reply);
+}
+
+/**
+ * @brief Serialize response and queue it.
+ *
+ * @param[in] L         Lua VM.
+ * @param[in] req       Request.
+ * @param[in] hdr_idx   Index of header table, or 0 if no header. It is an
+ *   array of name/value.
+ * @param[in] body      Response body.
+ * @param[in] body_len  Body length.
+ */
+static void _http_server_request_finish(struct lua_State* L, http_server_request_t* req,
+    int hdr_idx, const char* body, size_t body_len)
+{
+    char framing[48];
+    http_server_reply_t* reply;
+
+    if (req->flow != NULL)
+    {
+        _http_server_stream_end(req, body, body_len, 0);
+        return;
+    }
+
+    req->finished = 1;
+    if (req->server == NULL)
+    {
+        return;
+    }
+
+    atomic_fetch_sub(&req->server->gauges->inflight, 1);
+    http_metrics_route_t* metrics = req->pending->metrics;
+    http_metrics_hist_record(&metrics->handler, api->misc->hrtime() - req->pending->dispatch);
+    http_metrics_route_status(metrics, req->status);
+
+    snprintf(framing, sizeof(framing), "Content-Length: %zu", body_len);
+    reply = _http_server_serialize_head(L, req, hdr_idx, framing, body_len);
+    memcpy(reply->buf + reply->len, body, body_len);
+    reply->len += body_len;
+
+    _http_server_queue_reply(req->pending, reply);
+    _http_server_cache_settle(req->pending, reply->buf, reply->len, req->status);
+}
+
+/**
+ * @brief Get request object, which may already be answered.
+ */
+static http_server_request_t* _http_server_request_get(struct lua_State* L, int idx)
+{
+    api->lua->L_checkudata(L, idx, "__auto_http_request");
+    return api->lua->touserdata(L, idx);
+}
+
+/**
+ * @brief Get request object that is not answered yet.
+ */
+static http_server_request_t* _http_server_request_check(struct lua_State* L, int idx)
+{
+    http_server_request_t* req = _http_server_request_get(L, idx);
+
+    if (req->finished)
+    {
+        api->lua->L_error(L, "response already sent");
+    }
+
+    return req;
+}
+
+static int _http_server_request_gc(struct lua_State* L)
+{
+    http_server_request_t* req = api->lua->touserdata(L, 1);
+
+    /* Never leave client waiting. */
+    if (!req->finished && req->flow != NULL)
+    {
+        _http_server_stream_end(req, NULL, 0, 1);
+    }
+    else if (!req->finished)
+    {
+        static const char* s_body = "Internal Server Error\n";
+        req->status = 500;
+        _http_server_request_finish(L, req, 0, s_body, strlen(s_body));
+    }
+
+    if (req->flow != NULL)
+    {
+        req->flow->waiter = NULL;
+        _http_server_outflow_release(req->flow);
+        req->flow = NULL;
+    }
+    _http_server_request_end_body(req, -1);
+    if (req->server != NULL)
+    {
+        api->list->erase(&req->server->requests, &req->node);
+        req->server = NULL;
+    }
+
+    http_arena_release(req->pending->arena);
+    req->pending = NULL;
+
+    return 0;
+}
+
+/**
+ * @brief Get request object whose head is not sent yet.
+ */
+static http_server_request_t* _http_server_request_check_head(struct lua_State* L, int idx)
+{
+    http_server_request_t* req = _http_server_request_check(L, idx);
+
+    if (req->flow != NULL)
+    {
+        api->lua->L_error(L, "response head already sent");
+    }
+
+    return req;
+}
+
+static int _http_server_request_status(struct lua_State* L)
+{
+    http_server_request_t* req = _http_server_request_check_head(L, 1);
+    int64_t status = api->lua->L_checkinteger(L, 2);
+
+    if (status < 100 || status > 999)
+    {
+        return api->lua->L_error(L, "invalid status code %d", (int)status);
+    }
+    req->status = (int)status;
+
+    return 0;
+}
+
+/**
+ * @brief `req:set_header(name, value)`, adds a response header.
+ *
+ * Raises if \p name is empty or contains ':', or if either contains CR, LF
+ * or NUL. Content-Length and Transfer-Encoding are ignored, as framing is
+ * always generated.
+ */
+static int _http_server_request_set_header(struct lua_State* L)
+{
+    size_t name_len, value_len;
+    _http_server_request_check_head(L, 1);
+    const char* name = api->lua->L_checklstring(L, 2, &name_len);
+    const char* value = api->lua->L_checklstring(L, 3, &value_len);
+
+    if (name_len == 0 || memchr(name, ':', name_len) != NULL)
+    {
+        return api->lua->L_error(L, "invalid header name");
+    }
+    if (memchr(name, '\r', name_len) != NULL || memchr(name, '\n', name_len) != NULL
+        || memchr(name, '\0', name_len) != NULL || memchr(value, '\r', value_len) != NULL
+        || memchr(value, '\n', value_len) != NULL || memchr(value, '\0', value_len) != NULL)
+    {
+        return api->lua->L_error(L, "header must not contain CR, LF or NUL");
+    }
+
+    /* Only framing is left to refuse. */
+    if (_http_server_header_refused(name, name_len, value, value_len))
+    {
+        return 0;
+    }
+
+    /* Header table is only created for callbacks that need it. */
+    if (api->lua->getiuservalue(L, 1, 1) != AUTO_LUA_TTABLE)
+    {
+        api->lua->pop(L, 1);
+        api->lua->newtable(L);
+        api->lua->pushvalue(L, -1);
+        api->lua->setiuservalue(L, 1, 1);
+    }
+    int64_t n = api->lua->L_len(L, -1);
+    api->lua->pushvalue(L, 2);
+    api->lua->seti(L, -2, n + 1);
+    api->lua->pushvalue(L, 3);
+    api->lua->seti(L, -2, n + 2);
+    api->lua->pop(L, 1);
+
+    return 0;
+}
+
+static int _http_server_request_send(struct lua_State* L)
+{
+    size_t body_len = 0;
+    const char* body = "";
+    http_server_request_t* req = _http_server_request_check(L, 1);
+
+    if (api->lua->type(L, 2) > AUTO_LUA_TNIL)
+    {
+        body = api->lua->L_checklstring(L, 2, &body_len);
+    }
+
+    if (api->lua->getiuservalue(L, 1, 1) == AUTO_LUA_TTABLE)
+    {
+        _http_server_request_finish(L, req, api->lua->gettop(L), body, body_len);
+    }
+    else
+    {
+        _http_server_request_finish(L, req, 0, body, body_len);
+    }
+    api->lua->pop(L, 1);
+
+    return 0;
+}
+
+static int _http_server_request_write_k(struct lua_State* L, int status, void* ctx)
+{
+    http_server_request_t* req = ctx;
+    (void)status;
+
+    api->lua->pushboolean(L, req->flow == NULL || !atomic_load(&req->flow->closed));
+    return 1;
+}
+
+/**
+ * @brief `req:write(data)`, send a piece of response body.
+ *
+ * The first call sends status and headers, and the body goes out with
+ * chunked transfer encoding. `req:send()` or returning from callback ends it.
+ *
+ * Waits here while too much is queued for a slow client. Returns false once
+ * client is gone.
+ */
+static int _http_server_request_write(struct lua_State* L)
+{
+    size_t len;
+    http_server_request_t* req = _http_server_request_check(L, 1);
+    const char* data = api->lua->L_checklstring(L, 2, &len);
+
+    if (req->server == NULL)
+    {
+        api->lua->pushboolean(L, 0);
+        return 1;
+    }
+    if (req->flow == NULL)
+    {
+        _http_server_stream_begin(L, req);
+    }
+    if (len != 0)
+    {
+        _http_server_stream_chunk(req, data, len, 0);
+    }
+
+    http_server_outflow_t* flow = req->flow;
+    if (atomic_load(&flow->queued) <= HTTP_SERVER_WRITE_HIGH_WATER)
+    {
+        return _http_server_request_write_k(L, 0, req);
+    }
+
+    /* Poll thread may have sent enough before it could see the flag. */
+    atomic_store(&flow->waiting, 1);
+    if (atomic_load(&flow->queued) <= HTTP_SERVER_WRITE_HIGH_WATER / 2
+        && atomic_exchange(&flow->waiting, 0) != 0)
+    {
+        return _http_server_request_write_k(L, 0, req);
+    }
+
+    flow->waiter = api->coroutine->find(L);
+    api->coroutine->set_state(flow->waiter, AUTO_COROUTINE_WAIT);
+    return api->lua->yieldk(L, 0, req, _http_server_request_write_k);
+}
+
+static void _http_server_push_mg_str(struct lua_State* L, const struct mg_str* str)
+{
+    if (str == NULL || str->ptr == NULL)
+    {
+        api->lua->pushnil(L);
+        return;
+    }
+    api->lua->pushlstring(L, str->ptr, str->len);
+}
+
+static int _http_server_request_read_k(struct lua_State* L, int status, void* ctx)
+{
+    auto_list_node_t* it;
+    http_server_request_t* req = ctx;
+    (void)status;
+
+    if (req->upload != NULL && (it = api->list->pop_front(&req->chunks)) != NULL)
+    {
+        http_server_pending_t* chunk = container_of(it, http_server_pending_t, body_node);
+        api->lua->pushlstring(L, chunk->hm.body.ptr, chunk->hm.body.len);
+        if (http_upload_consumed(req->upload, chunk->hm.body.len) && req->server != NULL)
+        {
+            _http_server_wakeup(req->reactor);
+        }
+        http_arena_release(chunk->arena);
+        return 1;
+    }
+
+    if (req->upload == NULL || req->body_state != 0)
+    {
+        api->lua->pushnil(L);
+        if (req->body_state < 0)
+        {
+            api->lua->pushstring(L, "aborted");
+            return 2;
+        }
+        return 1;
+    }
+
+    /* Sleep until poll thread sends more. */
+    if ((req->waiter = api->coroutine->find(L)) == NULL)
+    {
+        return api->lua->L_error(L, "req:read() must be called in a streaming route");
+    }
+    api->coroutine->set_state(req->waiter, AUTO_COROUTINE_WAIT);
+    return api->lua->yieldk(L, 0, req, _http_server_request_read_k);
+}
+
+/**
+ * @brief `req:read()`, next piece of request body, or nil at end of body.
+ *
+ * A streaming route gets body as it arrives, and waits here for more. A
+ * second value `"aborted"` tells the client went away or the body was
+ * malformed. Other routes get whole body in the first call.
+ */
+static int _http_server_request_read(struct lua_State* L)
+{
+    http_server_request_t* req = _http_server_request_get(L, 1);
+
+    if (req->upload == NULL)
+    {
+        if (req->body_state == 0 && req->pending->hm.body.len != 0)
+        {
+            req->body_state = 1;
+            _http_server_push_mg_str(L, &req->pending->hm.body);
+            return 1;
+        }
+        req->body_state = 1;
+        api->lua->pushnil(L);
+        return 1;
+    }
+
+    return _http_server_request_read_k(L, 0, req);
+}
+
+/**
+ * @brief `req:header(name)`, value of first header named \p name, or nil.
+ */
+static int _http_server_request_header(struct lua_State* L)
+{
+    http_server_request_t* req = _http_server_request_get(L, 1);
+    const char* name = api->lua->L_checkstring(L, 2);
+
+    _http_server_push_mg_str(L, mg_http_get_header(&req->pending->hm, name));
+    return 1;
+}
+
+/**
+ * @brief `req:query(name)`, URL decoded value of query parameter \p name, or
+ *   nil.
+ */
+static int _http_server_request_query(struct lua_State* L)
+{
+    int len;
+    char tmp[256];
+    char* buf = tmp;
+    http_server_request_t* req = _http_server_request_get(L, 1);
+    const char* name = api->lua->L_checkstring(L, 2);
+
+    struct mg_str value = mg_http_var(req->pending->hm.query, mg_str(name));
+    if (value.ptr == NULL)
+    {
+        api->lua->pushnil(L);
+        return 1;
+    }
+
+    /* Decoded value is never longer than the raw one. */
+    if (value.len >= sizeof(tmp))
+    {
+        buf = http_arena_alloc(req->pending->arena, value.len + 1);
+    }
+    if ((len = mg_url_decode(value.ptr, value.len, buf, value.len + 1, 1)) < 0)
+    {
+        api->lua->pushnil(L);
+        return 1;
+    }
+
+    api->lua->pushlstring(L, buf, len);
+    return 1;
+}
+
+/**
+ * @brief `__index` of request object.
+ *
+ * Request fields are pushed straight from the request buffer when they are
+ * read, so handlers only pay for what they use. Anything else is looked up in
+ * the method table, which is upvalue 1.
+ */
+static int _http_server_request_index(struct lua_State* L)
+{
+    http_server_request_t* req = api->lua->touserdata(L, 1);
+    const struct mg_http_message* hm = &req->pending->hm;
+    const char* key = api->lua->type(L, 2) == AUTO_LUA_TSTRING ? api->lua->tostring(L, 2) : "";
+
+    if (strcmp(key, "method") == 0)
+    {
+        _http_server_push_mg_str(L, &hm->method);
+    }
+    else if (strcmp(key, "uri") == 0)
+    {
+        _http_server_push_mg_str(L, &hm->uri);
+    }
+    else if (strcmp(key, "body") == 0)
+    {
+        _http_server_push_mg_str(L, &hm->body);
+    }
+    else
+    {
+        api->lua->getfield(L, HTTP_SERVER_UPVALUE_INDEX(1), key);
+    }
+
+    return 1;
+}
+
+static void _http_server_request_set_metatable(struct lua_State* L)
+{
+    static const auto_luaL_Reg s_http_request_meta[] = {
+        { "__gc",       _http_server_request_gc },
+        { NULL,         NULL },
+    };
+    static const auto_luaL_Reg s_http_request_method[] = {
+        { "header",     _http_server_request_header },
+        { "query",      _http_server_request_query },
+        { "status",     _http_server_request_status },
+        { "set_header", _http_server_request_set_header },
+        { "send",       _http_server_request_send },
+        { "read",       _http_server_request_read },
+        { "write",      _http_server_request_write },
+        { NULL,         NULL },
+    };
+    if (api->lua->L_newmetatable(L, "__auto_http_request") != 0)
+    {
+        api->lua->L_setfuncs(L, s_http_request_meta, 0);
+        api->lua->L_newlib(L, s_http_request_method);
+        api->lua->pushcclosure(L, _http_server_request_index, 1);
+        api->lua->setfield(L, -2, "__index");
+    }
+    api->lua->setmetatable(L, -2);
+}
+
+/**
+ * @brief Reply with values returned by route callback, if it did not reply.
+ *
+ * Stack: [req] [status] [body] [headers], which are popped.
+ */
+static void _http_server_reply_returned(struct lua_State* L)
+{
+    int top = api->lua->gettop(L);
+    http_server_request_t* req = api->lua->touserdata(L, top - 3);
+
+    /* Returning ends a streamed response, with returned body as last piece. */
+    if (!req->finished && req->flow != NULL)
+    {
+        size_t body_len = 0;
+        const char* body = "";
+        if (api->lua->type(L, top - 1) == AUTO_LUA_TSTRING)
+        {
+            body = api->lua->tolstring(L, top - 1, &body_len);
+        }
+        _http_server_stream_end(req, body, body_len, 0);
+    }
+    else if (!req->finished && api->lua->type(L, top - 2) == AUTO_LUA_TNUMBER)
+    {
+        size_t body_len = 0;
+        const char* body = "";
+
+        /* Same range as req:status(). */
+        int64_t status = api->lua->tointeger(L, top - 2);
+        req->status = status >= 100 && status <= 999 ? (int)status : 500;
+        if (api->lua->type(L, top - 1) == AUTO_LUA_TSTRING)
+        {
+            body = api->lua->tolstring(L, top - 1, &body_len);
+        }
+        if (api->lua->type(L, top) != AUTO_LUA_TTABLE)
+        {
+            api->lua->getiuservalue(L, top - 3, 1);
+            api->lua->replace(L, top);
+        }
+
+        _http_server_request_finish(L, req,
+            api->lua->type(L, top) == AUTO_LUA_TTABLE ? top : 0, body, body_len);
+    }
+
+    api->lua->pop(L, 4);
+}
+
+static int _http_server_handler_after(struct lua_State* L, int status, void* ctx)
+{
+    http_server_request_t* req = ctx;
+    (void)status;
+
+    /* Callback is done, so is its interest in the body. */
+    _http_server_request_end_body(req, -1);
+    _http_server_reply_returned(L);
+    return 0;
+}
+
+/**
+ * @brief Body of coroutine that runs a route.
+ *
+ * Stack: [req] [callback] [captures...]
+ */
+static int _http_server_handler_entry(struct lua_State* L)
+{
+    int nargs = api->lua->gettop(L) - 1;
+    http_server_request_t* req = api->lua->touserdata(L, 1);
+
+    api->lua->pushvalue(L, 1);
+    api->lua->insert(L, 3);
+
+    return api->lua->A_callk(L, nargs, 3, req, _http_server_handler_after);
+}
+
+/**
+ * @brief Queue a piece of streamed body on its request, and wake up the
+ *   reader.
+ */
+static void _http_server_handle_body_lua(http_server_pending_t* pending)
+{
+    http_server_request_t tmp;
+    http_server_t* server = pending->server;
+
+    tmp.reactor = pending->reactor;
+    tmp.conn_id = pending->conn_id;
+    auto_map_node_t* it = api->map->find(&server->uploads, &tmp.upload_node);
+    if (it == NULL)
+    {
+        http_arena_release(pending->arena);
+        return;
+    }
+
+    http_server_request_t* req = container_of(it, http_server_request_t, upload_node);
+    if (pending->body_end != 0)
+    {
+        req->body_state = pending->body_end;
+        api->map->erase(&server->uploads, &req->upload_node);
+    }
+    if (pending->hm.body.len != 0)
+    {
+        api->list->push_back(&req->chunks, &pending->body_node);
+    }
+    else
+    {
+        http_arena_release(pending->arena);
+    }
+
+    if (req->waiter != NULL)
+    {
+        api->coroutine->set_state(req->waiter, AUTO_COROUTINE_BUSY);
+        req->waiter = NULL;
+    }
+}
+
+static void _http_server_ws_queue(http_server_reactor_t* reactor, http_server_ws_cmd_t* cmd)
+{
+    api->sem->wait(reactor->reply_lock);
+    api->list->push_back(&reactor->ws_cmds, &cmd->node);
+    api->sem->post(reactor->reply_lock);
+
+    _http_server_wakeup(reactor);
+}
+
+static http_server_ws_cmd_t* _http_server_ws_new_cmd(http_ws_frame_t* frame, size_t conn_cnt)
+{
+    http_server_ws_cmd_t* cmd = malloc(sizeof(http_server_ws_cmd_t) + sizeof(unsigned long) * conn_cnt);
+    http_ws_frame_ref(frame);
+    cmd->frame = frame;
+    cmd->close = 0;
+    cmd->conn_cnt = 0;
+    return cmd;
+}
+
+/**
+ * @brief Send \p frame to the connection of \p ws.
+ */
+static void _http_server_ws_send_frame(http_server_ws_t* ws, http_ws_frame_t* frame, int close)
+{
+    http_server_ws_cmd_t* cmd = _http_server_ws_new_cmd(frame, 1);
+    cmd->close = close;
+    cmd->conn_ids[cmd->conn_cnt++] = ws->conn_id;
+    http_ws_frame_release(frame);
+    _http_server_ws_queue(ws->reactor, cmd);
+}
+
+static http_server_ws_t* _http_server_ws_check(struct lua_State* L, int idx)
+{
+    api->lua->L_checkudata(L, idx, "__auto_http_websocket");
+    return api->lua->touserdata(L, idx);
+}
+
+static http_server_topic_t* _http_server_find_topic(http_server_t* server, const char* name)
+{
+    http_server_topic_t tmp;
+    tmp.name = (char*)name;
+
+    auto_map_node_t* it = api->map->find(&server->topics, &tmp.node);
+    return it != NULL ? container_of(it, http_server_topic_t, node) : NULL;
+}
+
+/**
+ * @brief `ws:send(data[, binary])`. Returns false if connection is closed.
+ */
+static int _http_server_ws_send(struct lua_State* L)
+{
+    size_t len;
+    http_server_ws_t* ws = _http_server_ws_check(L, 1);
+    const char* data = api->lua->L_checklstring(L, 2, &len);
+    int op = api->lua->toboolean(L, 3) ? WEBSOCKET_OP_BINARY : WEBSOCKET_OP_TEXT;
+
+    if (ws->server == NULL)
+    {
+        api->lua->pushboolean(L, 0);
+        return 1;
+    }
+
+    _http_server_ws_send_frame(ws, http_ws_frame_create(api->memory, op, data, len), 0);
+    api->lua->pushboolean(L, 1);
+    return 1;
+}
+
+/**
+ * @brief `ws:close()`. The close handler is called once the connection is
+ *   gone.
+ */
+static int _http_server_ws_close(struct lua_State* L)
+{
+    static const char s_normal_closure[] = { 0x03, (char)0xe8 };
+    http_server_ws_t* ws = _http_server_ws_check(L, 1);
+
+    if (ws->server != NULL)
+    {
+        _http_server_ws_send_frame(ws, http_ws_frame_create(api->memory, WEBSOCKET_OP_CLOSE,
+            s_normal_closure, sizeof(s_normal_closure)), 1);
+    }
+    return 0;
+}
+
+/**
+ * @brief `ws:subscribe(topic)`, receive everything broadcast to \p topic.
+ */
+static int _http_server_ws_subscribe(struct lua_State* L)
+{
+    auto_list_node_t* it;
+    http_server_ws_t* ws = _http_server_ws_check(L, 1);
+    const char* name = api->lua->L_checkstring(L, 2);
+    http_server_t* server = ws->server;
+
+    if (server == NULL)
+    {
+        api->lua->pushboolean(L, 0);
+        return 1;
+    }
+
+    http_server_topic_t* topic = _http_server_find_topic(server, name);
+    if (topic == NULL)
+    {
+        topic = malloc(sizeof(http_server_topic_t));
+        topic->name = strdup(name);
+        api->list->init(&topic->subs);
+        api->map->insert(&server->topics, &topic->node);
+    }
+
+    for (it = api->list->begin(&ws->subs); it != NULL; it = api->list->next(it))
+    {
+        if (container_of(it, http_server_sub_t, ws_node)->topic == topic)
+        {
+            api->lua->pushboolean(L, 1);
+            return 1;
+        }
+    }
+
+    http_server_sub_t* sub = malloc(sizeof(http_server_sub_t));
+    sub->topic = topic;
+    sub->ws = ws;
+    api->list->push_back(&topic->subs, &sub->topic_node);
+    api->list->push_back(&ws->subs, &sub->ws_node);
+
+    api->lua->pushboolean(L, 1);
+    return 1;
+}
+
+/**
+ * @brief `ws:unsubscribe(topic)`
+ */
+static int _http_server_ws_unsubscribe_lua(struct lua_State* L)
+{
+    auto_list_node_t* it;
+    http_server_ws_t* ws = _http_server_ws_check(L, 1);
+    const char* name = api->lua->L_checkstring(L, 2);
+
+    if (ws->server == NULL)
+    {
+        return 0;
+    }
+
+    for (it = api->list->begin(&ws->subs); it != NULL; it = api->list->next(it))
+    {
+        http_server_sub_t* sub = container_of(it, http_server_sub_t, ws_node);
+        if (strcmp(sub->topic->name, name) == 0)
+        {
+            _http_server_ws_unsubscribe(ws->server, sub);
+            break;
+        }
+    }
+    return 0;
+}
+
+static void _http_server_ws_set_metatable(struct lua_State* L)
+{
+    static const auto_luaL_Reg s_http_ws_method[] = {
+        { "send",           _http_server_ws_send },
+        { "close",          _http_server_ws_close },
+        { "subscribe",      _http_server_ws_subscribe },
+        { "unsubscribe",    _http_server_ws_unsubscribe_lua },
+        { NULL,             NULL },
+    };
+    if (api->lua->L_newmetatable(L, "__auto_http_websocket") != 0)
+    {
+        api->lua->L_newlib(L, s_http_ws_method);
+        api->lua->setfield(L, -2, "__index");
+    }
+    api->lua->setmetatable(L, -2);
+}
+
+/**
+ * @brief Push captures of \p pending as handler arguments.
+ *
+ * Poll thread already converted `<int>`, `<float>` and `<uuid>` while
+ * matching, so numbers cost no string.
+ */
+static void _http_server_push_captures(struct lua_State* L, const http_server_pending_t* pending)
+{
+    size_t i;
+    const http_router_match_t* match = &pending->match;
+
+    for (i = 0; i < match->group_cnt; i++)
+    {
+        switch (match->types[i])
+        {
+        case HTTP_ROUTER_PARAM_INT:
+            api->lua->pushinteger(L, match->values[i].i);
+            break;
+
+        case HTTP_ROUTER_PARAM_FLOAT:
+            api->lua->pushnumber(L, match->values[i].f);
+            break;
+
+        case HTTP_ROUTER_PARAM_UUID:
+            if (pending->raw_uuid)
+            {
+                api->lua->pushlstring(L, (const char*)match->values[i].uuid, sizeof(match->values[i].uuid));
+                break;
+            }
+            /* fall through */
+
+        default:
+            api->lua->pushlstring(L, pending->hm.uri.ptr + match->groups[2 * i],
+                match->groups[2 * i + 1] - match->groups[2 * i]);
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Call websocket handler for \p pending.
+ *
+ * The websocket object is created on open and kept in a registry reference
+ * until close, so later events of the same connection find it. Like routes,
+ * each event runs in its own coroutine, so a handler that yields may still be
+ * running when the next event of the same websocket arrives.
+ */
+static void _http_server_handle_ws_lua(struct lua_State* L, http_server_pending_t* pending)
+{
+    const char* name;
+    http_server_ws_t* ws;
+    http_server_t* server = pending->server;
+    struct lua_State* co = api->lua->newthread(L);
+
+    if (pending->type == HTTP_SERVER_EVENT_WS_OPEN)
+    {
+        ws = api->lua->newuserdatauv(co, sizeof(http_server_ws_t), 0);
+        memset(ws, 0, sizeof(*ws));
+        ws->server = server;
+        ws->reactor = pending->reactor;
+        ws->conn_id = pending->conn_id;
+        api->list->init(&ws->subs);
+        _http_server_ws_set_metatable(co);
+
+        api->lua->pushvalue(co, -1);
+        ws->ref_self = api->lua->L_ref(co, AUTO_LUA_REGISTRYINDEX);
+        api->map->insert(&server->websockets, &ws->node);
+        name = "open";
+    }
+    else
+    {
+        http_server_ws_t tmp;
+        tmp.reactor = pending->reactor;
+        tmp.conn_id = pending->conn_id;
+        auto_map_node_t* it = api->map->find(&server->websockets, &tmp.node);
+        if (it == NULL)
+        {
+            _http_server_pending_unroute(pending);
+            http_arena_release(pending->arena);
+            api->lua->pop(L, 1);
+            return;
+        }
+        ws = container_of(it, http_server_ws_t, node);
+        api->lua->rawgeti(co, AUTO_LUA_REGISTRYINDEX, ws->ref_self);
+        name = pending->type == HTTP_SERVER_EVENT_WS_MSG ? "message" : "close";
+    }
+
+    /* Stack: [ws] [handlers] [fn] */
+    api->lua->rawgeti(co, AUTO_LUA_REGISTRYINDEX, pending->router->data.ref_cb);
+    _http_server_pending_unroute(pending);
+    int has_fn = api->lua->getfield(co, -1, name) == AUTO_LUA_TFUNCTION;
+    if (pending->type == HTTP_SERVER_EVENT_WS_CLOSE)
+    {
+        _http_server_ws_detach(co, ws);
+    }
+    if (!has_fn)
+    {
+        http_arena_release(pending->arena);
+        api->lua->pop(L, 1);
+        return;
+    }
+
+    /* Stack: [fn] [ws] */
+    api->lua->remove(co, -2);
+    api->lua->insert(co, -2);
+
+    switch (pending->type)
+    {
+    case HTTP_SERVER_EVENT_WS_OPEN:
+        _http_server_push_captures(co, pending);
+        break;
+
+    case HTTP_SERVER_EVENT_WS_MSG:
+        api->lua->pushlstring(co, pending->hm.body.ptr, pending->hm.body.len);
+        api->lua->pushboolean(co, pending->ws_op == WEBSOCKET_OP_BINARY);
+        break;
+
+    default:
+        break;
+    }
+
+    /* Everything is copied into lua by now. */
+    http_arena_release(pending->arena);
+
+    api->coroutine->host(co);
+    api->lua->pop(L, 1);
+}
+
+/**
+ * @brief Answer 503 to a request that waited too long, without calling its
+ *   route.
+ */
+static void _http_server_shed_pending(http_server_pending_t* pending)
+{
+    http_server_t* server = pending->server;
+
+    atomic_fetch_sub(&server->gauges->inflight, 1);
+    http_metrics_route_status(pending->metrics, 503);
+    _http_server_pending_unroute(pending);
+    _http_server_cache_settle(pending, NULL, 0, 0);
+
+    /* Poll thread discards the rest of body. */
+    if (pending->upload != NULL)
+    {
+        if (http_upload_abandon(pending->upload))
+        {
+            _http_server_wakeup(pending->reactor);
+        }
+        http_upload_release(pending->upload);
+        pending->upload = NULL;
+    }
+
+    _http_server_queue_reply(pending, _http_server_new_unavailable());
+    http_arena_release(pending->arena);
+}
+
+/**
+ * @brief Start handler of \p pending.
+ *
+ * Every route runs in its own coroutine, so a callback that waits or raises
+ * holds up or loses only its own request, and the drain goes on with the
+ * next one. A request left unanswered by a failed callback gets 500 when it
+ * is collected.
+ */
+static void _http_server_handle_msg_lua(struct lua_State* L, http_server_pending_t* pending)
+{
+    http_server_t* server = pending->server;
+
+    if (pending->type == HTTP_SERVER_EVENT_BODY)
+    {
+        _http_server_handle_body_lua(pending);
+        return;
+    }
+    if (pending->type != HTTP_SERVER_EVENT_REQUEST)
+    {
+        _http_server_handle_ws_lua(L, pending);
+        return;
+    }
+
+    pending->dispatch = api->misc->hrtime();
+    http_metrics_hist_record(&pending->metrics->queue, pending->dispatch - pending->start);
+
+    /* Tells poll threads how far behind lua is. A request that waited too long is likely given up on by its client. */
+    uint64_t waited = pending->dispatch - pending->start;
+    atomic_store_explicit(&server->gauges->queue_delay, waited, memory_order_relaxed);
+    if (server->options.max_queue_delay != 0 && waited > server->options.max_queue_delay)
+    {
+        _http_server_shed_pending(pending);
+        return;
+    }
+
+    struct lua_State* co = api->lua->newthread(L);
+    api->lua->pushcfunction(co, _http_server_handler_entry);
+
+    /* The request object stays under the callback so it is alive in continuation. */
+    http_server_request_t* req = api->lua->newuserdatauv(co, sizeof(http_server_request_t), 1);
+    memset(req, 0, sizeof(*req));
+    req->server = server;
+    req->pending = pending;
+    req->status = 200;
+    api->list->init(&req->chunks);
+    api->list->push_back(&server->requests, &req->node);
+    if (pending->upload != NULL)
+    {
+        req->upload = pending->upload;
+        req->reactor = pending->reactor;
+        req->conn_id = pending->conn_id;
+        pending->upload = NULL;
+        api->map->insert(&server->uploads, &req->upload_node);
+    }
+    _http_server_request_set_metatable(co);
+
+    api->lua->rawgeti(co, AUTO_LUA_REGISTRYINDEX, pending->router->data.ref_cb);
+    _http_server_pending_unroute(pending);
+    _http_server_push_captures(co, pending);
+    api->coroutine->host(co);
+    api->lua->pop(L, 1);
+}
+
+static void _http_server_drain_lua(struct lua_State* L, void* arg);
+static void _http_server_reclaim(struct lua_State* L, http_server_t* server);
+
+/**
+ * @brief Make sure a drain is scheduled in lua.
+ *
+ * Only the first push after a drain starts pays for a lua wake-up, the rest
+ * are picked up by that drain.
+ */
+static void _http_server_arm_drain(http_server_t* server)
+{
+    if (atomic_exchange(&server->inbox_armed, 1) != 0)
+    {
+        return;
+    }
+
+    if (!api->async->call_in_lua(server->async, _http_server_drain_lua, server))
+    {
+        atomic_store(&server->inbox_armed, 0);
+    }
+}
+
+/**
+ * @brief Pass \p pending to lua.
+ * @note MT-Safe
+ */
+static void _http_server_post(http_server_t* server, http_server_pending_t* pending)
+{
+    if (pending->type == HTTP_SERVER_EVENT_REQUEST)
+    {
+        atomic_fetch_add(&server->gauges->inflight, 1);
+    }
+    atomic_fetch_add(&server->gauges->queue_depth, 1);
+
+    mpsc_queue_push(&server->inbox, &pending->node);
+    _http_server_arm_drain(server);
+}
+
+/**
+ * @brief Start handlers of pending events, at most one batch.
+ *
+ * Handlers only get started here, so the drain returns to the scheduler
+ * within its budget whatever they do.
+ */
+static void _http_server_drain_lua(struct lua_State* L, void* arg)
+{
+    http_server_t* server = arg;
+
+    /* Pushes from now on need a new drain. */
+    atomic_store(&server->inbox_armed, 0);
+
+    /* Events drained since last time may have let go of retired routes. */
+    if (api->list->size(&server->retired_tables) != 0 || api->list->size(&server->retired_routes) != 0)
+    {
+        _http_server_reclaim(L, server);
+    }
+
+    unsigned cnt;
+    uint64_t start = api->misc->hrtime();
+    for (cnt = 0; cnt < server->options.batch_size
+        && api->misc->hrtime() - start < server->options.batch_budget; cnt++)
+    {
+        mpsc_node_t* node = mpsc_queue_pop(&server->inbox);
+        if (node == NULL)
+        {
+            /* Caught up, so poll threads stop shedding for queue delay. */
+            atomic_store_explicit(&server->gauges->queue_delay, 0, memory_order_relaxed);
+            return;
+        }
+
+        atomic_fetch_sub(&server->gauges->queue_depth, 1);
+        _http_server_handle_msg_lua(L, container_of(node, http_server_pending_t, node));
+    }
+
+    /* Out of batch, give other coroutines a chance and come back later. */
+    _http_server_arm_drain(server);
+}
+
+static void _http_server_rebase_str(struct mg_str* str, const char* from, size_t len, char* to)
+{
+    if (str->ptr < from || str->ptr + str->len > from + len)
+    {
+        str->ptr = NULL;
+        str->len = 0;
+        return;
+    }
+    str->ptr = to + (str->ptr - from);
+}
+
+/**
+ * @brief Copy \p hm into a self contained pending request.
+ */
+static http_server_pending_t* _http_server_new_pending(http_server_reactor_t* reactor,
+    http_server_conn_t* conn, struct mg_http_message* hm, const http_router_match_t* match,
+    uint64_t start)
+{
+    size_t i;
+    size_t head_len = hm->head.len, body_len = hm->body.len;
+    http_arena_t* arena = http_arena_acquire(&reactor->arenas);
+    http_server_pending_t* pending = http_arena_alloc(arena, sizeof(http_server_pending_t) + head_len + body_len + 1);
+
+    pending->arena = arena;
+    pending->type = HTTP_SERVER_EVENT_REQUEST;
+    pending->ws_op = 0;
+    pending->body_end = 0;
+    pending->upload = NULL;
+    pending->cache_entry = NULL;
+    pending->server = reactor->server;
+    pending->reactor = reactor;
+    pending->router = match->data;
+    pending->metrics = pending->router->metrics;
+    pending->cache_ttl = pending->router->cache.ttl;
+    pending->raw_uuid = pending->router->data.raw_uuid;
+    atomic_fetch_add_explicit(&pending->router->users, 1, memory_order_relaxed);
+    pending->conn_id = conn->id;
+    pending->seq = conn->req_seq++;
+    pending->start = start;
+    pending->match = *match;
+
+    memcpy(pending->data, hm->head.ptr, head_len);
+    memcpy(pending->data + head_len, hm->body.ptr, body_len);
+    pending->data[head_len + body_len] = '\0';
+
+    pending->hm = *hm;
+    _http_server_rebase_str(&pending->hm.method, hm->head.ptr, head_len, pending->data);
+    _http_server_rebase_str(&pending->hm.uri, hm->head.ptr, head_len, pending->data);
+    _http_server_rebase_str(&pending->hm.query, hm->head.ptr, head_len, pending->data);
+    _http_server_rebase_str(&pending->hm.proto, hm->head.ptr, head_len, pending->data);
+    for (i = 0; i < ARRAY_SIZE(pending->hm.headers); i++)
+    {
+        _http_server_rebase_str(&pending->hm.headers[i].name, hm->head.ptr, head_len, pending->data);
+        _http_server_rebase_str(&pending->hm.headers[i].value, hm->head.ptr, head_len, pending->data);
+    }
+    pending->hm.head = mg_str_n(pending->data, head_len);
+    pending->hm.body = mg_str_n(pending->data + head_len, body_len);
+    pending->hm.message = mg_str_n(pending->data, head_len + body_len);
+    pending->hm.chunk = mg_str_n(NULL, 0);
+
+    return pending;
+}
+
+/**
+ * @brief Pass websocket event of \p conn to lua.
+ */
+static void _http_server_post_ws_event(http_server_conn_t* conn, http_server_event_t type,
+    int op, const char* data, size_t len)
+{
+    http_server_reactor_t* reactor = conn->reactor;
+    http_server_t* server = reactor->server;
+    http_arena_t* arena = http_arena_acquire(&reactor->arenas);
+    http_server_pending_t* pending = http_arena_alloc(arena, sizeof(http_server_pending_t) + len + 1);
+
+    memset(pending, 0, sizeof(*pending));
+    pending->arena = arena;
+    pending->type = type;
+    pending->ws_op = op;
+    pending->server = server;
+    pending->reactor = reactor;
+    pending->router = conn->ws_router;
+    atomic_fetch_add_explicit(&pending->router->users, 1, memory_order_relaxed);
+    pending->conn_id = conn->id;
+    pending->start = api->misc->hrtime();
+
+    memcpy(pending->data, data, len);
+    pending->data[len] = '\0';
+    pending->hm.body = mg_str_n(pending->data, len);
+
+    _http_server_post(server, pending);
+}
+
+static http_server_pending_t* _http_server_new_body_event(http_server_conn_t* conn)
+{
+    http_server_reactor_t* reactor = conn->reactor;
+    http_arena_t* arena = http_arena_acquire(&reactor->arenas);
+    http_server_pending_t* pending = http_arena_alloc(arena, sizeof(http_server_pending_t) + HTTP_SERVER_BODY_CHUNK);
+
+    memset(pending, 0, sizeof(*pending));
+    pending->arena = arena;
+    pending->type = HTTP_SERVER_EVENT_BODY;
+    pending->server = reactor->server;
+    pending->reactor = reactor;
+    pending->conn_id = conn->id;
+    pending->start = api->misc->hrtime();
+    pending->hm.body = mg_str_n(pending->data, 0);
+
+    return pending;
+}
+
+static void _http_server_post_body(http_server_conn_t* conn, http_server_pending_t* pending, int body_end)
+{
+    http_server_t* server = conn->reactor->server;
+
+    pending->body_end = body_end;
+    http_upload_produced(conn->upload, pending->hm.body.len);
+
+    _http_server_post(server, pending);
+}
+
+/**
+ * @brief Answer \p status to request \p seq of \p conn, without reading what
+ *   is left of it, and close once replies before it are out.
+ *
+ * A reply lua may still make for the same request is never sent.
+ */
+static void _http_server_refuse(http_server_conn_t* conn, unsigned long seq, int status)
+{
+    char buf[256];
+    struct mg_connection* c = conn->c;
+    const char* text = _http_server_status_str(status);
+    int len = snprintf(buf, sizeof(buf), "HTTP/1.1 %d %s\r\n%sConnection: close\r\nContent-Length: %u\r\n\r\n%s\n",
+        status, text, status == 503 || status == 429 ? "Retry-After: 1\r\n" : "", (unsigned)strlen(text) + 1, text);
+
+    c->recv.len = 0;
+    conn->refused = 1;
+    if (conn->send_seq == seq && api->list->size(&conn->held) == 0
+        && !http_static_stream_active(&conn->stream) && conn->file_pfn == NULL)
+    {
+        mg_send(c, buf, (size_t)len);
+        conn->send_seq++;
+        c->is_draining = 1;
+        return;
+    }
+
+    http_server_reply_t* reply = api->memory->malloc(sizeof(http_server_reply_t) + len);
+    reply->arena = NULL;
+    reply->flow = NULL;
+    reply->partial = 0;
+    reply->close = 0;
+    reply->conn_id = conn->id;
+    reply->seq = seq;
+    reply->start = api->misc->hrtime();
+    reply->len = (size_t)len;
+    memcpy(reply->buf, buf, len);
+    _http_server_conn_deliver(conn, reply);
+}
+
+/**
+ * @brief Answer \p status to request just parsed on \p conn and close it,
+ *   in request order.
+ */
+static void _http_server_reject(http_server_conn_t* conn, int status)
+{
+    _http_server_refuse(conn, conn->req_seq++, status);
+}
+
+/**
+ * @brief Tell if lua is too busy to take another request.
+ * @return  #http_metrics_shed_t, or -1 if not.
+ */
+static int _http_server_overloaded(http_server_t* server)
+{
+    if (server->options.max_inflight != 0
+        && atomic_load_explicit(&server->gauges->inflight, memory_order_relaxed) >= server->options.max_inflight)
+    {
+        return HTTP_METRICS_SHED_INFLIGHT;
+    }
+    if (server->options.max_queue_delay != 0
+        && atomic_load_explicit(&server->gauges->queue_delay, memory_order_relaxed) > server->options.max_queue_delay)
+    {
+        return HTTP_METRICS_SHED_QUEUE_DELAY;
+    }
+    return -1;
+}
+
+/**
+ * @brief Answer 503 to request just parsed on \p conn, in request order.
+ */
+static void _http_server_shed(http_server_conn_t* conn, int reason)
+{
+    http_metrics_add(&conn->reactor->metrics->shed[reason], 1);
+    _http_server_conn_send(conn, HTTP_SERVER_UNAVAILABLE, sizeof(HTTP_SERVER_UNAVAILABLE) - 1);
+}
+
+/**
+ * @brief Take a token for request just parsed on \p conn.
+ * @param[in] conn      Connection.
+ * @param[in] route     Matched route, or NULL for limit of whole server.
+ * @return              0 if request may go on, else nanoseconds until it may.
+ */
+static uint64_t _http_server_rate_take(http_server_conn_t* conn, http_server_router_t* route)
+{
+    uint8_t addr[16];
+    http_server_t* server = conn->reactor->server;
+    const struct mg_addr* rem = &conn->c->rem;
+    const http_ratelimit_rule_t* rule = route != NULL ? &route->rate_limit : &server->options.rate_limit.rule;
+
+    if (rule->rate <= 0)
+    {
+        return 0;
+    }
+
+    /* IPv4 as IPv4-mapped IPv6, so both share one key space. */
+    if (rem->is_ip6)
+    {
+        memcpy(addr, rem->ip6, 16);
+    }
+    else
+    {
+        memset(addr, 0, 10);
+        addr[10] = 0xff;
+        addr[11] = 0xff;
+        memcpy(addr + 12, &rem->ip, 4);
+    }
+
+    uint64_t wait = http_ratelimit_take(server->rate_limits, addr, route, rule, api->misc->hrtime());
+    if (wait != 0)
+    {
+        http_metrics_add(&conn->reactor->metrics->limited[route != NULL ?
+            HTTP_METRICS_LIMIT_ROUTE : HTTP_METRICS_LIMIT_CLIENT], 1);
+    }
+    return wait;
+}
+
+/**
+ * @brief Answer 429 to request just parsed on \p conn, in request order.
+ * @param[in] conn      Connection.
+ * @param[in] wait      Nanoseconds until client may try again.
+ */
+static void _http_server_too_many(http_server_conn_t* conn, uint64_t wait)
+{
+    char buf[160];
+    unsigned long long retry = (unsigned long long)((wait + 999999999) / 1000000000);
+    int len = snprintf(buf, sizeof(buf), "HTTP/1.1 429 Too Many Requests\r\n"
+        "Retry-After: %llu\r\nContent-Length: 18\r\n\r\nToo Many Requests\n", retry);
+
+    _http_server_conn_send(conn, buf, (size_t)len);
+}
+
+/**
+ * @brief Answer 405 to request just parsed on \p conn, in request order.
+ * @param[in] conn      Connection.
+ * @param[in] allow     Bit per #http_router_method_t the uri has routes for.
+ */
+static void _http_server_not_allowed(http_server_conn_t* conn, unsigned allow)
+{
+    int i;
+    char buf[256];
+    int len = snprintf(buf, sizeof(buf), "HTTP/1.1 405 Method Not Allowed\r\nAllow:");
+
+    for (i = 0; i < HTTP_ROUTER_METHOD_ANY; i++)
+    {
+        if (allow & (1u << i))
+        {
+            len += snprintf(buf + len, sizeof(buf) - len, "%s %s",
+                buf[len - 1] == ':' ? "" : ",", http_router_method_name(i));
+        }
+    }
+    len += snprintf(buf + len, sizeof(buf) - len, "\r\nContent-Length: 19\r\n\r\n"
+        "Method Not Allowed\n");
+
+    _http_server_conn_send(conn, buf, (size_t)len);
+}
+
+/**
+ * @brief Detach upload from \p conn, telling lua how it ended.
+ * @param[in] conn      Connection.
+ * @param[in] pending   Last piece of body, or NULL.
+ * @param[in] body_end  1 if body is complete, -1 if aborted.
+ */
+static void _http_server_upload_end(http_server_conn_t* conn, http_server_pending_t* pending, int body_end)
+{
+    http_upload_t* upload = conn->upload;
+
+    if (atomic_load(&upload->abandoned) || !conn->reactor->server->looping)
+    {
+        if (pending != NULL)
+        {
+            http_arena_release(pending->arena);
+        }
+    }
+    else
+    {
+        _http_server_post_body(conn, pending != NULL ? pending : _http_server_new_body_event(conn), body_end);
+    }
+
+    conn->upload = NULL;
+    conn->c->is_full = 0;
+    http_upload_release(upload);
+}
+
+static void _http_server_proto(struct mg_connection* c, int ev, void* ev_data, void* fn_data);
+
+/**
+ * @brief Hand received body of \p conn to lua, as far as window allows.
+ *
+ * Body is taken out of receive buffer as it is handed over, so an upload
+ * holds at most a window of memory, whatever its size. Once window is full
+ * the connection is not read until lua catches up.
+ */
+static void _http_server_upload_pump(http_server_conn_t* conn)
+{
+    size_t off = 0, consumed;
+    struct mg_str data;
+    int rc = HTTP_UPLOAD_MORE;
+    struct mg_connection* c = conn->c;
+    http_upload_t* upload = conn->upload;
+    http_server_pending_t* pending = NULL;
+    uint64_t max_body_size = conn->reactor->server->options.max_body_size;
+    int abandoned = atomic_load(&upload->abandoned);
+
+    while (off < c->recv.len)
+    {
+        /* Bytes not wanted anymore are only decoded to find end of body. */
+        size_t room = c->recv.len;
+        if (!abandoned)
+        {
+            size_t used = pending != NULL ? pending->hm.body.len : 0;
+            size_t window = http_upload_window(upload);
+            room = window > used ? window - used : 0;
+            if (room > HTTP_SERVER_BODY_CHUNK - used)
+            {
+                room = HTTP_SERVER_BODY_CHUNK - used;
+            }
+            if (room == 0 && used == HTTP_SERVER_BODY_CHUNK)
+            {
+                _http_server_post_body(conn, pending, 0);
+                pending = NULL;
+                continue;
+            }
+            if (room == 0)
+            {
+                break;
+            }
+        }
+
+        rc = http_upload_decode(upload, (const char*)c->recv.buf + off, c->recv.len - off, room, &consumed, &data);
+        if (rc == HTTP_UPLOAD_ERROR)
+        {
+            break;
+        }
+        off += consumed;
+
+        if (data.len != 0 && !abandoned)
+        {
+            if (pending == NULL)
+            {
+                pending = _http_server_new_body_event(conn);
+            }
+            memcpy(pending->data + pending->hm.body.len, data.ptr, data.len);
+            pending->hm.body.len += data.len;
+        }
+        if (rc == HTTP_UPLOAD_DONE || consumed == 0)
+        {
+            break;
+        }
+    }
+    mg_iobuf_del(&c->recv, 0, off);
+
+    if (rc == HTTP_UPLOAD_ERROR || (max_body_size != 0 && upload->received > max_body_size))
+    {
+        _http_server_upload_end(conn, pending, -1);
+        /* Body belongs to the last request handed to lua. */
+        _http_server_refuse(conn, conn->req_seq - 1, rc == HTTP_UPLOAD_ERROR ? 400 : 413);
+        return;
+    }
+
+    if (rc == HTTP_UPLOAD_DONE)
+    {
+        _http_server_upload_end(conn, pending, 1);
+
+        /* Next pipelined request. */
+        if (c->recv.len != 0)
+        {
+            _http_server_proto(c, MG_EV_READ, NULL, c->pfn_data);
+        }
+        return;
+    }
+
+    if (pending != NULL)
+    {
+        _http_server_post_body(conn, pending, 0);
+    }
+    if (!abandoned && http_upload_window(upload) == 0 && http_upload_pause(upload))
+    {
+        c->is_full = 1;
+    }
+}
+
+static uint64_t _http_server_parse_length(const struct mg_str* str)
+{
+    size_t i;
+    uint64_t v = 0;
+
+    for (i = 0; i < str->len && str->ptr[i] >= '0' && str->ptr[i] <= '9'; i++)
+    {
+        if (v > (UINT64_MAX - 9) / 10)
+        {
+            return UINT64_MAX;
+        }
+        v = v * 10 + (uint64_t)(str->ptr[i] - '0');
+    }
+
+    return v;
+}
+
+/**
+ * @brief Look at head of request in receive buffer, before mongoose buffers
+ *   its body.
+ *
+ * Bodies over `max_body_size` are refused here, and requests for streaming
+ * routes are taken over.
+ *
+ * @return  Non-zero if receive buffer is handled.
+ */
+static int _http_server_check_head(http_server_conn_t* conn)
+{
+    int n, chunked;
+    uint64_t length = 0;
+    struct mg_http_message hm;
+    http_router_match_t match;
+    struct mg_connection* c = conn->c;
+    http_server_reactor_t* reactor = conn->reactor;
+    http_server_t* server = reactor->server;
+    http_server_table_t* table = atomic_load_explicit(&server->table, memory_order_acquire);
+    int stream_routes = table->stream_routes;
+
+    if (conn->head_len != 0 || (server->options.max_body_size == 0 && stream_routes == 0))
+    {
+        return 0;
+    }
+    if ((n = mg_http_parse((const char*)c->recv.buf, c->recv.len, &hm)) <= 0)
+    {
+        return 0;
+    }
+    conn->head_len = (size_t)n;
+
+    struct mg_str* te = mg_http_get_header(&hm, "Transfer-Encoding");
+    struct mg_str* cl = mg_http_get_header(&hm, "Content-Length");
+    chunked = te != NULL && mg_vcasecmp(te, "chunked") == 0;
+    if (cl != NULL && !chunked)
+    {
+        length = _http_server_parse_length(cl);
+    }
+
+    if (server->options.max_body_size != 0 && length > server->options.max_body_size)
+    {
+        _http_server_reject(conn, 413);
+        return 1;
+    }
+
+    if (stream_routes == 0 || (!chunked && length == 0))
+    {
+        return 0;
+    }
+
+    /* Turn away abusive clients before their body is read. */
+    conn->rate_taken = 1;
+    if (_http_server_rate_take(conn, NULL) != 0)
+    {
+        _http_server_reject(conn, 429);
+        return 1;
+    }
+
+    uint64_t start = api->misc->hrtime();
+    int matched = http_router_match(table->router, http_router_method(hm.method.ptr, hm.method.len),
+        hm.uri.ptr, hm.uri.len, &match);
+    if (!matched || !((http_server_router_t*)match.data)->data.stream)
+    {
+        return 0;
+    }
+    if (_http_server_rate_take(conn, match.data) != 0)
+    {
+        _http_server_reject(conn, 429);
+        return 1;
+    }
+    http_metrics_hist_record(&reactor->metrics->route_match, api->misc->hrtime() - start);
+
+    /* Do not take a body in that nobody would read soon. */
+    int reason = _http_server_overloaded(server);
+    if (reason >= 0)
+    {
+        http_metrics_add(&reactor->metrics->shed[reason], 1);
+        _http_server_reject(conn, 503);
+        return 1;
+    }
+    http_metrics_add(&reactor->metrics->requests[HTTP_METRICS_HANDLER_ROUTE], 1);
+
+    /* Lua gets the head now, and the body as it comes. */
+    hm.body.len = 0;
+    http_server_pending_t* pending = _http_server_new_pending(reactor, conn, &hm, &match, start);
+    conn->upload = pending->upload = http_upload_create(api->memory, chunked, length);
+    _http_server_post(server, pending);
+
+    struct mg_str* expect = mg_http_get_header(&hm, "Expect");
+    if (expect != NULL && mg_vcasecmp(expect, "100-continue") == 0)
+    {
+        mg_printf(c, "HTTP/1.1 100 Continue\r\n\r\n");
+    }
+
+    mg_iobuf_del(&c->recv, 0, (size_t)n);
+    conn->head_len = 0;
+    conn->rate_taken = 0;
+    _http_server_upload_pump(conn);
+    return 1;
+}
+
+/**
+ * @brief Protocol handler of accepted connections, in front of the one of
+ *   mongoose.
+ *
+ * Streamed bodies never reach mongoose, which would buffer them whole.
+ */
+static void _http_server_proto(struct mg_connection* c, int ev, void* ev_data, void* fn_data)
+{
+    http_server_conn_t* conn = c->fn_data;
+
+    if (conn->file_pfn != NULL)
+    {
+        /* Requests after the file wait until its body is out. */
+        if (ev == MG_EV_READ)
+        {
+            return;
+        }
+        conn->file_pfn(c, ev, ev_data, fn_data);
+        if (c->pfn == _http_server_proto)
+        {
+            return;
+        }
+
+        /* Mongoose hands connection back to its own handler once done. */
+        c->pfn = _http_server_proto;
+        conn->file_pfn = NULL;
+        if (ev == MG_EV_CLOSE)
+        {
+            return;
+        }
+        _http_server_conn_flush_held(conn);
+        if (c->recv.len != 0)
+        {
+            _http_server_proto(c, MG_EV_READ, NULL, fn_data);
+        }
+        return;
+    }
+
+    if (ev == MG_EV_READ)
+    {
+        if (c->is_draining || conn->refused)
+        {
+            c->recv.len = 0;
+            return;
+        }
+        if (conn->upload != NULL)
+        {
+            _http_server_upload_pump(conn);
+            return;
+        }
+        if (_http_server_check_head(conn))
+        {
+            return;
+        }
+    }
+    else if (ev == MG_EV_CLOSE && conn->upload != NULL)
+    {
+        /* What is left is body, not a request. */
+        c->recv.len = 0;
+    }
+
+    conn->http_pfn(c, ev, ev_data, fn_data);
+}
+
+/**
+ * @brief Answer metrics page on \p conn, in request order.
+ */
+static void _http_server_serve_metrics(http_server_conn_t* conn)
+{
+    size_t len;
+    char head[128];
+    char* text = http_metrics_prometheus(conn->reactor->server->metrics, &len);
+    int head_len = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+        "Content-Length: %lu\r\n\r\n", (unsigned long)len);
+
+    char* page = api->memory->malloc(head_len + len);
+    memcpy(page, head, head_len);
+    memcpy(page + head_len, text, len);
+    _http_server_conn_send(conn, page, head_len + len);
+    api->memory->free(page);
+    api->memory->free(text);
+}
+
+/**
+ * @brief Append \p len bytes of \p str to key in \p buf.
+ * @return  Boolean, false if it does not fit.
+ */
+static int _http_server_cache_key_add(char* buf, size_t* pos, const char* str, size_t len)
+{
+    if (*pos + len > HTTP_SERVER_CACHE_KEY_MAX)
+    {
+        return 0;
+    }
+    memcpy(buf + *pos, str, len);
+    *pos += len;
+    return 1;
+}
+
+/**
+ * @brief Build response cache key of \p hm on \p router.
+ * @param[out] buf  Key, #HTTP_SERVER_CACHE_KEY_MAX bytes.
+ * @return          Key length, 0 if too long.
+ */
+static size_t _http_server_cache_key(const http_server_router_t* router, struct mg_http_message* hm, char* buf)
+{
+    size_t i, pos = 0;
+    int ok = _http_server_cache_key_add(buf, &pos, hm->method.ptr, hm->method.len)
+        && _http_server_cache_key_add(buf, &pos, " ", 1)
+        && _http_server_cache_key_add(buf, &pos, hm->uri.ptr, hm->uri.len)
+        && _http_server_cache_key_add(buf, &pos, "?", 1)
+        && _http_server_cache_key_add(buf, &pos, hm->query.ptr, hm->query.len);
+
+    /* A missing header and an empty one are told apart. */
+    for (i = 0; ok && i < router->cache.vary_cnt; i++)
+    {
+        struct mg_str* value = mg_http_get_header(hm, router->cache.vary[i]);
+        ok = value != NULL ? _http_server_cache_key_add(buf, &pos, "\n", 1)
+                && _http_server_cache_key_add(buf, &pos, value->ptr, value->len)
+            : _http_server_cache_key_add(buf, &pos, "\r", 1);
+    }
+
+    return ok ? pos : 0;
+}
+
+/**
+ * @brief Send response \p data on \p conn, in request order.
+ *
+ * It goes straight out if nothing is before it.
+ */
+static void _http_server_conn_send(http_server_conn_t* conn, const char* data, size_t len)
+{
+    if (_http_server_conn_idle(conn))
+    {
+        _http_server_send_reply(conn->c, data, len);
+        return;
+    }
+
+    http_server_reply_t* reply = api->memory->malloc(sizeof(http_server_reply_t) + len);
+    reply->arena = NULL;
+    reply->flow = NULL;
+    reply->partial = 0;
+    reply->close = 0;
+    reply->conn_id = conn->id;
+    reply->seq = conn->req_seq++;
+    reply->start = api->misc->hrtime();
+    reply->len = len;
+    memcpy(reply->buf, data, len);
+    _http_server_conn_deliver(conn, reply);
+}
+
+/**
+ * @brief Serve \p hm from response cache of its route.
+ *
+ * On a miss the request goes to lua and fills the cache. Misses for the same
+ * key that arrive meanwhile wait for that response instead of calling lua.
+ *
+ * @return  Non-zero if request is handled.
+ */
+static int _http_server_cache_request(http_server_conn_t* conn, struct mg_http_message* hm,
+    const http_router_match_t* match, uint64_t start)
+{
+    int rc, reason;
+    size_t key_len;
+    char key[HTTP_SERVER_CACHE_KEY_MAX];
+    http_cache_entry_t* entry;
+    http_server_pending_t* pending = NULL;
+    http_server_router_t* router = match->data;
+    http_server_reactor_t* reactor = conn->reactor;
+    http_server_t* server = reactor->server;
+
+    if (router->cache.ttl == 0 || mg_vcmp(&hm->method, "GET") != 0
+        || (key_len = _http_server_cache_key(router, hm, key)) == 0)
+    {
+        return 0;
+    }
+
+    /* Try without allocating first, hits are the common case. */
+    rc = http_cache_lookup(server->cache, key, key_len, start, NULL, &entry);
+
+    /* Only a miss costs lua anything. */
+    if (rc == HTTP_CACHE_MISS && (reason = _http_server_overloaded(server)) >= 0)
+    {
+        _http_server_shed(conn, reason);
+        return 1;
+    }
+    if (rc != HTTP_CACHE_HIT)
+    {
+        pending = _http_server_new_pending(reactor, conn, hm, match, start);
+        rc = http_cache_lookup(server->cache, key, key_len, start, &pending->cache_waiter, &entry);
+    }
+
+    switch (rc)
+    {
+    case HTTP_CACHE_HIT:
+        http_metrics_add(&reactor->metrics->requests[HTTP_METRICS_HANDLER_CACHE], 1);
+        if (pending == NULL)
+        {
+            _http_server_conn_send(conn, entry->data, entry->len);
+        }
+        else
+        {
+            /* Filled in between, answer in place of pending. */
+            _http_server_pending_unroute(pending);
+            http_server_reply_t* reply = _http_server_copy_reply(pending, entry->data, entry->len);
+            reply->conn_id = conn->id;
+            reply->seq = pending->seq;
+            reply->start = start;
+            _http_server_conn_deliver(conn, reply);
+        }
+        http_cache_entry_release(entry);
+        break;
+
+    case HTTP_CACHE_WAIT:
+        http_metrics_add(&reactor->metrics->requests[HTTP_METRICS_HANDLER_CACHE], 1);
+        break;
+
+    default:
+        http_metrics_add(&reactor->metrics->requests[HTTP_METRICS_HANDLER_ROUTE], 1);
+        pending->cache_entry = entry;
+        _http_server_post(server, pending);
+        break;
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Headers that only concern one hop, never relayed upstream.
+ */
+static const char* s_http_server_hop_headers[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer",
+    "Transfer-Encoding", "Upgrade", "Content-Length", "X-Forwarded-For",
+    "Expect",   /* Body is already complete. */
+};
+
+static void _http_server_upstream_ev(struct mg_connection* c, int ev, void* ev_data, void* fn_data);
+
+static int _http_server_hop_header(const struct mg_str* name)
+{
+    size_t i;
+    for (i = 0; i < ARRAY_SIZE(s_http_server_hop_headers); i++)
+    {
+        if (mg_vcasecmp(name, s_http_server_hop_headers[i]) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static char* _http_server_put(char* pos, const char* data, size_t len)
+{
+    memcpy(pos, data, len);
+    return pos + len;
+}
+
+/**
+ * @brief Make exchange for \p hm, with the request rewritten for upstream.
+ *
+ * Body is sent with Content-Length as mongoose has it whole, and the client
+ * address is appended to X-Forwarded-For.
+ */
+static http_server_exchange_t* _http_server_proxy_new(http_server_conn_t* conn, struct mg_http_message* hm,
+    http_proxy_t* proxy)
+{
+    size_t i, len;
+    char addr[64], length[48];
+    struct mg_str* xff = mg_http_get_header(hm, "X-Forwarded-For");
+
+    mg_ntoa(&conn->c->rem, addr, sizeof(addr));
+    int length_len = snprintf(length, sizeof(length), "Content-Length: %lu\r\n", (unsigned long)hm->body.len);
+
+    len = hm->method.len + hm->uri.len + hm->query.len + sizeof(" ? HTTP/1.1\r\n");
+    for (i = 0; i < MG_MAX_HTTP_HEADERS && hm->headers[i].name.len != 0; i++)
+    {
+        len += hm->headers[i].name.len + hm->headers[i].value.len + 4;
+    }
+    len += sizeof("X-Forwarded-For: , \r\n") + (xff != NULL ? xff->len : 0) + strlen(addr);
+    len += (size_t)length_len + 2 + hm->body.len;
+
+    http_server_exchange_t* ex = api->memory->calloc(1, sizeof(http_server_exchange_t) + len);
+    char* pos = ex->req;
+
+    pos = _http_server_put(pos, hm->method.ptr, hm->method.len);
+    pos = _http_server_put(pos, " ", 1);
+    pos = _http_server_put(pos, hm->uri.ptr, hm->uri.len);
+    if (hm->query.len != 0)
+    {
+        pos = _http_server_put(pos, "?", 1);
+        pos = _http_server_put(pos, hm->query.ptr, hm->query.len);
+    }
+    pos = _http_server_put(pos, " HTTP/1.1\r\n", 11);
+    for (i = 0; i < MG_MAX_HTTP_HEADERS && hm->headers[i].name.len != 0; i++)
+    {
+        if (_http_server_hop_header(&hm->headers[i].name))
+        {
+            continue;
+        }
+        pos = _http_server_put(pos, hm->headers[i].name.ptr, hm->headers[i].name.len);
+        pos = _http_server_put(pos, ": ", 2);
+        pos = _http_server_put(pos, hm->headers[i].value.ptr, hm->headers[i].value.len);
+        pos = _http_server_put(pos, "\r\n", 2);
+    }
+    pos = _http_server_put(pos, "X-Forwarded-For: ", 17);
+    if (xff != NULL)
+    {
+        pos = _http_server_put(pos, xff->ptr, xff->len);
+        pos = _http_server_put(pos, ", ", 2);
+    }
+    pos = _http_server_put(pos, addr, strlen(addr));
+    pos = _http_server_put(pos, "\r\n", 2);
+    pos = _http_server_put(pos, length, (size_t)length_len);
+    pos = _http_server_put(pos, "\r\n", 2);
+    pos = _http_server_put(pos, hm->body.ptr, hm->body.len);
+    ex->req_len = (size_t)(pos - ex->req);
+
+    http_proxy_ref(proxy);
+    ex->proxy = proxy;
+    ex->down = conn;
+    ex->head_only = mg_vcmp(&hm->method, "HEAD") == 0;
+    ex->idempotent = ex->head_only || mg_vcmp(&hm->method, "GET") == 0 || mg_vcmp(&hm->method, "PUT") == 0
+        || mg_vcmp(&hm->method, "DELETE") == 0 || mg_vcmp(&hm->method, "OPTIONS") == 0;
+    return ex;
+}
+
+/**
+ * @brief Send \p ex on a connection to \p up, reusing an idle one if any.
+ * @return  Boolean.
+ */
+static int _http_server_proxy_attach(http_server_exchange_t* ex, http_proxy_upstream_t* up)
+{
+    http_server_upconn_t* upconn;
+    http_server_reactor_t* reactor = ex->down->reactor;
+    auto_list_t* idle = &up->idle[reactor - reactor->server->reactors];
+    auto_list_node_t* it = api->list->pop_front(idle);
+
+    if (it != NULL)
+    {
+        upconn = container_of(it, http_server_upconn_t, node);
+        upconn->idle = 0;
+        upconn->reused = 1;
+    }
+    else
+    {
+        upconn = api->memory->calloc(1, sizeof(http_server_upconn_t));
+        http_proxy_ref(ex->proxy);
+        upconn->proxy = ex->proxy;
+        upconn->upstream = up;
+        upconn->reactor = reactor;
+        if ((upconn->c = mg_connect(&reactor->mgr, up->url, _http_server_upstream_ev, upconn)) == NULL)
+        {
+            http_proxy_release(upconn->proxy);
+            api->memory->free(upconn);
+            return 0;
+        }
+    }
+
+    atomic_fetch_add_explicit(&up->active, 1, memory_order_relaxed);
+    upconn->exchange = ex;
+    ex->upconn = upconn;
+    ex->upstream = up;
+    ex->progress = (uint64_t)mg_millis();
+    http_proxy_frame_init(&ex->frame, ex->head_only);
+
+    /* Buffered until connected. */
+    mg_send(upconn->c, ex->req, ex->req_len);
+    return 1;
+}
+
+/**
+ * @brief Stop counting \p ex on its upstream, and close its connection if
+ *   it still has one.
+ */
+static void _http_server_proxy_detach(http_server_exchange_t* ex)
+{
+    if (ex->upconn != NULL)
+    {
+        ex->upconn->exchange = NULL;
+        ex->upconn->c->is_closing = 1;
+        ex->upconn = NULL;
+    }
+    if (ex->upstream != NULL)
+    {
+        atomic_fetch_sub_explicit(&ex->upstream->active, 1, memory_order_relaxed);
+        ex->upstream = NULL;
+    }
+}
+
+/**
+ * @brief Take \p ex off its client connection and free it.
+ */
+static void _http_server_proxy_free(http_server_exchange_t* ex)
+{
+    api->list->erase(&ex->down->proxies, &ex->node);
+    _http_server_proxy_detach(ex);
+    mg_iobuf_free(&ex->rest);
+    http_proxy_release(ex->proxy);
+    api->memory->free(ex);
+}
+
+/**
+ * @brief Give up on \p ex. The client gets \p status if nothing of the
+ *   response reached it yet, else it is closed.
+ */
+static void _http_server_proxy_abort(http_server_exchange_t* ex, int status)
+{
+    char buf[160];
+    http_server_conn_t* conn = ex->down;
+    const char* reason = _http_server_status_str(status);
+    unsigned long seq = ex->seq;
+    uint64_t start = ex->start;
+    int sent = ex->relayed != 0;
+
+    _http_server_proxy_free(ex);
+    if (sent)
+    {
+        conn->c->is_closing = 1;
+        return;
+    }
+
+    int len = snprintf(buf, sizeof(buf), "HTTP/1.1 %d %s\r\nContent-Length: %u\r\n\r\n%s\n",
+        status, reason, (unsigned)strlen(reason) + 1, reason);
+    http_server_reply_t* reply = api->memory->malloc(sizeof(http_server_reply_t) + len);
+    reply->arena = NULL;
+    reply->flow = NULL;
+    reply->partial = 0;
+    reply->close = 0;
+    reply->len = (size_t)len;
+    memcpy(reply->buf, buf, len);
+    reply->conn_id = conn->id;
+    reply->seq = seq;
+    reply->start = start;
+    _http_server_conn_deliver(conn, reply);
+}
+
+/**
+ * @brief Complete \p ex, and keep its upstream connection for the next
+ *   request if it can carry one.
+ */
+static void _http_server_proxy_finish(http_server_exchange_t* ex)
+{
+    http_server_conn_t* conn = ex->down;
+    http_server_upconn_t* upconn = ex->upconn;
+    http_server_reactor_t* reactor = conn->reactor;
+    http_proxy_t* proxy = ex->proxy;
+
+    http_metrics_hist_record(&reactor->metrics->response, api->misc->hrtime() - ex->start);
+    http_proxy_succeeded(ex->upstream);
+    conn->send_seq++;
+
+    if (upconn != NULL)
+    {
+        auto_list_t* idle = &ex->upstream->idle[reactor - reactor->server->reactors];
+        if (ex->frame.keep_alive && upconn->c->recv.len == 0 && reactor->server->looping
+            && api->list->size(idle) < proxy->config.max_idle)
+        {
+            upconn->exchange = NULL;
+            upconn->idle = 1;
+            upconn->idle_since = (uint64_t)mg_millis();
+            upconn->c->is_full = 0;
+            api->list->push_front(idle, &upconn->node);
+            ex->upconn = NULL;
+        }
+    }
+
+    /* Client learns where the body ends by the close, too. */
+    if (ex->frame.state == HTTP_PROXY_FRAME_CLOSE)
+    {
+        conn->c->is_draining = 1;
+    }
+
+    _http_server_proxy_free(ex);
+    _http_server_conn_flush_held(conn);
+    _http_server_conn_timer(conn);
+}
+
+/**
+ * @brief Move response of \p ex from upstream to client.
+ *
+ * Only the response due next on the client connection moves. Others, and
+ * this one while the client is slow, stop reading their upstream, so TCP
+ * flow control pushes back on it.
+ */
+static void _http_server_proxy_relay(http_server_exchange_t* ex)
+{
+    int rc;
+    size_t take;
+    struct mg_connection* dc = ex->down->c;
+    struct mg_iobuf* src = ex->upconn != NULL ? &ex->upconn->c->recv : &ex->rest;
+
+    if (ex->down->send_seq != ex->seq || http_static_stream_active(&ex->down->stream))
+    {
+        if (ex->upconn != NULL)
+        {
+            ex->upconn->c->is_full = 1;
+        }
+        return;
+    }
+
+    while (src->len != 0 && dc->send.len < HTTP_SERVER_SEND_HIGH_WATER)
+    {
+        if ((rc = http_proxy_frame_feed(&ex->frame, (const char*)src->buf, src->len, &take)) < 0)
+        {
+            http_metrics_add(&ex->down->reactor->metrics->upstream[HTTP_METRICS_UPSTREAM_CLOSED], 1);
+            http_proxy_failed(ex->proxy, ex->upstream, (uint64_t)mg_millis());
+            _http_server_proxy_abort(ex, 502);
+            return;
+        }
+        if (take == 0)
+        {
+            break;
+        }
+
+        if (take == src->len && dc->send.len == 0)
+        {
+            /* Hand the buffer over instead of copying it. */
+            struct mg_iobuf tmp = dc->send;
+            dc->send = *src;
+            *src = tmp;
+        }
+        else
+        {
+            mg_send(dc, src->buf, take);
+            mg_iobuf_del(src, 0, take);
+        }
+        ex->relayed += take;
+        ex->progress = (uint64_t)mg_millis();
+
+        if (rc == 1)
+        {
+            _http_server_proxy_finish(ex);
+            return;
+        }
+    }
+
+    if (ex->upconn != NULL)
+    {
+        ex->upconn->c->is_full = dc->send.len >= HTTP_SERVER_SEND_HIGH_WATER;
+        return;
+    }
+    if (src->len != 0 && dc->send.len >= HTTP_SERVER_SEND_HIGH_WATER)
+    {
+        return;
+    }
+
+    /* Upstream is gone and all it sent is relayed. */
+    if (ex->frame.state == HTTP_PROXY_FRAME_CLOSE)
+    {
+        _http_server_proxy_finish(ex);
+        return;
+    }
+    http_metrics_add(&ex->down->reactor->metrics->upstream[HTTP_METRICS_UPSTREAM_CLOSED], 1);
+    http_proxy_failed(ex->proxy, ex->upstream, (uint64_t)mg_millis());
+    _http_server_proxy_abort(ex, 502);
+}
+
+static void _http_server_proxy_kick(http_server_conn_t* conn)
+{
+    auto_list_node_t* it = api->list->begin(&conn->proxies);
+    if (it != NULL && container_of(it, http_server_exchange_t, node)->seq == conn->send_seq)
+    {
+        _http_server_proxy_relay(container_of(it, http_server_exchange_t, node));
+    }
+}
+
+/**
+ * @brief Upstream connection of \p ex closed before any response came.
+ *
+ * A keep-alive connection the upstream closed meanwhile is retried on a fresh
+ * one. Otherwise the upstream is blamed, and the request goes to another one
+ * if it never reached the upstream or may be sent twice.
+ */
+static void _http_server_proxy_retry(http_server_exchange_t* ex, http_server_upconn_t* upconn)
+{
+    uint64_t now = (uint64_t)mg_millis();
+    http_proxy_upstream_t* up = ex->upstream;
+    http_metrics_thread_t* metrics = ex->down->reactor->metrics;
+
+    _http_server_proxy_detach(ex);
+    if (upconn->reused && ex->idempotent && _http_server_proxy_attach(ex, up))
+    {
+        return;
+    }
+
+    http_metrics_add(&metrics->upstream[upconn->connected ?
+        HTTP_METRICS_UPSTREAM_CLOSED : HTTP_METRICS_UPSTREAM_CONNECT], 1);
+    http_proxy_failed(ex->proxy, up, now);
+    if ((!upconn->connected || ex->idempotent) && ex->tries < ex->proxy->config.retries)
+    {
+        ex->tries++;
+        if (_http_server_proxy_attach(ex, http_proxy_pick(ex->proxy, up, now)))
+        {
+            return;
+        }
+    }
+    _http_server_proxy_abort(ex, 502);
+}
+
+static void _http_server_upstream_close(http_server_upconn_t* upconn, struct mg_connection* c)
+{
+    http_server_exchange_t* ex = upconn->exchange;
+    http_server_reactor_t* reactor = upconn->reactor;
+
+    if (upconn->idle)
+    {
+        api->list->erase(&upconn->upstream->idle[reactor - reactor->server->reactors], &upconn->node);
+    }
+
+    /* Exchanges go with their client connection on shutdown. */
+    if (ex != NULL && reactor->server->looping)
+    {
+        http_server_conn_t* conn = ex->down;
+        ex->upconn = NULL;
+        if (ex->relayed == 0 && ex->frame.state == HTTP_PROXY_FRAME_HEAD && c->recv.len == 0)
+        {
+            _http_server_proxy_retry(ex, upconn);
+        }
+        else
+        {
+            /* What arrived before the close is still relayed in order. */
+            struct mg_iobuf tmp = ex->rest;
+            ex->rest = c->recv;
+            c->recv = tmp;
+            _http_server_proxy_relay(ex);
+        }
+        _http_server_conn_timer(conn);
+    }
+    else if (ex != NULL)
+    {
+        ex->upconn = NULL;
+    }
+
+    http_proxy_release(upconn->proxy);
+    api->memory->free(upconn);
+}
+
+/**
+ * @brief Time out \p upconn if its request or its idleness took too long.
+ *
+ * Time spent waiting for the client, or for responses due before, does not
+ * count.
+ */
+static void _http_server_upstream_poll(http_server_upconn_t* upconn, struct mg_connection* c)
+{
+    uint64_t now = (uint64_t)mg_millis();
+    http_server_exchange_t* ex = upconn->exchange;
+    const http_proxy_config_t* config = &upconn->proxy->config;
+
+    if (upconn->idle)
+    {
+        if (config->idle_timeout != 0 && now - upconn->idle_since >= config->idle_timeout)
+        {
+            c->is_closing = 1;
+        }
+        return;
+    }
+    if (ex == NULL || config->timeout == 0)
+    {
+        return;
+    }
+    if (c->is_full)
+    {
+        ex->progress = now;
+        return;
+    }
+    if (now - ex->progress < config->timeout)
+    {
+        return;
+    }
+
+    http_server_conn_t* conn = ex->down;
+    http_metrics_add(&conn->reactor->metrics->upstream[HTTP_METRICS_UPSTREAM_TIMEOUT], 1);
+    http_proxy_failed(ex->proxy, ex->upstream, now);
+    _http_server_proxy_abort(ex, 504);
+    _http_server_conn_timer(conn);
+}
+
+static void _http_server_upstream_ev(struct mg_connection* c, int ev, void* ev_data, void* fn_data)
+{
+    http_server_upconn_t* upconn = fn_data;
+    http_server_exchange_t* ex = upconn->exchange;
+    (void)ev_data;
+
+    switch (ev)
+    {
+    case MG_EV_CONNECT:
+        upconn->connected = 1;
+        if (ex != NULL)
+        {
+            ex->progress = (uint64_t)mg_millis();
+        }
+        break;
+
+    case MG_EV_READ:
+        if (ex != NULL)
+        {
+            http_server_conn_t* conn = ex->down;
+            _http_server_proxy_relay(ex);
+            _http_server_conn_timer(conn);
+        }
+        else if (upconn->idle)
+        {
+            /* Nothing is asked, so this can only be garbage or a close notice. */
+            c->is_closing = 1;
+        }
+        break;
+
+    case MG_EV_POLL:
+        _http_server_upstream_poll(upconn, c);
+        break;
+
+    case MG_EV_CLOSE:
+        _http_server_upstream_close(upconn, c);
+        break;
+
+    default:
+        break;
+    }
+}
+
+/**
+ * @brief Relay \p hm to an upstream of \p router.
+ */
+static void _http_server_proxy_request(http_server_conn_t* conn, struct mg_http_message* hm,
+    http_server_router_t* router, uint64_t start)
+{
+    http_server_exchange_t* ex = _http_server_proxy_new(conn, hm, router->proxy);
+
+    ex->seq = conn->req_seq++;
+    ex->start = start;
+    api->list->push_back(&conn->proxies, &ex->node);
+    if (!_http_server_proxy_attach(ex, http_proxy_pick(ex->proxy, NULL, (uint64_t)mg_millis())))
+    {
+        _http_server_proxy_abort(ex, 502);
+    }
+}
+
+/**
+ * @brief Answer \p hm from static files, directory or with 404.
+ *
+ * It writes straight to the send buffer, so \p hm must be next to answer.
+ */
+static void _http_server_serve_local(http_server_conn_t* conn, struct mg_http_message* hm)
+{
+    struct mg_connection* c = conn->c;
+    http_server_t* server = conn->reactor->server;
+    http_metrics_thread_t* metrics = conn->reactor->metrics;
+
+    if (server->static_files != NULL && http_static_serve(server->static_files, c, hm, &conn->stream))
+    {
+        http_metrics_add(&metrics->requests[HTTP_METRICS_HANDLER_STATIC], 1);
+        return;
+    }
+
+    if (server->options.serve_dir != NULL)
+    {
+        struct mg_http_serve_opts opts;
+        memset(&opts, 0, sizeof(opts));
+        opts.root_dir = server->options.serve_dir;
+        opts.ssi_pattern = server->options.ssi_pattern;
+        http_metrics_add(&metrics->requests[HTTP_METRICS_HANDLER_DIR], 1);
+        mg_http_serve_dir(c, hm, &opts);
+
+        /* Large files are sent by a handler of mongoose, keep ours in front. */
+        if (c->pfn != _http_server_proto)
+        {
+            conn->file_pfn = c->pfn;
+            c->pfn = _http_server_proto;
+        }
+        return;
+    }
+
+    http_metrics_add(&metrics->requests[HTTP_METRICS_HANDLER_NOT_FOUND], 1);
+    mg_http_reply(c, 404, "", "Not Found\n");
+}
+
+static void _http_server_handle_msg(http_server_conn_t* conn, struct mg_http_message* hm)
+{
+    int matched, reason, rate_taken = conn->rate_taken;
+    uint64_t wait;
+    http_router_match_t match;
+    struct mg_connection* c = conn->c;
+    http_server_reactor_t* reactor = conn->reactor;
+    http_server_t* server = reactor->server;
+    http_metrics_thread_t* metrics = reactor->metrics;
+    uint64_t start = api->misc->hrtime();
+
+    /* Next request needs a fresh look. */
+    conn->head_len = 0;
+    conn->rate_taken = 0;
+
+    /* Chunked bodies have no length upfront. */
+    if (server->options.max_body_size != 0 && hm->body.len > server->options.max_body_size)
+    {
+        _http_server_reject(conn, 413);
+        return;
+    }
+
+    /* Cheap answers before any work, so backlog does not grow further. */
+    if (!rate_taken && (wait = _http_server_rate_take(conn, NULL)) != 0)
+    {
+        _http_server_too_many(conn, wait);
+        return;
+    }
+
+    /* Rendering metrics is not free either, so it is rate limited too. */
+    if (server->options.metrics_url != NULL && mg_vcmp(&hm->uri, server->options.metrics_url) == 0)
+    {
+        http_metrics_add(&metrics->requests[HTTP_METRICS_HANDLER_METRICS], 1);
+        _http_server_serve_metrics(conn);
+        return;
+    }
+
+    /* Check if url match router. Table stays alive until this poll is over. */
+    http_server_table_t* table = atomic_load_explicit(&server->table, memory_order_acquire);
+    matched = http_router_match(table->router, http_router_method(hm->method.ptr, hm->method.len),
+        hm->uri.ptr, hm->uri.len, &match);
+    http_metrics_hist_record(&metrics->route_match, api->misc->hrtime() - start);
+    if (matched && (wait = _http_server_rate_take(conn, match.data)) != 0)
+    {
+        _http_server_too_many(conn, wait);
+        return;
+    }
+    if (matched && ((http_server_router_t*)match.data)->data.websocket)
+    {
+        /* Replies 426 by itself if this is not an upgrade request. */
+        mg_ws_upgrade(c, hm, NULL);
+        if (!c->is_websocket)
+        {
+            return;
+        }
+        conn->ws_router = match.data;
+        atomic_fetch_add_explicit(&conn->ws_router->users, 1, memory_order_relaxed);
+        http_server_pending_t* pending = _http_server_new_pending(reactor, conn, hm, &match, start);
+        pending->type = HTTP_SERVER_EVENT_WS_OPEN;
+        _http_server_post(server, pending);
+        return;
+    }
+    if (matched && ((http_server_router_t*)match.data)->proxy != NULL)
+    {
+        http_metrics_add(&metrics->requests[HTTP_METRICS_HANDLER_PROXY], 1);
+        _http_server_proxy_request(conn, hm, match.data, start);
+        return;
+    }
+    if (matched && _http_server_cache_request(conn, hm, &match, start))
+    {
+        return;
+    }
+    if (matched && (reason = _http_server_overloaded(server)) >= 0)
+    {
+        _http_server_shed(conn, reason);
+        return;
+    }
+    if (matched)
+    {
+        http_metrics_add(&metrics->requests[HTTP_METRICS_HANDLER_ROUTE], 1);
+        http_server_pending_t* pending = _http_server_new_pending(reactor, conn, hm, &match, start);
+        _http_server_post(server, pending);
+        return;
+    }
+    if (match.allow != 0)
+    {
+        http_metrics_add(&metrics->requests[HTTP_METRICS_HANDLER_NOT_ALLOWED], 1);
+        _http_server_not_allowed(conn, match.allow);
+        return;
+    }
+
+    /* Answered right here, so wait for the replies before it. */
+    if (!_http_server_conn_idle(conn))
+    {
+        http_server_parked_t* parked = api->memory->malloc(sizeof(http_server_parked_t) + hm->message.len);
+        parked->seq = conn->req_seq++;
+        parked->len = hm->message.len;
+        memcpy(parked->buf, hm->message.ptr, hm->message.len);
+        api->list->push_back(&conn->parked, &parked->node);
+        return;
+    }
+    _http_server_serve_local(conn, hm);
+}
+
+static void _http_server_on_timeout(http_wheel_timer_t* timer, void* arg)
+{
+    http_server_conn_t* conn = container_of(timer, http_server_conn_t, timer);
+    struct mg_connection* c = conn->c;
+    (void)arg;
+
+    http_metrics_add(&conn->reactor->metrics->timeouts[conn->timer_kind], 1);
+    if (conn->timer_kind == HTTP_METRICS_TIMEOUT_HEADER)
+    {
+        /* Client is still talking, so tell it why. */
+        conn->timer_kind = -1;
+        _http_server_reject(conn, 408);
+        _http_server_conn_timer(conn);
+        return;
+    }
+
+    conn->timer_kind = -1;
+    c->is_closing = 1;
+}
+
+/**
+ * @brief Track accepted connection.
+ *
+ * From now on \p c carries its #http_server_conn_t as fn_data instead of the
+ * reactor, so events need no lookup.
+ */
+static void _http_server_on_accept(http_server_reactor_t* reactor, struct mg_connection* c)
+{
+    http_server_conn_t* conn = api->memory->calloc(1, sizeof(http_server_conn_t));
+    conn->id = c->id;
+    conn->c = c;
+    conn->reactor = reactor;
+    api->list->init(&conn->held);
+    api->list->init(&conn->parked);
+    api->list->init(&conn->proxies);
+    http_static_stream_init(&conn->stream);
+    http_ws_queue_init(&conn->ws_out, api->memory);
+    api->map->insert(&reactor->conns, &conn->node);
+    http_metrics_add(&reactor->metrics->accepted, 1);
+
+    c->fn_data = conn;
+    conn->http_pfn = c->pfn;
+    c->pfn = _http_server_proto;
+    http_wheel_timer_init(&conn->timer);
+    conn->timer_kind = -1;
+
+    /* Tell client to come back later instead of leaving it in listen backlog. */
+    unsigned open_cnt = (unsigned)atomic_fetch_add(&reactor->server->connections, 1);
+    if (reactor->server->options.max_connections != 0 && open_cnt >= reactor->server->options.max_connections)
+    {
+        http_metrics_add(&reactor->metrics->shed[HTTP_METRICS_SHED_CONNECTIONS], 1);
+        mg_http_reply(c, 503, "Retry-After: 1\r\nConnection: close\r\n", "%s\n", _http_server_status_str(503));
+        c->is_draining = 1;
+    }
+}
+
+static void _http_server_on_close(http_server_conn_t* conn)
+{
+    auto_list_node_t* it;
+
+    /* Nobody handles events once server is going away, and routes are gone. */
+    if (conn->ws_router != NULL && conn->reactor->server->looping)
+    {
+        _http_server_post_ws_event(conn, HTTP_SERVER_EVENT_WS_CLOSE, 0, NULL, 0);
+        atomic_fetch_sub_explicit(&conn->ws_router->users, 1, memory_order_release);
+    }
+    if (conn->upload != NULL)
+    {
+        _http_server_upload_end(conn, NULL, -1);
+    }
+    while ((it = api->list->begin(&conn->proxies)) != NULL)
+    {
+        _http_server_proxy_free(container_of(it, http_server_exchange_t, node));
+    }
+    http_ws_queue_exit(&conn->ws_out);
+    http_wheel_cancel(&conn->timer);
+    api->map->erase(&conn->reactor->conns, &conn->node);
+    atomic_fetch_sub(&conn->reactor->server->connections, 1);
+    http_metrics_add(&conn->reactor->metrics->closed, 1);
+    while ((it = api->list->pop_front(&conn->held)) != NULL)
+    {
+        _http_server_reply_drop(conn->reactor->server, container_of(it, http_server_reply_t, node));
+    }
+    while ((it = api->list->pop_front(&conn->parked)) != NULL)
+    {
+        api->memory->free(container_of(it, http_server_parked_t, node));
+    }
+    http_static_stream_close(&conn->stream);
+    api->memory->free(conn);
+}
+
+static void _http_server_on_writable(http_server_conn_t* conn)
+{
+    /* Lua caught up with upload. */
+    if (conn->upload != NULL && conn->c->is_full && !atomic_load(&conn->upload->paused))
+    {
+        conn->c->is_full = 0;
+        _http_server_upload_pump(conn);
+    }
+    if (conn->ws_router != NULL)
+    {
+        _http_server_ws_pump(conn);
+        return;
+    }
+    if (http_static_stream_active(&conn->stream))
+    {
+        http_static_stream_pump(conn->c, &conn->stream);
+    }
+    if (api->list->size(&conn->held) != 0 || api->list->size(&conn->parked) != 0)
+    {
+        _http_server_conn_flush_held(conn);
+    }
+    _http_server_proxy_kick(conn);
+}
+
+static void _http_server_work(struct mg_connection* c, int ev, void* ev_data, void* fn_data)
+{
+    /* Listeners, and accepted connections before MG_EV_ACCEPT, carry the reactor. */
+    if (c->is_listening && ev == MG_EV_POLL)
+    {
+        /* Each reactor has one listener, so this runs once per poll. */
+        http_server_reactor_t* reactor = fn_data;
+        http_wheel_advance(&reactor->timers, (uint64_t)mg_millis(), _http_server_on_timeout, NULL);
+        return;
+    }
+    if (!c->is_accepted || ev == MG_EV_OPEN)
+    {
+        return;
+    }
+    if (ev == MG_EV_ACCEPT)
+    {
+        _http_server_on_accept(fn_data, c);
+        _http_server_conn_timer(c->fn_data);
+        return;
+    }
+
+    http_server_conn_t* conn = fn_data;
+    switch (ev)
+    {
+    case MG_EV_HTTP_MSG:
+        _http_server_handle_msg(conn, (struct mg_http_message*) ev_data);
+        break;
+
+    case MG_EV_WS_MSG:
+    {
+        struct mg_ws_message* wm = ev_data;
+        _http_server_post_ws_event(conn, HTTP_SERVER_EVENT_WS_MSG, wm->flags & 0x0f, wm->data.ptr, wm->data.len);
+        break;
+    }
+
+    case MG_EV_WRITE:
+        /* Write timeout is for a response making no progress, not for a large one. */
+        if (conn->timer_kind == HTTP_METRICS_TIMEOUT_WRITE)
+        {
+            http_wheel_schedule(&conn->reactor->timers, &conn->timer, conn->reactor->server->options.write_timeout);
+        }
+        _http_server_on_writable(conn);
+        break;
+
+    case MG_EV_POLL:
+        _http_server_on_writable(conn);
+        return;
+
+    case MG_EV_CLOSE:
+        _http_server_on_close(conn);
+        return;
+
+    default:
+        break;
+    }
+
+    _http_server_conn_timer(conn);
+}
+
+static int _http_server_cmp_route(const auto_map_node_t* key1,
+    const auto_map_node_t* key2, void* arg)
+{
+    (void)arg;
+    http_server_router_t* r1 = container_of(key1, http_server_router_t, node);
+    http_server_router_t* r2 = container_of(key2, http_server_router_t, node);
+    int ret = strcmp(r1->data.raw, r2->data.raw);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    return r1->method - r2->method;
+}
+
+/**
+ * @brief Make route \p raw from \p tmpl.
+ * @param[in] handler   Stack index of handler, 0 if none.
+ * @param[in] tmpl      Route options. Cache `vary` and proxy are taken over.
+ */
+static http_server_router_t* _http_server_new_route(struct lua_State* L, http_server_t* server,
+    const char* raw, int handler, const http_server_router_t* tmpl)
+{
+    http_server_router_t* route = malloc(sizeof(http_server_router_t));
+    *route = *tmpl;
+    route->data.raw = strdup(raw);
+    route->data.ref_cb = AUTO_LUA_NOREF;
+    if (handler != 0)
+    {
+        api->lua->pushvalue(L, handler);
+        route->data.ref_cb = api->lua->L_ref(L, AUTO_LUA_REGISTRYINDEX);
+    }
+    route->retired = 0;
+    atomic_init(&route->users, 0);
+
+    /* Per route metrics are written by lua. Methods of one path count apart. */
+    if (!route->data.websocket && route->proxy == NULL)
+    {
+        const char* method = http_router_method_name(route->method);
+        char* name = NULL;
+        if (method != NULL)
+        {
+            name = malloc(strlen(method) + strlen(raw) + 2);
+            sprintf(name, "%s %s", method, raw);
+        }
+        route->metrics = http_metrics_route(server->metrics, name != NULL ? name : raw);
+        free(name);
+    }
+    return route;
+}
+
+/**
+ * @brief Free retired tables and routes that no poll thread can reach
+ *   anymore.
+ *
+ * Each poll thread notes the epoch when a poll starts, and lets go of the
+ * table it loaded when the poll ends. So once all of them noted an epoch,
+ * tables retired up to it are unreachable. Routes also wait for events that
+ * still point at them.
+ */
+static void _http_server_reclaim(struct lua_State* L, http_server_t* server)
+{
+    unsigned i;
+    auto_list_node_t* it;
+    auto_list_node_t* next;
+    uint64_t safe = atomic_load(&server->epoch);
+
+    for (i = 0; i < server->reactor_cnt; i++)
+    {
+        if (server->reactors[i].thread != NULL)
+        {
+            uint64_t seen = atomic_load(&server->reactors[i].epoch);
+            safe = seen < safe ? seen : safe;
+        }
+    }
+
+    for (it = api->list->begin(&server->retired_tables); it != NULL; it = next)
+    {
+        http_server_table_t* table = container_of(it, http_server_table_t, node);
+        next = api->list->next(it);
+        if (table->retired <= safe)
+        {
+            api->list->erase(&server->retired_tables, it);
+            _http_server_destroy_table(table);
+        }
+    }
+
+    for (it = api->list->begin(&server->retired_routes); it != NULL; it = next)
+    {
+        http_server_router_t* route = container_of(it, http_server_router_t, retire_node);
+        next = api->list->next(it);
+        if (route->retired <= safe && atomic_load_explicit(&route->users, memory_order_acquire) == 0)
+        {
+            api->list->erase(&server->retired_routes, it);
+            _http_server_destroy_route(L, route);
+        }
+    }
+}
+
+/**
+ * @brief Compile \p routes into a table for poll threads.
+ * @return  Table, or NULL if a route does not compile.
+ */
+static http_server_table_t* _http_server_build_table(const auto_map_t* routes)
+{
+    const auto_map_node_t* it;
+    http_server_table_t* table = calloc(1, sizeof(http_server_table_t));
+    table->router = http_router_create(api->regex);
+
+    for (it = api->map->begin(routes); it != NULL; it = api->map->next(it))
+    {
+        http_server_router_t* route = container_of(it, http_server_router_t, node);
+        if (!http_router_add(table->router, route->data.raw, route->method, route->priority, route))
+        {
+            _http_server_destroy_table(table);
+            return NULL;
+        }
+        table->stream_routes += route->data.stream != 0;
+    }
+    return table;
+}
+
+/**
+ * @brief Hand \p table to poll threads.
+ *
+ * The table is never changed after, so poll threads read it without locks.
+ * The one it replaces is freed by _http_server_reclaim().
+ */
+static void _http_server_publish(struct lua_State* L, http_server_t* server, http_server_table_t* table)
+{
+    http_server_table_t* old = atomic_exchange(&server->table, table);
+    old->retired = atomic_fetch_add(&server->epoch, 1) + 1;
+    api->list->push_back(&server->retired_tables, &old->node);
+    _http_server_reclaim(L, server);
+}
+
+/**
+ * @brief Free \p route once poll threads and pending events are done with
+ *   it.
+ * @warning Call after the table without it is published.
+ */
+static void _http_server_retire_route(struct lua_State* L, http_server_t* server, http_server_router_t* route)
+{
+    route->retired = atomic_load(&server->epoch);
+    api->list->push_back(&server->retired_routes, &route->retire_node);
+    _http_server_reclaim(L, server);
+}
+
+/**
+ * @brief Add \p route and publish, or destroy it if its path is taken or
+ *   invalid.
+ */
+static int _http_server_add_route(struct lua_State* L, http_server_t* server, http_server_router_t* route)
+{
+    http_server_table_t* table;
+    if (api->map->insert(&server->routers, &route->node) == NULL)
+    {
+        if ((table = _http_server_build_table(&server->routers)) != NULL)
+        {
+            _http_server_publish(L, server, table);
+            api->lua->pushboolean(L, 1);
+            return 1;
+        }
+        api->map->erase(&server->routers, &route->node);
+    }
+
+    _http_server_destroy_route(L, route);
+    api->lua->pushboolean(L, 0);
+    return 1;
+}
+
+/**
+ * @brief Parse `cache = { ttl_ms = n, vary = { header... } }` at \p idx.
+ */
+static void _http_server_parse_route_cache(struct lua_State* L, int idx, http_server_route_cache_t* cache)
+{
+    if (api->lua->getfield(L, idx, "ttl_ms") == AUTO_LUA_TNUMBER && api->lua->tointeger(L, -1) > 0)
+    {
+        cache->ttl = (uint64_t)api->lua->tointeger(L, -1) * 1000 * 1000;
+    }
+    api->lua->pop(L, 1);
+
+    if (api->lua->getfield(L, idx, "vary") == AUTO_LUA_TTABLE)
+    {
+        int64_t i, cnt = api->lua->L_len(L, -1);
+        cache->vary = malloc(sizeof(char*) * (cnt > 0 ? cnt : 1));
+        for (i = 1; i <= cnt; i++)
+        {
+            if (api->lua->geti(L, -1, i) == AUTO_LUA_TSTRING)
+            {
+                cache->vary[cache->vary_cnt++] = strdup(api->lua->tostring(L, -1));
+            }
+            api->lua->pop(L, 1);
+        }
+    }
+    api->lua->pop(L, 1);
+}
+
+/**
+ * @brief Parse `{ rate = n, burst = n }` at \p idx, in requests per second.
+ *
+ * Burst defaults to one second worth of requests.
+ */
+static void _http_server_parse_rate_limit(struct lua_State* L, int idx, http_ratelimit_rule_t* rule)
+{
+    if (api->lua->getfield(L, idx, "rate") == AUTO_LUA_TNUMBER && api->lua->tonumber(L, -1) > 0)
+    {
+        rule->rate = api->lua->tonumber(L, -1);
+        rule->burst = rule->rate;
+    }
+    api->lua->pop(L, 1);
+
+    if (api->lua->getfield(L, idx, "burst") == AUTO_LUA_TNUMBER && api->lua->tonumber(L, -1) > 0)
+    {
+        rule->burst = api->lua->tonumber(L, -1);
+    }
+    api->lua->pop(L, 1);
+
+    if (rule->burst < 1)
+    {
+        rule->burst = 1;
+    }
+}
+
+/**
+ * @brief Read `method` and `priority` of options at \p idx into \p tmpl.
+ * @return  NULL on success, else what is wrong.
+ */
+static const char* _http_server_match_opts(struct lua_State* L, int idx, http_server_router_t* tmpl)
+{
+    size_t len;
+    const char* err = NULL;
+
+    if (api->lua->getfield(L, idx, "method") == AUTO_LUA_TSTRING)
+    {
+        const char* method = api->lua->tolstring(L, -1, &len);
+        tmpl->method = http_router_method(method, len);
+        if (tmpl->method == HTTP_ROUTER_METHOD_ANY)
+        {
+            err = "unknown route method";
+        }
+    }
+    api->lua->pop(L, 1);
+
+    if (api->lua->getfield(L, idx, "priority") == AUTO_LUA_TNUMBER)
+    {
+        tmpl->priority = (int)api->lua->tointeger(L, -1);
+    }
+    api->lua->pop(L, 1);
+    return err;
+}
+
+/**
+ * @brief Read options of `server:route()` at \p idx into \p tmpl.
+ * @return  NULL on success, else what is wrong.
+ */
+static const char* _http_server_route_opts(struct lua_State* L, int idx, http_server_router_t* tmpl)
+{
+    const char* err = _http_server_match_opts(L, idx, tmpl);
+    if (err != NULL)
+    {
+        return err;
+    }
+
+    api->lua->getfield(L, idx, "stream_body");
+    tmpl->data.stream = api->lua->toboolean(L, -1);
+    api->lua->getfield(L, idx, "raw_uuid");
+    tmpl->data.raw_uuid = api->lua->toboolean(L, -1);
+    api->lua->pop(L, 2);
+    if (api->lua->getfield(L, idx, "cache") == AUTO_LUA_TTABLE)
+    {
+        _http_server_parse_route_cache(L, api->lua->gettop(L), &tmpl->cache);
+    }
+    api->lua->pop(L, 1);
+    if (api->lua->getfield(L, idx, "rate_limit") == AUTO_LUA_TTABLE)
+    {
+        _http_server_parse_rate_limit(L, api->lua->gettop(L), &tmpl->rate_limit);
+    }
+    api->lua->pop(L, 1);
+    return NULL;
+}
+
+/**
+ * @brief Register lua handler at index 3 for \p method, with options at
+ *   index 4 if any.
+ */
+static int _http_server_add_handler(struct lua_State* L, int method)
+{
+    const char* err;
+    http_server_router_t tmpl;
+    http_server_t* server = api->lua->touserdata(L, 1);
+    const char* raw = api->lua->L_checkstring(L, 2);
+    api->lua->L_checktype(L, 3, AUTO_LUA_TFUNCTION);
+
+    memset(&tmpl, 0, sizeof(tmpl));
+    tmpl.method = HTTP_ROUTER_METHOD_ANY;
+    if (api->lua->type(L, 4) == AUTO_LUA_TTABLE && (err = _http_server_route_opts(L, 4, &tmpl)) != NULL)
+    {
+        return api->lua->L_error(L, "%s", err);
+    }
+    if (method != HTTP_ROUTER_METHOD_ANY)
+    {
+        tmpl.method = method;
+    }
+
+    return _http_server_add_route(L, server, _http_server_new_route(L, server, raw, 3, &tmpl));
+}
+
+/**
+ * @brief `server:route(route, fn[, opts])`
+ *
+ * Takes any method, unless `opts.method` names one. Among regex routes and
+ * against trie routes, higher `opts.priority` is tried first.
+ *
+ * Captures are passed after the request: `<int>` as integer, `<float>` as
+ * number, others as strings. With `opts.raw_uuid`, `<uuid>` is passed as 16
+ * raw bytes instead of its text.
+ *
+ * \p fn runs in its own coroutine, so it may wait, e.g. in `req:write()` for a
+ * slow client or in `mongoose.http_request()`, without holding up other
+ * requests. With `opts.stream_body`, it
+ * starts as soon as request head arrives, and reads body with `req:read()`.
+ * With `opts.cache`, responses to GET are served from cache by poll
+ * threads for `ttl_ms`, keyed by method, URI and the request headers listed
+ * in `vary`. With `opts.rate_limit`, each client gets `rate` requests per
+ * second with bursts of `burst`, and 429 beyond.
+ */
+static int _http_server_route(struct lua_State* L)
+{
+    return _http_server_add_handler(L, HTTP_ROUTER_METHOD_ANY);
+}
+
+/**
+ * @brief `server:get(route, fn[, opts])`, like `server:route()` for GET and
+ *   HEAD only.
+ *
+ * Requests to a path whose routes all take other methods get 405 with
+ * `Allow`.
+ */
+static int _http_server_route_get(struct lua_State* L)
+{
+    return _http_server_add_handler(L, HTTP_ROUTER_METHOD_GET);
+}
+
+/**
+ * @brief `server:post(route, fn[, opts])`
+ */
+static int _http_server_route_post(struct lua_State* L)
+{
+    return _http_server_add_handler(L, HTTP_ROUTER_METHOD_POST);
+}
+
+/**
+ * @brief `server:put(route, fn[, opts])`
+ */
+static int _http_server_route_put(struct lua_State* L)
+{
+    return _http_server_add_handler(L, HTTP_ROUTER_METHOD_PUT);
+}
+
+/**
+ * @brief `server:delete(route, fn[, opts])`
+ */
+static int _http_server_route_delete(struct lua_State* L)
+{
+    return _http_server_add_handler(L, HTTP_ROUTER_METHOD_DELETE);
+}
+
+/**
+ * @brief `server:websocket(route, { open = fn, message = fn, close = fn })`
+ */
+static int _http_server_websocket(struct lua_State* L)
+{
+    http_server_router_t tmpl;
+    http_server_t* server = api->lua->touserdata(L, 1);
+    const char* raw = api->lua->L_checkstring(L, 2);
+    api->lua->L_checktype(L, 3, AUTO_LUA_TTABLE);
+
+    memset(&tmpl, 0, sizeof(tmpl));
+    tmpl.method = HTTP_ROUTER_METHOD_ANY;
+    tmpl.data.websocket = 1;
+    return _http_server_add_route(L, server, _http_server_new_route(L, server, raw, 3, &tmpl));
+}
+
+/**
+ * @brief Read non-negative integer field \p name of table at \p idx into
+ *   \p value, if present.
+ */
+static void _http_server_opt_uint(struct lua_State* L, int idx, const char* name, uint64_t* value)
+{
+    if (api->lua->getfield(L, idx, name) == AUTO_LUA_TNUMBER && api->lua->tointeger(L, -1) >= 0)
+    {
+        *value = (uint64_t)api->lua->tointeger(L, -1);
+    }
+    api->lua->pop(L, 1);
+}
+
+/**
+ * @brief Read proxy options at \p idx into \p tmpl.
+ * @return  NULL on success, else what is wrong.
+ */
+static const char* _http_server_proxy_opts(struct lua_State* L, http_server_t* server, int idx,
+    http_server_router_t* tmpl)
+{
+    int64_t i, cnt = 0;
+    http_proxy_config_t config;
+    uint64_t retries = 1, max_fails = 1, max_idle = 32;
+    int top = api->lua->gettop(L);
+    const char* err = _http_server_match_opts(L, idx, tmpl);
+
+    if (err != NULL)
+    {
+        return err;
+    }
+
+    memset(&config, 0, sizeof(config));
+    config.policy = HTTP_PROXY_ROUND_ROBIN;
+    if (api->lua->getfield(L, idx, "policy") == AUTO_LUA_TSTRING)
+    {
+        const char* policy = api->lua->tostring(L, -1);
+        if (strcmp(policy, "least_conn") == 0)
+        {
+            config.policy = HTTP_PROXY_LEAST_CONN;
+        }
+        else if (strcmp(policy, "round_robin") != 0)
+        {
+            api->lua->settop(L, top);
+            return "unknown proxy policy";
+        }
+    }
+    api->lua->pop(L, 1);
+
+    config.fail_timeout = 10 * 1000;
+    config.timeout = 60 * 1000;
+    config.idle_timeout = 60 * 1000;
+    _http_server_opt_uint(L, idx, "retries", &retries);
+    _http_server_opt_uint(L, idx, "max_fails", &max_fails);
+    _http_server_opt_uint(L, idx, "fail_timeout_ms", &config.fail_timeout);
+    _http_server_opt_uint(L, idx, "timeout_ms", &config.timeout);
+    _http_server_opt_uint(L, idx, "max_idle", &max_idle);
+    _http_server_opt_uint(L, idx, "idle_timeout_ms", &config.idle_timeout);
+    config.retries = (unsigned)retries;
+    config.max_fails = (unsigned)max_fails;
+    config.max_idle = (size_t)max_idle;
+
+    /* Strings stay alive in the options table. */
+    if (api->lua->getfield(L, idx, "upstreams") == AUTO_LUA_TTABLE)
+    {
+        cnt = api->lua->L_len(L, -1);
+    }
+    if (cnt <= 0)
+    {
+        api->lua->settop(L, top);
+        return "proxy needs at least one upstream";
+    }
+    const char** urls = malloc(sizeof(char*) * cnt);
+    for (i = 0; i < cnt; i++)
+    {
+        api->lua->geti(L, -1, i + 1);
+        urls[i] = api->lua->tostring(L, -1);
+        api->lua->pop(L, 1);
+        if (urls[i] == NULL || strncmp(urls[i], "http://", 7) != 0)
+        {
+            free(urls);
+            api->lua->settop(L, top);
+            return "proxy upstreams must be http:// urls";
+        }
+    }
 
-    return 0;
+    tmpl->proxy = http_proxy_create(api, urls, (size_t)cnt, &config, server->reactor_cnt);
+    free(urls);
+    api->lua->settop(L, top);
+    return NULL;
 }
 
-static void _http_server_body(void* arg)
+/**
+ * @brief `server:proxy(route, { upstreams = { url... }, policy, retries,
+ *   max_fails, fail_timeout_ms, timeout_ms, max_idle, idle_timeout_ms })`
+ *
+ * Requests are relayed by poll threads without calling lua. Responses stream
+ * back as they arrive, and upstream connections are kept alive per poll
+ * thread. `policy` is `"round_robin"` (default) or `"least_conn"`. An
+ * upstream that fails `max_fails` times in a row is skipped for
+ * `fail_timeout_ms`.
+ */
+static int _http_server_proxy(struct lua_State* L)
 {
-    http_server_t* server = arg;
+    const char* err;
+    http_server_router_t tmpl;
+    http_server_t* server = api->lua->touserdata(L, 1);
+    const char* raw = api->lua->L_checkstring(L, 2);
+    api->lua->L_checktype(L, 3, AUTO_LUA_TTABLE);
 
-    while (server->looping)
+    memset(&tmpl, 0, sizeof(tmpl));
+    tmpl.method = HTTP_ROUTER_METHOD_ANY;
+    if ((err = _http_server_proxy_opts(L, server, 3, &tmpl)) != NULL)
     {
-        mg_mgr_poll(&server->mgr, 100);
+        return api->lua->L_error(L, "%s", err);
     }
+    return _http_server_add_route(L, server, _http_server_new_route(L, server, raw, 0, &tmpl));
 }
 
-static int _http_server_handle_msg_lua_after(struct lua_State* L, int status, void* ctx)
+/**
+ * @brief `server:unroute(route[, method])`, returns whether a route was
+ *   there.
+ *
+ * Without \p method, routes of all methods on \p route go. Requests already
+ * routed still finish with their handler.
+ */
+static int _http_server_unroute(struct lua_State* L)
 {
-    (void)L; (void)status; (void)ctx;
-    return 0;
-}
+    size_t len;
+    int method, first = 0, last = HTTP_ROUTER_METHOD__MAX - 1;
+    auto_list_t removed;
+    auto_list_node_t* node;
+    http_server_router_t tmp;
+    http_server_t* server = api->lua->touserdata(L, 1);
+    tmp.data.raw = (char*)api->lua->L_checkstring(L, 2);
 
-static void _http_server_handle_msg_lua(struct lua_State* L, void* arg)
-{
-    int i;
-    http_server_msg_helper_t* helper = arg;
-    http_server_router_t* router = helper->router;
+    if (api->lua->type(L, 3) == AUTO_LUA_TSTRING)
+    {
+        const char* name = api->lua->tolstring(L, 3, &len);
+        first = last = http_router_method(name, len);
+        if (first == HTTP_ROUTER_METHOD_ANY)
+        {
+            return api->lua->L_error(L, "unknown route method");
+        }
+    }
 
-    api->lua->rawgeti(L, AUTO_LUA_REGISTRYINDEX, helper->router->data.ref_cb);
+    api->list->init(&removed);
+    for (method = first; method <= last; method++)
+    {
+        tmp.method = method;
+        auto_map_node_t* it = api->map->find(&server->routers, &tmp.node);
+        if (it != NULL)
+        {
+            api->map->erase(&server->routers, it);
+            api->list->push_back(&removed, &container_of(it, http_server_router_t, node)->retire_node);
+        }
+    }
+    if (api->list->size(&removed) == 0)
+    {
+        api->lua->pushboolean(L, 0);
+        return 1;
+    }
 
-    for (i = 0; i < helper->ret; i++)
+    http_server_table_t* table = _http_server_build_table(&server->routers);
+    if (table != NULL)
+    {
+        _http_server_publish(L, server, table);
+    }
+    while ((node = api->list->pop_front(&removed)) != NULL)
     {
-        size_t len = router->data.groups[2 * i + 1] - router->data.groups[2 * i];
-        api->lua->pushlstring(L, helper->hm->uri.ptr + router->data.groups[2 * i], len);
+        http_server_router_t* route = container_of(node, http_server_router_t, retire_node);
+        if (table != NULL)
+        {
+            _http_server_retire_route(L, server, route);
+        }
+        else
+        {
+            api->map->insert(&server->routers, &route->node);
+        }
     }
 
-    api->lua->A_callk(L, helper->ret, 0, NULL, _http_server_handle_msg_lua_after);
+    api->lua->pushboolean(L, table != NULL);
+    return 1;
 }
 
-static void _http_server_handle_msg(http_server_t* server, struct mg_connection* c, struct mg_http_message* hm)
+/**
+ * @brief Make route from `{ route, handler[, opts] }` at \p idx.
+ *
+ * A function handler makes a route with `server:route()` options. A table
+ * handler with `upstreams` is proxy options, any other table is websocket
+ * handlers.
+ *
+ * @return  NULL on success, else what is wrong.
+ */
+static const char* _http_server_parse_entry(struct lua_State* L, http_server_t* server, int idx,
+    http_server_router_t** route)
 {
-    auto_map_node_t* it;
-    http_server_msg_helper_t helper = { 0, c, hm, NULL };
+    const char* err = NULL;
+    http_server_router_t tmpl;
+    int top = api->lua->gettop(L);
 
-    /* Check if url match router */
-    for (it = api->map->begin(&server->routers); it != NULL; it = api->map->next(it))
+    memset(&tmpl, 0, sizeof(tmpl));
+    tmpl.method = HTTP_ROUTER_METHOD_ANY;
+    if (api->lua->geti(L, idx, 1) != AUTO_LUA_TSTRING)
     {
-        helper.router = container_of(it, http_server_router_t, node);
-        helper.ret = api->regex->match(helper.router->data.url_pattern, hm->uri.ptr, hm->uri.len,
-            helper.router->data.groups, helper.router->data.group_cnt);
+        api->lua->settop(L, top);
+        return "route entry needs a route string";
+    }
+    const char* raw = api->lua->tostring(L, -1);
+    int type = api->lua->geti(L, idx, 2);
+    int handler = api->lua->gettop(L);
+    int has_opts = api->lua->geti(L, idx, 3) == AUTO_LUA_TTABLE;
 
-        if (helper.ret >= 0)
+    if (type == AUTO_LUA_TFUNCTION)
+    {
+        if (!has_opts || (err = _http_server_route_opts(L, handler + 1, &tmpl)) == NULL)
         {
-            api->async->call_in_lua(server->async, _http_server_handle_msg_lua, &helper);
-            return;
+            *route = _http_server_new_route(L, server, raw, handler, &tmpl);
         }
     }
-
-    if (server->options.serve_dir != NULL)
+    else if (type != AUTO_LUA_TTABLE)
     {
-        struct mg_http_serve_opts opts;
-        memset(&opts, 0, sizeof(opts));
-        opts.root_dir = server->options.serve_dir;
-        opts.ssi_pattern = server->options.ssi_pattern;
-        mg_http_serve_dir(c, hm, &opts);
+        err = "route entry needs a function or table handler";
+    }
+    else if (api->lua->getfield(L, handler, "upstreams") != AUTO_LUA_TNIL)
+    {
+        if ((err = _http_server_proxy_opts(L, server, handler, &tmpl)) == NULL)
+        {
+            *route = _http_server_new_route(L, server, raw, 0, &tmpl);
+        }
+    }
+    else if (!has_opts || (err = _http_server_match_opts(L, handler + 1, &tmpl)) == NULL)
+    {
+        tmpl.data.websocket = 1;
+        *route = _http_server_new_route(L, server, raw, handler, &tmpl);
     }
+
+    api->lua->settop(L, top);
+    return err;
 }
 
-static void _http_server_work(struct mg_connection* c, int ev, void* ev_data, void* fn_data)
+/**
+ * @brief `server:reload_routes{ { route, handler[, opts] }... }`, replaces
+ *   all routes at once.
+ *
+ * Poll threads switch from the old set to the new one between two requests,
+ * never seeing a mix. Requests already routed finish with the handler they
+ * were routed to. Raises an error and keeps the old set if a route is
+ * invalid or given twice.
+ */
+static int _http_server_reload_routes(struct lua_State* L)
 {
-    http_server_t* server = fn_data;
+    int64_t i, cnt;
+    auto_map_t routes;
+    auto_map_node_t* it;
+    const char* err = NULL;
+    http_server_t* server = api->lua->touserdata(L, 1);
+    api->lua->L_checktype(L, 2, AUTO_LUA_TTABLE);
+    api->lua->settop(L, 2);
 
-    if (ev == MG_EV_HTTP_MSG)
+    api->map->init(&routes, _http_server_cmp_route, NULL);
+    cnt = api->lua->L_len(L, 2);
+    for (i = 1; i <= cnt && err == NULL; i++)
     {
-        struct mg_http_message* hm = (struct mg_http_message*) ev_data;
-        _http_server_handle_msg(server, c, hm);
+        http_server_router_t* route = NULL;
+        if (api->lua->geti(L, 2, i) != AUTO_LUA_TTABLE)
+        {
+            err = "route entry must be a table";
+        }
+        else if ((err = _http_server_parse_entry(L, server, 3, &route)) == NULL
+            && api->map->insert(&routes, &route->node) != NULL)
+        {
+            _http_server_destroy_route(L, route);
+            err = "route given twice";
+        }
+        api->lua->settop(L, 2);
     }
-}
 
-static char* string_replace_2(const char* orig, const char* match, const char* replace, int* replaced)
-{
-    const char* pos = strstr(orig, match);
-    if (pos == NULL)
+    http_server_table_t* table = NULL;
+    if (err == NULL && (table = _http_server_build_table(&routes)) == NULL)
     {
-        *replaced = 0;
-        return strdup(orig);
+        err = "route does not compile";
+    }
+    if (err != NULL)
+    {
+        while ((it = api->map->begin(&routes)) != NULL)
+        {
+            api->map->erase(&routes, it);
+            _http_server_destroy_route(L, container_of(it, http_server_router_t, node));
+        }
+        return api->lua->L_error(L, "%s", err);
     }
 
-    *replaced = 1;
-    size_t match_len = strlen(match);
+    /* Old routes are retired only once the table without them is out. */
+    auto_list_t old;
+    api->list->init(&old);
+    while ((it = api->map->begin(&server->routers)) != NULL)
+    {
+        api->map->erase(&server->routers, it);
+        api->list->push_back(&old, &container_of(it, http_server_router_t, node)->retire_node);
+    }
+    while ((it = api->map->begin(&routes)) != NULL)
+    {
+        api->map->erase(&routes, it);
+        api->map->insert(&server->routers, it);
+    }
+    _http_server_publish(L, server, table);
 
-    char* dst;
-    asprintf(&dst, "%.*s%s%s", (int)(pos - orig), orig, replace, pos + match_len);
+    auto_list_node_t* node;
+    while ((node = api->list->pop_front(&old)) != NULL)
+    {
+        _http_server_retire_route(L, server, container_of(node, http_server_router_t, retire_node));
+    }
 
-    return dst;
+    api->lua->pushboolean(L, 1);
+    return 1;
 }
 
-static char* string_replace(const char* orig, const char* match, const char* replace)
+/**
+ * @brief `server:broadcast(topic, data[, binary])`, returns number of
+ *   recipients.
+ *
+ * The frame is encoded once. Every reactor gets a single command listing its
+ * recipients, and all of them write from the same buffer.
+ */
+static int _http_server_broadcast(struct lua_State* L)
 {
-    char* dst;
-    char* last_ret = (char*)orig;
+    size_t len, total = 0;
+    unsigned i;
+    auto_list_node_t* it;
+    http_server_t* server = api->lua->touserdata(L, 1);
+    const char* name = api->lua->L_checkstring(L, 2);
+    const char* data = api->lua->L_checklstring(L, 3, &len);
+    int op = api->lua->toboolean(L, 4) ? WEBSOCKET_OP_BINARY : WEBSOCKET_OP_TEXT;
+
+    http_server_topic_t* topic = _http_server_find_topic(server, name);
+    if (topic == NULL)
+    {
+        api->lua->pushinteger(L, 0);
+        return 1;
+    }
 
-    for (;;)
+    for (it = api->list->begin(&topic->subs); it != NULL; it = api->list->next(it))
     {
-        int replaced;
-        dst = string_replace_2(last_ret, match, replace, &replaced);
+        http_server_ws_t* ws = container_of(it, http_server_sub_t, topic_node)->ws;
+        server->fanout[ws->reactor - server->reactors].cnt++;
+    }
 
-        if (!replaced)
+    http_ws_frame_t* frame = http_ws_frame_create(api->memory, op, data, len);
+    for (i = 0; i < server->reactor_cnt; i++)
+    {
+        if (server->fanout[i].cnt != 0)
         {
-            break;
+            server->fanout[i].cmd = _http_server_ws_new_cmd(frame, server->fanout[i].cnt);
         }
+    }
+    http_ws_frame_release(frame);
+
+    for (it = api->list->begin(&topic->subs); it != NULL; it = api->list->next(it))
+    {
+        http_server_ws_t* ws = container_of(it, http_server_sub_t, topic_node)->ws;
+        http_server_ws_cmd_t* cmd = server->fanout[ws->reactor - server->reactors].cmd;
+        cmd->conn_ids[cmd->conn_cnt++] = ws->conn_id;
+    }
 
-        if (last_ret != orig)
+    for (i = 0; i < server->reactor_cnt; i++)
+    {
+        if (server->fanout[i].cmd != NULL)
         {
-            free(last_ret);
+            total += server->fanout[i].cnt;
+            _http_server_ws_queue(&server->reactors[i], server->fanout[i].cmd);
         }
-        last_ret = dst;
-        dst = NULL;
+        server->fanout[i].cnt = 0;
+        server->fanout[i].cmd = NULL;
     }
 
-    return dst;
+    api->lua->pushinteger(L, (int64_t)total);
+    return 1;
 }
 
-static int _http_server_route_fill_prefix(http_server_router_t* route, const char* raw_route)
-{
-    static struct {
-        const char* match;
-        const char* pattern;
-    } s_pattern_list[] = {
-        { "<string>",   "([^/\\s]+)" },
-        { "<int>",      "(\\d+)" },
-        { "<float>",    "([+-]?[0-9]+\\.?[0-9+])" },
-        { "<path>",     "([^\\s]+)" },
-        { "<uuid>",     "([0-9a-fA-F]{8}-[0-9a-fA-F]{4}-[0-9a-fA-F]{4}-[0-9a-fA-F]{4}-[0-9a-fA-F]{12})" },
-    };
+#if defined(SO_REUSEPORT)
 
-    size_t i;
-    char* last_str = (char*)raw_route;
+/**
+ * @brief Listen on \p url with SO_REUSEPORT, so every reactor can have its
+ *   own listener on the same address.
+ *
+ * Mongoose does not expose socket options of listeners, so a listener is
+ * created on an ephemeral port first, then its socket is replaced.
+ */
+static struct mg_connection* _http_server_listen_reuseport(http_server_reactor_t* reactor, const char* url)
+{
+    int fd, on = 1;
+    char* tmp_url;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    struct mg_connection* c;
+    struct mg_str host = mg_url_host(url);
+    unsigned short port = mg_url_port(url);
 
-    for (i = 0; i < ARRAY_SIZE(s_pattern_list); i++)
+    if (memchr(host.ptr, ':', host.len) != NULL && host.ptr[0] != '[')
     {
-        route->data.prefix = string_replace(last_str, s_pattern_list[i].match, s_pattern_list[i].pattern);
-        if (last_str != raw_route)
-        {
-            free(last_str);
-        }
-        last_str = route->data.prefix;
+        asprintf(&tmp_url, "%s://[%.*s]:0", mg_url_is_ssl(url) ? "https" : "http", (int)host.len, host.ptr);
+    }
+    else
+    {
+        asprintf(&tmp_url, "%s://%.*s:0", mg_url_is_ssl(url) ? "https" : "http", (int)host.len, host.ptr);
+    }
+    c = mg_http_listen(&reactor->mgr, tmp_url, _http_server_work, reactor);
+    free(tmp_url);
+    if (c == NULL)
+    {
+        return NULL;
     }
 
-    route->data.url_pattern = api->regex->create(route->data.prefix, strlen(route->data.prefix));
-    if (route->data.url_pattern == NULL)
+    memset(&addr, 0, sizeof(addr));
+    if (c->loc.is_ip6)
     {
-        return 0;
+        struct sockaddr_in6* sin6 = (struct sockaddr_in6*)&addr;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        memcpy(&sin6->sin6_addr, c->loc.ip6, sizeof(sin6->sin6_addr));
+        addr_len = sizeof(*sin6);
+    }
+    else
+    {
+        struct sockaddr_in* sin = (struct sockaddr_in*)&addr;
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        sin->sin_addr.s_addr = c->loc.ip;
+        addr_len = sizeof(*sin);
     }
 
-    route->data.group_cnt = api->regex->get_group_count(route->data.url_pattern);
-    if (route->data.group_cnt != 0)
+    if ((fd = socket(addr.ss_family, SOCK_STREAM, 0)) < 0)
+    {
+        goto error;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0
+        || setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0
+        || bind(fd, (struct sockaddr*)&addr, addr_len) != 0
+        || listen(fd, SOMAXCONN) != 0
+        || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) != 0
+        || fcntl(fd, F_SETFD, FD_CLOEXEC) != 0)
     {
-        route->data.groups = malloc(sizeof(size_t) * route->data.group_cnt * 2);
+        close(fd);
+        goto error;
     }
 
-    return route->data.url_pattern != NULL;
+    close((int)(size_t)c->fd);
+    c->fd = (void*)(size_t)fd;
+    c->loc.port = htons(port);
+
+    return c;
+
+error:
+    c->is_closing = 1;
+    return NULL;
 }
 
-static int _http_server_route(struct lua_State* L)
+#endif
+
+static int _http_server_run(struct lua_State* L)
 {
+    unsigned i;
     http_server_t* server = api->lua->touserdata(L, 1);
-    const char* raw_route = api->lua->L_checkstring(L, 2);
-    api->lua->L_checktype(L, 3, AUTO_LUA_TFUNCTION);
-
-    /* Only 3 arguments needed. */
-    api->lua->settop(L, 3);
-
-    http_server_router_t* route = malloc(sizeof(http_server_router_t));
-    memset(route, 0, sizeof(*route));
-    route->data.ref_cb = AUTO_LUA_NOREF;
-    route->data.raw = strdup(raw_route);
-    route->data.ref_cb = api->lua->L_ref(L, AUTO_LUA_REGISTRYINDEX);
 
-    if (!_http_server_route_fill_prefix(route, raw_route))
+    /* Start listen */
+    for (i = 0; i < server->reactor_cnt; i++)
     {
-        goto failure;
+        struct mg_connection* c;
+#if defined(SO_REUSEPORT)
+        if (server->reactor_cnt > 1)
+        {
+            c = _http_server_listen_reuseport(&server->reactors[i], server->options.listen_url);
+        }
+        else
+#endif
+        {
+            c = mg_http_listen(&server->reactors[i].mgr, server->options.listen_url,
+                _http_server_work, &server->reactors[i]);
+        }
+
+        if (c == NULL)
+        {
+            api->lua->pushboolean(L, 0);
+            return 1;
+        }
     }
 
-    if (api->map->insert(&server->routers, &route->node) != NULL)
+    /* Create background thread for serving */
+    for (i = 0; i < server->reactor_cnt; i++)
     {
-        goto failure;
+        server->reactors[i].thread = api->thread->create(_http_server_body, &server->reactors[i]);
     }
 
     api->lua->pushboolean(L, 1);
     return 1;
-
-failure:
-    _http_server_destroy_route(L, route);
-    api->lua->pushboolean(L, 0);
-    return 1;
 }
 
-static int _http_server_run(struct lua_State* L)
+/**
+ * @brief `server:stats()`, same numbers as metrics_url as a table.
+ */
+static int _http_server_stats(struct lua_State* L)
 {
     http_server_t* server = api->lua->touserdata(L, 1);
+    http_metrics_push(server->metrics, L);
+    return 1;
+}
 
-    /* Start listen */
-    struct mg_connection* c = mg_http_listen(&server->mgr,
-        server->options.listen_url, _http_server_work, server);
-    if (c == NULL)
+static int _http_server_cmp_conn(const auto_map_node_t* key1,
+    const auto_map_node_t* key2, void* arg)
+{
+    (void)arg;
+    http_server_conn_t* c1 = container_of(key1, http_server_conn_t, node);
+    http_server_conn_t* c2 = container_of(key2, http_server_conn_t, node);
+    if (c1->id == c2->id)
     {
-        api->lua->pushboolean(L, 0);
-        return 1;
+        return 0;
     }
+    return c1->id < c2->id ? -1 : 1;
+}
 
-    /* Create background thread for serving */
-    server->thread = api->thread->create(_http_server_body, server);
+static int _http_server_cmp_ws(const auto_map_node_t* key1,
+    const auto_map_node_t* key2, void* arg)
+{
+    (void)arg;
+    http_server_ws_t* w1 = container_of(key1, http_server_ws_t, node);
+    http_server_ws_t* w2 = container_of(key2, http_server_ws_t, node);
+    if (w1->reactor != w2->reactor)
+    {
+        return w1->reactor < w2->reactor ? -1 : 1;
+    }
+    if (w1->conn_id == w2->conn_id)
+    {
+        return 0;
+    }
+    return w1->conn_id < w2->conn_id ? -1 : 1;
+}
 
-    api->lua->pushboolean(L, 1);
-    return 1;
+static int _http_server_cmp_upload(const auto_map_node_t* key1,
+    const auto_map_node_t* key2, void* arg)
+{
+    (void)arg;
+    http_server_request_t* r1 = container_of(key1, http_server_request_t, upload_node);
+    http_server_request_t* r2 = container_of(key2, http_server_request_t, upload_node);
+    if (r1->reactor != r2->reactor)
+    {
+        return r1->reactor < r2->reactor ? -1 : 1;
+    }
+    if (r1->conn_id == r2->conn_id)
+    {
+        return 0;
+    }
+    return r1->conn_id < r2->conn_id ? -1 : 1;
 }
 
-static int _http_server_cmp_route(const auto_map_node_t* key1,
+static int _http_server_cmp_topic(const auto_map_node_t* key1,
     const auto_map_node_t* key2, void* arg)
 {
     (void)arg;
-    http_server_router_t* r1 = container_of(key1, http_server_router_t, node);
-    http_server_router_t* r2 = container_of(key2, http_server_router_t, node);
-    return strcmp(r1->data.raw, r2->data.raw);
+    http_server_topic_t* t1 = container_of(key1, http_server_topic_t, node);
+    http_server_topic_t* t2 = container_of(key2, http_server_topic_t, node);
+    return strcmp(t1->name, t2->name);
 }
 
 static void _http_server_set_metatable(struct lua_State* L)
@@ -369,7 +5175,17 @@ static void _http_server_set_metatable(struct lua_State* L)
     };
     static const auto_luaL_Reg s_http_server_method[] = {
         { "route",      _http_server_route },
+        { "get",        _http_server_route_get },
+        { "post",       _http_server_route_post },
+        { "put",        _http_server_route_put },
+        { "delete",     _http_server_route_delete },
+        { "websocket",  _http_server_websocket },
+        { "proxy",      _http_server_proxy },
+        { "unroute",    _http_server_unroute },
+        { "reload_routes", _http_server_reload_routes },
+        { "broadcast",  _http_server_broadcast },
         { "run",        _http_server_run },
+        { "stats",      _http_server_stats },
         { NULL,         NULL },
     };
     if (api->lua->L_newmetatable(L, "__auto_http_server") != 0)
@@ -418,19 +5234,262 @@ static void _http_server_parse_options(struct lua_State* L, int idx, http_server
         server->options.ssi_pattern = strdup(api->lua->tostring(L, -1));
     }
     api->lua->pop(L, 1);
+
+    /* metrics_url */
+    if (api->lua->getfield(L, idx, "metrics_url") == AUTO_LUA_TSTRING)
+    {
+        server->options.metrics_url = strdup(api->lua->tostring(L, -1));
+    }
+    api->lua->pop(L, 1);
+
+    /* threads */
+    server->options.threads = 1;
+    if (api->lua->getfield(L, idx, "threads") == AUTO_LUA_TNUMBER
+        && api->lua->tointeger(L, -1) > 0)
+    {
+        int64_t threads = api->lua->tointeger(L, -1);
+        server->options.threads = threads > HTTP_SERVER_MAX_THREADS ? HTTP_SERVER_MAX_THREADS : (unsigned)threads;
+    }
+#if !defined(SO_REUSEPORT)
+    server->options.threads = 1;
+#endif
+    api->lua->pop(L, 1);
+
+    /* max_body_size */
+    if (api->lua->getfield(L, idx, "max_body_size") == AUTO_LUA_TNUMBER
+        && api->lua->tointeger(L, -1) > 0)
+    {
+        server->options.max_body_size = (uint64_t)api->lua->tointeger(L, -1);
+    }
+    api->lua->pop(L, 1);
+
+    /* max_connections */
+    if (api->lua->getfield(L, idx, "max_connections") == AUTO_LUA_TNUMBER
+        && api->lua->tointeger(L, -1) > 0)
+    {
+        server->options.max_connections = (unsigned)api->lua->tointeger(L, -1);
+    }
+    api->lua->pop(L, 1);
+
+    /* max_inflight_requests */
+    if (api->lua->getfield(L, idx, "max_inflight_requests") == AUTO_LUA_TNUMBER
+        && api->lua->tointeger(L, -1) > 0)
+    {
+        server->options.max_inflight = (unsigned)api->lua->tointeger(L, -1);
+    }
+    api->lua->pop(L, 1);
+
+    /* max_queue_delay_ms */
+    if (api->lua->getfield(L, idx, "max_queue_delay_ms") == AUTO_LUA_TNUMBER
+        && api->lua->tointeger(L, -1) > 0)
+    {
+        server->options.max_queue_delay = (uint64_t)api->lua->tointeger(L, -1) * 1000 * 1000;
+    }
+    api->lua->pop(L, 1);
+
+    /* idle_timeout_ms */
+    if (api->lua->getfield(L, idx, "idle_timeout_ms") == AUTO_LUA_TNUMBER
+        && api->lua->tointeger(L, -1) > 0)
+    {
+        server->options.idle_timeout = (uint64_t)api->lua->tointeger(L, -1);
+    }
+    api->lua->pop(L, 1);
+
+    /* header_timeout_ms */
+    if (api->lua->getfield(L, idx, "header_timeout_ms") == AUTO_LUA_TNUMBER
+        && api->lua->tointeger(L, -1) > 0)
+    {
+        server->options.header_timeout = (uint64_t)api->lua->tointeger(L, -1);
+    }
+    api->lua->pop(L, 1);
+
+    /* write_timeout_ms */
+    if (api->lua->getfield(L, idx, "write_timeout_ms") == AUTO_LUA_TNUMBER
+        && api->lua->tointeger(L, -1) > 0)
+    {
+        server->options.write_timeout = (uint64_t)api->lua->tointeger(L, -1);
+    }
+    api->lua->pop(L, 1);
+
+    /* batch_size */
+    server->options.batch_size = 32;
+    if (api->lua->getfield(L, idx, "batch_size") == AUTO_LUA_TNUMBER
+        && api->lua->tointeger(L, -1) > 0)
+    {
+        server->options.batch_size = (unsigned)api->lua->tointeger(L, -1);
+    }
+    api->lua->pop(L, 1);
+
+    /* batch_budget_us */
+    server->options.batch_budget = 2000 * 1000;
+    if (api->lua->getfield(L, idx, "batch_budget_us") == AUTO_LUA_TNUMBER
+        && api->lua->tointeger(L, -1) > 0)
+    {
+        server->options.batch_budget = (uint64_t)api->lua->tointeger(L, -1) * 1000;
+    }
+    api->lua->pop(L, 1);
+
+    /* static_cache: true, or a table of limits */
+    server->options.static_cache.max_bytes = 64 * 1024 * 1024;
+    server->options.static_cache.max_entries = 4096;
+    server->options.static_cache.max_file_size = 1024 * 1024;
+    switch (api->lua->getfield(L, idx, "static_cache"))
+    {
+    case AUTO_LUA_TBOOLEAN:
+        server->options.static_cache.enabled = api->lua->toboolean(L, -1);
+        break;
+
+    case AUTO_LUA_TTABLE:
+        server->options.static_cache.enabled = 1;
+        if (api->lua->getfield(L, -1, "max_bytes") == AUTO_LUA_TNUMBER && api->lua->tointeger(L, -1) > 0)
+        {
+            server->options.static_cache.max_bytes = (size_t)api->lua->tointeger(L, -1);
+        }
+        api->lua->pop(L, 1);
+        if (api->lua->getfield(L, -1, "max_entries") == AUTO_LUA_TNUMBER && api->lua->tointeger(L, -1) > 0)
+        {
+            server->options.static_cache.max_entries = (size_t)api->lua->tointeger(L, -1);
+        }
+        api->lua->pop(L, 1);
+        if (api->lua->getfield(L, -1, "max_file_size") == AUTO_LUA_TNUMBER && api->lua->tointeger(L, -1) >= 0)
+        {
+            server->options.static_cache.max_file_size = (size_t)api->lua->tointeger(L, -1);
+        }
+        api->lua->pop(L, 1);
+        break;
+
+    default:
+        break;
+    }
+    api->lua->pop(L, 1);
+
+    /* response_cache: a table of limits */
+    server->options.response_cache.max_bytes = 64 * 1024 * 1024;
+    if (api->lua->getfield(L, idx, "response_cache") == AUTO_LUA_TTABLE)
+    {
+        if (api->lua->getfield(L, -1, "max_bytes") == AUTO_LUA_TNUMBER && api->lua->tointeger(L, -1) > 0)
+        {
+            server->options.response_cache.max_bytes = (size_t)api->lua->tointeger(L, -1);
+        }
+        api->lua->pop(L, 1);
+    }
+    api->lua->pop(L, 1);
+
+    /* rate_limit: a table with rate, burst and max_clients */
+    server->options.rate_limit.max_clients = 65536;
+    if (api->lua->getfield(L, idx, "rate_limit") == AUTO_LUA_TTABLE)
+    {
+        _http_server_parse_rate_limit(L, api->lua->gettop(L), &server->options.rate_limit.rule);
+        if (api->lua->getfield(L, -1, "max_clients") == AUTO_LUA_TNUMBER && api->lua->tointeger(L, -1) > 0)
+        {
+            server->options.rate_limit.max_clients = (size_t)api->lua->tointeger(L, -1);
+        }
+        api->lua->pop(L, 1);
+    }
+    api->lua->pop(L, 1);
+
+    /* compress: true, or a table with min_size and mime_types */
+    server->options.compress.min_size = 1024;
+    switch (api->lua->getfield(L, idx, "compress"))
+    {
+    case AUTO_LUA_TBOOLEAN:
+        server->options.compress.enabled = api->lua->toboolean(L, -1);
+        break;
+
+    case AUTO_LUA_TTABLE:
+        server->options.compress.enabled = 1;
+        if (api->lua->getfield(L, -1, "min_size") == AUTO_LUA_TNUMBER && api->lua->tointeger(L, -1) >= 0)
+        {
+            server->options.compress.min_size = (size_t)api->lua->tointeger(L, -1);
+        }
+        api->lua->pop(L, 1);
+        if (api->lua->getfield(L, -1, "mime_types") == AUTO_LUA_TTABLE)
+        {
+            int64_t i, cnt = api->lua->L_len(L, -1);
+            server->options.compress.mime_types = malloc(sizeof(char*) * (cnt > 0 ? cnt : 1));
+            for (i = 1; i <= cnt; i++)
+            {
+                if (api->lua->geti(L, -1, i) == AUTO_LUA_TSTRING)
+                {
+                    size_t n = server->options.compress.mime_type_cnt++;
+                    server->options.compress.mime_types[n] = strdup(api->lua->tostring(L, -1));
+                }
+                api->lua->pop(L, 1);
+            }
+        }
+        api->lua->pop(L, 1);
+        break;
+
+    default:
+        break;
+    }
+    api->lua->pop(L, 1);
 }
 
 static int _http_server(struct lua_State* L)
 {
+    unsigned i;
     http_server_t* server = api->lua->newuserdatauv(L, sizeof(http_server_t), 0);
     memset(server, 0, sizeof(*server));
 
     _http_server_set_metatable(L);
     _http_server_parse_options(L, 1, server);
 
-    mg_mgr_init(&server->mgr);
+    server->reactor_cnt = server->options.threads;
+    server->reactors = calloc(server->reactor_cnt, sizeof(http_server_reactor_t));
+    server->metrics = http_metrics_create(api, server->reactor_cnt);
+    server->gauges = http_metrics_gauges(server->metrics);
+    atomic_init(&server->connections, 0);
+    server->fanout = calloc(server->reactor_cnt, sizeof(http_server_fanout_t));
+    for (i = 0; i < server->reactor_cnt; i++)
+    {
+        http_server_reactor_t* reactor = &server->reactors[i];
+        reactor->server = server;
+        mg_mgr_init(&reactor->mgr);
+        api->map->init(&reactor->conns, _http_server_cmp_conn, NULL);
+        http_wheel_init(&reactor->timers, (uint64_t)mg_millis(), HTTP_SERVER_TIMER_TICK);
+        api->list->init(&reactor->replies);
+        api->list->init(&reactor->ws_cmds);
+        reactor->reply_lock = api->sem->create(1);
+        http_arena_pool_init(&reactor->arenas, api->memory, HTTP_SERVER_ARENA_SIZE);
+        reactor->metrics = http_metrics_thread(server->metrics, i);
+        atomic_init(&reactor->epoch, 0);
+        atomic_init(&reactor->wakeup_pending, 0);
+        reactor->wakeup_fd = mg_mkpipe(&reactor->mgr, _http_server_on_wakeup, reactor, false);
+    }
+
     server->looping = 1;
     api->map->init(&server->routers, _http_server_cmp_route, NULL);
+    api->map->init(&server->websockets, _http_server_cmp_ws, NULL);
+    api->map->init(&server->topics, _http_server_cmp_topic, NULL);
+    api->map->init(&server->uploads, _http_server_cmp_upload, NULL);
+    http_server_table_t* table = calloc(1, sizeof(http_server_table_t));
+    table->router = http_router_create(api->regex);
+    atomic_init(&server->table, table);
+    atomic_init(&server->epoch, 1);
+    api->list->init(&server->retired_tables);
+    api->list->init(&server->retired_routes);
+    server->cache = http_cache_create(api, server->options.response_cache.max_bytes);
+    server->rate_limits = http_ratelimit_create(api, server->options.rate_limit.max_clients);
+    api->list->init(&server->requests);
+    mpsc_queue_init(&server->inbox);
+    atomic_init(&server->inbox_armed, 0);
+
+    if (server->options.serve_dir != NULL
+        && (server->options.static_cache.enabled || server->options.compress.enabled))
+    {
+        http_static_config_t cfg;
+        cfg.root_dir = server->options.serve_dir;
+        cfg.ssi_pattern = server->options.ssi_pattern;
+        cfg.max_bytes = server->options.static_cache.max_bytes;
+        cfg.max_entries = server->options.static_cache.max_entries;
+        cfg.max_file_size = server->options.static_cache.max_file_size;
+        cfg.compress = server->options.compress.enabled;
+        cfg.compress_min_size = server->options.compress.min_size;
+        cfg.compress_types = (const char**)server->options.compress.mime_types;
+        cfg.compress_type_cnt = server->options.compress.mime_type_cnt;
+        server->static_files = http_static_create(api, &cfg);
+    }
 
     server->async = api->async->create(api->lua->newthread(L));
     api->lua->pop(L, 1);
@@ -447,6 +5506,7 @@ AUTO_EXPORT int luaopen_mongoose(struct lua_State* L)
         { NULL,             NULL },
     };
     api->lua->L_newlib(L, s_http_method);
+    http_client_register(api, L);
 
     return 1;
 }
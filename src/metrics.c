@@ -0,0 +1,672 @@
+#include "metrics.h"
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * @brief Values below this many nanoseconds go to bucket 0.
+ */
+#define HTTP_METRICS_HIST_MIN_BITS  10
+
+struct http_metrics
+{
+    const auto_api_t*       api;
+
+    http_metrics_thread_t*  threads;    /**< One per poll thread. */
+    unsigned                thread_cnt;
+    http_metrics_gauges_t   gauges;
+
+    auto_sem_t*             lock;       /**< Lock for #http_metrics_t::routes */
+    auto_list_t             routes;     /**< #http_metrics_route_t */
+};
+
+/**
+ * @brief Histogram summed over threads, as plain numbers.
+ */
+typedef struct http_metrics_hist_snap
+{
+    uint64_t                buckets[HTTP_METRICS_HIST_BUCKETS];
+    uint64_t                count;
+    uint64_t                sum;
+} http_metrics_hist_snap_t;
+
+/**
+ * @brief Growing text buffer.
+ */
+typedef struct http_metrics_text
+{
+    const auto_api_t*       api;
+    char*                   buf;
+    size_t                  len;
+    size_t                  cap;
+} http_metrics_text_t;
+
+static const char* s_http_metrics_handler_name[HTTP_METRICS_HANDLER_MAX] = {
+    "route",
+    "static",
+    "dir",
+    "not_found",
+    "metrics",
+    "cache",
+    "proxy",
+    "not_allowed",
+};
+
+static const char* s_http_metrics_shed_name[HTTP_METRICS_SHED_MAX] = {
+    "connections",
+    "inflight",
+    "queue_delay",
+};
+
+static const char* s_http_metrics_limit_name[HTTP_METRICS_LIMIT_MAX] = {
+    "client",
+    "route",
+};
+
+static const char* s_http_metrics_timeout_name[HTTP_METRICS_TIMEOUT_MAX] = {
+    "idle",
+    "header",
+    "write",
+};
+
+static const char* s_http_metrics_upstream_name[HTTP_METRICS_UPSTREAM_MAX] = {
+    "connect",
+    "timeout",
+    "closed",
+};
+
+static unsigned _http_metrics_msb(uint64_t v)
+{
+#if defined(__GNUC__)
+    return 63 - (unsigned)__builtin_clzll(v);
+#else
+    unsigned n = 0;
+    while (v >>= 1)
+    {
+        n++;
+    }
+    return n;
+#endif
+}
+
+static unsigned _http_metrics_hist_index(uint64_t ns)
+{
+    if (ns < ((uint64_t)1 << HTTP_METRICS_HIST_MIN_BITS))
+    {
+        return 0;
+    }
+
+    /* Octave of the value, then its quarter within the octave. */
+    unsigned msb = _http_metrics_msb(ns);
+    unsigned idx = 1 + (msb - HTTP_METRICS_HIST_MIN_BITS) * 4 + (unsigned)((ns >> (msb - 2)) & 3);
+    return idx < HTTP_METRICS_HIST_BUCKETS - 1 ? idx : HTTP_METRICS_HIST_BUCKETS - 1;
+}
+
+/**
+ * @brief Exclusive upper bound of bucket \p idx in nanoseconds.
+ */
+static uint64_t _http_metrics_hist_bound(unsigned idx)
+{
+    if (idx == 0)
+    {
+        return (uint64_t)1 << HTTP_METRICS_HIST_MIN_BITS;
+    }
+
+    unsigned octave = (idx - 1) / 4, quarter = (idx - 1) % 4;
+    return (uint64_t)(5 + quarter) << (octave + HTTP_METRICS_HIST_MIN_BITS - 2);
+}
+
+void http_metrics_hist_record(http_metrics_hist_t* hist, uint64_t ns)
+{
+    http_metrics_add(&hist->buckets[_http_metrics_hist_index(ns)], 1);
+    http_metrics_add(&hist->sum, ns);
+}
+
+static void _http_metrics_hist_load(http_metrics_hist_snap_t* snap, http_metrics_hist_t* hist)
+{
+    size_t i;
+    for (i = 0; i < HTTP_METRICS_HIST_BUCKETS; i++)
+    {
+        uint64_t n = atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+        snap->buckets[i] += n;
+        snap->count += n;
+    }
+    snap->sum += atomic_load_explicit(&hist->sum, memory_order_relaxed);
+}
+
+/**
+ * @brief Upper bound of quantile \p q in nanoseconds, 0 if empty.
+ */
+static uint64_t _http_metrics_hist_quantile(const http_metrics_hist_snap_t* snap, double q)
+{
+    unsigned i;
+    uint64_t cum = 0, rank = (uint64_t)(q * (double)snap->count + 0.5);
+
+    if (snap->count == 0)
+    {
+        return 0;
+    }
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+
+    for (i = 0; i < HTTP_METRICS_HIST_BUCKETS - 1; i++)
+    {
+        if ((cum += snap->buckets[i]) >= rank)
+        {
+            return _http_metrics_hist_bound(i);
+        }
+    }
+    return _http_metrics_hist_bound(HTTP_METRICS_HIST_BUCKETS - 2);
+}
+
+void http_metrics_route_status(http_metrics_route_t* route, int status)
+{
+    size_t i;
+    for (i = 0; i < HTTP_METRICS_STATUS_SLOTS; i++)
+    {
+        int code = atomic_load_explicit(&route->status[i].code, memory_order_relaxed);
+        if (code == status)
+        {
+            http_metrics_add(&route->status[i].cnt, 1);
+            return;
+        }
+        if (code == 0)
+        {
+            /* Counter must be seen before the slot is. */
+            http_metrics_add(&route->status[i].cnt, 1);
+            atomic_store_explicit(&route->status[i].code, status, memory_order_release);
+            return;
+        }
+    }
+    http_metrics_add(&route->status_other, 1);
+}
+
+http_metrics_t* http_metrics_create(const auto_api_t* api, unsigned thread_cnt)
+{
+    http_metrics_t* self = api->memory->calloc(1, sizeof(http_metrics_t));
+    self->api = api;
+    self->threads = api->memory->calloc(thread_cnt, sizeof(http_metrics_thread_t));
+    self->thread_cnt = thread_cnt;
+    atomic_init(&self->gauges.inflight, 0);
+    atomic_init(&self->gauges.queue_depth, 0);
+    atomic_init(&self->gauges.queue_delay, 0);
+    self->lock = api->sem->create(1);
+    api->list->init(&self->routes);
+    return self;
+}
+
+void http_metrics_destroy(http_metrics_t* self)
+{
+    const auto_api_t* api = self->api;
+    auto_list_node_t* it;
+
+    while ((it = api->list->pop_front(&self->routes)) != NULL)
+    {
+        http_metrics_route_t* route = container_of(it, http_metrics_route_t, node);
+        api->memory->free(route->name);
+        api->memory->free(route);
+    }
+
+    api->sem->destroy(self->lock);
+    api->memory->free(self->threads);
+    api->memory->free(self);
+}
+
+http_metrics_thread_t* http_metrics_thread(http_metrics_t* self, unsigned idx)
+{
+    return &self->threads[idx];
+}
+
+http_metrics_gauges_t* http_metrics_gauges(http_metrics_t* self)
+{
+    return &self->gauges;
+}
+
+http_metrics_route_t* http_metrics_route(http_metrics_t* self, const char* name)
+{
+    const auto_api_t* api = self->api;
+    auto_list_node_t* it;
+    http_metrics_route_t* route = NULL;
+
+    api->sem->wait(self->lock);
+    for (it = api->list->begin(&self->routes); it != NULL; it = api->list->next(it))
+    {
+        http_metrics_route_t* tmp = container_of(it, http_metrics_route_t, node);
+        if (strcmp(tmp->name, name) == 0)
+        {
+            route = tmp;
+            break;
+        }
+    }
+    if (route == NULL)
+    {
+        size_t name_len = strlen(name);
+        route = api->memory->calloc(1, sizeof(http_metrics_route_t));
+        route->name = api->memory->malloc(name_len + 1);
+        memcpy(route->name, name, name_len + 1);
+        api->list->push_back(&self->routes, &route->node);
+    }
+    api->sem->post(self->lock);
+
+    return route;
+}
+
+static void _http_metrics_text_append(http_metrics_text_t* text, const char* data, size_t len)
+{
+    if (text->len + len + 1 > text->cap)
+    {
+        size_t cap = text->cap != 0 ? text->cap : 4096;
+        while (text->len + len + 1 > cap)
+        {
+            cap *= 2;
+        }
+        text->buf = text->api->memory->realloc(text->buf, cap);
+        text->cap = cap;
+    }
+    memcpy(text->buf + text->len, data, len);
+    text->len += len;
+    text->buf[text->len] = '\0';
+}
+
+static void _http_metrics_text_printf(http_metrics_text_t* text, const char* fmt, ...)
+{
+    char tmp[256];
+    va_list ap;
+
+    va_start(ap, fmt);
+    int len = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+    va_end(ap);
+
+    /* Only used for names and numbers, which always fit. */
+    if (len > 0)
+    {
+        _http_metrics_text_append(text, tmp, (size_t)len < sizeof(tmp) ? (size_t)len : sizeof(tmp) - 1);
+    }
+}
+
+/**
+ * @brief Append `name{` and, if \p route is not NULL, its escaped label.
+ * @return  Boolean, whether a label was written.
+ */
+static int _http_metrics_text_open(http_metrics_text_t* text, const char* name, const char* route)
+{
+    const char* p;
+
+    _http_metrics_text_printf(text, "%s{", name);
+    if (route == NULL)
+    {
+        return 0;
+    }
+
+    _http_metrics_text_append(text, "route=\"", 7);
+    for (p = route; *p != '\0'; p++)
+    {
+        switch (*p)
+        {
+        case '\\':  _http_metrics_text_append(text, "\\\\", 2); break;
+        case '"':   _http_metrics_text_append(text, "\\\"", 2); break;
+        case '\n':  _http_metrics_text_append(text, "\\n", 2);  break;
+        default:    _http_metrics_text_append(text, p, 1);      break;
+        }
+    }
+    _http_metrics_text_append(text, "\"", 1);
+    return 1;
+}
+
+static void _http_metrics_text_header(http_metrics_text_t* text, const char* name,
+    const char* type, const char* help)
+{
+    _http_metrics_text_printf(text, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * @brief Append histogram series, with one bucket per power of two.
+ */
+static void _http_metrics_text_hist(http_metrics_text_t* text, const char* name,
+    const char* route, const http_metrics_hist_snap_t* snap)
+{
+    unsigned i;
+    uint64_t cum = 0;
+    char series[128];
+
+    snprintf(series, sizeof(series), "%s_bucket", name);
+    for (i = 0; i < HTTP_METRICS_HIST_BUCKETS - 1; i++)
+    {
+        cum += snap->buckets[i];
+        if (i != 0 && (i - 1) % 4 != 3)
+        {
+            continue;
+        }
+        int labeled = _http_metrics_text_open(text, series, route);
+        _http_metrics_text_printf(text, "%sle=\"%.12g\"} %llu\n", labeled ? "," : "",
+            (double)_http_metrics_hist_bound(i) / 1e9, (unsigned long long)cum);
+    }
+    int labeled = _http_metrics_text_open(text, series, route);
+    _http_metrics_text_printf(text, "%sle=\"+Inf\"} %llu\n", labeled ? "," : "",
+        (unsigned long long)snap->count);
+
+    if (route == NULL)
+    {
+        _http_metrics_text_printf(text, "%s_sum %.9g\n", name, (double)snap->sum / 1e9);
+        _http_metrics_text_printf(text, "%s_count %llu\n", name, (unsigned long long)snap->count);
+        return;
+    }
+
+    snprintf(series, sizeof(series), "%s_sum", name);
+    _http_metrics_text_open(text, series, route);
+    _http_metrics_text_printf(text, "} %.9g\n", (double)snap->sum / 1e9);
+
+    snprintf(series, sizeof(series), "%s_count", name);
+    _http_metrics_text_open(text, series, route);
+    _http_metrics_text_printf(text, "} %llu\n", (unsigned long long)snap->count);
+}
+
+static uint64_t _http_metrics_load(http_metrics_counter_t* counter)
+{
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+/**
+ * @brief Sum thread metrics.
+ */
+static void _http_metrics_load_threads(http_metrics_t* self, uint64_t* accepted, uint64_t* closed,
+    uint64_t* requests, uint64_t* shed, uint64_t* timeouts, uint64_t* limited,
+    uint64_t* upstream, http_metrics_hist_snap_t* route_match, http_metrics_hist_snap_t* response)
+{
+    unsigned i, j;
+
+    *accepted = 0;
+    *closed = 0;
+    memset(requests, 0, sizeof(uint64_t) * HTTP_METRICS_HANDLER_MAX);
+    memset(shed, 0, sizeof(uint64_t) * HTTP_METRICS_SHED_MAX);
+    memset(timeouts, 0, sizeof(uint64_t) * HTTP_METRICS_TIMEOUT_MAX);
+    memset(limited, 0, sizeof(uint64_t) * HTTP_METRICS_LIMIT_MAX);
+    memset(upstream, 0, sizeof(uint64_t) * HTTP_METRICS_UPSTREAM_MAX);
+    memset(route_match, 0, sizeof(*route_match));
+    memset(response, 0, sizeof(*response));
+
+    for (i = 0; i < self->thread_cnt; i++)
+    {
+        http_metrics_thread_t* thread = &self->threads[i];
+        *accepted += _http_metrics_load(&thread->accepted);
+        *closed += _http_metrics_load(&thread->closed);
+        for (j = 0; j < HTTP_METRICS_HANDLER_MAX; j++)
+        {
+            requests[j] += _http_metrics_load(&thread->requests[j]);
+        }
+        for (j = 0; j < HTTP_METRICS_SHED_MAX; j++)
+        {
+            shed[j] += _http_metrics_load(&thread->shed[j]);
+        }
+        for (j = 0; j < HTTP_METRICS_TIMEOUT_MAX; j++)
+        {
+            timeouts[j] += _http_metrics_load(&thread->timeouts[j]);
+        }
+        for (j = 0; j < HTTP_METRICS_LIMIT_MAX; j++)
+        {
+            limited[j] += _http_metrics_load(&thread->limited[j]);
+        }
+        for (j = 0; j < HTTP_METRICS_UPSTREAM_MAX; j++)
+        {
+            upstream[j] += _http_metrics_load(&thread->upstream[j]);
+        }
+        _http_metrics_hist_load(route_match, &thread->route_match);
+        _http_metrics_hist_load(response, &thread->response);
+    }
+}
+
+char* http_metrics_prometheus(http_metrics_t* self, size_t* len)
+{
+    unsigned i;
+    auto_list_node_t* it;
+    uint64_t accepted, closed, requests[HTTP_METRICS_HANDLER_MAX], shed[HTTP_METRICS_SHED_MAX];
+    uint64_t timeouts[HTTP_METRICS_TIMEOUT_MAX], limited[HTTP_METRICS_LIMIT_MAX];
+    uint64_t upstream[HTTP_METRICS_UPSTREAM_MAX];
+    http_metrics_hist_snap_t snap, snap2;
+    http_metrics_text_t text = { self->api, NULL, 0, 0 };
+
+    _http_metrics_load_threads(self, &accepted, &closed, requests, shed, timeouts, limited, upstream, &snap, &snap2);
+
+    _http_metrics_text_header(&text, "http_connections_accepted_total", "counter", "Connections accepted.");
+    _http_metrics_text_printf(&text, "http_connections_accepted_total %llu\n", (unsigned long long)accepted);
+    _http_metrics_text_header(&text, "http_connections_open", "gauge", "Connections currently open.");
+    _http_metrics_text_printf(&text, "http_connections_open %llu\n",
+        (unsigned long long)(accepted >= closed ? accepted - closed : 0));
+    _http_metrics_text_header(&text, "http_connection_timeouts_total", "counter",
+        "Connections closed by a timeout, by timeout.");
+    for (i = 0; i < HTTP_METRICS_TIMEOUT_MAX; i++)
+    {
+        _http_metrics_text_printf(&text, "http_connection_timeouts_total{timeout=\"%s\"} %llu\n",
+            s_http_metrics_timeout_name[i], (unsigned long long)timeouts[i]);
+    }
+
+    _http_metrics_text_header(&text, "http_requests_total", "counter", "Requests parsed, by handler.");
+    for (i = 0; i < HTTP_METRICS_HANDLER_MAX; i++)
+    {
+        _http_metrics_text_printf(&text, "http_requests_total{handler=\"%s\"} %llu\n",
+            s_http_metrics_handler_name[i], (unsigned long long)requests[i]);
+    }
+
+    _http_metrics_text_header(&text, "http_shed_total", "counter", "Connections and requests answered 503, by reason.");
+    for (i = 0; i < HTTP_METRICS_SHED_MAX; i++)
+    {
+        _http_metrics_text_printf(&text, "http_shed_total{reason=\"%s\"} %llu\n",
+            s_http_metrics_shed_name[i], (unsigned long long)shed[i]);
+    }
+    _http_metrics_text_header(&text, "http_rate_limited_total", "counter", "Requests answered 429, by limit.");
+    for (i = 0; i < HTTP_METRICS_LIMIT_MAX; i++)
+    {
+        _http_metrics_text_printf(&text, "http_rate_limited_total{limit=\"%s\"} %llu\n",
+            s_http_metrics_limit_name[i], (unsigned long long)limited[i]);
+    }
+    _http_metrics_text_header(&text, "http_upstream_errors_total", "counter", "Proxied requests failed on upstream, by cause.");
+    for (i = 0; i < HTTP_METRICS_UPSTREAM_MAX; i++)
+    {
+        _http_metrics_text_printf(&text, "http_upstream_errors_total{cause=\"%s\"} %llu\n",
+            s_http_metrics_upstream_name[i], (unsigned long long)upstream[i]);
+    }
+    _http_metrics_text_header(&text, "http_requests_inflight", "gauge", "Routed requests not answered yet.");
+    _http_metrics_text_printf(&text, "http_requests_inflight %lld\n",
+        (long long)atomic_load(&self->gauges.inflight));
+    _http_metrics_text_header(&text, "http_queue_depth", "gauge", "Events waiting for lua.");
+    _http_metrics_text_printf(&text, "http_queue_depth %lld\n",
+        (long long)atomic_load(&self->gauges.queue_depth));
+    _http_metrics_text_header(&text, "http_queue_delay_seconds", "gauge",
+        "Time the last request picked up by lua had waited.");
+    _http_metrics_text_printf(&text, "http_queue_delay_seconds %g\n",
+        (double)atomic_load(&self->gauges.queue_delay) / 1e9);
+
+    _http_metrics_text_header(&text, "http_route_match_seconds", "histogram", "Time spent matching routes.");
+    _http_metrics_text_hist(&text, "http_route_match_seconds", NULL, &snap);
+    _http_metrics_text_header(&text, "http_response_seconds", "histogram",
+        "Routed request parsed to response handed to socket.");
+    _http_metrics_text_hist(&text, "http_response_seconds", NULL, &snap2);
+
+    self->api->sem->wait(self->lock);
+
+    _http_metrics_text_header(&text, "http_route_responses_total", "counter", "Route responses, by status code.");
+    for (it = self->api->list->begin(&self->routes); it != NULL; it = self->api->list->next(it))
+    {
+        http_metrics_route_t* route = container_of(it, http_metrics_route_t, node);
+        for (i = 0; i < HTTP_METRICS_STATUS_SLOTS; i++)
+        {
+            int code = atomic_load_explicit(&route->status[i].code, memory_order_acquire);
+            if (code == 0)
+            {
+                break;
+            }
+            _http_metrics_text_open(&text, "http_route_responses_total", route->name);
+            _http_metrics_text_printf(&text, ",code=\"%d\"} %llu\n", code,
+                (unsigned long long)_http_metrics_load(&route->status[i].cnt));
+        }
+        if (_http_metrics_load(&route->status_other) != 0)
+        {
+            _http_metrics_text_open(&text, "http_route_responses_total", route->name);
+            _http_metrics_text_printf(&text, ",code=\"other\"} %llu\n",
+                (unsigned long long)_http_metrics_load(&route->status_other));
+        }
+    }
+
+    _http_metrics_text_header(&text, "http_route_queue_seconds", "histogram",
+        "Request parsed to route callback called.");
+    for (it = self->api->list->begin(&self->routes); it != NULL; it = self->api->list->next(it))
+    {
+        http_metrics_route_t* route = container_of(it, http_metrics_route_t, node);
+        memset(&snap, 0, sizeof(snap));
+        _http_metrics_hist_load(&snap, &route->queue);
+        _http_metrics_text_hist(&text, "http_route_queue_seconds", route->name, &snap);
+    }
+
+    _http_metrics_text_header(&text, "http_route_handler_seconds", "histogram",
+        "Route callback called to response sent.");
+    for (it = self->api->list->begin(&self->routes); it != NULL; it = self->api->list->next(it))
+    {
+        http_metrics_route_t* route = container_of(it, http_metrics_route_t, node);
+        memset(&snap, 0, sizeof(snap));
+        _http_metrics_hist_load(&snap, &route->handler);
+        _http_metrics_text_hist(&text, "http_route_handler_seconds", route->name, &snap);
+    }
+
+    self->api->sem->post(self->lock);
+
+    *len = text.len;
+    return text.buf;
+}
+
+/**
+ * @brief Push `{ count, sum, p50, p90, p99, p999 }`, times in seconds.
+ */
+static void _http_metrics_push_hist(const auto_api_t* api, struct lua_State* L,
+    const http_metrics_hist_snap_t* snap)
+{
+    api->lua->newtable(L);
+    api->lua->pushinteger(L, (int64_t)snap->count);
+    api->lua->setfield(L, -2, "count");
+    api->lua->pushnumber(L, (double)snap->sum / 1e9);
+    api->lua->setfield(L, -2, "sum");
+    api->lua->pushnumber(L, (double)_http_metrics_hist_quantile(snap, 0.5) / 1e9);
+    api->lua->setfield(L, -2, "p50");
+    api->lua->pushnumber(L, (double)_http_metrics_hist_quantile(snap, 0.9) / 1e9);
+    api->lua->setfield(L, -2, "p90");
+    api->lua->pushnumber(L, (double)_http_metrics_hist_quantile(snap, 0.99) / 1e9);
+    api->lua->setfield(L, -2, "p99");
+    api->lua->pushnumber(L, (double)_http_metrics_hist_quantile(snap, 0.999) / 1e9);
+    api->lua->setfield(L, -2, "p999");
+}
+
+void http_metrics_push(http_metrics_t* self, struct lua_State* L)
+{
+    unsigned i;
+    auto_list_node_t* it;
+    const auto_api_t* api = self->api;
+    uint64_t accepted, closed, requests[HTTP_METRICS_HANDLER_MAX], shed[HTTP_METRICS_SHED_MAX];
+    uint64_t timeouts[HTTP_METRICS_TIMEOUT_MAX], limited[HTTP_METRICS_LIMIT_MAX];
+    uint64_t upstream[HTTP_METRICS_UPSTREAM_MAX];
+    http_metrics_hist_snap_t snap, snap2;
+
+    _http_metrics_load_threads(self, &accepted, &closed, requests, shed, timeouts, limited, upstream, &snap, &snap2);
+
+    api->lua->newtable(L);
+
+    api->lua->newtable(L);
+    api->lua->pushinteger(L, (int64_t)accepted);
+    api->lua->setfield(L, -2, "accepted");
+    api->lua->pushinteger(L, (int64_t)closed);
+    api->lua->setfield(L, -2, "closed");
+    api->lua->pushinteger(L, (int64_t)(accepted >= closed ? accepted - closed : 0));
+    api->lua->setfield(L, -2, "open");
+    api->lua->newtable(L);
+    for (i = 0; i < HTTP_METRICS_TIMEOUT_MAX; i++)
+    {
+        api->lua->pushinteger(L, (int64_t)timeouts[i]);
+        api->lua->setfield(L, -2, s_http_metrics_timeout_name[i]);
+    }
+    api->lua->setfield(L, -2, "timeouts");
+    api->lua->setfield(L, -2, "connections");
+
+    api->lua->newtable(L);
+    for (i = 0; i < HTTP_METRICS_HANDLER_MAX; i++)
+    {
+        api->lua->pushinteger(L, (int64_t)requests[i]);
+        api->lua->setfield(L, -2, s_http_metrics_handler_name[i]);
+    }
+    api->lua->setfield(L, -2, "requests");
+
+    api->lua->newtable(L);
+    api->lua->pushinteger(L, (int64_t)atomic_load(&self->gauges.inflight));
+    api->lua->setfield(L, -2, "inflight");
+    api->lua->pushinteger(L, (int64_t)atomic_load(&self->gauges.queue_depth));
+    api->lua->setfield(L, -2, "queue_depth");
+    api->lua->pushnumber(L, (double)atomic_load(&self->gauges.queue_delay) / 1e9);
+    api->lua->setfield(L, -2, "queue_delay");
+    api->lua->newtable(L);
+    for (i = 0; i < HTTP_METRICS_SHED_MAX; i++)
+    {
+        api->lua->pushinteger(L, (int64_t)shed[i]);
+        api->lua->setfield(L, -2, s_http_metrics_shed_name[i]);
+    }
+    api->lua->setfield(L, -2, "shed");
+    api->lua->newtable(L);
+    for (i = 0; i < HTTP_METRICS_LIMIT_MAX; i++)
+    {
+        api->lua->pushinteger(L, (int64_t)limited[i]);
+        api->lua->setfield(L, -2, s_http_metrics_limit_name[i]);
+    }
+    api->lua->setfield(L, -2, "rate_limited");
+    api->lua->newtable(L);
+    for (i = 0; i < HTTP_METRICS_UPSTREAM_MAX; i++)
+    {
+        api->lua->pushinteger(L, (int64_t)upstream[i]);
+        api->lua->setfield(L, -2, s_http_metrics_upstream_name[i]);
+    }
+    api->lua->setfield(L, -2, "upstream_errors");
+    api->lua->setfield(L, -2, "load");
+
+    _http_metrics_push_hist(api, L, &snap);
+    api->lua->setfield(L, -2, "route_match");
+    _http_metrics_push_hist(api, L, &snap2);
+    api->lua->setfield(L, -2, "response");
+
+    api->lua->newtable(L);
+    api->sem->wait(self->lock);
+    for (it = api->list->begin(&self->routes); it != NULL; it = api->list->next(it))
+    {
+        http_metrics_route_t* route = container_of(it, http_metrics_route_t, node);
+        api->lua->newtable(L);
+
+        api->lua->newtable(L);
+        for (i = 0; i < HTTP_METRICS_STATUS_SLOTS; i++)
+        {
+            int code = atomic_load_explicit(&route->status[i].code, memory_order_acquire);
+            if (code == 0)
+            {
+                break;
+            }
+            api->lua->pushinteger(L, (int64_t)_http_metrics_load(&route->status[i].cnt));
+            api->lua->seti(L, -2, code);
+        }
+        if (_http_metrics_load(&route->status_other) != 0)
+        {
+            api->lua->pushinteger(L, (int64_t)_http_metrics_load(&route->status_other));
+            api->lua->setfield(L, -2, "other");
+        }
+        api->lua->setfield(L, -2, "responses");
+
+        memset(&snap, 0, sizeof(snap));
+        _http_metrics_hist_load(&snap, &route->queue);
+        _http_metrics_push_hist(api, L, &snap);
+        api->lua->setfield(L, -2, "queue");
+
+        memset(&snap, 0, sizeof(snap));
+        _http_metrics_hist_load(&snap, &route->handler);
+        _http_metrics_push_hist(api, L, &snap);
+        api->lua->setfield(L, -2, "handler");
+
+        api->lua->setfield(L, -2, route->name);
+    }
+    api->sem->post(self->lock);
+    api->lua->setfield(L, -2, "routes");
+}
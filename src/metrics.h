@@ -0,0 +1,237 @@
+#ifndef __AUTO_MONGOOSE_METRICS_H__
+#define __AUTO_MONGOOSE_METRICS_H__
+
+#include <autodo.h>
+#include <stdatomic.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Number of histogram buckets.
+ *
+ * Bucket 0 takes everything below 1024 ns. Each power of two above that is
+ * split into 4 buckets, up to 2^37 ns (about 137 s). The last bucket takes
+ * everything beyond.
+ */
+#define HTTP_METRICS_HIST_BUCKETS   (1 + 27 * 4 + 1)
+
+/**
+ * @brief Number of distinct status codes counted per route.
+ */
+#define HTTP_METRICS_STATUS_SLOTS   16
+
+/**
+ * @brief Every counter and histogram has exactly one writer thread, so an
+ *   update is a relaxed load and store instead of a locked read-modify-write.
+ *   Readers may run on any thread.
+ */
+typedef atomic_uint_least64_t http_metrics_counter_t;
+
+/**
+ * @brief Log-linear latency histogram, in the manner of HDR histogram.
+ */
+typedef struct http_metrics_hist
+{
+    http_metrics_counter_t  buckets[HTTP_METRICS_HIST_BUCKETS];
+    http_metrics_counter_t  sum;        /**< Sum of recorded values in nanoseconds. */
+} http_metrics_hist_t;
+
+/**
+ * @brief Kind of handler that answered a request.
+ */
+typedef enum http_metrics_handler
+{
+    HTTP_METRICS_HANDLER_ROUTE,         /**< Lua route callback. */
+    HTTP_METRICS_HANDLER_STATIC,        /**< Static file cache. */
+    HTTP_METRICS_HANDLER_DIR,           /**< mg_http_serve_dir() */
+    HTTP_METRICS_HANDLER_NOT_FOUND,     /**< Nothing matched. */
+    HTTP_METRICS_HANDLER_METRICS,       /**< Metrics endpoint. */
+    HTTP_METRICS_HANDLER_CACHE,         /**< Response cache, or waited for a request filling it. */
+    HTTP_METRICS_HANDLER_PROXY,         /**< Relayed to an upstream. */
+    HTTP_METRICS_HANDLER_NOT_ALLOWED,   /**< Uri has routes, but not for this method. */
+    HTTP_METRICS_HANDLER_MAX,
+} http_metrics_handler_t;
+
+/**
+ * @brief Why a connection or request was turned away with 503.
+ */
+typedef enum http_metrics_shed
+{
+    HTTP_METRICS_SHED_CONNECTIONS,      /**< `max_connections` reached. */
+    HTTP_METRICS_SHED_INFLIGHT,         /**< `max_inflight_requests` reached. */
+    HTTP_METRICS_SHED_QUEUE_DELAY,      /**< `max_queue_delay_ms` exceeded. */
+    HTTP_METRICS_SHED_MAX,
+} http_metrics_shed_t;
+
+/**
+ * @brief Which rate limit answered a request with 429.
+ */
+typedef enum http_metrics_limit
+{
+    HTTP_METRICS_LIMIT_CLIENT,          /**< `rate_limit` of server, per client. */
+    HTTP_METRICS_LIMIT_ROUTE,           /**< `rate_limit` of route, per client. */
+    HTTP_METRICS_LIMIT_MAX,
+} http_metrics_limit_t;
+
+/**
+ * @brief Which timeout closed a connection.
+ */
+typedef enum http_metrics_timeout
+{
+    HTTP_METRICS_TIMEOUT_IDLE,          /**< `idle_timeout_ms` between requests. */
+    HTTP_METRICS_TIMEOUT_HEADER,        /**< `header_timeout_ms` to receive a request. */
+    HTTP_METRICS_TIMEOUT_WRITE,         /**< `write_timeout_ms` without write progress. */
+    HTTP_METRICS_TIMEOUT_MAX,
+} http_metrics_timeout_t;
+
+/**
+ * @brief Why a proxied request failed on its upstream.
+ */
+typedef enum http_metrics_upstream
+{
+    HTTP_METRICS_UPSTREAM_CONNECT,      /**< Upstream could not be reached. */
+    HTTP_METRICS_UPSTREAM_TIMEOUT,      /**< `timeout_ms` without progress. */
+    HTTP_METRICS_UPSTREAM_CLOSED,       /**< Upstream closed or sent garbage before response was complete. */
+    HTTP_METRICS_UPSTREAM_MAX,
+} http_metrics_upstream_t;
+
+/**
+ * @brief Metrics written by one poll thread.
+ */
+typedef struct http_metrics_thread
+{
+    http_metrics_counter_t  accepted;   /**< Connections accepted. */
+    http_metrics_counter_t  closed;     /**< Connections closed. */
+    http_metrics_counter_t  requests[HTTP_METRICS_HANDLER_MAX]; /**< Requests parsed, by handler. */
+    http_metrics_counter_t  shed[HTTP_METRICS_SHED_MAX];        /**< Answered 503 by poll thread, by reason. */
+    http_metrics_counter_t  timeouts[HTTP_METRICS_TIMEOUT_MAX]; /**< Connections timed out, by timeout. */
+    http_metrics_counter_t  limited[HTTP_METRICS_LIMIT_MAX];    /**< Answered 429 by poll thread, by limit. */
+    http_metrics_counter_t  upstream[HTTP_METRICS_UPSTREAM_MAX];/**< Proxy upstream failures, by cause. */
+    http_metrics_hist_t     route_match;/**< Time spent matching routes. */
+    http_metrics_hist_t     response;   /**< Routed request parsed to response handed to socket. */
+} http_metrics_thread_t;
+
+/**
+ * @brief Metrics of one route, written by lua.
+ */
+typedef struct http_metrics_route
+{
+    auto_list_node_t        node;       /**< Node for #http_metrics_t::routes */
+    char*                   name;       /**< Route string. */
+
+    struct
+    {
+        atomic_int              code;   /**< Status code, 0 if slot is free. */
+        http_metrics_counter_t  cnt;    /**< Responses with this code. */
+    } status[HTTP_METRICS_STATUS_SLOTS];
+    http_metrics_counter_t  status_other;   /**< Responses with a code that did not fit. */
+
+    http_metrics_hist_t     queue;      /**< Request parsed to route callback called. */
+    http_metrics_hist_t     handler;    /**< Route callback called to response sent. */
+} http_metrics_route_t;
+
+/**
+ * @brief Levels shared by every thread, updated with atomic read-modify-write.
+ */
+typedef struct http_metrics_gauges
+{
+    atomic_int_least64_t    inflight;   /**< Routed requests handed to lua and not answered yet. */
+    atomic_int_least64_t    queue_depth;/**< Events waiting for lua. */
+    atomic_uint_least64_t   queue_delay;/**< Nanoseconds the last request picked up by lua had waited, 0 once lua caught up. */
+} http_metrics_gauges_t;
+
+struct http_metrics;
+typedef struct http_metrics http_metrics_t;
+
+/**
+ * @brief Create metrics registry.
+ * @param[in] api           autodo API.
+ * @param[in] thread_cnt    Number of poll threads.
+ * @return                  Registry.
+ */
+http_metrics_t* http_metrics_create(const auto_api_t* api, unsigned thread_cnt);
+
+/**
+ * @brief Destroy registry.
+ * @warning No thread may write to it anymore.
+ * @param[in] self  Registry.
+ */
+void http_metrics_destroy(http_metrics_t* self);
+
+/**
+ * @brief Get metrics of poll thread \p idx.
+ * @param[in] self  Registry.
+ * @param[in] idx   Poll thread index.
+ * @return          Thread metrics, to be written by that thread only.
+ */
+http_metrics_thread_t* http_metrics_thread(http_metrics_t* self, unsigned idx);
+
+/**
+ * @brief Get gauges shared by every thread.
+ * @param[in] self  Registry.
+ * @return          Gauges.
+ */
+http_metrics_gauges_t* http_metrics_gauges(http_metrics_t* self);
+
+/**
+ * @brief Get metrics of route \p name, creating them if needed.
+ *
+ * Route metrics live as long as the registry, so a route added again keeps
+ * counting where it left off.
+ *
+ * @note MT-Safe
+ * @param[in] self  Registry.
+ * @param[in] name  Route string. It is copied.
+ * @return          Route metrics, to be written by lua only.
+ */
+http_metrics_route_t* http_metrics_route(http_metrics_t* self, const char* name);
+
+/**
+ * @brief Add \p n to \p counter.
+ * @warning Only the owner thread of \p counter may call this.
+ */
+static inline void http_metrics_add(http_metrics_counter_t* counter, uint64_t n)
+{
+    atomic_store_explicit(counter,
+        atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/**
+ * @brief Record \p ns in \p hist.
+ * @warning Only the owner thread of \p hist may call this.
+ * @param[in] hist  Histogram.
+ * @param[in] ns    Value in nanoseconds.
+ */
+void http_metrics_hist_record(http_metrics_hist_t* hist, uint64_t ns);
+
+/**
+ * @brief Count a response with \p status on \p route.
+ * @warning Only lua may call this.
+ * @param[in] route     Route metrics.
+ * @param[in] status    Status code.
+ */
+void http_metrics_route_status(http_metrics_route_t* route, int status);
+
+/**
+ * @brief Render all metrics in Prometheus text exposition format.
+ * @note MT-Safe
+ * @param[in] self  Registry.
+ * @param[out] len  Text length.
+ * @return          Text, release with `api->memory->free()`.
+ */
+char* http_metrics_prometheus(http_metrics_t* self, size_t* len);
+
+/**
+ * @brief Push all metrics onto lua stack as a table.
+ * @note MT-Safe
+ * @param[in] self  Registry.
+ * @param[in] L     Lua VM.
+ */
+void http_metrics_push(http_metrics_t* self, struct lua_State* L);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
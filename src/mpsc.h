@@ -0,0 +1,109 @@
+#ifndef __AUTO_MONGOOSE_MPSC_H__
+#define __AUTO_MONGOOSE_MPSC_H__
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Intrusive node of #mpsc_queue_t.
+ */
+typedef struct mpsc_node
+{
+    _Atomic(struct mpsc_node*)  next;
+} mpsc_node_t;
+
+/**
+ * @brief Lock-free multi-producer single-consumer queue.
+ *
+ * Producers only do one atomic exchange per push. See Dmitry Vyukov's
+ * intrusive MPSC node-based queue.
+ */
+typedef struct mpsc_queue
+{
+    _Atomic(mpsc_node_t*)       head;       /**< Last pushed node. Touched by producers. */
+    mpsc_node_t*                tail;       /**< Next node to pop. Touched by consumer. */
+    mpsc_node_t                 stub;       /**< Placeholder so the queue is never empty. */
+} mpsc_queue_t;
+
+/**
+ * @brief Initialize queue.
+ * @warning MT-UnSafe
+ * @param[out] self Queue.
+ */
+static inline void mpsc_queue_init(mpsc_queue_t* self)
+{
+    atomic_init(&self->stub.next, NULL);
+    atomic_init(&self->head, &self->stub);
+    self->tail = &self->stub;
+}
+
+/**
+ * @brief Push \p node into queue.
+ * @note MT-Safe
+ * @param[in] self  Queue.
+ * @param[in] node  Node.
+ */
+static inline void mpsc_queue_push(mpsc_queue_t* self, mpsc_node_t* node)
+{
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    mpsc_node_t* prev = atomic_exchange_explicit(&self->head, node, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+/**
+ * @brief Pop a node from queue.
+ *
+ * It may return NULL while a producer is in the middle of push. The producer
+ * is expected to wake up consumer after push, so nothing is lost.
+ *
+ * @warning Only one consumer is allowed.
+ * @param[in] self  Queue.
+ * @return          Node, or NULL if queue is empty.
+ */
+static inline mpsc_node_t* mpsc_queue_pop(mpsc_queue_t* self)
+{
+    mpsc_node_t* tail = self->tail;
+    mpsc_node_t* next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &self->stub)
+    {
+        if (next == NULL)
+        {
+            return NULL;
+        }
+        self->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+
+    if (next != NULL)
+    {
+        self->tail = next;
+        return tail;
+    }
+
+    if (tail != atomic_load_explicit(&self->head, memory_order_acquire))
+    {
+        return NULL;
+    }
+
+    mpsc_queue_push(self, &self->stub);
+
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next != NULL)
+    {
+        self->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif
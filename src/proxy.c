@@ -0,0 +1,222 @@
+#include "proxy.h"
+#include <mongoose.h>
+#include <stdint.h>
+#include <string.h>
+
+http_proxy_t* http_proxy_create(const auto_api_t* api, const char** urls, size_t cnt,
+    const http_proxy_config_t* config, unsigned thread_cnt)
+{
+    size_t i, j;
+    http_proxy_t* self = api->memory->calloc(1, sizeof(http_proxy_t) + sizeof(http_proxy_upstream_t) * cnt);
+
+    atomic_init(&self->refcnt, 1);
+    self->api = api;
+    self->config = *config;
+    atomic_init(&self->next, 0);
+    self->upstream_cnt = cnt;
+
+    for (i = 0; i < cnt; i++)
+    {
+        http_proxy_upstream_t* up = &self->upstreams[i];
+        size_t len = strlen(urls[i]) + 1;
+        up->url = api->memory->malloc(len);
+        memcpy(up->url, urls[i], len);
+        atomic_init(&up->active, 0);
+        atomic_init(&up->fails, 0);
+        atomic_init(&up->down_until, 0);
+        up->idle = api->memory->calloc(thread_cnt, sizeof(auto_list_t));
+        for (j = 0; j < thread_cnt; j++)
+        {
+            api->list->init(&up->idle[j]);
+        }
+    }
+
+    return self;
+}
+
+void http_proxy_ref(http_proxy_t* self)
+{
+    atomic_fetch_add_explicit(&self->refcnt, 1, memory_order_relaxed);
+}
+
+void http_proxy_release(http_proxy_t* self)
+{
+    size_t i;
+    if (atomic_fetch_sub_explicit(&self->refcnt, 1, memory_order_acq_rel) != 1)
+    {
+        return;
+    }
+
+    for (i = 0; i < self->upstream_cnt; i++)
+    {
+        self->api->memory->free(self->upstreams[i].url);
+        self->api->memory->free(self->upstreams[i].idle);
+    }
+    self->api->memory->free(self);
+}
+
+http_proxy_upstream_t* http_proxy_pick(http_proxy_t* self, const http_proxy_upstream_t* exclude, uint64_t now)
+{
+    size_t i;
+    http_proxy_upstream_t* best = NULL;
+    http_proxy_upstream_t* soonest = NULL;
+    unsigned start = atomic_fetch_add_explicit(&self->next, 1, memory_order_relaxed);
+
+    for (i = 0; i < self->upstream_cnt; i++)
+    {
+        http_proxy_upstream_t* up = &self->upstreams[(start + i) % self->upstream_cnt];
+        if (up == exclude && self->upstream_cnt > 1)
+        {
+            continue;
+        }
+
+        if (atomic_load_explicit(&up->down_until, memory_order_relaxed) > now)
+        {
+            if (soonest == NULL || atomic_load_explicit(&up->down_until, memory_order_relaxed)
+                < atomic_load_explicit(&soonest->down_until, memory_order_relaxed))
+            {
+                soonest = up;
+            }
+            continue;
+        }
+
+        if (self->config.policy == HTTP_PROXY_ROUND_ROBIN)
+        {
+            return up;
+        }
+        /* Starting point rotates, so ties spread evenly. */
+        if (best == NULL || atomic_load_explicit(&up->active, memory_order_relaxed)
+            < atomic_load_explicit(&best->active, memory_order_relaxed))
+        {
+            best = up;
+        }
+    }
+
+    return best != NULL ? best : soonest;
+}
+
+void http_proxy_failed(http_proxy_t* self, http_proxy_upstream_t* upstream, uint64_t now)
+{
+    unsigned fails = atomic_fetch_add_explicit(&upstream->fails, 1, memory_order_relaxed) + 1;
+    if (self->config.max_fails != 0 && fails >= self->config.max_fails)
+    {
+        atomic_store_explicit(&upstream->down_until, now + self->config.fail_timeout, memory_order_relaxed);
+        atomic_store_explicit(&upstream->fails, 0, memory_order_relaxed);
+    }
+}
+
+void http_proxy_succeeded(http_proxy_upstream_t* upstream)
+{
+    /* Avoid writing a line every request shares. */
+    if (atomic_load_explicit(&upstream->fails, memory_order_relaxed) != 0)
+    {
+        atomic_store_explicit(&upstream->fails, 0, memory_order_relaxed);
+    }
+}
+
+void http_proxy_frame_init(http_proxy_frame_t* frame, int head_only)
+{
+    memset(frame, 0, sizeof(*frame));
+    frame->state = HTTP_PROXY_FRAME_HEAD;
+    frame->head_only = head_only;
+}
+
+/**
+ * @brief Set up body framing from response head \p hm.
+ */
+static void _http_proxy_frame_head(http_proxy_frame_t* frame, struct mg_http_message* hm)
+{
+    struct mg_str* connection = mg_http_get_header(hm, "Connection");
+    struct mg_str* te = mg_http_get_header(hm, "Transfer-Encoding");
+    struct mg_str* cl = mg_http_get_header(hm, "Content-Length");
+
+    frame->keep_alive = mg_vcmp(&hm->proto, "HTTP/1.0") == 0 ?
+        connection != NULL && mg_vcasecmp(connection, "keep-alive") == 0 :
+        connection == NULL || mg_vcasecmp(connection, "close") != 0;
+
+    if (frame->head_only || frame->status == 204 || frame->status == 304)
+    {
+        frame->state = HTTP_PROXY_FRAME_DONE;
+    }
+    else if (te != NULL && mg_vcasecmp(te, "chunked") == 0)
+    {
+        http_upload_init(&frame->body, NULL, 1, 0);
+        frame->state = HTTP_PROXY_FRAME_BODY;
+    }
+    else if (cl != NULL)
+    {
+        uint64_t length = 0;
+        size_t i;
+        for (i = 0; i < cl->len && cl->ptr[i] >= '0' && cl->ptr[i] <= '9'; i++)
+        {
+            length = length * 10 + (uint64_t)(cl->ptr[i] - '0');
+        }
+        http_upload_init(&frame->body, NULL, 0, length);
+        frame->state = length != 0 ? HTTP_PROXY_FRAME_BODY : HTTP_PROXY_FRAME_DONE;
+    }
+    else
+    {
+        frame->keep_alive = 0;
+        frame->state = HTTP_PROXY_FRAME_CLOSE;
+    }
+}
+
+int http_proxy_frame_feed(http_proxy_frame_t* frame, const char* buf, size_t len, size_t* take)
+{
+    int n, rc;
+    size_t off = 0, consumed;
+    struct mg_str data;
+    struct mg_http_message hm;
+
+    while (off < len && frame->state != HTTP_PROXY_FRAME_DONE)
+    {
+        switch (frame->state)
+        {
+        case HTTP_PROXY_FRAME_HEAD:
+            if ((n = mg_http_parse(buf + off, len - off, &hm)) < 0)
+            {
+                return -1;
+            }
+            if (n == 0)
+            {
+                goto finish;
+            }
+            off += (size_t)n;
+
+            /* Interim responses are relayed, the final one follows. */
+            frame->status = mg_http_status(&hm);
+            if (frame->status >= 100 && frame->status < 200)
+            {
+                frame->status = 0;
+                break;
+            }
+            _http_proxy_frame_head(frame, &hm);
+            break;
+
+        case HTTP_PROXY_FRAME_BODY:
+            rc = http_upload_decode(&frame->body, buf + off, len - off, SIZE_MAX, &consumed, &data);
+            if (rc == HTTP_UPLOAD_ERROR)
+            {
+                return -1;
+            }
+            off += consumed;
+            if (rc == HTTP_UPLOAD_DONE)
+            {
+                frame->state = HTTP_PROXY_FRAME_DONE;
+            }
+            else if (consumed == 0)
+            {
+                goto finish;
+            }
+            break;
+
+        default:
+            off = len;
+            break;
+        }
+    }
+
+finish:
+    *take = off;
+    return frame->state == HTTP_PROXY_FRAME_DONE;
+}
@@ -0,0 +1,159 @@
+#ifndef __AUTO_MONGOOSE_PROXY_H__
+#define __AUTO_MONGOOSE_PROXY_H__
+
+#include <autodo.h>
+#include <stdatomic.h>
+#include "upload.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief How a proxy spreads requests over its upstreams.
+ */
+typedef enum http_proxy_policy
+{
+    HTTP_PROXY_ROUND_ROBIN,         /**< Each upstream in turn. */
+    HTTP_PROXY_LEAST_CONN,          /**< Upstream with fewest requests in flight. */
+} http_proxy_policy_t;
+
+/**
+ * @brief Proxy settings.
+ */
+typedef struct http_proxy_config
+{
+    int                         policy;         /**< #http_proxy_policy_t */
+    unsigned                    retries;        /**< Extra attempts on another upstream if one cannot be reached. */
+    unsigned                    max_fails;      /**< Failures in a row that take an upstream out. */
+    uint64_t                    fail_timeout;   /**< Milliseconds an upstream stays out. */
+    uint64_t                    timeout;        /**< Milliseconds an upstream may make no progress. */
+    uint64_t                    idle_timeout;   /**< Milliseconds an idle upstream connection is kept. */
+    size_t                      max_idle;       /**< Max idle connections per upstream and poll thread. */
+} http_proxy_config_t;
+
+/**
+ * @brief One upstream of a proxy.
+ */
+typedef struct http_proxy_upstream
+{
+    char*                       url;            /**< Where to connect. */
+    atomic_int                  active;         /**< Requests in flight on all poll threads. */
+    atomic_uint                 fails;          /**< Failures since last success. */
+    atomic_ullong               down_until;     /**< Skipped until this mg_millis(). */
+    auto_list_t*                idle;           /**< Idle connections, one list per poll thread. */
+} http_proxy_upstream_t;
+
+/**
+ * @brief Upstreams of a proxy route.
+ *
+ * Shared by the route and every connection to its upstreams, freed when all
+ * of them are done with it.
+ */
+typedef struct http_proxy
+{
+    atomic_int                  refcnt;
+    const auto_api_t*           api;
+    http_proxy_config_t         config;
+    atomic_uint                 next;           /**< Where the next pick starts. */
+    size_t                      upstream_cnt;
+    http_proxy_upstream_t       upstreams[];
+} http_proxy_t;
+
+/**
+ * @brief Where a response is in http_proxy_frame_feed().
+ */
+typedef enum http_proxy_frame_state
+{
+    HTTP_PROXY_FRAME_HEAD,          /**< Waiting for status line and headers. */
+    HTTP_PROXY_FRAME_BODY,          /**< Body with known framing. */
+    HTTP_PROXY_FRAME_CLOSE,         /**< Body ends with the connection. */
+    HTTP_PROXY_FRAME_DONE,          /**< Response is complete. */
+} http_proxy_frame_state_t;
+
+/**
+ * @brief Finds where a relayed response ends, without copying it.
+ */
+typedef struct http_proxy_frame
+{
+    int                         state;          /**< #http_proxy_frame_state_t */
+    int                         head_only;      /**< Request was HEAD, so no body follows. */
+    int                         keep_alive;     /**< Connection may carry another request after. */
+    int                         status;         /**< Final status, 0 until head is complete. */
+    http_upload_t               body;           /**< Decoder of body framing. */
+} http_proxy_frame_t;
+
+/**
+ * @brief Create proxy with one reference.
+ * @param[in] api           autodo API.
+ * @param[in] urls          Upstream URLs.
+ * @param[in] cnt           Number of \p urls, at least one.
+ * @param[in] config        Settings.
+ * @param[in] thread_cnt    Number of poll threads.
+ * @return                  Proxy.
+ */
+http_proxy_t* http_proxy_create(const auto_api_t* api, const char** urls, size_t cnt,
+    const http_proxy_config_t* config, unsigned thread_cnt);
+
+/**
+ * @brief Add a reference.
+ * @note MT-Safe
+ */
+void http_proxy_ref(http_proxy_t* self);
+
+/**
+ * @brief Drop a reference.
+ * @note MT-Safe
+ * @warning Idle lists must be empty when the last reference goes.
+ */
+void http_proxy_release(http_proxy_t* self);
+
+/**
+ * @brief Pick upstream for next request.
+ *
+ * Upstreams taken out by http_proxy_failed() are skipped. If all are out, the
+ * one back soonest is used anyway.
+ *
+ * @note MT-Safe
+ * @param[in] self      Proxy.
+ * @param[in] exclude   Upstream that just failed this request, or NULL.
+ * @param[in] now       mg_millis()
+ * @return              Upstream.
+ */
+http_proxy_upstream_t* http_proxy_pick(http_proxy_t* self, const http_proxy_upstream_t* exclude, uint64_t now);
+
+/**
+ * @brief Account a failure of \p upstream, taking it out after
+ *   http_proxy_config_t::max_fails in a row.
+ * @note MT-Safe
+ */
+void http_proxy_failed(http_proxy_t* self, http_proxy_upstream_t* upstream, uint64_t now);
+
+/**
+ * @brief Account a success of \p upstream.
+ * @note MT-Safe
+ */
+void http_proxy_succeeded(http_proxy_upstream_t* upstream);
+
+/**
+ * @brief Prepare to follow a response.
+ * @param[out] frame    Frame.
+ * @param[in] head_only Request was HEAD.
+ */
+void http_proxy_frame_init(http_proxy_frame_t* frame, int head_only);
+
+/**
+ * @brief Find how much of \p buf belongs to the response.
+ * @param[in] frame     Frame.
+ * @param[in] buf       Bytes received from upstream.
+ * @param[in] len       Length of \p buf.
+ * @param[out] take     Bytes of \p buf that belong to the response.
+ * @return              1 if response ends with them, 0 if more follows, -1
+ *   if response is malformed.
+ */
+int http_proxy_frame_feed(http_proxy_frame_t* frame, const char* buf, size_t len, size_t* take);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,184 @@
+#include "ratelimit.h"
+#include <string.h>
+
+/**
+ * @brief Number of shards, each with its own lock.
+ */
+#define HTTP_RATELIMIT_SHARDS   16
+
+/**
+ * @brief Slots looked at for a key before one is reused.
+ */
+#define HTTP_RATELIMIT_PROBE    8
+
+typedef struct http_ratelimit_slot
+{
+    uint64_t            hash;       /**< Hash of key. */
+    const void*         scope;      /**< Scope of key. */
+    uint8_t             addr[16];   /**< Address of key. */
+    uint64_t            stamp;      /**< Last refill in nanoseconds, 0 if slot is empty. */
+    uint64_t            full_at;    /**< When bucket is full again in nanoseconds. */
+    double              tokens;     /**< Tokens at #http_ratelimit_slot_t::stamp */
+} http_ratelimit_slot_t;
+
+typedef struct http_ratelimit_shard
+{
+    auto_sem_t*             lock;   /**< Lock for #http_ratelimit_shard_t::slots */
+    http_ratelimit_slot_t*  slots;  /**< Table, NULL until first use. */
+} http_ratelimit_shard_t;
+
+struct http_ratelimit
+{
+    const auto_api_t*       api;
+    size_t                  mask;   /**< Slots per shard minus one. */
+    http_ratelimit_shard_t  shards[HTTP_RATELIMIT_SHARDS];
+};
+
+/**
+ * @brief FNV-1a over address and scope.
+ */
+static uint64_t _http_ratelimit_hash(const uint8_t addr[16], const void* scope)
+{
+    size_t i;
+    uintptr_t s = (uintptr_t)scope;
+    uint64_t h = 14695981039346656037ULL;
+    for (i = 0; i < 16; i++)
+    {
+        h ^= addr[i];
+        h *= 1099511628211ULL;
+    }
+    for (i = 0; i < sizeof(s); i++)
+    {
+        h ^= (s >> (i * 8)) & 0xff;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+http_ratelimit_t* http_ratelimit_create(const auto_api_t* api, size_t capacity)
+{
+    size_t i, per_shard = 1;
+    http_ratelimit_t* self = api->memory->calloc(1, sizeof(http_ratelimit_t));
+
+    while (per_shard * HTTP_RATELIMIT_SHARDS < capacity || per_shard < HTTP_RATELIMIT_PROBE)
+    {
+        per_shard <<= 1;
+    }
+
+    self->api = api;
+    self->mask = per_shard - 1;
+    for (i = 0; i < HTTP_RATELIMIT_SHARDS; i++)
+    {
+        self->shards[i].lock = api->sem->create(1);
+    }
+
+    return self;
+}
+
+void http_ratelimit_destroy(http_ratelimit_t* self)
+{
+    size_t i;
+    const auto_api_t* api = self->api;
+
+    for (i = 0; i < HTTP_RATELIMIT_SHARDS; i++)
+    {
+        if (self->shards[i].slots != NULL)
+        {
+            api->memory->free(self->shards[i].slots);
+        }
+        api->sem->destroy(self->shards[i].lock);
+    }
+
+    api->memory->free(self);
+}
+
+/**
+ * @brief Find slot of key in \p shard, or a slot to put it in.
+ * @warning Must hold #http_ratelimit_shard_t::lock
+ * @param[out] found    Non-zero if slot holds key.
+ */
+static http_ratelimit_slot_t* _http_ratelimit_probe(http_ratelimit_t* self, http_ratelimit_shard_t* shard,
+    uint64_t hash, const uint8_t addr[16], const void* scope, uint64_t now, int* found)
+{
+    size_t i;
+    http_ratelimit_slot_t* victim = NULL;
+
+    *found = 0;
+    for (i = 0; i < HTTP_RATELIMIT_PROBE; i++)
+    {
+        http_ratelimit_slot_t* slot = &shard->slots[((hash >> 4) + i) & self->mask];
+
+        /* Slots are reused but never emptied, so the key is not further. */
+        if (slot->stamp == 0)
+        {
+            return victim != NULL && victim->full_at <= now ? victim : slot;
+        }
+        if (slot->hash == hash && slot->scope == scope && memcmp(slot->addr, addr, 16) == 0)
+        {
+            *found = 1;
+            return slot;
+        }
+
+        /* A full bucket behaves like a new one, so forgetting it is free. */
+        if (victim == NULL || (victim->full_at > now
+            && (slot->full_at <= now || slot->stamp < victim->stamp)))
+        {
+            victim = slot;
+        }
+    }
+
+    return victim;
+}
+
+uint64_t http_ratelimit_take(http_ratelimit_t* self, const uint8_t addr[16], const void* scope,
+    const http_ratelimit_rule_t* rule, uint64_t now)
+{
+    int found;
+    uint64_t wait = 0;
+    uint64_t hash = _http_ratelimit_hash(addr, scope);
+    http_ratelimit_shard_t* shard = &self->shards[hash % HTTP_RATELIMIT_SHARDS];
+    const auto_api_t* api = self->api;
+
+    /* Zero stamp marks an empty slot. */
+    if (now == 0)
+    {
+        now = 1;
+    }
+
+    api->sem->wait(shard->lock);
+    if (shard->slots == NULL)
+    {
+        shard->slots = api->memory->calloc(self->mask + 1, sizeof(http_ratelimit_slot_t));
+    }
+
+    http_ratelimit_slot_t* slot = _http_ratelimit_probe(self, shard, hash, addr, scope, now, &found);
+    if (!found)
+    {
+        slot->hash = hash;
+        slot->scope = scope;
+        memcpy(slot->addr, addr, 16);
+        slot->tokens = rule->burst;
+    }
+    else if (now > slot->stamp)
+    {
+        slot->tokens += (double)(now - slot->stamp) * rule->rate / 1e9;
+        if (slot->tokens > rule->burst)
+        {
+            slot->tokens = rule->burst;
+        }
+    }
+    slot->stamp = now;
+
+    if (slot->tokens >= 1)
+    {
+        slot->tokens -= 1;
+    }
+    else
+    {
+        wait = (uint64_t)((1 - slot->tokens) * 1e9 / rule->rate) + 1;
+    }
+    slot->full_at = now + (uint64_t)((rule->burst - slot->tokens) * 1e9 / rule->rate);
+    api->sem->post(shard->lock);
+
+    return wait;
+}
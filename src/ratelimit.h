@@ -0,0 +1,59 @@
+#ifndef __AUTO_MONGOOSE_RATELIMIT_H__
+#define __AUTO_MONGOOSE_RATELIMIT_H__
+
+#include <autodo.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Token bucket settings.
+ */
+typedef struct http_ratelimit_rule
+{
+    double                      rate;       /**< Tokens refilled per second, 0 if no limit. */
+    double                      burst;      /**< Bucket size. */
+} http_ratelimit_rule_t;
+
+struct http_ratelimit;
+typedef struct http_ratelimit http_ratelimit_t;
+
+/**
+ * @brief Create a table of token buckets.
+ *
+ * Buckets live in open addressing hash tables, spread over shards with a lock
+ * each. Memory of a shard is only taken on its first use. When a probe finds
+ * no room, a bucket that refilled completely is reused, else the one least
+ * recently touched.
+ *
+ * @param[in] api       autodo API.
+ * @param[in] capacity  Max number of buckets, rounded up to a power of two.
+ * @return              Table.
+ */
+http_ratelimit_t* http_ratelimit_create(const auto_api_t* api, size_t capacity);
+
+/**
+ * @brief Destroy table.
+ * @param[in] self      Table.
+ */
+void http_ratelimit_destroy(http_ratelimit_t* self);
+
+/**
+ * @brief Take a token from bucket of \p addr in \p scope.
+ * @note MT-Safe
+ * @param[in] self      Table.
+ * @param[in] addr      Client address, IPv4 as IPv4-mapped IPv6.
+ * @param[in] scope     What the bucket limits, e.g. a route. NULL for whole server.
+ * @param[in] rule      Bucket settings, with non-zero rate.
+ * @param[in] now       Current time in nanoseconds.
+ * @return              0 if a token was taken, else nanoseconds until one is available.
+ */
+uint64_t http_ratelimit_take(http_ratelimit_t* self, const uint8_t addr[16], const void* scope,
+    const http_ratelimit_rule_t* rule, uint64_t now);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,936 @@
+#define _GNU_SOURCE
+#include "router.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @brief Get array size.
+ * @param[in] x The array
+ * @return      The size.
+ */
+#define ARRAY_SIZE(x)   (sizeof(x) / sizeof(x[0]))
+
+typedef struct http_router_node http_router_node_t;
+
+/**
+ * @brief Routes of one path, by method.
+ */
+typedef struct http_router_slots
+{
+    void*                   data[HTTP_ROUTER_METHOD__MAX];      /**< User data by #http_router_method_t */
+    int                     priority[HTTP_ROUTER_METHOD__MAX];  /**< Priority by #http_router_method_t */
+    unsigned                methods;        /**< Bit per method with a route. */
+} http_router_slots_t;
+
+/**
+ * @brief Radix trie node.
+ *
+ * A node matches \p prefix literally, then either ends a route, continues
+ * with a literal child selected by the next byte, or continues with one of
+ * the placeholder children.
+ */
+struct http_router_node
+{
+    char*                   prefix;         /**< Literal bytes of this edge. */
+    size_t                  prefix_len;     /**< Literal length in bytes. */
+
+    http_router_node_t**    children;       /**< Literal children, sorted by first byte. */
+    size_t                  child_cnt;      /**< Number of literal children. */
+
+    http_router_node_t*     params[HTTP_ROUTER_PARAM__MAX]; /**< Placeholder children. */
+
+    http_router_slots_t     slots;          /**< Routes that end here. */
+};
+
+typedef struct http_router_regex
+{
+    char*                   route;          /**< Route string. */
+    int                     priority;       /**< Priority of all routes in \p slots. */
+    auto_regex_code_t*      code;           /**< Compiled route. */
+    uint8_t                 types[HTTP_ROUTER_MAX_GROUPS];  /**< #http_router_param_t of groups. */
+    size_t                  type_cnt;       /**< Number of groups with known type. */
+    http_router_slots_t     slots;          /**< Routes by method. */
+} http_router_regex_t;
+
+struct http_router
+{
+    const auto_api_regex_t* regex;          /**< Regex API. */
+    http_router_node_t      root;           /**< Trie root. */
+
+    http_router_regex_t*    fallback;       /**< Routes that cannot be put into trie, by descending priority. */
+    size_t                  fallback_cnt;   /**< Number of fallback routes. */
+};
+
+typedef struct http_router_token
+{
+    int                     param;          /**< Placeholder type, or -1 if literal. */
+    const char*             str;            /**< Literal string. */
+    size_t                  len;            /**< Literal length. */
+} http_router_token_t;
+
+/**
+ * @brief State of one http_router_match().
+ */
+typedef struct http_router_search
+{
+    int                     method;         /**< Request method. */
+    int                     priority;       /**< Priority of trie route found. */
+    http_router_match_t*    match;          /**< Match result. */
+} http_router_search_t;
+
+typedef struct http_router_regex_helper
+{
+    http_router_match_t*    match;
+    size_t                  len;
+    int                     matched;
+} http_router_regex_helper_t;
+
+static const char* s_method_list[HTTP_ROUTER_METHOD_ANY] = {
+    "GET", "HEAD", "POST", "PUT", "DELETE", "PATCH", "OPTIONS",
+};
+
+static const struct
+{
+    const char*             match;
+    size_t                  match_len;
+    const char*             pattern;
+    http_router_param_t     type;
+} s_param_list[] = {
+    { "<string>",   8,  "([^/\\s]+)",                   HTTP_ROUTER_PARAM_STRING },
+    { "<int>",      5,  "(\\d+)",                       HTTP_ROUTER_PARAM_INT },
+    { "<float>",    7,  "([+-]?[0-9]+\\.?[0-9]*)",      HTTP_ROUTER_PARAM_FLOAT },
+    { "<path>",     6,  "([^\\s]+)",                    HTTP_ROUTER_PARAM_PATH },
+    { "<uuid>",     6,  "([0-9a-fA-F]{8}-[0-9a-fA-F]{4}-[0-9a-fA-F]{4}-[0-9a-fA-F]{4}-[0-9a-fA-F]{12})", HTTP_ROUTER_PARAM_UUID },
+};
+
+static int _router_is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f' || c == '\v';
+}
+
+static int _router_is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static int _router_is_hex(char c)
+{
+    return _router_is_digit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+static size_t _router_scan_digits(const char* s, size_t len)
+{
+    size_t i;
+    for (i = 0; i < len && _router_is_digit(s[i]); i++)
+    {
+    }
+    return i;
+}
+
+static size_t _router_scan_float(const char* s, size_t len)
+{
+    size_t pos = 0, n;
+
+    if (len > 0 && (s[0] == '+' || s[0] == '-'))
+    {
+        pos++;
+    }
+
+    if ((n = _router_scan_digits(s + pos, len - pos)) == 0)
+    {
+        return 0;
+    }
+    pos += n;
+
+    if (pos < len && s[pos] == '.')
+    {
+        pos++;
+        pos += _router_scan_digits(s + pos, len - pos);
+    }
+
+    return pos;
+}
+
+static size_t _router_scan_uuid(const char* s, size_t len)
+{
+    static const size_t s_dash_pos[] = { 8, 13, 18, 23 };
+    size_t i, d = 0;
+
+    if (len < 36)
+    {
+        return 0;
+    }
+
+    for (i = 0; i < 36; i++)
+    {
+        if (d < ARRAY_SIZE(s_dash_pos) && i == s_dash_pos[d])
+        {
+            if (s[i] != '-')
+            {
+                return 0;
+            }
+            d++;
+            continue;
+        }
+        if (!_router_is_hex(s[i]))
+        {
+            return 0;
+        }
+    }
+
+    return 36;
+}
+
+/**
+ * @brief Get the longest prefix of \p s that match placeholder \p type.
+ * @param[in] type  Placeholder type.
+ * @param[in] s     String.
+ * @param[in] len   String length.
+ * @return          Matched length, 0 if not match.
+ */
+static size_t _router_scan_param(int type, const char* s, size_t len)
+{
+    size_t i;
+
+    switch (type)
+    {
+    case HTTP_ROUTER_PARAM_INT:
+        return _router_scan_digits(s, len);
+
+    case HTTP_ROUTER_PARAM_UUID:
+        return _router_scan_uuid(s, len);
+
+    case HTTP_ROUTER_PARAM_FLOAT:
+        return _router_scan_float(s, len);
+
+    case HTTP_ROUTER_PARAM_STRING:
+        for (i = 0; i < len && s[i] != '/' && !_router_is_space(s[i]); i++)
+        {
+        }
+        return i;
+
+    default:
+        for (i = 0; i < len && !_router_is_space(s[i]); i++)
+        {
+        }
+        return i;
+    }
+}
+
+/**
+ * @brief Bind \p data to \p method in \p slots.
+ * @return  Boolean, false if \p method is taken.
+ */
+static int _router_slots_set(http_router_slots_t* slots, int method, int priority, void* data)
+{
+    if (slots->data[method] != NULL)
+    {
+        return 0;
+    }
+
+    slots->data[method] = data;
+    slots->priority[method] = priority;
+    slots->methods |= 1u << method;
+    return 1;
+}
+
+/**
+ * @brief Pick route of \p slots for request in \p search.
+ *
+ * If there is none, methods that have one are added to
+ * http_router_match_t::allow.
+ *
+ * @return  Boolean.
+ */
+static int _router_slots_pick(const http_router_slots_t* slots, http_router_search_t* search)
+{
+    int method = search->method;
+
+    if (slots->methods == 0)
+    {
+        return 0;
+    }
+    if (slots->data[method] == NULL && method == HTTP_ROUTER_METHOD_HEAD)
+    {
+        method = HTTP_ROUTER_METHOD_GET;
+    }
+    if (slots->data[method] == NULL)
+    {
+        method = HTTP_ROUTER_METHOD_ANY;
+    }
+    if (slots->data[method] == NULL)
+    {
+        search->match->allow |= slots->methods;
+        if (slots->methods & (1u << HTTP_ROUTER_METHOD_GET))
+        {
+            search->match->allow |= 1u << HTTP_ROUTER_METHOD_HEAD;
+        }
+        return 0;
+    }
+
+    search->match->data = slots->data[method];
+    search->priority = slots->priority[method];
+    return 1;
+}
+
+static int _router_hex_value(char c)
+{
+    return _router_is_digit(c) ? c - '0' : (c | 0x20) - 'a' + 10;
+}
+
+/**
+ * @brief Convert capture \p s of placeholder \p type into \p value.
+ * @return  Boolean, false if value is out of range.
+ */
+static int _router_convert(int type, const char* s, size_t len, http_router_value_t* value)
+{
+    size_t i, n = 0;
+    char buf[64];
+
+    switch (type)
+    {
+    case HTTP_ROUTER_PARAM_INT:
+        value->i = 0;
+        for (i = 0; i < len; i++)
+        {
+            int digit = s[i] - '0';
+            if (value->i > (INT64_MAX - digit) / 10)
+            {
+                return 0;
+            }
+            value->i = value->i * 10 + digit;
+        }
+        return 1;
+
+    case HTTP_ROUTER_PARAM_FLOAT:
+        /* Longer text would only spell out more digits than a double holds. */
+        if (len >= sizeof(buf))
+        {
+            return 0;
+        }
+        memcpy(buf, s, len);
+        buf[len] = '\0';
+        value->f = strtod(buf, NULL);
+        return isfinite(value->f);
+
+    case HTTP_ROUTER_PARAM_UUID:
+        for (i = 0; i < len; i += 2)
+        {
+            if (s[i] == '-')
+            {
+                i--;
+                continue;
+            }
+            value->uuid[n++] = (uint8_t)(_router_hex_value(s[i]) << 4 | _router_hex_value(s[i + 1]));
+        }
+        return 1;
+
+    default:
+        return 1;
+    }
+}
+
+/**
+ * @brief Record capture \p idx of placeholder \p type at \p uri + \p pos.
+ * @return  Boolean, false if value is out of range.
+ */
+static int _router_capture(http_router_match_t* match, size_t idx, int type, const char* uri,
+    size_t pos, size_t end)
+{
+    match->groups[2 * idx] = pos;
+    match->groups[2 * idx + 1] = end;
+    match->types[idx] = (uint8_t)type;
+    return _router_convert(type, uri + pos, end - pos, &match->values[idx]);
+}
+
+static http_router_node_t* _router_new_node(const char* prefix, size_t len)
+{
+    http_router_node_t* node = calloc(1, sizeof(http_router_node_t));
+
+    if (len != 0)
+    {
+        node->prefix = malloc(len);
+        memcpy(node->prefix, prefix, len);
+        node->prefix_len = len;
+    }
+
+    return node;
+}
+
+static void _router_destroy_node(http_router_node_t* node)
+{
+    size_t i;
+
+    for (i = 0; i < node->child_cnt; i++)
+    {
+        _router_destroy_node(node->children[i]);
+        free(node->children[i]);
+    }
+    free(node->children);
+    node->children = NULL;
+    node->child_cnt = 0;
+
+    for (i = 0; i < ARRAY_SIZE(node->params); i++)
+    {
+        if (node->params[i] != NULL)
+        {
+            _router_destroy_node(node->params[i]);
+            free(node->params[i]);
+            node->params[i] = NULL;
+        }
+    }
+
+    free(node->prefix);
+    node->prefix = NULL;
+    node->prefix_len = 0;
+}
+
+/**
+ * @brief Find position of literal child starting with \p c.
+ * @param[in] node  Parent node.
+ * @param[in] c     First byte.
+ * @param[out] pos  Position of child, or where it should be inserted.
+ * @return          Boolean.
+ */
+static int _router_find_child_pos(const http_router_node_t* node, char c, size_t* pos)
+{
+    size_t lo = 0, hi = node->child_cnt;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        unsigned char k = (unsigned char)node->children[mid]->prefix[0];
+
+        if (k == (unsigned char)c)
+        {
+            *pos = mid;
+            return 1;
+        }
+        if (k < (unsigned char)c)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    *pos = lo;
+    return 0;
+}
+
+static void _router_insert_child(http_router_node_t* node, size_t pos, http_router_node_t* child)
+{
+    node->children = realloc(node->children, sizeof(http_router_node_t*) * (node->child_cnt + 1));
+    memmove(&node->children[pos + 1], &node->children[pos],
+        sizeof(http_router_node_t*) * (node->child_cnt - pos));
+    node->children[pos] = child;
+    node->child_cnt++;
+}
+
+static http_router_node_t* _router_insert_literal(http_router_node_t* node, const char* s, size_t len)
+{
+    while (len != 0)
+    {
+        size_t pos, common;
+        http_router_node_t* child;
+
+        if (!_router_find_child_pos(node, s[0], &pos))
+        {
+            child = _router_new_node(s, len);
+            _router_insert_child(node, pos, child);
+            return child;
+        }
+
+        child = node->children[pos];
+        for (common = 0; common < len && common < child->prefix_len
+            && child->prefix[common] == s[common]; common++)
+        {
+        }
+
+        /* Split edge so the shared part becomes its own node. */
+        if (common < child->prefix_len)
+        {
+            http_router_node_t* mid = _router_new_node(child->prefix, common);
+
+            child->prefix_len -= common;
+            memmove(child->prefix, child->prefix + common, child->prefix_len);
+
+            mid->children = malloc(sizeof(http_router_node_t*));
+            mid->children[0] = child;
+            mid->child_cnt = 1;
+
+            node->children[pos] = mid;
+            child = mid;
+        }
+
+        node = child;
+        s += common;
+        len -= common;
+    }
+
+    return node;
+}
+
+/**
+ * @brief Split \p route into literal and placeholder tokens.
+ * @return  The number of tokens, or -1 if the route contains regex syntax or
+ *   too many placeholders.
+ */
+static int _router_tokenize(const char* route, http_router_token_t** tokens)
+{
+    size_t i, j, pos = 0, lit = 0, param_cnt = 0;
+    size_t len = strlen(route);
+    int cnt = 0;
+
+    /* Each placeholder splits at most one literal, so this is enough. */
+    *tokens = malloc(sizeof(http_router_token_t) * (len + 1));
+
+    while (pos < len)
+    {
+        if (strchr("^$*+?()[]{}|\\", route[pos]) != NULL)
+        {
+            goto fallback;
+        }
+
+        if (route[pos] != '<')
+        {
+            pos++;
+            continue;
+        }
+
+        for (i = 0; i < ARRAY_SIZE(s_param_list); i++)
+        {
+            if (strncmp(route + pos, s_param_list[i].match, s_param_list[i].match_len) == 0)
+            {
+                break;
+            }
+        }
+        if (i == ARRAY_SIZE(s_param_list))
+        {
+            pos++;
+            continue;
+        }
+
+        if (++param_cnt > HTTP_ROUTER_MAX_GROUPS)
+        {
+            goto fallback;
+        }
+
+        if (pos != lit)
+        {
+            (*tokens)[cnt].param = -1;
+            (*tokens)[cnt].str = route + lit;
+            (*tokens)[cnt].len = pos - lit;
+            cnt++;
+        }
+
+        (*tokens)[cnt].param = s_param_list[i].type;
+        (*tokens)[cnt].str = NULL;
+        (*tokens)[cnt].len = 0;
+        cnt++;
+
+        pos += s_param_list[i].match_len;
+        lit = pos;
+    }
+
+    if (pos != lit)
+    {
+        (*tokens)[cnt].param = -1;
+        (*tokens)[cnt].str = route + lit;
+        (*tokens)[cnt].len = pos - lit;
+        cnt++;
+    }
+
+    /* Two placeholders in a row cannot be split without regex backtracking. */
+    for (j = 1; j < (size_t)cnt; j++)
+    {
+        if ((*tokens)[j].param >= 0 && (*tokens)[j - 1].param >= 0)
+        {
+            goto fallback;
+        }
+    }
+
+    return cnt;
+
+fallback:
+    free(*tokens);
+    *tokens = NULL;
+    return -1;
+}
+
+/**
+ * @brief Find type of each capture group of regex \p route.
+ */
+static void _router_group_types(http_router_regex_t* item, const char* route)
+{
+    size_t i, pos = 0;
+
+    while (route[pos] != '\0' && item->type_cnt < HTTP_ROUTER_MAX_GROUPS)
+    {
+        if (route[pos] == '\\' && route[pos + 1] != '\0')
+        {
+            pos += 2;
+            continue;
+        }
+        if (route[pos] == '(' && route[pos + 1] != '?')
+        {
+            item->types[item->type_cnt++] = HTTP_ROUTER_PARAM_STRING;
+            pos++;
+            continue;
+        }
+        if (route[pos] != '<')
+        {
+            pos++;
+            continue;
+        }
+
+        for (i = 0; i < ARRAY_SIZE(s_param_list); i++)
+        {
+            if (strncmp(route + pos, s_param_list[i].match, s_param_list[i].match_len) == 0)
+            {
+                break;
+            }
+        }
+        if (i == ARRAY_SIZE(s_param_list))
+        {
+            pos++;
+            continue;
+        }
+        item->types[item->type_cnt++] = (uint8_t)s_param_list[i].type;
+        pos += s_param_list[i].match_len;
+    }
+}
+
+static int _router_add_fallback(http_router_t* self, const char* route, int method, int priority, void* data)
+{
+    size_t i, pos = self->fallback_cnt;
+
+    /* Methods of a route share its regex. */
+    for (i = 0; i < self->fallback_cnt; i++)
+    {
+        http_router_regex_t* item = &self->fallback[i];
+        if (item->priority == priority && strcmp(item->route, route) == 0)
+        {
+            return _router_slots_set(&item->slots, method, priority, data);
+        }
+        if (item->priority < priority && pos == self->fallback_cnt)
+        {
+            pos = i;
+        }
+    }
+
+    char* pattern = http_router_expand(route);
+    auto_regex_code_t* code = self->regex->create(pattern, strlen(pattern));
+    free(pattern);
+
+    if (code == NULL)
+    {
+        return 0;
+    }
+
+    self->fallback = realloc(self->fallback, sizeof(http_router_regex_t) * (self->fallback_cnt + 1));
+    memmove(&self->fallback[pos + 1], &self->fallback[pos],
+        sizeof(http_router_regex_t) * (self->fallback_cnt - pos));
+    memset(&self->fallback[pos], 0, sizeof(http_router_regex_t));
+    self->fallback[pos].route = strdup(route);
+    self->fallback[pos].priority = priority;
+    self->fallback[pos].code = code;
+    _router_group_types(&self->fallback[pos], route);
+    _router_slots_set(&self->fallback[pos].slots, method, priority, data);
+    self->fallback_cnt++;
+
+    return 1;
+}
+
+static int _router_match_node(const http_router_node_t* node, const char* uri,
+    size_t len, size_t pos, http_router_search_t* search)
+{
+    size_t i, child_pos;
+    http_router_match_t* match = search->match;
+
+    if (pos == len)
+    {
+        return _router_slots_pick(&node->slots, search);
+    }
+
+    if (_router_find_child_pos(node, uri[pos], &child_pos))
+    {
+        const http_router_node_t* child = node->children[child_pos];
+        if (len - pos >= child->prefix_len
+            && memcmp(uri + pos, child->prefix, child->prefix_len) == 0
+            && _router_match_node(child, uri, len, pos + child->prefix_len, search))
+        {
+            return 1;
+        }
+    }
+
+    for (i = 0; i < ARRAY_SIZE(node->params); i++)
+    {
+        const http_router_node_t* param = node->params[i];
+        size_t idx = match->group_cnt;
+        size_t n;
+
+        if (param == NULL || (n = _router_scan_param((int)i, uri + pos, len - pos)) == 0)
+        {
+            continue;
+        }
+
+        match->group_cnt++;
+
+        /* A leaf placeholder must consume the rest of uri. */
+        if (param->child_cnt == 0)
+        {
+            if (pos + n == len && _router_capture(match, idx, (int)i, uri, pos, len)
+                && _router_slots_pick(&param->slots, search))
+            {
+                return 1;
+            }
+            match->group_cnt--;
+            continue;
+        }
+
+        /*
+         * Try longest capture first, then back off. A capture that consumes
+         * the rest of uri is tried last so more specific routes win.
+         */
+        size_t full = n;
+        if (pos + n == len)
+        {
+            n = _router_scan_param((int)i, uri + pos, n - 1);
+        }
+        for (; n != 0; n = _router_scan_param((int)i, uri + pos, n - 1))
+        {
+            if (_router_capture(match, idx, (int)i, uri, pos, pos + n)
+                && _router_match_node(param, uri, len, pos + n, search))
+            {
+                return 1;
+            }
+        }
+        if (pos + full == len && _router_capture(match, idx, (int)i, uri, pos, len)
+            && _router_slots_pick(&param->slots, search))
+        {
+            return 1;
+        }
+        match->group_cnt--;
+    }
+
+    return 0;
+}
+
+static void _router_on_regex_match(const char* data, size_t* groups, size_t group_sz, void* arg)
+{
+    size_t i;
+    http_router_regex_helper_t* helper = arg;
+    (void)data;
+
+    /* Group 0 is the whole match, which must cover the whole uri. */
+    if (group_sz == 0 || groups[0] != 0 || groups[1] != helper->len)
+    {
+        return;
+    }
+
+    helper->matched = 1;
+    helper->match->group_cnt = 0;
+    for (i = 1; i < group_sz && helper->match->group_cnt < HTTP_ROUTER_MAX_GROUPS; i++)
+    {
+        helper->match->groups[2 * helper->match->group_cnt] = groups[2 * i];
+        helper->match->groups[2 * helper->match->group_cnt + 1] = groups[2 * i + 1];
+        helper->match->group_cnt++;
+    }
+}
+
+/**
+ * @brief Convert groups of \p match by types of regex route \p item.
+ * @return  Boolean, false if a value is out of range.
+ */
+static int _router_convert_groups(const http_router_regex_t* item, const char* uri, http_router_match_t* match)
+{
+    size_t i;
+
+    for (i = 0; i < match->group_cnt; i++)
+    {
+        int type = i < item->type_cnt ? item->types[i] : HTTP_ROUTER_PARAM_STRING;
+        if (!_router_capture(match, i, type, uri, match->groups[2 * i], match->groups[2 * i + 1]))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+http_router_t* http_router_create(const auto_api_regex_t* regex)
+{
+    http_router_t* self = calloc(1, sizeof(http_router_t));
+    self->regex = regex;
+    return self;
+}
+
+void http_router_destroy(http_router_t* self)
+{
+    size_t i;
+
+    _router_destroy_node(&self->root);
+
+    for (i = 0; i < self->fallback_cnt; i++)
+    {
+        self->regex->destroy(self->fallback[i].code);
+        free(self->fallback[i].route);
+    }
+    free(self->fallback);
+
+    free(self);
+}
+
+int http_router_add(http_router_t* self, const char* route, int method, int priority, void* data)
+{
+    int i, cnt;
+    http_router_token_t* tokens;
+    http_router_node_t* node = &self->root;
+
+    if (method < 0 || method >= HTTP_ROUTER_METHOD__MAX)
+    {
+        return 0;
+    }
+    if ((cnt = _router_tokenize(route, &tokens)) < 0)
+    {
+        return _router_add_fallback(self, route, method, priority, data);
+    }
+
+    for (i = 0; i < cnt; i++)
+    {
+        if (tokens[i].param < 0)
+        {
+            node = _router_insert_literal(node, tokens[i].str, tokens[i].len);
+            continue;
+        }
+
+        if (node->params[tokens[i].param] == NULL)
+        {
+            node->params[tokens[i].param] = _router_new_node(NULL, 0);
+        }
+        node = node->params[tokens[i].param];
+    }
+    free(tokens);
+
+    return _router_slots_set(&node->slots, method, priority, data);
+}
+
+int http_router_match(const http_router_t* self, int method, const char* uri, size_t len,
+    http_router_match_t* match)
+{
+    size_t i;
+    http_router_match_t tmp;
+    http_router_search_t search = { method, 0, match };
+
+    match->data = NULL;
+    match->allow = 0;
+    match->group_cnt = 0;
+    int found = _router_match_node(&self->root, uri, len, 0, &search);
+
+    for (i = 0; i < self->fallback_cnt; i++)
+    {
+        const http_router_regex_t* item = &self->fallback[i];
+        if (found && item->priority <= search.priority)
+        {
+            break;
+        }
+
+        /* Groups of trie match stay until a regex route wins. */
+        http_router_regex_helper_t helper = { &tmp, len, 0 };
+        http_router_search_t regex_search = { method, 0, &tmp };
+        tmp.allow = 0;
+        if (self->regex->match(item->code, uri, len, _router_on_regex_match, &helper) < 0 || !helper.matched)
+        {
+            continue;
+        }
+        if (!_router_convert_groups(item, uri, &tmp))
+        {
+            continue;
+        }
+        if (!_router_slots_pick(&item->slots, &regex_search))
+        {
+            match->allow |= tmp.allow;
+            continue;
+        }
+
+        match->data = tmp.data;
+        match->group_cnt = tmp.group_cnt;
+        memcpy(match->groups, tmp.groups, sizeof(size_t) * 2 * tmp.group_cnt);
+        memcpy(match->types, tmp.types, tmp.group_cnt);
+        memcpy(match->values, tmp.values, sizeof(http_router_value_t) * tmp.group_cnt);
+        return 1;
+    }
+
+    if (found)
+    {
+        return 1;
+    }
+    match->group_cnt = 0;
+    return 0;
+}
+
+int http_router_method(const char* method, size_t len)
+{
+    int i;
+    for (i = 0; i < HTTP_ROUTER_METHOD_ANY; i++)
+    {
+        if (strlen(s_method_list[i]) == len && memcmp(s_method_list[i], method, len) == 0)
+        {
+            return i;
+        }
+    }
+    return HTTP_ROUTER_METHOD_ANY;
+}
+
+const char* http_router_method_name(int method)
+{
+    return method >= 0 && method < HTTP_ROUTER_METHOD_ANY ? s_method_list[method] : NULL;
+}
+
+char* http_router_expand(const char* route)
+{
+    size_t i, pos, len = 0;
+    char* dst;
+
+    /* Calculate expanded length first so we only allocate once. */
+    for (pos = 0; route[pos] != '\0'; pos++, len++)
+    {
+        for (i = 0; i < ARRAY_SIZE(s_param_list); i++)
+        {
+            if (strncmp(route + pos, s_param_list[i].match, s_param_list[i].match_len) == 0)
+            {
+                len += strlen(s_param_list[i].pattern) - 1;
+                pos += s_param_list[i].match_len - 1;
+                break;
+            }
+        }
+    }
+
+    dst = malloc(len + 1);
+    for (pos = 0, len = 0; route[pos] != '\0'; pos++)
+    {
+        for (i = 0; i < ARRAY_SIZE(s_param_list); i++)
+        {
+            if (strncmp(route + pos, s_param_list[i].match, s_param_list[i].match_len) == 0)
+            {
+                break;
+            }
+        }
+
+        if (i == ARRAY_SIZE(s_param_list))
+        {
+            dst[len++] = route[pos];
+            continue;
+        }
+
+        memcpy(dst + len, s_param_list[i].pattern, strlen(s_param_list[i].pattern));
+        len += strlen(s_param_list[i].pattern);
+        pos += s_param_list[i].match_len - 1;
+    }
+    dst[len] = '\0';
+
+    return dst;
+}
@@ -0,0 +1,152 @@
+#ifndef __AUTO_MONGOOSE_ROUTER_H__
+#define __AUTO_MONGOOSE_ROUTER_H__
+
+#include <autodo.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Maximum number of capture groups a route can have.
+ *
+ * Routes with more placeholders than this are matched by the regex fallback.
+ */
+#define HTTP_ROUTER_MAX_GROUPS  16
+
+/**
+ * @brief Placeholder types understood by the router.
+ */
+typedef enum http_router_param_e
+{
+    HTTP_ROUTER_PARAM_INT       = 0,    /**< `<int>` */
+    HTTP_ROUTER_PARAM_UUID      = 1,    /**< `<uuid>` */
+    HTTP_ROUTER_PARAM_FLOAT     = 2,    /**< `<float>` */
+    HTTP_ROUTER_PARAM_STRING    = 3,    /**< `<string>` */
+    HTTP_ROUTER_PARAM_PATH      = 4,    /**< `<path>` */
+    HTTP_ROUTER_PARAM__MAX,
+} http_router_param_t;
+
+/**
+ * @brief Request methods a route can be bound to.
+ */
+typedef enum http_router_method_e
+{
+    HTTP_ROUTER_METHOD_GET      = 0,
+    HTTP_ROUTER_METHOD_HEAD     = 1,    /**< Falls back to GET routes. */
+    HTTP_ROUTER_METHOD_POST     = 2,
+    HTTP_ROUTER_METHOD_PUT      = 3,
+    HTTP_ROUTER_METHOD_DELETE   = 4,
+    HTTP_ROUTER_METHOD_PATCH    = 5,
+    HTTP_ROUTER_METHOD_OPTIONS  = 6,
+    HTTP_ROUTER_METHOD_ANY      = 7,    /**< Route takes any method, or request method is none of the above. */
+    HTTP_ROUTER_METHOD__MAX,
+} http_router_method_t;
+
+struct http_router;
+typedef struct http_router http_router_t;
+
+/**
+ * @brief Value of a typed capture, converted while matching.
+ */
+typedef union http_router_value
+{
+    int64_t     i;                                      /**< `<int>`, 0 to INT64_MAX. */
+    double      f;                                      /**< `<float>`, finite. */
+    uint8_t     uuid[16];                               /**< `<uuid>` as raw bytes. */
+} http_router_value_t;
+
+/**
+ * @brief Match result.
+ */
+typedef struct http_router_match
+{
+    void*       data;                                   /**< User data of matched route. */
+    unsigned    allow;                                  /**< If not matched, bit per #http_router_method_t the uri has routes for. */
+    size_t      group_cnt;                              /**< Number of captured groups. */
+    size_t      groups[HTTP_ROUTER_MAX_GROUPS * 2];     /**< Begin/end offset pairs of captured groups. */
+    uint8_t     types[HTTP_ROUTER_MAX_GROUPS];          /**< #http_router_param_t of captured groups. */
+    http_router_value_t values[HTTP_ROUTER_MAX_GROUPS]; /**< Values of `<int>`, `<float>` and `<uuid>` groups. */
+} http_router_match_t;
+
+/**
+ * @brief Create a router.
+ * @param[in] regex     Regex API used for routes that cannot be compiled into
+ *   the trie.
+ * @return              Router object.
+ */
+http_router_t* http_router_create(const auto_api_regex_t* regex);
+
+/**
+ * @brief Destroy router.
+ * @note User data of routes is not touched.
+ * @param[in] self  Router object.
+ */
+void http_router_destroy(http_router_t* self);
+
+/**
+ * @brief Add a route.
+ *
+ * The \p route is a path that may contain placeholders `<int>`, `<float>`,
+ * `<string>`, `<path>` and `<uuid>`. Trie routes are tried by specificity:
+ * literal bytes before placeholders, and placeholders in the order of
+ * #http_router_param_t. Routes that contain regex syntax are compiled as
+ * regular expressions and tried by descending \p priority, then in the order
+ * they were added. One only wins over a trie route with lower priority.
+ *
+ * A placeholder only matches if its value converts: `<int>` must fit in
+ * int64_t and `<float>` must be finite. Regex groups that are not
+ * placeholders capture strings.
+ *
+ * The same \p route may be added once per \p method. All methods share one
+ * trie node or regex, so picking the method is an array lookup.
+ *
+ * @param[in] self      Router object.
+ * @param[in] route     Route string.
+ * @param[in] method    #http_router_method_t
+ * @param[in] priority  Priority against other routes, default is 0.
+ * @param[in] data      User data, must not be NULL.
+ * @return              Boolean.
+ */
+int http_router_add(http_router_t* self, const char* route, int method, int priority, void* data);
+
+/**
+ * @brief Match \p uri against all routes.
+ * @param[in] self      Router object.
+ * @param[in] method    Request method, see http_router_method().
+ * @param[in] uri       Request URI.
+ * @param[in] len       URI length in bytes.
+ * @param[out] match    Match result. If not matched, http_router_match_t::allow
+ *   tells whether the uri matched with another method.
+ * @return              Boolean.
+ */
+int http_router_match(const http_router_t* self, int method, const char* uri, size_t len,
+    http_router_match_t* match);
+
+/**
+ * @brief Get #http_router_method_t of method string.
+ * @param[in] method    Method, case sensitive.
+ * @param[in] len       Method length in bytes.
+ * @return              #http_router_method_t, #HTTP_ROUTER_METHOD_ANY if unknown.
+ */
+int http_router_method(const char* method, size_t len);
+
+/**
+ * @brief Get name of \p method.
+ * @param[in] method    #http_router_method_t
+ * @return              Name, or NULL for #HTTP_ROUTER_METHOD_ANY.
+ */
+const char* http_router_method_name(int method);
+
+/**
+ * @brief Expand placeholders in \p route into regex syntax.
+ * @param[in] route Route string.
+ * @return          Regex pattern. Use `free()` to release it.
+ */
+char* http_router_expand(const char* route);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,1171 @@
+#define _GNU_SOURCE
+#include "static_file.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+#if defined(HTTP_STATIC_WITH_ZLIB)
+#include <zlib.h>
+#endif
+
+/**
+ * @brief Max length of a resolved file path.
+ */
+#define HTTP_STATIC_MAX_PATH        4096
+
+/**
+ * @brief Fill send buffer up to this size when copying body.
+ */
+#define HTTP_STATIC_HIGH_WATER      (256 * 1024)
+
+/**
+ * @brief Bytes copied after sendfile() would block.
+ *
+ * Mongoose only watches a socket for writability if its send buffer is not
+ * empty, so a little data is left there to get MG_EV_WRITE when the socket
+ * drains.
+ */
+#define HTTP_STATIC_ARM_SIZE        (16 * 1024)
+
+/**
+ * @brief Max bytes passed to sendfile() in one pump, so one large download
+ *   does not hold up other connections of the same poll thread.
+ */
+#define HTTP_STATIC_SENDFILE_MAX    (4 * 1024 * 1024)
+
+#define HTTP_STATIC_ENC_GZIP        0x01
+#define HTTP_STATIC_ENC_BR          0x02
+
+struct http_static_entry
+{
+    auto_map_node_t     node;       /**< Node for #http_static_t::entries */
+    auto_list_node_t    lru;        /**< Node for #http_static_t::lru */
+    atomic_int          refcnt;     /**< One for the cache, one for each stream. */
+
+    char*               path;       /**< Resolved file path. */
+    const char*         encoding;   /**< Compressed on the fly with this coding, or NULL. */
+    int                 passthrough;/**< Compression did not help, send file as is. */
+    dev_t               dev;
+    ino_t               ino;
+    time_t              mtime;
+    size_t              file_size;  /**< File size on disk. */
+
+    char*               data;       /**< Content to send. */
+    size_t              size;       /**< Content size in bytes. */
+};
+
+struct http_static
+{
+    const auto_api_t*   api;
+
+    char*               root_dir;   /**< Without trailing slash. */
+    size_t              root_len;
+    char*               ssi_pattern;
+    size_t              max_bytes;
+    size_t              max_entries;
+    size_t              max_file_size;
+
+    int                 compress;
+    size_t              compress_min_size;
+    char**              compress_types;
+    size_t              compress_type_cnt;
+
+    auto_sem_t*         lock;       /**< Lock for everything below. */
+    auto_map_t          entries;    /**< #http_static_entry_t by path. */
+    auto_list_t         lru;        /**< #http_static_entry_t, most recently used first. */
+    size_t              bytes;      /**< Total size of cached files. */
+};
+
+typedef struct http_static_mime
+{
+    const char*         ext;
+    const char*         type;
+} http_static_mime_t;
+
+static const http_static_mime_t s_http_static_mime[] = {
+    { "html",   "text/html; charset=utf-8" },
+    { "htm",    "text/html; charset=utf-8" },
+    { "shtml",  "text/html; charset=utf-8" },
+    { "css",    "text/css; charset=utf-8" },
+    { "js",     "text/javascript; charset=utf-8" },
+    { "mjs",    "text/javascript; charset=utf-8" },
+    { "json",   "application/json; charset=utf-8" },
+    { "map",    "application/json; charset=utf-8" },
+    { "txt",    "text/plain; charset=utf-8" },
+    { "xml",    "application/xml; charset=utf-8" },
+    { "svg",    "image/svg+xml" },
+    { "png",    "image/png" },
+    { "jpg",    "image/jpeg" },
+    { "jpeg",   "image/jpeg" },
+    { "gif",    "image/gif" },
+    { "ico",    "image/x-icon" },
+    { "webp",   "image/webp" },
+    { "wasm",   "application/wasm" },
+    { "woff",   "font/woff" },
+    { "woff2",  "font/woff2" },
+    { "ttf",    "font/ttf" },
+    { "otf",    "font/otf" },
+    { "pdf",    "application/pdf" },
+    { "zip",    "application/zip" },
+    { "gz",     "application/gzip" },
+    { "mp3",    "audio/mpeg" },
+    { "wav",    "audio/wav" },
+    { "mp4",    "video/mp4" },
+    { "webm",   "video/webm" },
+};
+
+static const char* s_http_static_compress_types[] = {
+    "text/",
+    "application/javascript",
+    "application/json",
+    "application/xml",
+    "application/wasm",
+    "image/svg+xml",
+    "image/x-icon",
+    "font/ttf",
+    "font/otf",
+};
+
+static const char* _http_static_mime(const char* path, size_t len)
+{
+    size_t i, ext_len = 0;
+
+    while (ext_len < len && path[len - ext_len - 1] != '.' && path[len - ext_len - 1] != '/')
+    {
+        ext_len++;
+    }
+    if (ext_len == len || path[len - ext_len - 1] != '.')
+    {
+        return "application/octet-stream";
+    }
+
+    for (i = 0; i < sizeof(s_http_static_mime) / sizeof(s_http_static_mime[0]); i++)
+    {
+        if (strlen(s_http_static_mime[i].ext) == ext_len
+            && strncasecmp(s_http_static_mime[i].ext, path + len - ext_len, ext_len) == 0)
+        {
+            return s_http_static_mime[i].type;
+        }
+    }
+
+    return "application/octet-stream";
+}
+
+static int _http_static_compressible(const http_static_t* self, const char* mime)
+{
+    size_t i;
+    const char* end = strchr(mime, ';');
+    size_t mime_len = end != NULL ? (size_t)(end - mime) : strlen(mime);
+
+    for (i = 0; i < self->compress_type_cnt; i++)
+    {
+        const char* type = self->compress_types[i];
+        size_t type_len = strlen(type);
+
+        if (type_len > 0 && type[type_len - 1] == '/')
+        {
+            if (mime_len > type_len && strncasecmp(mime, type, type_len) == 0)
+            {
+                return 1;
+            }
+        }
+        else if (mime_len == type_len && strncasecmp(mime, type, type_len) == 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Parse `Accept-Encoding`.
+ * @return  Bit set of HTTP_STATIC_ENC_*
+ */
+static int _http_static_accept_encoding(struct mg_http_message* hm)
+{
+    int ret = 0;
+    const struct mg_str* hdr = mg_http_get_header(hm, "Accept-Encoding");
+    const char* p = hdr != NULL ? hdr->ptr : NULL;
+    const char* end = hdr != NULL ? hdr->ptr + hdr->len : NULL;
+
+    while (p < end)
+    {
+        const char* token, *params;
+        size_t token_len;
+        int flags = 0;
+
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+        {
+            p++;
+        }
+        token = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+        {
+            p++;
+        }
+        token_len = p - token;
+        params = p;
+        while (p < end && *p != ',')
+        {
+            p++;
+        }
+
+        if (token_len == 4 && strncasecmp(token, "gzip", 4) == 0)
+        {
+            flags = HTTP_STATIC_ENC_GZIP;
+        }
+        else if (token_len == 2 && strncasecmp(token, "br", 2) == 0)
+        {
+            flags = HTTP_STATIC_ENC_BR;
+        }
+        else if (token_len == 1 && token[0] == '*')
+        {
+            flags = HTTP_STATIC_ENC_GZIP | HTTP_STATIC_ENC_BR;
+        }
+
+        /* `q=0` means not acceptable. */
+        for (; params + 2 < p; params++)
+        {
+            if ((params[0] == 'q' || params[0] == 'Q') && params[1] == '=')
+            {
+                const char* v = params + 2;
+                while (v < p && (*v == '0' || *v == '.'))
+                {
+                    v++;
+                }
+                if (v == p || *v == ' ' || *v == '\t' || *v == ';')
+                {
+                    flags = 0;
+                }
+                break;
+            }
+        }
+
+        ret |= flags;
+    }
+
+    return ret;
+}
+
+static int _http_static_cmp_entry(const auto_map_node_t* key1,
+    const auto_map_node_t* key2, void* arg)
+{
+    (void)arg;
+    int ret;
+    http_static_entry_t* e1 = container_of(key1, http_static_entry_t, node);
+    http_static_entry_t* e2 = container_of(key2, http_static_entry_t, node);
+
+    if ((ret = strcmp(e1->path, e2->path)) != 0)
+    {
+        return ret;
+    }
+    return strcmp(e1->encoding != NULL ? e1->encoding : "", e2->encoding != NULL ? e2->encoding : "");
+}
+
+static void _http_static_entry_release(http_static_entry_t* entry)
+{
+    if (atomic_fetch_sub(&entry->refcnt, 1) != 1)
+    {
+        return;
+    }
+
+    free(entry->data);
+    free(entry->path);
+    free(entry);
+}
+
+static int _http_static_entry_fresh(const http_static_entry_t* entry, const struct stat* st)
+{
+    return entry->dev == st->st_dev && entry->ino == st->st_ino
+        && entry->mtime == st->st_mtime && entry->file_size == (size_t)st->st_size;
+}
+
+/**
+ * @brief Drop \p entry from cache.
+ * @warning Must hold #http_static_t::lock
+ */
+static void _http_static_evict(http_static_t* self, http_static_entry_t* entry)
+{
+    self->api->map->erase(&self->entries, &entry->node);
+    self->api->list->erase(&self->lru, &entry->lru);
+    self->bytes -= entry->size;
+    _http_static_entry_release(entry);
+}
+
+#if defined(HTTP_STATIC_WITH_ZLIB)
+
+/**
+ * @brief Replace content of \p entry with its gzip encoding.
+ *
+ * It runs once per file version, so best compression is worth its time.
+ */
+static void _http_static_gzip(http_static_entry_t* entry)
+{
+    z_stream zs;
+    char* dst;
+    size_t dst_size;
+
+    memset(&zs, 0, sizeof(zs));
+    if (entry->size > UINT32_MAX
+        || deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        entry->passthrough = 1;
+        return;
+    }
+
+    dst_size = deflateBound(&zs, (uLong)entry->size);
+    dst = malloc(dst_size);
+    zs.next_in = (Bytef*)entry->data;
+    zs.avail_in = (uInt)entry->size;
+    zs.next_out = (Bytef*)dst;
+    zs.avail_out = (uInt)dst_size;
+
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END || zs.total_out >= entry->size)
+    {
+        /* Remember it, so we do not try again until file changes. */
+        deflateEnd(&zs);
+        free(dst);
+        entry->passthrough = 1;
+        return;
+    }
+    deflateEnd(&zs);
+
+    free(entry->data);
+    entry->data = dst;
+    entry->size = zs.total_out;
+}
+
+#endif
+
+/**
+ * @brief Read file into memory.
+ *
+ * The file is copied instead of mapped: a mapped file that is truncated while
+ * being sent would crash the process with SIGBUS.
+ *
+ * @param[in] path      File path.
+ * @param[in] st        File status.
+ * @param[in] encoding  Content coding to apply, or NULL.
+ */
+static http_static_entry_t* _http_static_load(const char* path, const struct stat* st,
+    const char* encoding)
+{
+    int fd;
+    size_t pos = 0;
+    http_static_entry_t* entry;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+    {
+        return NULL;
+    }
+
+    entry = calloc(1, sizeof(http_static_entry_t));
+    atomic_init(&entry->refcnt, 1);
+    entry->path = strdup(path);
+    entry->encoding = encoding;
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->mtime = st->st_mtime;
+    entry->file_size = (size_t)st->st_size;
+    entry->size = entry->file_size;
+    entry->data = malloc(entry->size + 1);
+
+    while (pos < entry->size)
+    {
+        ssize_t n = read(fd, entry->data + pos, entry->size - pos);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            /* File changed under us. */
+            close(fd);
+            _http_static_entry_release(entry);
+            return NULL;
+        }
+        pos += (size_t)n;
+    }
+    close(fd);
+
+#if defined(HTTP_STATIC_WITH_ZLIB)
+    if (encoding != NULL)
+    {
+        _http_static_gzip(entry);
+    }
+#endif
+    if (entry->passthrough)
+    {
+        free(entry->data);
+        entry->data = NULL;
+        entry->size = 0;
+    }
+
+    return entry;
+}
+
+/**
+ * @brief Get cached file, load it if needed.
+ * @param[in] self      Cache object.
+ * @param[in] path      File path.
+ * @param[in] st        File status.
+ * @param[in] encoding  Content coding applied on the fly, or NULL.
+ * @return  Entry with a reference for caller, or NULL if it cannot be cached.
+ */
+static http_static_entry_t* _http_static_lookup(http_static_t* self, const char* path,
+    const struct stat* st, const char* encoding)
+{
+    auto_map_node_t* it;
+    http_static_entry_t tmp, *entry;
+    const auto_api_t* api = self->api;
+
+    tmp.path = (char*)path;
+    tmp.encoding = encoding;
+
+    api->sem->wait(self->lock);
+    if ((it = api->map->find(&self->entries, &tmp.node)) != NULL)
+    {
+        entry = container_of(it, http_static_entry_t, node);
+        if (_http_static_entry_fresh(entry, st))
+        {
+            api->list->erase(&self->lru, &entry->lru);
+            api->list->push_front(&self->lru, &entry->lru);
+            atomic_fetch_add(&entry->refcnt, 1);
+            api->sem->post(self->lock);
+            return entry;
+        }
+        _http_static_evict(self, entry);
+    }
+    api->sem->post(self->lock);
+
+    /* Read without lock, other poll threads go on. */
+    if ((entry = _http_static_load(path, st, encoding)) == NULL)
+    {
+        return NULL;
+    }
+
+    api->sem->wait(self->lock);
+    if ((it = api->map->insert(&self->entries, &entry->node)) != NULL)
+    {
+        /* Another poll thread loaded it at the same time. */
+        http_static_entry_t* other = container_of(it, http_static_entry_t, node);
+        if (_http_static_entry_fresh(other, st))
+        {
+            atomic_fetch_add(&other->refcnt, 1);
+            api->sem->post(self->lock);
+
+            _http_static_entry_release(entry);
+            return other;
+        }
+        _http_static_evict(self, other);
+        api->map->insert(&self->entries, &entry->node);
+    }
+    api->list->push_front(&self->lru, &entry->lru);
+    self->bytes += entry->size;
+    atomic_fetch_add(&entry->refcnt, 1);
+
+    while (api->map->size(&self->entries) > self->max_entries || self->bytes > self->max_bytes)
+    {
+        http_static_entry_t* victim = container_of(api->list->end(&self->lru), http_static_entry_t, lru);
+        _http_static_evict(self, victim);
+    }
+    api->sem->post(self->lock);
+
+    return entry;
+}
+
+/**
+ * @brief Map request URI to a regular file under root directory.
+ * @return  Length of \p path, or 0 if mongoose should handle it.
+ */
+static size_t _http_static_resolve(const http_static_t* self, const struct mg_str* uri,
+    char* path, size_t size, struct stat* st)
+{
+    int n;
+    size_t len;
+
+    if (uri->len == 0 || uri->ptr[0] != '/'
+        || self->root_len + uri->len + sizeof("index.html") > size)
+    {
+        return 0;
+    }
+
+    memcpy(path, self->root_dir, self->root_len);
+    if ((n = mg_url_decode(uri->ptr, uri->len, path + self->root_len, size - self->root_len, 0)) <= 0)
+    {
+        return 0;
+    }
+    len = self->root_len + (size_t)n;
+
+    /* Leave anything suspicious to mongoose, it knows how to reject it. */
+    if (memchr(path + self->root_len, '\0', (size_t)n) != NULL
+        || strstr(path + self->root_len, "..") != NULL
+        || strchr(path + self->root_len, '\\') != NULL)
+    {
+        return 0;
+    }
+
+    if (path[len - 1] == '/')
+    {
+        memcpy(path + len, "index.html", sizeof("index.html"));
+        len += sizeof("index.html") - 1;
+    }
+
+    if (stat(path, st) != 0 || !S_ISREG(st->st_mode))
+    {
+        return 0;
+    }
+
+    return len;
+}
+
+http_static_t* http_static_create(const auto_api_t* api, const http_static_config_t* cfg)
+{
+    size_t i;
+    http_static_t* self = calloc(1, sizeof(http_static_t));
+
+    self->api = api;
+    self->root_dir = strdup(cfg->root_dir);
+    self->root_len = strlen(self->root_dir);
+    while (self->root_len > 1 && self->root_dir[self->root_len - 1] == '/')
+    {
+        self->root_dir[--self->root_len] = '\0';
+    }
+    self->ssi_pattern = cfg->ssi_pattern != NULL ? strdup(cfg->ssi_pattern) : NULL;
+    self->max_bytes = cfg->max_bytes;
+    self->max_entries = cfg->max_entries;
+    self->max_file_size = cfg->max_file_size < cfg->max_bytes ? cfg->max_file_size : cfg->max_bytes;
+
+    self->compress = cfg->compress;
+    self->compress_min_size = cfg->compress_min_size;
+    if (cfg->compress_types != NULL)
+    {
+        self->compress_type_cnt = cfg->compress_type_cnt;
+        self->compress_types = malloc(sizeof(char*) * self->compress_type_cnt);
+        for (i = 0; i < self->compress_type_cnt; i++)
+        {
+            self->compress_types[i] = strdup(cfg->compress_types[i]);
+        }
+    }
+    else
+    {
+        self->compress_type_cnt = sizeof(s_http_static_compress_types) / sizeof(s_http_static_compress_types[0]);
+        self->compress_types = malloc(sizeof(char*) * self->compress_type_cnt);
+        for (i = 0; i < self->compress_type_cnt; i++)
+        {
+            self->compress_types[i] = strdup(s_http_static_compress_types[i]);
+        }
+    }
+
+    self->lock = api->sem->create(1);
+    api->map->init(&self->entries, _http_static_cmp_entry, NULL);
+    api->list->init(&self->lru);
+
+    return self;
+}
+
+void http_static_destroy(http_static_t* self)
+{
+    size_t i;
+    auto_list_node_t* it;
+    while ((it = self->api->list->begin(&self->lru)) != NULL)
+    {
+        _http_static_evict(self, container_of(it, http_static_entry_t, lru));
+    }
+
+    self->api->sem->destroy(self->lock);
+    for (i = 0; i < self->compress_type_cnt; i++)
+    {
+        free(self->compress_types[i]);
+    }
+    free(self->compress_types);
+    free(self->ssi_pattern);
+    free(self->root_dir);
+    free(self);
+}
+
+/**
+ * @brief Pick a compressed variant of \p path the client accepts.
+ *
+ * Only file status is looked at. A precompressed sibling replaces \p path
+ * and \p st, otherwise \p on_the_fly is set if the file should be compressed
+ * by us.
+ *
+ * @return  Content coding, or NULL to send the file as is.
+ */
+static const char* _http_static_negotiate(http_static_t* self, struct mg_http_message* hm,
+    char* path, size_t size, size_t* path_len, struct stat* st, int* on_the_fly)
+{
+    size_t i;
+    struct stat sibling;
+    int accept = _http_static_accept_encoding(hm);
+    static const struct
+    {
+        int         flag;
+        const char* coding;
+        const char* ext;
+    } s_siblings[] = {
+        { HTTP_STATIC_ENC_BR,   "br",   ".br" },
+        { HTTP_STATIC_ENC_GZIP, "gzip", ".gz" },
+    };
+
+    for (i = 0; i < sizeof(s_siblings) / sizeof(s_siblings[0]); i++)
+    {
+        if (!(accept & s_siblings[i].flag) || *path_len + 4 > size)
+        {
+            continue;
+        }
+
+        memcpy(path + *path_len, s_siblings[i].ext, 4);
+        if (stat(path, &sibling) == 0 && S_ISREG(sibling.st_mode))
+        {
+            *path_len += 3;
+            *st = sibling;
+            return s_siblings[i].coding;
+        }
+        path[*path_len] = '\0';
+    }
+
+#if defined(HTTP_STATIC_WITH_ZLIB)
+    if ((accept & HTTP_STATIC_ENC_GZIP) && (size_t)st->st_size <= self->max_bytes)
+    {
+        *on_the_fly = 1;
+        return "gzip";
+    }
+#else
+    (void)self;
+    (void)on_the_fly;
+#endif
+
+    return NULL;
+}
+
+static const char* s_http_static_wday[] = {
+    "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat",
+};
+
+static const char* s_http_static_month[] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
+};
+
+/**
+ * @brief Format \p t as IMF-fixdate, like `Sun, 06 Nov 1994 08:49:37 GMT`.
+ */
+static void _http_static_format_date(time_t t, char* buf, size_t size)
+{
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    snprintf(buf, size, "%s, %02d %s %04d %02d:%02d:%02d GMT", s_http_static_wday[tm.tm_wday],
+        tm.tm_mday, s_http_static_month[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+/**
+ * @brief Parse IMF-fixdate. Obsolete date formats are not supported.
+ * @return  Boolean.
+ */
+static int _http_static_parse_date(const struct mg_str* str, time_t* t)
+{
+    int i;
+    struct tm tm;
+    char buf[32], mon[4];
+
+    if (str->len >= sizeof(buf))
+    {
+        return 0;
+    }
+    memcpy(buf, str->ptr, str->len);
+    buf[str->len] = '\0';
+
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(buf, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT", &tm.tm_mday, mon, &tm.tm_year,
+        &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+    {
+        return 0;
+    }
+
+    for (i = 0; i < 12; i++)
+    {
+        if (strcmp(mon, s_http_static_month[i]) == 0)
+        {
+            break;
+        }
+    }
+    if (i == 12)
+    {
+        return 0;
+    }
+    tm.tm_mon = i;
+    tm.tm_year -= 1900;
+
+    *t = timegm(&tm);
+    return 1;
+}
+
+/**
+ * @brief Strong validator of a file version.
+ *
+ * It only depends on inode, mtime and size, so it is computed from file
+ * status without reading the file.
+ */
+static void _http_static_format_etag(const struct stat* st, const char* suffix, char* buf, size_t size)
+{
+    snprintf(buf, size, "\"%llx-%llx-%llx%s\"", (unsigned long long)st->st_ino,
+        (unsigned long long)st->st_mtime, (unsigned long long)st->st_size, suffix);
+}
+
+/**
+ * @brief Check if \p etag is listed in `If-None-Match`.
+ *
+ * Weak comparison is used as RFC 7232 asks.
+ */
+static int _http_static_etag_listed(const struct mg_str* hdr, const char* etag)
+{
+    const char* p = hdr->ptr;
+    const char* end = hdr->ptr + hdr->len;
+    size_t etag_len = strlen(etag);
+
+    while (p < end)
+    {
+        const char* tag;
+
+        if (*p == ' ' || *p == '\t' || *p == ',')
+        {
+            p++;
+            continue;
+        }
+        if (*p == '*')
+        {
+            return 1;
+        }
+        if (end - p >= 2 && p[0] == 'W' && p[1] == '/')
+        {
+            p += 2;
+        }
+        if (p >= end || *p != '"')
+        {
+            while (p < end && *p != ',')
+            {
+                p++;
+            }
+            continue;
+        }
+
+        tag = p++;
+        while (p < end && *p != '"')
+        {
+            p++;
+        }
+        if (p < end)
+        {
+            p++;
+        }
+        if ((size_t)(p - tag) == etag_len && memcmp(tag, etag, etag_len) == 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Check conditional headers against current version.
+ * @return  Boolean. True if client copy is still good.
+ */
+static int _http_static_not_modified(struct mg_http_message* hm, const char* etag, time_t mtime)
+{
+    time_t since;
+    const struct mg_str* hdr;
+
+    /* If-Modified-Since is ignored when If-None-Match is present. */
+    if ((hdr = mg_http_get_header(hm, "If-None-Match")) != NULL)
+    {
+        return _http_static_etag_listed(hdr, etag);
+    }
+    if ((hdr = mg_http_get_header(hm, "If-Modified-Since")) != NULL)
+    {
+        return _http_static_parse_date(hdr, &since) && mtime <= since;
+    }
+    return 0;
+}
+
+/**
+ * @brief Check `If-Range` against current version.
+ * @return  Boolean. True if Range should be honored.
+ */
+static int _http_static_if_range(struct mg_http_message* hm, const char* etag, time_t mtime)
+{
+    time_t date;
+    const struct mg_str* hdr = mg_http_get_header(hm, "If-Range");
+
+    if (hdr == NULL)
+    {
+        return 1;
+    }
+    if (hdr->len > 0 && (hdr->ptr[0] == '"' || hdr->ptr[0] == 'W'))
+    {
+        /* Strong comparison, weak tags never match. */
+        return hdr->len == strlen(etag) && memcmp(hdr->ptr, etag, hdr->len) == 0;
+    }
+    return _http_static_parse_date(hdr, &date) && date == mtime;
+}
+
+static int _http_static_parse_u64(const char** p, const char* end, uint64_t* v)
+{
+    int digits = 0;
+
+    *v = 0;
+    while (*p < end && **p >= '0' && **p <= '9')
+    {
+        if (++digits > 18)
+        {
+            return -1;
+        }
+        *v = *v * 10 + (uint64_t)(**p - '0');
+        (*p)++;
+    }
+
+    return digits;
+}
+
+/**
+ * @brief Parse `Range`. Only a single byte range is supported.
+ * @return  1 if range is good, 0 if header should be ignored, -1 if range is
+ *   not satisfiable.
+ */
+static int _http_static_parse_range(const struct mg_str* hdr, uint64_t size,
+    uint64_t* start, uint64_t* len)
+{
+    int has_first, has_last;
+    uint64_t first, last;
+    const char* p = hdr->ptr;
+    const char* end = hdr->ptr + hdr->len;
+
+    if (hdr->len < 6 || strncasecmp(p, "bytes=", 6) != 0)
+    {
+        return 0;
+    }
+    p += 6;
+
+    /* Multiple ranges are allowed to be answered with the whole file. */
+    if (memchr(p, ',', (size_t)(end - p)) != NULL)
+    {
+        return 0;
+    }
+
+    if ((has_first = _http_static_parse_u64(&p, end, &first)) < 0 || p >= end || *p++ != '-'
+        || (has_last = _http_static_parse_u64(&p, end, &last)) < 0)
+    {
+        return 0;
+    }
+    while (p < end && (*p == ' ' || *p == '\t'))
+    {
+        p++;
+    }
+    if (p != end || (!has_first && !has_last))
+    {
+        return 0;
+    }
+
+    /* `-N` is the last N bytes. */
+    if (!has_first)
+    {
+        if (last == 0 || size == 0)
+        {
+            return -1;
+        }
+        *len = last < size ? last : size;
+        *start = size - *len;
+        return 1;
+    }
+
+    if (has_last && last < first)
+    {
+        return 0;
+    }
+    if (first >= size)
+    {
+        return -1;
+    }
+    if (!has_last || last >= size)
+    {
+        last = size - 1;
+    }
+    *start = first;
+    *len = last - first + 1;
+
+    return 1;
+}
+
+static void _http_static_send_not_modified(struct mg_connection* c, const char* etag,
+    const char* last_modified, int vary)
+{
+    mg_printf(c, "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nLast-Modified: %s\r\n%s\r\n",
+        etag, last_modified, vary ? "Vary: Accept-Encoding\r\n" : "");
+}
+
+int http_static_serve(http_static_t* self, struct mg_connection* c, struct mg_http_message* hm,
+    http_static_stream_t* stream)
+{
+    size_t path_len;
+    uint64_t size, start = 0, len;
+    struct stat st;
+    char path[HTTP_STATIC_MAX_PATH];
+    char etag[64], last_modified[32], range[64];
+    const char* mime, *encoding = NULL;
+    const struct mg_str* range_hdr;
+    http_static_entry_t* entry = NULL;
+    int fd = -1, vary = 0, on_the_fly = 0, partial = 0;
+    int is_head = mg_vcasecmp(&hm->method, "HEAD") == 0;
+
+    if (!is_head && mg_vcasecmp(&hm->method, "GET") != 0)
+    {
+        return 0;
+    }
+
+    if ((path_len = _http_static_resolve(self, &hm->uri, path, sizeof(path), &st)) == 0)
+    {
+        return 0;
+    }
+
+    if (self->ssi_pattern != NULL
+        && mg_globmatch(self->ssi_pattern, strlen(self->ssi_pattern), path, path_len))
+    {
+        return 0;
+    }
+
+    mime = _http_static_mime(path, path_len);
+    if (self->compress && (size_t)st.st_size >= self->compress_min_size
+        && _http_static_compressible(self, mime))
+    {
+        vary = 1;
+        encoding = _http_static_negotiate(self, hm, path, sizeof(path), &path_len, &st, &on_the_fly);
+    }
+
+    /* Revalidation is answered from file status alone. */
+    _http_static_format_etag(&st, on_the_fly ? "-gz" : "", etag, sizeof(etag));
+    _http_static_format_date(st.st_mtime, last_modified, sizeof(last_modified));
+    if (_http_static_not_modified(hm, etag, st.st_mtime))
+    {
+        _http_static_send_not_modified(c, etag, last_modified, vary);
+        return 1;
+    }
+
+    if (on_the_fly)
+    {
+        entry = _http_static_lookup(self, path, &st, encoding);
+        if (entry != NULL && entry->passthrough)
+        {
+            _http_static_entry_release(entry);
+            entry = NULL;
+        }
+        if (entry == NULL)
+        {
+            encoding = NULL;
+            _http_static_format_etag(&st, "", etag, sizeof(etag));
+            if (_http_static_not_modified(hm, etag, st.st_mtime))
+            {
+                _http_static_send_not_modified(c, etag, last_modified, vary);
+                return 1;
+            }
+        }
+    }
+
+    if (entry == NULL && (size_t)st.st_size <= self->max_file_size)
+    {
+        entry = _http_static_lookup(self, path, &st, NULL);
+    }
+    if (entry == NULL && (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+    {
+        return 0;
+    }
+
+    size = entry != NULL ? entry->size : (uint64_t)st.st_size;
+    len = size;
+    range[0] = '\0';
+    if ((range_hdr = mg_http_get_header(hm, "Range")) != NULL && _http_static_if_range(hm, etag, st.st_mtime))
+    {
+        switch (_http_static_parse_range(range_hdr, size, &start, &len))
+        {
+        case 1:
+            partial = 1;
+            snprintf(range, sizeof(range), "Content-Range: bytes %llu-%llu/%llu\r\n",
+                (unsigned long long)start, (unsigned long long)(start + len - 1), (unsigned long long)size);
+            break;
+
+        case -1:
+            mg_printf(c, "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%llu\r\n"
+                "Content-Length: 0\r\n\r\n", (unsigned long long)size);
+            stream->entry = entry;
+            stream->fd = fd;
+            http_static_stream_close(stream);
+            return 1;
+
+        default:
+            break;
+        }
+    }
+
+    mg_printf(c, "HTTP/1.1 %s\r\nContent-Type: %s\r\n%s%s%s%sETag: %s\r\nLast-Modified: %s\r\n"
+        "Accept-Ranges: bytes\r\n%sContent-Length: %llu\r\n\r\n",
+        partial ? "206 Partial Content" : "200 OK", mime,
+        encoding != NULL ? "Content-Encoding: " : "", encoding != NULL ? encoding : "",
+        encoding != NULL ? "\r\n" : "", vary ? "Vary: Accept-Encoding\r\n" : "",
+        etag, last_modified, range, (unsigned long long)len);
+
+    stream->entry = entry;
+    stream->fd = fd;
+    stream->offset = start;
+    stream->remaining = is_head ? 0 : len;
+
+    /* Stop mongoose from parsing pipelined requests until body is out. */
+    c->is_resp = 1;
+    http_static_stream_pump(c, stream);
+
+    return 1;
+}
+
+void http_static_stream_init(http_static_stream_t* stream)
+{
+    stream->entry = NULL;
+    stream->fd = -1;
+    stream->offset = 0;
+    stream->remaining = 0;
+}
+
+int http_static_stream_active(const http_static_stream_t* stream)
+{
+    return stream->entry != NULL || stream->fd >= 0;
+}
+
+static int _http_static_pump_file(struct mg_connection* c, http_static_stream_t* stream)
+{
+    size_t room = HTTP_STATIC_HIGH_WATER;
+
+#if defined(__linux__)
+    if (!c->is_tls)
+    {
+        /* Anything in send buffer must go out first. */
+        if (c->send.len != 0)
+        {
+            return 1;
+        }
+
+        size_t budget = HTTP_STATIC_SENDFILE_MAX;
+        while (stream->remaining > 0 && budget > 0)
+        {
+            off_t off = (off_t)stream->offset;
+            size_t want = stream->remaining < budget ? (size_t)stream->remaining : budget;
+            ssize_t n = sendfile((int)(size_t)c->fd, stream->fd, &off, want);
+
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            {
+                break;
+            }
+            if (n <= 0)
+            {
+                return 0;
+            }
+
+            stream->offset += (uint64_t)n;
+            stream->remaining -= (uint64_t)n;
+            budget -= (size_t)n;
+        }
+        room = HTTP_STATIC_ARM_SIZE;
+    }
+#endif
+
+    if (stream->remaining == 0 || c->send.len >= room)
+    {
+        return 1;
+    }
+
+    size_t want = room - c->send.len;
+    if (want > stream->remaining)
+    {
+        want = (size_t)stream->remaining;
+    }
+    if (!mg_iobuf_resize(&c->send, c->send.len + want))
+    {
+        return 0;
+    }
+
+    ssize_t n = pread(stream->fd, c->send.buf + c->send.len, want, (off_t)stream->offset);
+    if (n <= 0)
+    {
+        return n < 0 && errno == EINTR;
+    }
+    c->send.len += (size_t)n;
+    stream->offset += (uint64_t)n;
+    stream->remaining -= (uint64_t)n;
+
+    return 1;
+}
+
+static int _http_static_pump_memory(struct mg_connection* c, http_static_stream_t* stream)
+{
+    if (stream->remaining == 0 || c->send.len >= HTTP_STATIC_HIGH_WATER)
+    {
+        return 1;
+    }
+
+    size_t want = HTTP_STATIC_HIGH_WATER - c->send.len;
+    if (want > stream->remaining)
+    {
+        want = (size_t)stream->remaining;
+    }
+    if (!mg_send(c, stream->entry->data + stream->offset, want))
+    {
+        return 0;
+    }
+    stream->offset += want;
+    stream->remaining -= want;
+
+    return 1;
+}
+
+void http_static_stream_pump(struct mg_connection* c, http_static_stream_t* stream)
+{
+    int ok;
+
+    if (!http_static_stream_active(stream))
+    {
+        return;
+    }
+
+    ok = stream->entry != NULL ? _http_static_pump_memory(c, stream) : _http_static_pump_file(c, stream);
+    if (!ok)
+    {
+        /* Content-Length is already out, the only way to tell client is closing. */
+        c->is_closing = 1;
+        http_static_stream_close(stream);
+        return;
+    }
+
+    if (stream->remaining == 0)
+    {
+        http_static_stream_close(stream);
+        c->is_resp = 0;
+    }
+}
+
+void http_static_stream_close(http_static_stream_t* stream)
+{
+    if (stream->entry != NULL)
+    {
+        _http_static_entry_release(stream->entry);
+    }
+    if (stream->fd >= 0)
+    {
+        close(stream->fd);
+    }
+    http_static_stream_init(stream);
+}
@@ -0,0 +1,123 @@
+#ifndef __AUTO_MONGOOSE_STATIC_FILE_H__
+#define __AUTO_MONGOOSE_STATIC_FILE_H__
+
+#include <autodo.h>
+#include <mongoose.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Static file cache configuration.
+ */
+typedef struct http_static_config
+{
+    const char*     root_dir;           /**< Directory to serve. */
+    const char*     ssi_pattern;        /**< Files matching this glob are left to mongoose. Can be NULL. */
+    size_t          max_bytes;          /**< Max total size of cached files. */
+    size_t          max_entries;        /**< Max number of cached files. */
+    size_t          max_file_size;      /**< Files larger than this are streamed and never cached. */
+
+    int             compress;           /**< Serve compressed variants to clients that accept them. */
+    size_t          compress_min_size;  /**< Smaller files are always sent as is. */
+    const char**    compress_types;     /**< MIME types worth compressing, NULL for defaults. A type ending with `/` matches the whole category. */
+    size_t          compress_type_cnt;  /**< Number of elements in #http_static_config_t::compress_types */
+} http_static_config_t;
+
+struct http_static;
+typedef struct http_static http_static_t;
+
+struct http_static_entry;
+typedef struct http_static_entry http_static_entry_t;
+
+/**
+ * @brief Response body still being sent on a connection.
+ *
+ * The body is fed to the connection a piece at a time, so a large file never
+ * sits in the send buffer as a whole.
+ */
+typedef struct http_static_stream
+{
+    http_static_entry_t*    entry;      /**< Cached file being sent, or NULL. */
+    int                     fd;         /**< Uncached file being sent, or -1. */
+    uint64_t                offset;     /**< Position of next byte to send. */
+    uint64_t                remaining;  /**< Bytes left to send. */
+} http_static_stream_t;
+
+/**
+ * @brief Create a static file cache.
+ *
+ * The cache is shared by all poll threads.
+ *
+ * @param[in] api   autodo API.
+ * @param[in] cfg   Configuration. Strings are copied.
+ * @return          Cache object.
+ */
+http_static_t* http_static_create(const auto_api_t* api, const http_static_config_t* cfg);
+
+/**
+ * @brief Destroy cache.
+ * @warning All streams must be closed before.
+ * @param[in] self  Cache object.
+ */
+void http_static_destroy(http_static_t* self);
+
+/**
+ * @brief Try to serve \p hm from the cache.
+ *
+ * Only GET and HEAD of regular files are handled here. Everything else, like
+ * directory listing and SSI, is left to mg_http_serve_dir().
+ *
+ * Responses carry a strong ETag and Last-Modified derived from file status.
+ * Revalidation by `If-None-Match` or `If-Modified-Since` is answered with 304
+ * without reading the file. A single byte `Range`, guarded by `If-Range`, is
+ * answered with 206 or 416.
+ *
+ * If compression is enabled, `.br` and `.gz` siblings of a compressible file
+ * are preferred when the client accepts them. Without a sibling the file is
+ * gzip compressed once, and the result is cached until the file changes.
+ *
+ * @param[in] self      Cache object.
+ * @param[in] c         Connection.
+ * @param[in] hm        Request.
+ * @param[out] stream   Where to keep the response body. Must be idle.
+ * @return              Boolean. If false nothing is sent.
+ */
+int http_static_serve(http_static_t* self, struct mg_connection* c, struct mg_http_message* hm,
+    http_static_stream_t* stream);
+
+/**
+ * @brief Initialize \p stream as idle.
+ * @param[out] stream   Stream.
+ */
+void http_static_stream_init(http_static_stream_t* stream);
+
+/**
+ * @brief Check if \p stream still has data to send.
+ * @param[in] stream    Stream.
+ * @return              Boolean.
+ */
+int http_static_stream_active(const http_static_stream_t* stream);
+
+/**
+ * @brief Feed more of \p stream into \p c.
+ *
+ * Call it whenever the connection may have room again, i.e. on MG_EV_WRITE
+ * and MG_EV_POLL. The stream is closed once all data is sent.
+ *
+ * @param[in] c         Connection.
+ * @param[in] stream    Stream.
+ */
+void http_static_stream_pump(struct mg_connection* c, http_static_stream_t* stream);
+
+/**
+ * @brief Release resources of \p stream and make it idle.
+ * @param[in] stream    Stream.
+ */
+void http_static_stream_close(http_static_stream_t* stream);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
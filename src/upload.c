@@ -0,0 +1,223 @@
+#include "upload.h"
+#include <string.h>
+
+/**
+ * @brief Longest chunk size line or trailer line accepted.
+ */
+#define HTTP_UPLOAD_MAX_LINE    1024
+
+typedef enum http_upload_state
+{
+    HTTP_UPLOAD_STATE_BODY,         /**< Content-Length body. */
+    HTTP_UPLOAD_STATE_SIZE,         /**< Chunk size line. */
+    HTTP_UPLOAD_STATE_DATA,         /**< Chunk data. */
+    HTTP_UPLOAD_STATE_DATA_END,     /**< CRLF after chunk data. */
+    HTTP_UPLOAD_STATE_TRAILER,      /**< Trailer lines after last chunk. */
+    HTTP_UPLOAD_STATE_DONE,
+} http_upload_state_t;
+
+void http_upload_init(http_upload_t* self, const auto_api_memory_t* mem, int chunked, uint64_t length)
+{
+    memset(self, 0, sizeof(*self));
+    atomic_init(&self->refcnt, 2);
+    self->mem = mem;
+    atomic_init(&self->inflight, 0);
+    atomic_init(&self->paused, 0);
+    atomic_init(&self->abandoned, 0);
+
+    self->chunked = chunked;
+    if (chunked)
+    {
+        self->state = HTTP_UPLOAD_STATE_SIZE;
+    }
+    else
+    {
+        self->state = length != 0 ? HTTP_UPLOAD_STATE_BODY : HTTP_UPLOAD_STATE_DONE;
+        self->remaining = length;
+    }
+}
+
+http_upload_t* http_upload_create(const auto_api_memory_t* mem, int chunked, uint64_t length)
+{
+    http_upload_t* self = mem->malloc(sizeof(http_upload_t));
+    http_upload_init(self, mem, chunked, length);
+    return self;
+}
+
+void http_upload_release(http_upload_t* self)
+{
+    if (atomic_fetch_sub_explicit(&self->refcnt, 1, memory_order_acq_rel) == 1)
+    {
+        self->mem->free(self);
+    }
+}
+
+/**
+ * @brief Find end of line in \p buf.
+ * @return  Length of line including LF, 0 if not complete, or -1 if too long.
+ */
+static int _http_upload_line(const char* buf, size_t len)
+{
+    const char* lf = memchr(buf, '\n', len < HTTP_UPLOAD_MAX_LINE ? len : HTTP_UPLOAD_MAX_LINE);
+    if (lf != NULL)
+    {
+        return (int)(lf - buf) + 1;
+    }
+    return len < HTTP_UPLOAD_MAX_LINE ? 0 : -1;
+}
+
+static int _http_upload_parse_size(const char* buf, size_t len, uint64_t* size)
+{
+    size_t i;
+    uint64_t v = 0;
+
+    for (i = 0; i < len; i++)
+    {
+        int d;
+        char ch = buf[i];
+        if (ch >= '0' && ch <= '9')
+        {
+            d = ch - '0';
+        }
+        else if (ch >= 'a' && ch <= 'f')
+        {
+            d = ch - 'a' + 10;
+        }
+        else if (ch >= 'A' && ch <= 'F')
+        {
+            d = ch - 'A' + 10;
+        }
+        else
+        {
+            break;
+        }
+
+        if (v >> 60)
+        {
+            return -1;
+        }
+        v = (v << 4) | (uint64_t)d;
+    }
+
+    /* Chunk extensions after ';' are ignored. */
+    if (i == 0 || (i < len && buf[i] != ';' && buf[i] != '\r' && buf[i] != '\n'
+        && buf[i] != ' ' && buf[i] != '\t'))
+    {
+        return -1;
+    }
+
+    *size = v;
+    return 0;
+}
+
+int http_upload_decode(http_upload_t* self, const char* buf, size_t len, size_t max,
+    size_t* consumed, struct mg_str* data)
+{
+    int n;
+    size_t take;
+
+    *consumed = 0;
+    *data = mg_str_n(buf, 0);
+
+    switch (self->state)
+    {
+    case HTTP_UPLOAD_STATE_BODY:
+    case HTTP_UPLOAD_STATE_DATA:
+        take = len < max ? len : max;
+        if (take > self->remaining)
+        {
+            take = (size_t)self->remaining;
+        }
+        *consumed = take;
+        *data = mg_str_n(buf, take);
+        self->remaining -= take;
+        self->received += take;
+        if (self->remaining == 0)
+        {
+            self->state = self->state == HTTP_UPLOAD_STATE_BODY ?
+                HTTP_UPLOAD_STATE_DONE : HTTP_UPLOAD_STATE_DATA_END;
+        }
+        break;
+
+    case HTTP_UPLOAD_STATE_SIZE:
+        if ((n = _http_upload_line(buf, len)) <= 0)
+        {
+            return n < 0 ? HTTP_UPLOAD_ERROR : HTTP_UPLOAD_MORE;
+        }
+        if (_http_upload_parse_size(buf, (size_t)n, &self->remaining) != 0)
+        {
+            return HTTP_UPLOAD_ERROR;
+        }
+        *consumed = (size_t)n;
+        self->state = self->remaining != 0 ? HTTP_UPLOAD_STATE_DATA : HTTP_UPLOAD_STATE_TRAILER;
+        break;
+
+    case HTTP_UPLOAD_STATE_DATA_END:
+        if ((n = _http_upload_line(buf, len)) <= 0)
+        {
+            return n < 0 ? HTTP_UPLOAD_ERROR : HTTP_UPLOAD_MORE;
+        }
+        if (n > 2 || (n == 2 && buf[0] != '\r'))
+        {
+            return HTTP_UPLOAD_ERROR;
+        }
+        *consumed = (size_t)n;
+        self->state = HTTP_UPLOAD_STATE_SIZE;
+        break;
+
+    case HTTP_UPLOAD_STATE_TRAILER:
+        if ((n = _http_upload_line(buf, len)) <= 0)
+        {
+            return n < 0 ? HTTP_UPLOAD_ERROR : HTTP_UPLOAD_MORE;
+        }
+        *consumed = (size_t)n;
+        if (n == 1 || (n == 2 && buf[0] == '\r'))
+        {
+            self->state = HTTP_UPLOAD_STATE_DONE;
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    return self->state == HTTP_UPLOAD_STATE_DONE ? HTTP_UPLOAD_DONE : HTTP_UPLOAD_MORE;
+}
+
+size_t http_upload_window(http_upload_t* self)
+{
+    size_t inflight = atomic_load_explicit(&self->inflight, memory_order_acquire);
+    return inflight < HTTP_UPLOAD_WINDOW ? HTTP_UPLOAD_WINDOW - inflight : 0;
+}
+
+void http_upload_produced(http_upload_t* self, size_t n)
+{
+    atomic_fetch_add_explicit(&self->inflight, n, memory_order_acq_rel);
+}
+
+int http_upload_consumed(http_upload_t* self, size_t n)
+{
+    size_t left = atomic_fetch_sub_explicit(&self->inflight, n, memory_order_acq_rel) - n;
+
+    /* Resume at half window, so poll thread is not woken for every chunk. */
+    return left <= HTTP_UPLOAD_WINDOW / 2 && atomic_exchange(&self->paused, 0) != 0;
+}
+
+int http_upload_pause(http_upload_t* self)
+{
+    atomic_store(&self->paused, 1);
+
+    /* Lua may have read everything before it could see the flag. */
+    if ((atomic_load(&self->inflight) <= HTTP_UPLOAD_WINDOW / 2 || atomic_load(&self->abandoned))
+        && atomic_exchange(&self->paused, 0) != 0)
+    {
+        return 0;
+    }
+    return 1;
+}
+
+int http_upload_abandon(http_upload_t* self)
+{
+    atomic_store(&self->abandoned, 1);
+    return atomic_exchange(&self->paused, 0) != 0;
+}
@@ -0,0 +1,135 @@
+#ifndef __AUTO_MONGOOSE_UPLOAD_H__
+#define __AUTO_MONGOOSE_UPLOAD_H__
+
+#include <autodo.h>
+#include <mongoose.h>
+#include <stdatomic.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Max body bytes handed to lua and not read yet, per upload.
+ *
+ * Poll thread stops reading the connection when it is reached, so TCP flow
+ * control pushes back on the client.
+ */
+#define HTTP_UPLOAD_WINDOW      (256 * 1024)
+
+/**
+ * @brief Result of http_upload_decode().
+ */
+typedef enum http_upload_rc
+{
+    HTTP_UPLOAD_ERROR   = -1,   /**< Malformed chunked encoding. */
+    HTTP_UPLOAD_MORE    = 0,    /**< Body is not complete yet. */
+    HTTP_UPLOAD_DONE    = 1,    /**< Body is complete. */
+} http_upload_rc_t;
+
+/**
+ * @brief Request body being streamed from poll thread to lua.
+ *
+ * Shared by the connection and the request object, freed when both are done
+ * with it.
+ */
+typedef struct http_upload
+{
+    atomic_int                  refcnt;     /**< Upload is freed when it drops to zero. */
+    const auto_api_memory_t*    mem;        /**< Memory API. */
+
+    atomic_size_t               inflight;   /**< Bytes handed to lua and not read yet. */
+    atomic_int                  paused;     /**< Poll thread stopped reading and waits for lua. */
+    atomic_int                  abandoned;  /**< Lua does not want the rest of body. */
+
+    /* Only touched by poll thread. */
+    int                         chunked;    /**< Body uses chunked transfer encoding. */
+    int                         state;      /**< Decoder state. */
+    uint64_t                    remaining;  /**< Bytes left in body, or in current chunk. */
+    uint64_t                    received;   /**< Decoded body bytes so far. */
+} http_upload_t;
+
+/**
+ * @brief Initialize \p self in place, for callers that only need the
+ *   decoder.
+ * @param[out] self     Upload.
+ * @param[in] mem       Memory API.
+ * @param[in] chunked   Body uses chunked transfer encoding.
+ * @param[in] length    Content-Length, ignored if \p chunked.
+ */
+void http_upload_init(http_upload_t* self, const auto_api_memory_t* mem, int chunked, uint64_t length);
+
+/**
+ * @brief Create upload with two references, one for each side.
+ * @param[in] mem       Memory API.
+ * @param[in] chunked   Body uses chunked transfer encoding.
+ * @param[in] length    Content-Length, ignored if \p chunked.
+ * @return              Upload.
+ */
+http_upload_t* http_upload_create(const auto_api_memory_t* mem, int chunked, uint64_t length);
+
+/**
+ * @brief Drop a reference.
+ * @note MT-Safe
+ * @param[in] self      Upload.
+ */
+void http_upload_release(http_upload_t* self);
+
+/**
+ * @brief Take next piece of body out of received bytes.
+ * @warning Only poll thread may call this.
+ * @param[in] self      Upload.
+ * @param[in] buf       Received bytes.
+ * @param[in] len       Length of \p buf.
+ * @param[in] max       Max length of \p data.
+ * @param[out] consumed Bytes of \p buf used, including chunk framing.
+ * @param[out] data     Body bytes, points into \p buf. May be empty.
+ * @return              #http_upload_rc_t
+ */
+int http_upload_decode(http_upload_t* self, const char* buf, size_t len, size_t max,
+    size_t* consumed, struct mg_str* data);
+
+/**
+ * @brief Bytes that may still be handed to lua.
+ * @note MT-Safe
+ * @param[in] self      Upload.
+ * @return              Bytes left in window.
+ */
+size_t http_upload_window(http_upload_t* self);
+
+/**
+ * @brief Account \p n bytes handed to lua.
+ * @warning Only poll thread may call this.
+ */
+void http_upload_produced(http_upload_t* self, size_t n);
+
+/**
+ * @brief Account \p n bytes read by lua.
+ * @warning Only lua may call this.
+ * @param[in] self      Upload.
+ * @param[in] n         Bytes read.
+ * @return              Non-zero if poll thread waits and must be woken up.
+ */
+int http_upload_consumed(http_upload_t* self, size_t n);
+
+/**
+ * @brief Mark poll thread as waiting for lua.
+ * @warning Only poll thread may call this.
+ * @param[in] self      Upload.
+ * @return              Non-zero if reading should stop. Zero if lua caught
+ *   up meanwhile.
+ */
+int http_upload_pause(http_upload_t* self);
+
+/**
+ * @brief Tell poll thread the rest of body is not wanted.
+ * @warning Only lua may call this.
+ * @param[in] self      Upload.
+ * @return              Non-zero if poll thread waits and must be woken up.
+ */
+int http_upload_abandon(http_upload_t* self);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,165 @@
+#include "websocket.h"
+#include <errno.h>
+#include <string.h>
+#if !defined(_WIN32)
+#include <sys/socket.h>
+#endif
+
+/**
+ * @brief Bytes copied into send buffer after the socket would block.
+ *
+ * Mongoose only watches a socket for writability if its send buffer is not
+ * empty, so a little data is left there to get MG_EV_WRITE when the socket
+ * drains.
+ */
+#define HTTP_WS_ARM_SIZE    (16 * 1024)
+
+http_ws_frame_t* http_ws_frame_create(const auto_api_memory_t* mem, int op, const void* payload, size_t len)
+{
+    size_t i, hdr_len = len < 126 ? 2 : (len <= 0xffff ? 4 : 10);
+    http_ws_frame_t* frame = mem->malloc(sizeof(http_ws_frame_t) + hdr_len + len);
+    unsigned char* p = (unsigned char*)frame->data;
+
+    atomic_init(&frame->refcnt, 1);
+    frame->mem = mem;
+    frame->len = hdr_len + len;
+
+    /* Final fragment, never masked from server side. */
+    p[0] = (unsigned char)(0x80 | (op & 0x0f));
+    if (hdr_len == 2)
+    {
+        p[1] = (unsigned char)len;
+    }
+    else if (hdr_len == 4)
+    {
+        p[1] = 126;
+        p[2] = (unsigned char)(len >> 8);
+        p[3] = (unsigned char)len;
+    }
+    else
+    {
+        p[1] = 127;
+        for (i = 0; i < 8; i++)
+        {
+            p[2 + i] = (unsigned char)((uint64_t)len >> (56 - 8 * i));
+        }
+    }
+    memcpy(p + hdr_len, payload, len);
+
+    return frame;
+}
+
+void http_ws_frame_ref(http_ws_frame_t* frame)
+{
+    atomic_fetch_add_explicit(&frame->refcnt, 1, memory_order_relaxed);
+}
+
+void http_ws_frame_release(http_ws_frame_t* frame)
+{
+    if (atomic_fetch_sub_explicit(&frame->refcnt, 1, memory_order_acq_rel) == 1)
+    {
+        frame->mem->free(frame);
+    }
+}
+
+void http_ws_queue_init(http_ws_queue_t* queue, const auto_api_memory_t* mem)
+{
+    memset(queue, 0, sizeof(*queue));
+    queue->mem = mem;
+}
+
+static void _http_ws_queue_pop(http_ws_queue_t* queue)
+{
+    http_ws_frame_release(queue->frames[queue->head]);
+    queue->head = (queue->head + 1) % queue->cap;
+    queue->cnt--;
+    queue->offset = 0;
+}
+
+void http_ws_queue_exit(http_ws_queue_t* queue)
+{
+    while (queue->cnt != 0)
+    {
+        _http_ws_queue_pop(queue);
+    }
+    queue->mem->free(queue->frames);
+    queue->frames = NULL;
+    queue->cap = 0;
+    queue->bytes = 0;
+}
+
+void http_ws_queue_push(http_ws_queue_t* queue, http_ws_frame_t* frame)
+{
+    if (queue->cnt == queue->cap)
+    {
+        size_t i, cap = queue->cap != 0 ? queue->cap * 2 : 8;
+        http_ws_frame_t** frames = queue->mem->malloc(sizeof(http_ws_frame_t*) * cap);
+        for (i = 0; i < queue->cnt; i++)
+        {
+            frames[i] = queue->frames[(queue->head + i) % queue->cap];
+        }
+        queue->mem->free(queue->frames);
+        queue->frames = frames;
+        queue->head = 0;
+        queue->cap = cap;
+    }
+
+    http_ws_frame_ref(frame);
+    queue->frames[(queue->head + queue->cnt) % queue->cap] = frame;
+    queue->cnt++;
+    queue->bytes += frame->len;
+}
+
+/**
+ * @brief Advance queue by \p n written bytes.
+ */
+static void _http_ws_queue_consume(http_ws_queue_t* queue, size_t n)
+{
+    queue->offset += n;
+    queue->bytes -= n;
+    if (queue->offset == queue->frames[queue->head]->len)
+    {
+        _http_ws_queue_pop(queue);
+    }
+}
+
+void http_ws_queue_pump(struct mg_connection* c, http_ws_queue_t* queue)
+{
+    /* Anything in send buffer must go out first. */
+    while (queue->cnt != 0 && c->send.len == 0)
+    {
+        http_ws_frame_t* frame = queue->frames[queue->head];
+        const char* data = frame->data + queue->offset;
+        size_t left = frame->len - queue->offset;
+
+#if !defined(_WIN32)
+        if (!c->is_tls)
+        {
+            ssize_t n = send((int)(size_t)c->fd, data, left, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                c->is_closing = 1;
+                return;
+            }
+            if (n > 0)
+            {
+                _http_ws_queue_consume(queue, (size_t)n);
+                continue;
+            }
+
+            /* Socket is full, park a little in send buffer to hear when it drains. */
+            if (left > HTTP_WS_ARM_SIZE)
+            {
+                left = HTTP_WS_ARM_SIZE;
+            }
+        }
+#endif
+
+        if (!mg_send(c, data, left))
+        {
+            c->is_closing = 1;
+            return;
+        }
+        _http_ws_queue_consume(queue, left);
+    }
+}
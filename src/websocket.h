@@ -0,0 +1,99 @@
+#ifndef __AUTO_MONGOOSE_WEBSOCKET_H__
+#define __AUTO_MONGOOSE_WEBSOCKET_H__
+
+#include <autodo.h>
+#include <mongoose.h>
+#include <stdatomic.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Encoded websocket frame, shared by every connection it is sent to.
+ */
+typedef struct http_ws_frame
+{
+    atomic_int                  refcnt;     /**< Frame is freed when it drops to zero. */
+    const auto_api_memory_t*    mem;        /**< Memory API. */
+    size_t                      len;        /**< Encoded length. */
+    char                        data[];     /**< Header and payload. */
+} http_ws_frame_t;
+
+/**
+ * @brief Frames waiting to be written to one connection.
+ *
+ * Frames are written to the socket straight from their shared buffer
+ * whenever the connection send buffer is empty, so a frame sent to many
+ * connections is not copied for each of them.
+ */
+typedef struct http_ws_queue
+{
+    const auto_api_memory_t*    mem;        /**< Memory API. */
+    http_ws_frame_t**           frames;     /**< Ring of frames, each holds a reference. */
+    size_t                      head;       /**< Index of first frame. */
+    size_t                      cnt;        /**< Number of frames. */
+    size_t                      cap;        /**< Capacity of #http_ws_queue_t::frames */
+    size_t                      offset;     /**< Bytes of first frame already written. */
+    size_t                      bytes;      /**< Bytes not written yet. */
+} http_ws_queue_t;
+
+/**
+ * @brief Encode a server to client frame.
+ * @param[in] mem       Memory API.
+ * @param[in] op        Opcode, like `WEBSOCKET_OP_TEXT`.
+ * @param[in] payload   Payload.
+ * @param[in] len       Payload length.
+ * @return              Frame with one reference.
+ */
+http_ws_frame_t* http_ws_frame_create(const auto_api_memory_t* mem, int op, const void* payload, size_t len);
+
+/**
+ * @brief Add a reference.
+ * @note MT-Safe
+ * @param[in] frame     Frame.
+ */
+void http_ws_frame_ref(http_ws_frame_t* frame);
+
+/**
+ * @brief Drop a reference.
+ * @note MT-Safe
+ * @param[in] frame     Frame.
+ */
+void http_ws_frame_release(http_ws_frame_t* frame);
+
+/**
+ * @brief Initialize \p queue as empty.
+ * @param[out] queue    Queue.
+ * @param[in] mem       Memory API.
+ */
+void http_ws_queue_init(http_ws_queue_t* queue, const auto_api_memory_t* mem);
+
+/**
+ * @brief Drop all frames and release resources of \p queue.
+ * @param[in] queue     Queue.
+ */
+void http_ws_queue_exit(http_ws_queue_t* queue);
+
+/**
+ * @brief Append \p frame to \p queue.
+ * @param[in] queue     Queue.
+ * @param[in] frame     Frame. A reference is added.
+ */
+void http_ws_queue_push(http_ws_queue_t* queue, http_ws_frame_t* frame);
+
+/**
+ * @brief Write as much of \p queue to \p c as the socket takes.
+ *
+ * Call it after push and whenever the connection may have room again, i.e.
+ * on MG_EV_WRITE and MG_EV_POLL.
+ *
+ * @param[in] c         Connection.
+ * @param[in] queue     Queue.
+ */
+void http_ws_queue_pump(struct mg_connection* c, http_ws_queue_t* queue);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,105 @@
+#include "wheel.h"
+
+static void _http_wheel_list_init(http_wheel_timer_t* head)
+{
+    head->prev = head;
+    head->next = head;
+}
+
+static void _http_wheel_list_push(http_wheel_timer_t* head, http_wheel_timer_t* timer)
+{
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+void http_wheel_init(http_wheel_t* wheel, uint64_t now, uint64_t tick_ms)
+{
+    size_t i;
+
+    wheel->tick_ms = tick_ms != 0 ? tick_ms : 1;
+    wheel->tick = now / wheel->tick_ms;
+    wheel->now = now;
+    for (i = 0; i < HTTP_WHEEL_SLOTS; i++)
+    {
+        _http_wheel_list_init(&wheel->slots[i]);
+    }
+}
+
+void http_wheel_timer_init(http_wheel_timer_t* timer)
+{
+    timer->prev = NULL;
+    timer->next = NULL;
+    timer->expire = 0;
+}
+
+void http_wheel_cancel(http_wheel_timer_t* timer)
+{
+    if (timer->next == NULL)
+    {
+        return;
+    }
+
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = NULL;
+    timer->next = NULL;
+}
+
+void http_wheel_schedule(http_wheel_t* wheel, http_wheel_timer_t* timer, uint64_t timeout_ms)
+{
+    http_wheel_cancel(timer);
+
+    timer->expire = (wheel->now + timeout_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+    if (timer->expire <= wheel->tick)
+    {
+        timer->expire = wheel->tick + 1;
+    }
+    _http_wheel_list_push(&wheel->slots[timer->expire & (HTTP_WHEEL_SLOTS - 1)], timer);
+}
+
+void http_wheel_advance(http_wheel_t* wheel, uint64_t now, http_wheel_cb cb, void* arg)
+{
+    uint64_t i, tick = now / wheel->tick_ms;
+    http_wheel_timer_t due, *it, *next;
+
+    if (now > wheel->now)
+    {
+        wheel->now = now;
+    }
+    if (tick <= wheel->tick)
+    {
+        return;
+    }
+
+    /* One revolution visits every slot, however long we slept. */
+    uint64_t steps = tick - wheel->tick;
+    if (steps > HTTP_WHEEL_SLOTS)
+    {
+        steps = HTTP_WHEEL_SLOTS;
+    }
+
+    /* Collect first, so callbacks may schedule and cancel freely. */
+    _http_wheel_list_init(&due);
+    for (i = 1; i <= steps; i++)
+    {
+        http_wheel_timer_t* head = &wheel->slots[(wheel->tick + i) & (HTTP_WHEEL_SLOTS - 1)];
+        for (it = head->next; it != head; it = next)
+        {
+            next = it->next;
+            if (it->expire <= tick)
+            {
+                http_wheel_cancel(it);
+                _http_wheel_list_push(&due, it);
+            }
+        }
+    }
+    wheel->tick = tick;
+
+    while ((it = due.next) != &due)
+    {
+        http_wheel_cancel(it);
+        cb(it, arg);
+    }
+}
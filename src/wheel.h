@@ -0,0 +1,102 @@
+#ifndef __AUTO_MONGOOSE_WHEEL_H__
+#define __AUTO_MONGOOSE_WHEEL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Number of slots, a power of two.
+ *
+ * Timers further away than one revolution stay in their slot and are skipped
+ * until their tick comes round.
+ */
+#define HTTP_WHEEL_SLOTS    512
+
+/**
+ * @brief Intrusive timer of #http_wheel_t.
+ */
+typedef struct http_wheel_timer
+{
+    struct http_wheel_timer*    prev;       /**< Previous timer in slot, NULL if not scheduled. */
+    struct http_wheel_timer*    next;       /**< Next timer in slot, NULL if not scheduled. */
+    uint64_t                    expire;     /**< Tick it fires at. */
+} http_wheel_timer_t;
+
+/**
+ * @brief Hashed timing wheel.
+ *
+ * Scheduling and cancelling are O(1). Advancing only looks at the slots of
+ * ticks that passed, so idle timers cost nothing until they are due.
+ *
+ * Time is only as fine as a tick, so timers fire within about a tick of when
+ * they are due.
+ */
+typedef struct http_wheel
+{
+    uint64_t                    tick_ms;    /**< Length of a tick in milliseconds. */
+    uint64_t                    tick;       /**< Current tick. */
+    uint64_t                    now;        /**< Time of last advance in milliseconds. */
+    http_wheel_timer_t          slots[HTTP_WHEEL_SLOTS];    /**< List heads. */
+} http_wheel_t;
+
+/**
+ * @brief Called for each expired timer.
+ * @param[in] timer     Timer, no longer scheduled. It may be scheduled again.
+ * @param[in] arg       User argument.
+ */
+typedef void (*http_wheel_cb)(http_wheel_timer_t* timer, void* arg);
+
+/**
+ * @brief Initialize \p wheel with no timers.
+ * @param[out] wheel    Wheel.
+ * @param[in] now       Current time in milliseconds.
+ * @param[in] tick_ms   Length of a tick in milliseconds.
+ */
+void http_wheel_init(http_wheel_t* wheel, uint64_t now, uint64_t tick_ms);
+
+/**
+ * @brief Initialize \p timer as not scheduled.
+ * @param[out] timer    Timer.
+ */
+void http_wheel_timer_init(http_wheel_timer_t* timer);
+
+/**
+ * @brief Tell if \p timer is scheduled.
+ */
+static inline int http_wheel_scheduled(const http_wheel_timer_t* timer)
+{
+    return timer->next != NULL;
+}
+
+/**
+ * @brief Fire \p timer \p timeout_ms after last advance, replacing any
+ *   earlier schedule.
+ * @param[in] wheel         Wheel.
+ * @param[in] timer         Timer.
+ * @param[in] timeout_ms    Timeout in milliseconds.
+ */
+void http_wheel_schedule(http_wheel_t* wheel, http_wheel_timer_t* timer, uint64_t timeout_ms);
+
+/**
+ * @brief Unschedule \p timer. Does nothing if it is not scheduled.
+ * @param[in] timer     Timer.
+ */
+void http_wheel_cancel(http_wheel_timer_t* timer);
+
+/**
+ * @brief Move \p wheel to \p now and fire timers that are due.
+ * @param[in] wheel     Wheel.
+ * @param[in] now       Current time in milliseconds.
+ * @param[in] cb        Called for each expired timer.
+ * @param[in] arg       User argument of \p cb.
+ */
+void http_wheel_advance(http_wheel_t* wheel, uint64_t now, http_wheel_cb cb, void* arg);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,193 @@
+/**
+ * @file
+ * Heap allocations of the buffers a routed request used to malloc(), for
+ * plain malloc() and for the per-request arena.
+ *
+ * This is a model, it does not run the server. Each simulated request does
+ * what the routed path does with its buffers: the poll thread copies request
+ * head and body, lua builds the response, the poll thread sends it, and both
+ * sides drop the request.
+ *
+ * The real routed path still allocates besides these: a lua thread and a
+ * request userdata per request, a parked copy of each request that waits
+ * behind pipelined replies, and a #http_server_conn_t per connection.
+ */
+#include "arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_HEAD_SIZE     512
+#define BENCH_REPLY_SIZE    1024
+#define BENCH_LARGE_BODY    (64 * 1024)
+#define BENCH_LARGE_EVERY   100
+#define BENCH_INFLIGHT      64
+
+static size_t s_alloc_cnt;
+
+static void* _bench_malloc(size_t size)
+{
+    s_alloc_cnt++;
+    return malloc(size);
+}
+
+static void _bench_free(void* ptr)
+{
+    free(ptr);
+}
+
+static void* _bench_calloc(size_t nmemb, size_t size)
+{
+    s_alloc_cnt++;
+    return calloc(nmemb, size);
+}
+
+static void* _bench_realloc(void* ptr, size_t size)
+{
+    s_alloc_cnt++;
+    return realloc(ptr, size);
+}
+
+static const auto_api_memory_t s_bench_memory = {
+    _bench_malloc,
+    _bench_free,
+    _bench_calloc,
+    _bench_realloc,
+};
+
+static char s_payload[64 + BENCH_HEAD_SIZE + BENCH_LARGE_BODY];
+
+typedef struct bench_request
+{
+    void*           pending;
+    void*           reply;
+    void*           reply_buf;
+    http_arena_t*   arena;
+} bench_request_t;
+
+static uint64_t _bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static size_t _bench_body_size(size_t i)
+{
+    return i % BENCH_LARGE_EVERY == BENCH_LARGE_EVERY - 1 ? BENCH_LARGE_BODY : i % 256;
+}
+
+static void _bench_malloc_path(size_t iterations, size_t* allocs, uint64_t* ns)
+{
+    size_t i, k;
+    bench_request_t reqs[BENCH_INFLIGHT];
+    size_t before = s_alloc_cnt;
+    uint64_t t0 = _bench_now();
+
+    for (i = 0; i < iterations; i += BENCH_INFLIGHT)
+    {
+        for (k = 0; k < BENCH_INFLIGHT; k++)
+        {
+            size_t len = 64 + BENCH_HEAD_SIZE + _bench_body_size(i + k);
+            reqs[k].pending = s_bench_memory.malloc(len);
+            memcpy(reqs[k].pending, s_payload, len);
+        }
+        for (k = 0; k < BENCH_INFLIGHT; k++)
+        {
+            reqs[k].reply_buf = s_bench_memory.malloc(BENCH_REPLY_SIZE);
+            memcpy(reqs[k].reply_buf, s_payload, BENCH_REPLY_SIZE);
+            reqs[k].reply = s_bench_memory.malloc(48);
+        }
+        for (k = 0; k < BENCH_INFLIGHT; k++)
+        {
+            s_bench_memory.free(reqs[k].reply_buf);
+            s_bench_memory.free(reqs[k].reply);
+            s_bench_memory.free(reqs[k].pending);
+        }
+    }
+
+    *ns = _bench_now() - t0;
+    *allocs = s_alloc_cnt - before;
+}
+
+static void _bench_arena_path(http_arena_pool_t* pool, size_t iterations, size_t* allocs,
+    size_t* large_allocs, uint64_t* ns)
+{
+    size_t i, k;
+    bench_request_t reqs[BENCH_INFLIGHT];
+    size_t before = s_alloc_cnt;
+    uint64_t t0 = _bench_now();
+
+    *large_allocs = 0;
+    for (i = 0; i < iterations; i += BENCH_INFLIGHT)
+    {
+        for (k = 0; k < BENCH_INFLIGHT; k++)
+        {
+            size_t cnt = s_alloc_cnt;
+            size_t len = 64 + BENCH_HEAD_SIZE + _bench_body_size(i + k);
+            reqs[k].arena = http_arena_acquire(pool);
+            reqs[k].pending = http_arena_alloc(reqs[k].arena, len);
+            memcpy(reqs[k].pending, s_payload, len);
+            if (_bench_body_size(i + k) == BENCH_LARGE_BODY)
+            {
+                *large_allocs += s_alloc_cnt - cnt;
+            }
+        }
+        for (k = 0; k < BENCH_INFLIGHT; k++)
+        {
+            reqs[k].reply = http_arena_alloc(reqs[k].arena, 48 + BENCH_REPLY_SIZE);
+            memcpy(reqs[k].reply, s_payload, 48 + BENCH_REPLY_SIZE);
+            http_arena_ref(reqs[k].arena);
+        }
+        for (k = 0; k < BENCH_INFLIGHT; k++)
+        {
+            /* Poll thread sent the reply, lua collected the request. */
+            http_arena_release(reqs[k].arena);
+            http_arena_release(reqs[k].arena);
+        }
+    }
+
+    *ns = _bench_now() - t0;
+    *allocs = s_alloc_cnt - before - *large_allocs;
+}
+
+int main(int argc, char* argv[])
+{
+    size_t allocs, large_allocs, large_cnt;
+    uint64_t ns;
+    http_arena_pool_t pool;
+    size_t iterations = argc > 1 ? (size_t)strtoull(argv[1], NULL, 10) : 100000;
+
+    iterations = (iterations + BENCH_INFLIGHT - 1) / BENCH_INFLIGHT * BENCH_INFLIGHT;
+    large_cnt = iterations / BENCH_LARGE_EVERY;
+    memset(s_payload, 'x', sizeof(s_payload));
+    http_arena_pool_init(&pool, &s_bench_memory, 16 * 1024);
+
+    printf("# %zu requests, %d in flight, 1 in %d with a %d byte body\n",
+        iterations, BENCH_INFLIGHT, BENCH_LARGE_EVERY, BENCH_LARGE_BODY);
+    printf("%-14s %14s %14s %14s\n", "path", "allocs/req", "large_allocs", "ns/req");
+
+    _bench_malloc_path(iterations, &allocs, &ns);
+    printf("%-14s %14.3f %14s %14.1f\n", "malloc", (double)allocs / iterations, "-",
+        (double)ns / iterations);
+
+    /* First round warms the pool up. */
+    _bench_arena_path(&pool, BENCH_INFLIGHT, &allocs, &large_allocs, &ns);
+    printf("%-14s %14.3f %14zu %14.1f\n", "arena_cold", (double)allocs / BENCH_INFLIGHT,
+        large_allocs, (double)ns / BENCH_INFLIGHT);
+
+    _bench_arena_path(&pool, iterations, &allocs, &large_allocs, &ns);
+    printf("%-14s %14.3f %14zu %14.1f\n", "arena_warm", (double)allocs / iterations,
+        large_allocs, (double)ns / iterations);
+
+    http_arena_pool_exit(&pool);
+
+    if (allocs != 0 || large_allocs != large_cnt)
+    {
+        fprintf(stderr, "unexpected heap allocation on warm arena path\n");
+        return EXIT_FAILURE;
+    }
+
+    return 0;
+}
@@ -0,0 +1,547 @@
+/**
+ * @file
+ * HTTP load generator with fixed scenarios, built on the mongoose client.
+ *
+ * It starts the server itself when given `--server AUTODO SCRIPT`, with the
+ * fixture directory, listen url and poll thread count passed through
+ * `BENCH_HTTP_ROOT`, `BENCH_HTTP_URL` and `BENCH_HTTP_THREADS`. The server is
+ * restarted when a scenario needs another thread count. Otherwise it loads an
+ * already running server at `--url`, which must serve the fixtures written to
+ * `--root` with one thread, and scenarios for more threads are skipped.
+ *
+ * Results go to stdout as a table and to `--out` as JSON, one object per
+ * scenario, so runs of different commits can be compared.
+ *
+ * Usage: bench_http [--server AUTODO SCRIPT] [--url URL] [--root DIR]
+ *                   [--duration SECONDS] [--out FILE]
+ */
+#define _GNU_SOURCE
+#include <mongoose.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define ARRAY_SIZE(x)   (sizeof(x) / sizeof(x[0]))
+
+#define BENCH_SMALL_SIZE    1024
+#define BENCH_LARGE_SIZE    (2 * 1024 * 1024)   /**< Above static cache max_file_size, below MG_MAX_RECV_SIZE. */
+#define BENCH_MAX_CONNS     1024
+#define BENCH_GRACE_MS      5000                /**< Wait this long for in flight requests after a run. */
+#define BENCH_MAX_ERRORS    100                 /**< Stop a run after this many errors. */
+
+typedef struct bench_scenario
+{
+    const char*     name;
+    const char*     path;
+    int             status;         /**< Expected status code. */
+    int             keep_alive;     /**< Reuse connection, or open one per request. */
+    unsigned        conns;          /**< Concurrent connections. */
+    unsigned        threads;        /**< Server poll threads, 0 for one per CPU. */
+} bench_scenario_t;
+
+typedef struct bench_result
+{
+    uint64_t        requests;
+    uint64_t        errors;
+    double          seconds;
+    double          rps;
+    double          p50_us;
+    double          p99_us;
+    double          p999_us;
+} bench_result_t;
+
+struct bench_run;
+
+typedef struct bench_slot
+{
+    struct bench_run*       run;
+    struct mg_connection*   c;      /**< Connection, or NULL. */
+    uint64_t                start;  /**< When current request started. */
+    int                     inflight;
+} bench_slot_t;
+
+typedef struct bench_run
+{
+    struct mg_mgr           mgr;
+    const char*             url;
+    const bench_scenario_t* scenario;
+    bench_slot_t*           slots;
+    int                     running;    /**< Issue new requests. */
+    unsigned                inflight;
+
+    uint64_t*               lat;        /**< Latencies in nanoseconds. */
+    size_t                  lat_cnt;
+    size_t                  lat_cap;
+    uint64_t                errors;
+} bench_run_t;
+
+/*
+ * Large files are only fetched by a few connections, as the client keeps each
+ * response in memory until it is complete. Scenarios ending in `_tn` repeat
+ * their one thread counterpart with a poll thread per CPU.
+ */
+static const bench_scenario_t s_scenarios[] = {
+    { "static_small_ka_c1",     "/small.txt",   200, 1, 1,    1 },
+    { "static_small_ka_c64",    "/small.txt",   200, 1, 64,   1 },
+    { "static_small_ka_c1024",  "/small.txt",   200, 1, 1024, 1 },
+    { "static_small_new_c1",    "/small.txt",   200, 0, 1,    1 },
+    { "static_small_new_c64",   "/small.txt",   200, 0, 64,   1 },
+    { "static_large_ka_c1",     "/large.bin",   200, 1, 1,    1 },
+    { "static_large_ka_c64",    "/large.bin",   200, 1, 64,   1 },
+    { "static_large_new_c64",   "/large.bin",   200, 0, 64,   1 },
+    { "route_int_ka_c1",        "/echo/12345",  200, 1, 1,    1 },
+    { "route_int_ka_c64",       "/echo/12345",  200, 1, 64,   1 },
+    { "route_int_ka_c1024",     "/echo/12345",  200, 1, 1024, 1 },
+    { "route_int_new_c1",       "/echo/12345",  200, 0, 1,    1 },
+    { "route_int_new_c64",      "/echo/12345",  200, 0, 64,   1 },
+    { "not_found_ka_c1",        "/no/such/file",404, 1, 1,    1 },
+    { "not_found_ka_c64",       "/no/such/file",404, 1, 64,   1 },
+    { "not_found_ka_c1024",     "/no/such/file",404, 1, 1024, 1 },
+    { "not_found_new_c64",      "/no/such/file",404, 0, 64,   1 },
+    { "static_small_ka_c64_tn", "/small.txt",   200, 1, 64,   0 },
+    { "route_int_ka_c64_tn",    "/echo/12345",  200, 1, 64,   0 },
+    { "not_found_ka_c64_tn",    "/no/such/file",404, 1, 64,   0 },
+};
+
+static uint64_t _bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void _bench_record(bench_run_t* run, uint64_t ns)
+{
+    if (run->lat_cnt == run->lat_cap)
+    {
+        run->lat_cap = run->lat_cap != 0 ? run->lat_cap * 2 : 65536;
+        run->lat = realloc(run->lat, sizeof(uint64_t) * run->lat_cap);
+    }
+    run->lat[run->lat_cnt++] = ns;
+}
+
+static void _bench_client(struct mg_connection* c, int ev, void* ev_data, void* fn_data);
+
+static void _bench_open(bench_slot_t* slot)
+{
+    bench_run_t* run = slot->run;
+
+    slot->start = _bench_now();
+    if ((slot->c = mg_http_connect(&run->mgr, run->url, _bench_client, slot)) == NULL)
+    {
+        run->errors++;
+        return;
+    }
+    slot->inflight = 1;
+    run->inflight++;
+}
+
+static void _bench_send(bench_slot_t* slot)
+{
+    const bench_scenario_t* scenario = slot->run->scenario;
+
+    if (scenario->keep_alive)
+    {
+        if (!slot->inflight)
+        {
+            slot->inflight = 1;
+            slot->run->inflight++;
+        }
+        slot->start = _bench_now();
+    }
+    mg_printf(slot->c, "GET %s HTTP/1.1\r\nHost: localhost\r\n%s\r\n", scenario->path,
+        scenario->keep_alive ? "" : "Connection: close\r\n");
+}
+
+/**
+ * @brief Close \p c with a reset, so a run that opens a connection per
+ *   request does not leave the client port range in TIME_WAIT.
+ */
+static void _bench_abort(struct mg_connection* c)
+{
+    struct linger lg = { 1, 0 };
+    setsockopt((int)(size_t)c->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    c->is_closing = 1;
+}
+
+static void _bench_done(bench_slot_t* slot)
+{
+    slot->inflight = 0;
+    slot->run->inflight--;
+}
+
+static void _bench_client(struct mg_connection* c, int ev, void* ev_data, void* fn_data)
+{
+    bench_slot_t* slot = fn_data;
+    bench_run_t* run = slot->run;
+
+    switch (ev)
+    {
+    case MG_EV_CONNECT:
+        _bench_send(slot);
+        break;
+
+    case MG_EV_HTTP_MSG:
+        _bench_record(run, _bench_now() - slot->start);
+        if (mg_http_status((struct mg_http_message*)ev_data) != run->scenario->status)
+        {
+            run->errors++;
+        }
+        _bench_done(slot);
+
+        if (run->running && run->scenario->keep_alive)
+        {
+            _bench_send(slot);
+            break;
+        }
+        slot->c = NULL;
+        _bench_abort(c);
+        if (run->running)
+        {
+            _bench_open(slot);
+        }
+        break;
+
+    case MG_EV_ERROR:
+        run->errors++;
+        break;
+
+    case MG_EV_CLOSE:
+        /* Closed before the response was complete. */
+        if (slot->c != c)
+        {
+            break;
+        }
+        slot->c = NULL;
+        if (slot->inflight)
+        {
+            run->errors++;
+            _bench_done(slot);
+        }
+        if (run->running && run->errors < BENCH_MAX_ERRORS)
+        {
+            _bench_open(slot);
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+static int _bench_cmp_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static double _bench_percentile_us(const uint64_t* sorted, size_t cnt, double q)
+{
+    if (cnt == 0)
+    {
+        return 0;
+    }
+    size_t idx = (size_t)(q * (double)(cnt - 1) + 0.5);
+    return (double)sorted[idx] / 1e3;
+}
+
+static void _bench_run(const char* url, const bench_scenario_t* scenario, double seconds,
+    bench_result_t* result)
+{
+    unsigned i;
+    bench_run_t run;
+    uint64_t start, deadline, stop, end;
+
+    memset(&run, 0, sizeof(run));
+    mg_mgr_init(&run.mgr);
+    run.url = url;
+    run.scenario = scenario;
+    run.running = 1;
+    run.slots = calloc(scenario->conns, sizeof(bench_slot_t));
+
+    start = _bench_now();
+    deadline = start + (uint64_t)(seconds * 1e9);
+    for (i = 0; i < scenario->conns; i++)
+    {
+        run.slots[i].run = &run;
+        _bench_open(&run.slots[i]);
+    }
+
+    while (_bench_now() < deadline && run.errors < BENCH_MAX_ERRORS)
+    {
+        mg_mgr_poll(&run.mgr, 10);
+    }
+    run.running = 0;
+
+    /* Requests in flight still count, so every connection ends on a response. */
+    stop = _bench_now() + (uint64_t)BENCH_GRACE_MS * 1000000;
+    while (run.inflight != 0 && _bench_now() < stop)
+    {
+        mg_mgr_poll(&run.mgr, 10);
+    }
+    end = _bench_now();
+
+    /* Requests still in flight are counted as errors on close. */
+    mg_mgr_free(&run.mgr);
+    free(run.slots);
+
+    qsort(run.lat, run.lat_cnt, sizeof(uint64_t), _bench_cmp_u64);
+    result->requests = run.lat_cnt;
+    result->errors = run.errors;
+    result->seconds = (double)(end - start) / 1e9;
+    result->rps = (double)run.lat_cnt / result->seconds;
+    result->p50_us = _bench_percentile_us(run.lat, run.lat_cnt, 0.5);
+    result->p99_us = _bench_percentile_us(run.lat, run.lat_cnt, 0.99);
+    result->p999_us = _bench_percentile_us(run.lat, run.lat_cnt, 0.999);
+    free(run.lat);
+}
+
+static int _bench_write_file(const char* path, size_t size, int text)
+{
+    size_t i;
+    FILE* f = fopen(path, "wb");
+    if (f == NULL)
+    {
+        fprintf(stderr, "cannot create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    /* Fixed content, so every run serves the same bytes. */
+    for (i = 0; i < size; i++)
+    {
+        fputc(text ? "abcdefghijklmnopqrstuvwxyz\n"[i % 27] : (int)((i * 2654435761u) >> 24) & 0xff, f);
+    }
+    fclose(f);
+    return 0;
+}
+
+static int _bench_prepare_root(const char* root)
+{
+    char path[4096];
+
+    if (mkdir(root, 0755) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "cannot create %s: %s\n", root, strerror(errno));
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/small.txt", root);
+    if (_bench_write_file(path, BENCH_SMALL_SIZE, 1) != 0)
+    {
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/large.bin", root);
+    return _bench_write_file(path, BENCH_LARGE_SIZE, 0);
+}
+
+static int _bench_wait_ready(const char* url, unsigned timeout_ms)
+{
+    unsigned waited;
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(mg_url_port(url));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    for (waited = 0; waited < timeout_ms; waited += 50)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        int ret = connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+        close(fd);
+        if (ret == 0)
+        {
+            return 0;
+        }
+        usleep(50 * 1000);
+    }
+
+    fprintf(stderr, "server did not come up on %s\n", url);
+    return -1;
+}
+
+static pid_t _bench_spawn_server(const char* autodo, const char* script, const char* root, const char* url,
+    unsigned threads)
+{
+    char buf[16];
+    pid_t pid = fork();
+    if (pid != 0)
+    {
+        return pid;
+    }
+
+    snprintf(buf, sizeof(buf), "%u", threads);
+    setenv("BENCH_HTTP_ROOT", root, 1);
+    setenv("BENCH_HTTP_URL", url, 1);
+    setenv("BENCH_HTTP_THREADS", buf, 1);
+    execlp(autodo, autodo, script, (char*)NULL);
+    fprintf(stderr, "cannot run %s: %s\n", autodo, strerror(errno));
+    _exit(127);
+}
+
+static void _bench_stop_server(pid_t pid)
+{
+    if (pid > 0)
+    {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+}
+
+/**
+ * @brief Allow every scenario connection plus what the process already has.
+ *   The spawned server inherits this limit.
+ */
+static void _bench_raise_fd_limit(void)
+{
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) != 0)
+    {
+        return;
+    }
+
+    rlim_t want = BENCH_MAX_CONNS * 2 + 64;
+    if (lim.rlim_cur < want)
+    {
+        lim.rlim_cur = lim.rlim_max < want ? lim.rlim_max : want;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int i, ret = EXIT_SUCCESS;
+    size_t k, written = 0;
+    unsigned threads = 1, want;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pid_t server = -1;
+    FILE* out;
+    const char* autodo = NULL;
+    const char* script = NULL;
+    const char* url = "http://127.0.0.1:18080";
+    const char* root = "bench_http_root";
+    const char* out_path = "bench_http.json";
+    double seconds = 1.0;
+    bench_result_t result;
+    char abs_root[4096];
+
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--server") == 0 && i + 2 < argc)
+        {
+            autodo = argv[++i];
+            script = argv[++i];
+        }
+        else if (strcmp(argv[i], "--url") == 0 && i + 1 < argc)
+        {
+            url = argv[++i];
+        }
+        else if (strcmp(argv[i], "--root") == 0 && i + 1 < argc)
+        {
+            root = argv[++i];
+        }
+        else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc)
+        {
+            seconds = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+        {
+            out_path = argv[++i];
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [--server AUTODO SCRIPT] [--url URL] [--root DIR]"
+                " [--duration SECONDS] [--out FILE]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    _bench_raise_fd_limit();
+
+    if (_bench_prepare_root(root) != 0 || realpath(root, abs_root) == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+
+    if (autodo != NULL)
+    {
+        server = _bench_spawn_server(autodo, script, abs_root, url, threads);
+    }
+    if (_bench_wait_ready(url, 10 * 1000) != 0)
+    {
+        ret = EXIT_FAILURE;
+        goto finish;
+    }
+
+    if ((out = fopen(out_path, "w")) == NULL)
+    {
+        fprintf(stderr, "cannot create %s: %s\n", out_path, strerror(errno));
+        ret = EXIT_FAILURE;
+        goto finish;
+    }
+
+    /* Warm up caches and pools, not recorded. */
+    _bench_run(url, &s_scenarios[0], seconds / 4, &result);
+
+    printf("%-24s %10s %8s %12s %10s %10s %10s\n", "scenario", "requests", "errors", "rps",
+        "p50_us", "p99_us", "p999_us");
+    fprintf(out, "[\n");
+    for (k = 0; k < ARRAY_SIZE(s_scenarios); k++)
+    {
+        const bench_scenario_t* scenario = &s_scenarios[k];
+        want = scenario->threads != 0 ? scenario->threads : (cpus > 0 ? (unsigned)cpus : 1);
+        if (want != threads)
+        {
+            if (autodo == NULL)
+            {
+                printf("%-24s skipped, needs --server to run %u threads\n", scenario->name, want);
+                continue;
+            }
+
+            _bench_stop_server(server);
+            threads = want;
+            server = _bench_spawn_server(autodo, script, abs_root, url, threads);
+            if (_bench_wait_ready(url, 10 * 1000) != 0)
+            {
+                ret = EXIT_FAILURE;
+                break;
+            }
+            _bench_run(url, &s_scenarios[0], seconds / 4, &result);
+        }
+
+        _bench_run(url, scenario, seconds, &result);
+
+        printf("%-24s %10llu %8llu %12.1f %10.1f %10.1f %10.1f\n", scenario->name,
+            (unsigned long long)result.requests, (unsigned long long)result.errors, result.rps,
+            result.p50_us, result.p99_us, result.p999_us);
+        fflush(stdout);
+
+        fprintf(out, "%s  {\"scenario\": \"%s\", \"path\": \"%s\", \"keep_alive\": %s, \"connections\": %u,"
+            " \"threads\": %u, \"requests\": %llu, \"errors\": %llu, \"seconds\": %.3f, \"rps\": %.1f,"
+            " \"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f}",
+            written++ != 0 ? ",\n" : "", scenario->name, scenario->path, scenario->keep_alive ? "true" : "false",
+            scenario->conns, threads, (unsigned long long)result.requests, (unsigned long long)result.errors,
+            result.seconds, result.rps, result.p50_us, result.p99_us, result.p999_us);
+
+        if (result.errors != 0)
+        {
+            ret = EXIT_FAILURE;
+        }
+    }
+    fprintf(out, "\n]\n");
+    fclose(out);
+
+finish:
+    _bench_stop_server(server);
+    return ret;
+}
@@ -0,0 +1,172 @@
+/**
+ * @file
+ * Per-request routing time versus route count, for the old linear regex scan
+ * and for the compiled trie.
+ *
+ * Both paths share the same POSIX regex backend.
+ */
+#define _GNU_SOURCE
+#include "router.h"
+#include "posix_regex.h"
+#include <string.h>
+#include <time.h>
+
+#define ARRAY_SIZE(x)   (sizeof(x) / sizeof(x[0]))
+
+typedef struct bench_linear_route
+{
+    auto_regex_code_t*  code;
+    size_t              idx;
+} bench_linear_route_t;
+
+static const char* s_route_templates[] = {
+    "/api/v1/res%zu",
+    "/api/v1/res%zu/<int>",
+    "/api/v1/res%zu/<int>/items/<uuid>",
+    "/api/v1/res%zu/<string>/meta",
+    "/static%zu/<path>",
+};
+
+static const char* s_uri_templates[] = {
+    "/api/v1/res%zu",
+    "/api/v1/res%zu/123456",
+    "/api/v1/res%zu/42/items/0f8fad5b-d9cb-469f-a165-70867728950e",
+    "/api/v1/res%zu/alice/meta",
+    "/static%zu/js/app/bundle.min.js",
+};
+
+static uint64_t _bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void _bench_linear_cb(const char* data, size_t* groups, size_t group_sz, void* arg)
+{
+    (void)data; (void)groups; (void)group_sz;
+    *(int*)arg = 1;
+}
+
+static size_t _bench_linear_match(bench_linear_route_t* routes, size_t route_cnt,
+    const char* uri, size_t len)
+{
+    size_t i;
+    for (i = 0; i < route_cnt; i++)
+    {
+        int matched = 0;
+        if (s_posix_regex.match(routes[i].code, uri, len, _bench_linear_cb, &matched) >= 0)
+        {
+            return routes[i].idx;
+        }
+    }
+    return (size_t)-1;
+}
+
+static void _bench_run(size_t route_cnt, size_t iterations)
+{
+    size_t i, hit = 0;
+    char buf[256];
+    char** uris = malloc(sizeof(char*) * route_cnt);
+    size_t* uri_lens = malloc(sizeof(size_t) * route_cnt);
+    bench_linear_route_t* linear = malloc(sizeof(bench_linear_route_t) * route_cnt);
+    http_router_t* router = http_router_create(&s_posix_regex);
+    const char* miss = "/api/v2/unknown/route/that/does/not/exist";
+
+    for (i = 0; i < route_cnt; i++)
+    {
+        size_t tpl = i % ARRAY_SIZE(s_route_templates);
+        char* pattern;
+
+        snprintf(buf, sizeof(buf), s_route_templates[tpl], i);
+        pattern = http_router_expand(buf);
+        linear[i].code = s_posix_regex.create(pattern, strlen(pattern));
+        linear[i].idx = i;
+        free(pattern);
+
+        if (!http_router_add(router, buf, HTTP_ROUTER_METHOD_ANY, 0, &linear[i]))
+        {
+            fprintf(stderr, "failed to add route `%s`\n", buf);
+            exit(EXIT_FAILURE);
+        }
+
+        snprintf(buf, sizeof(buf), s_uri_templates[tpl], i);
+        uris[i] = strdup(buf);
+        uri_lens[i] = strlen(buf);
+    }
+
+    /* Sanity check: both paths agree. */
+    for (i = 0; i < route_cnt; i++)
+    {
+        http_router_match_t match;
+        if (!http_router_match(router, HTTP_ROUTER_METHOD_GET, uris[i], uri_lens[i], &match)
+            || ((bench_linear_route_t*)match.data)->idx != i
+            || _bench_linear_match(linear, route_cnt, uris[i], uri_lens[i]) != i)
+        {
+            fprintf(stderr, "route mismatch for `%s`\n", uris[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    uint64_t t0 = _bench_now();
+    for (i = 0; i < iterations; i++)
+    {
+        size_t k = i % route_cnt;
+        hit += _bench_linear_match(linear, route_cnt, uris[k], uri_lens[k]) == k;
+    }
+    uint64_t t1 = _bench_now();
+    for (i = 0; i < iterations; i++)
+    {
+        hit += _bench_linear_match(linear, route_cnt, miss, strlen(miss)) == (size_t)-1;
+    }
+    uint64_t t2 = _bench_now();
+    for (i = 0; i < iterations; i++)
+    {
+        http_router_match_t match;
+        size_t k = i % route_cnt;
+        hit += http_router_match(router, HTTP_ROUTER_METHOD_GET, uris[k], uri_lens[k], &match);
+    }
+    uint64_t t3 = _bench_now();
+    for (i = 0; i < iterations; i++)
+    {
+        http_router_match_t match;
+        hit += !http_router_match(router, HTTP_ROUTER_METHOD_GET, miss, strlen(miss), &match);
+    }
+    uint64_t t4 = _bench_now();
+
+    printf("%6zu %14.1f %14.1f %14.1f %14.1f\n", route_cnt,
+        (double)(t1 - t0) / iterations, (double)(t2 - t1) / iterations,
+        (double)(t3 - t2) / iterations, (double)(t4 - t3) / iterations);
+
+    if (hit != iterations * 4)
+    {
+        fprintf(stderr, "unexpected match result\n");
+        exit(EXIT_FAILURE);
+    }
+
+    http_router_destroy(router);
+    for (i = 0; i < route_cnt; i++)
+    {
+        s_posix_regex.destroy(linear[i].code);
+        free(uris[i]);
+    }
+    free(linear);
+    free(uri_lens);
+    free(uris);
+}
+
+int main(int argc, char* argv[])
+{
+    size_t i;
+    static const size_t s_route_cnt[] = { 10, 50, 100, 200, 500, 1000 };
+    size_t iterations = argc > 1 ? (size_t)strtoull(argv[1], NULL, 10) : 2000;
+
+    printf("# ns per request\n");
+    printf("%6s %14s %14s %14s %14s\n", "routes", "linear_hit", "linear_miss", "trie_hit", "trie_miss");
+    for (i = 0; i < ARRAY_SIZE(s_route_cnt); i++)
+    {
+        _bench_run(s_route_cnt[i], iterations);
+    }
+
+    return 0;
+}
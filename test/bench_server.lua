@@ -0,0 +1,20 @@
+-- Server loaded by bench_http, which passes its fixture directory, listen url
+-- and poll thread count through the environment.
+local mongoose = require("mongoose")
+
+local server_opts = {
+    serve_dir = os.getenv("BENCH_HTTP_ROOT") or ".",
+    listen_url = os.getenv("BENCH_HTTP_URL") or "http://127.0.0.1:18080",
+    threads = tonumber(os.getenv("BENCH_HTTP_THREADS") or "1"),
+    static_cache = true,
+}
+local server = mongoose.http_server(server_opts)
+
+server:route("/echo/<int>", function(req, id)
+    return 200, id .. "\n", { "Content-Type", "text/plain" }
+end)
+
+assert(server:run() == true)
+
+io.write("bench server listen on " .. server_opts.listen_url .. "\n")
+auto.sleep(100000000)
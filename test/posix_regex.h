@@ -0,0 +1,137 @@
+/**
+ * @file
+ * Regex API of autodo provided by POSIX regex.
+ *
+ * autodo is not available outside of its host process, so tests of the router
+ * use this instead. Define `_GNU_SOURCE` before any include, matching needs
+ * `REG_STARTEND`.
+ */
+#ifndef __AUTO_MONGOOSE_TEST_POSIX_REGEX_H__
+#define __AUTO_MONGOOSE_TEST_POSIX_REGEX_H__
+
+#include <autodo.h>
+#include <regex.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define POSIX_REGEX_MAX_GROUPS  32
+
+struct auto_regex_code_s
+{
+    regex_t     re;
+    size_t      group_cnt;
+};
+
+/**
+ * @brief Translate the perl style escapes used by route patterns into POSIX ERE.
+ *
+ * The result is anchored at both ends, so a regex does full match just like
+ * the trie does.
+ */
+static char* _posix_regex_translate(const char* pattern, size_t size)
+{
+    size_t i, len = 0;
+    int in_bracket = 0;
+    char* dst = malloc(size * 12 + 3);
+
+    dst[len++] = '^';
+    for (i = 0; i < size; i++)
+    {
+        const char* rep = NULL;
+
+        if (pattern[i] == '\\' && i + 1 < size && (pattern[i + 1] == 'd' || pattern[i + 1] == 's'))
+        {
+            if (pattern[i + 1] == 'd')
+            {
+                rep = in_bracket ? "0-9" : "[0-9]";
+            }
+            else
+            {
+                rep = in_bracket ? "[:space:]" : "[[:space:]]";
+            }
+            i++;
+        }
+
+        if (rep != NULL)
+        {
+            memcpy(dst + len, rep, strlen(rep));
+            len += strlen(rep);
+            continue;
+        }
+
+        if (pattern[i] == '[')
+        {
+            in_bracket = 1;
+        }
+        else if (pattern[i] == ']')
+        {
+            in_bracket = 0;
+        }
+        dst[len++] = pattern[i];
+    }
+    dst[len++] = '$';
+    dst[len] = '\0';
+
+    return dst;
+}
+
+static auto_regex_code_t* _posix_regex_create(const char* pattern, size_t size)
+{
+    char* ere = _posix_regex_translate(pattern, size);
+    auto_regex_code_t* code = malloc(sizeof(auto_regex_code_t));
+
+    if (regcomp(&code->re, ere, REG_EXTENDED) != 0)
+    {
+        free(ere);
+        free(code);
+        return NULL;
+    }
+    free(ere);
+
+    code->group_cnt = code->re.re_nsub + 1;
+    return code;
+}
+
+static void _posix_regex_destroy(auto_regex_code_t* self)
+{
+    regfree(&self->re);
+    free(self);
+}
+
+static size_t _posix_regex_get_group_count(const auto_regex_code_t* code)
+{
+    return code->group_cnt;
+}
+
+static int _posix_regex_match(const auto_regex_code_t* self, const char* data, size_t size,
+    auto_regex_cb cb, void* arg)
+{
+    size_t i;
+    regmatch_t pmatch[POSIX_REGEX_MAX_GROUPS];
+    size_t groups[POSIX_REGEX_MAX_GROUPS * 2];
+
+    pmatch[0].rm_so = 0;
+    pmatch[0].rm_eo = (regoff_t)size;
+    if (regexec(&self->re, data, POSIX_REGEX_MAX_GROUPS, pmatch, REG_STARTEND) != 0)
+    {
+        return -1;
+    }
+
+    for (i = 0; i < self->group_cnt && i < POSIX_REGEX_MAX_GROUPS; i++)
+    {
+        groups[2 * i] = (size_t)pmatch[i].rm_so;
+        groups[2 * i + 1] = (size_t)pmatch[i].rm_eo;
+    }
+    cb(data, groups, i, arg);
+
+    return (int)i;
+}
+
+static const auto_api_regex_t s_posix_regex = {
+    _posix_regex_create,
+    _posix_regex_destroy,
+    _posix_regex_get_group_count,
+    _posix_regex_match,
+};
+
+#endif
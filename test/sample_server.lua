@@ -1,10 +1,133 @@
 local mongoose = require("mongoose")
 
+-- Serve the directory this script is in.
+local script_dir = debug.getinfo(1, "S").source:match("^@(.*[/\\])") or "./"
+
 local server_opts = {
-    serve_dir = "/home/qgymib/workspace/autodo-mongoose/test/",
+    serve_dir = script_dir,
+    static_cache = { max_bytes = 64 * 1024 * 1024, max_file_size = 1024 * 1024 },
+    compress = { min_size = 1024, mime_types = { "text/", "application/javascript", "application/json" } },
+    metrics_url = "/metrics",
+    max_body_size = 64 * 1024 * 1024,
+    -- Beyond these, clients get 503 with Retry-After instead of waiting in line.
+    max_connections = 10000,
+    max_inflight_requests = 1024,
+    max_queue_delay_ms = 500,
+    -- Close keep-alive connections idle this long, clients that take too long
+    -- to send a request, and clients that stop reading their response.
+    idle_timeout_ms = 30000,
+    header_timeout_ms = 10000,
+    write_timeout_ms = 30000,
+    response_cache = { max_bytes = 64 * 1024 * 1024 },
+    -- Per client address, beyond which requests get 429 with Retry-After.
+    rate_limit = { rate = 200, burst = 400, max_clients = 65536 },
     listen_url = "http://127.0.0.1:5001"
 }
 local server = mongoose.http_server(server_opts)
+
+server:route("/hello/<string>", function(req, name)
+    req:set_header("Content-Type", "text/plain")
+    req:send("hello " .. name .. "\n")
+end)
+
+server:route("/echo/<int>", function(req, id)
+    return 200, id .. "\n", { "Content-Type", "text/plain" }
+end)
+
+server:route("/greet", function(req)
+    local name = req:query("name") or "world"
+    return 200, req.method .. " hello " .. name .. "\n", { "Content-Type", "text/plain" }
+end)
+
+-- One path, one handler per method. Other methods get 405 with Allow.
+local items = {}
+server:get("/items/<int>", function(req, id)
+    local item = items[id]
+    if item == nil then
+        return 404, "no such item\n", { "Content-Type", "text/plain" }
+    end
+    return 200, item, { "Content-Type", "text/plain" }
+end)
+server:put("/items/<int>", function(req, id)
+    items[id] = req.body
+    return 204
+end)
+server:delete("/items/<int>", function(req, id)
+    items[id] = nil
+    return 204
+end)
+
+-- Regex routes are tried by priority rather than in the order of their text.
+server:route("/files/(.+)\\.json", function(req, name)
+    return 200, "json " .. name .. "\n", { "Content-Type", "text/plain" }
+end, { priority = 1 })
+server:route("/files/(.+)", function(req, name)
+    return 200, "file " .. name .. "\n", { "Content-Type", "text/plain" }
+end)
+
+-- Poll threads answer repeats for a second without calling lua.
+server:route("/time", function(req)
+    return 200, os.date("!%Y-%m-%dT%H:%M:%SZ") .. "\n", { "Content-Type", "text/plain" }
+end, { cache = { ttl_ms = 1000, vary = { "Accept-Encoding" } } })
+
+-- Calls /time over loopback, on a pooled keep-alive connection. Other requests
+-- are served while the handler waits for the upstream.
+server:route("/upstream", function(req)
+    local status, body = mongoose.http_request{ url = "http://127.0.0.1:5001/time", timeout_ms = 1000 }
+    if not status then
+        req:status(502)
+        req:write(body .. "\n")
+        return
+    end
+    req:set_header("Content-Type", "text/plain")
+    req:write("upstream said " .. body)
+end)
+
+-- Poll threads relay /api/... to two backends without calling lua.
+server:proxy("/api/<path>", {
+    upstreams = { "http://127.0.0.1:8081", "http://127.0.0.1:8082" },
+    policy = "least_conn",
+    timeout_ms = 5000,
+})
+
+server:route("/upload", function(req)
+    local size = 0
+    for chunk in req.read, req do
+        size = size + #chunk
+    end
+    return 200, size .. " bytes\n", { "Content-Type", "text/plain" }
+end, { stream_body = true, rate_limit = { rate = 1, burst = 5 } })
+
+server:route("/count/<int>", function(req, n)
+    req:set_header("Content-Type", "text/plain")
+    for i = 1, n do
+        if not req:write(i .. "\n") then
+            return
+        end
+    end
+end)
+
+-- Routes can change while serving. Requests already routed finish with the
+-- handler they matched.
+server:route("/feature/toggle", function(req)
+    if server:unroute("/feature") then
+        return 200, "off\n", { "Content-Type", "text/plain" }
+    end
+    server:route("/feature", function(req)
+        return 200, "feature on\n", { "Content-Type", "text/plain" }
+    end)
+    return 200, "on\n", { "Content-Type", "text/plain" }
+end)
+
+server:websocket("/chat", {
+    open = function(ws)
+        ws:subscribe("chat")
+    end,
+    message = function(ws, data, binary)
+        server:broadcast("chat", data, binary)
+    end,
+})
+
 assert(server:run() == true)
 
 io.write("server listen on " .. server_opts.listen_url .. "\n")
@@ -0,0 +1,57 @@
+-- Keep-alive pool and timeout of mongoose.http_request, against a loopback
+-- server that stands in for the upstream. Run by ctest through autodo.
+local mongoose = require("mongoose")
+
+local function check(cond, what)
+    if not cond then
+        io.stderr:write("test_http_client: check failed: " .. what .. "\n")
+        os.exit(1)
+    end
+end
+
+local url = os.getenv("TEST_HTTP_CLIENT_URL") or "http://127.0.0.1:18090"
+local upstream = mongoose.http_server({ listen_url = url, threads = 1 })
+
+upstream:route("/ok", function(req)
+    return 200, "ok", { "Content-Type", "text/plain" }
+end)
+
+upstream:route("/slow", function(req)
+    auto.sleep(2000)
+    return 200, "late", { "Content-Type", "text/plain" }
+end)
+
+assert(upstream:run() == true)
+
+local function accepted()
+    return upstream:stats().connections.accepted
+end
+
+mongoose.http_client_options{ max_idle_per_host = 4, idle_timeout_ms = 300 }
+
+-- Second request goes out on the connection the first one left idle.
+local status, body, headers = mongoose.http_request{ url = url .. "/ok" }
+check(status == 200 and body == "ok", "first request")
+check(headers["content-type"] == "text/plain", "response headers")
+check(accepted() == 1, "first request connects")
+
+status, body = mongoose.http_request{ url = url .. "/ok", method = "POST", body = "x" }
+check(status == 200 and body == "ok", "second request")
+check(accepted() == 1, "second request reuses the connection")
+
+-- Idle connection is closed after idle_timeout_ms, so next request connects again.
+auto.sleep(1000)
+status = mongoose.http_request{ url = url .. "/ok" }
+check(status == 200, "request after idle timeout")
+check(accepted() == 2, "idle connection is evicted")
+
+-- Upstream answers too late.
+status, body = mongoose.http_request{ url = url .. "/slow", timeout_ms = 200 }
+check(status == nil and body == "timeout", "timeout error")
+
+-- Connection that timed out is dropped, the pool still serves.
+status = mongoose.http_request{ url = url .. "/ok" }
+check(status == 200, "request after timeout")
+
+io.write("test_http_client: ok\n")
+os.exit(0)
@@ -0,0 +1,152 @@
+/**
+ * @file
+ * Method dispatch, priority and typed captures of the router.
+ */
+#define _GNU_SOURCE
+#include "router.h"
+#include "posix_regex.h"
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_CHECK(x) \
+    do { \
+        if (!(x)) \
+        { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+#define METHOD_BIT(x)   (1u << HTTP_ROUTER_METHOD_##x)
+
+static int _test_match(const http_router_t* router, int method, const char* uri, http_router_match_t* match)
+{
+    return http_router_match(router, method, uri, strlen(uri), match);
+}
+
+static void _test_methods(void)
+{
+    int get, post, del;
+    http_router_match_t match;
+    http_router_t* router = http_router_create(&s_posix_regex);
+
+    TEST_CHECK(http_router_add(router, "/users/<int>", HTTP_ROUTER_METHOD_GET, 0, &get));
+    TEST_CHECK(http_router_add(router, "/users/<int>", HTTP_ROUTER_METHOD_POST, 0, &post));
+    TEST_CHECK(!http_router_add(router, "/users/<int>", HTTP_ROUTER_METHOD_POST, 0, &post));
+    TEST_CHECK(http_router_add(router, "/users/<string>", HTTP_ROUTER_METHOD_DELETE, 0, &del));
+
+    TEST_CHECK(_test_match(router, HTTP_ROUTER_METHOD_GET, "/users/12", &match));
+    TEST_CHECK(match.data == &get && match.group_cnt == 1);
+    TEST_CHECK(_test_match(router, HTTP_ROUTER_METHOD_POST, "/users/12", &match) && match.data == &post);
+
+    /* Less specific route still serves a method the first one lacks. */
+    TEST_CHECK(_test_match(router, HTTP_ROUTER_METHOD_DELETE, "/users/12", &match) && match.data == &del);
+    TEST_CHECK(match.groups[0] == 7 && match.groups[1] == 9);
+
+    /* HEAD falls back to GET. */
+    TEST_CHECK(_test_match(router, HTTP_ROUTER_METHOD_HEAD, "/users/12", &match) && match.data == &get);
+
+    TEST_CHECK(!_test_match(router, HTTP_ROUTER_METHOD_PUT, "/users/12", &match));
+    TEST_CHECK(match.allow == (METHOD_BIT(GET) | METHOD_BIT(HEAD) | METHOD_BIT(POST) | METHOD_BIT(DELETE)));
+    TEST_CHECK(!_test_match(router, HTTP_ROUTER_METHOD_GET, "/users/ab", &match));
+    TEST_CHECK(match.allow == METHOD_BIT(DELETE));
+    TEST_CHECK(!_test_match(router, HTTP_ROUTER_METHOD_GET, "/groups/12", &match) && match.allow == 0);
+
+    http_router_destroy(router);
+}
+
+static void _test_priority(void)
+{
+    int put, any, low, get;
+    http_router_match_t match;
+    http_router_t* router = http_router_create(&s_posix_regex);
+
+    TEST_CHECK(http_router_add(router, "/x/(a|b)", HTTP_ROUTER_METHOD_PUT, 0, &put));
+    TEST_CHECK(http_router_add(router, "/x/(a|b)", HTTP_ROUTER_METHOD_ANY, 5, &any));
+    TEST_CHECK(http_router_add(router, "/x/<string>", HTTP_ROUTER_METHOD_ANY, 1, &low));
+
+    /* Priority belongs to the regex, so its any-method route wins over the trie. */
+    TEST_CHECK(_test_match(router, HTTP_ROUTER_METHOD_PUT, "/x/a", &match) && match.data == &any);
+    TEST_CHECK(_test_match(router, HTTP_ROUTER_METHOD_GET, "/x/a", &match) && match.data == &any);
+    TEST_CHECK(_test_match(router, HTTP_ROUTER_METHOD_GET, "/x/c", &match) && match.data == &low);
+    http_router_destroy(router);
+
+    /* At default priority the trie goes first, for methods it has. */
+    router = http_router_create(&s_posix_regex);
+    TEST_CHECK(http_router_add(router, "/x/(a|b)", HTTP_ROUTER_METHOD_PUT, 0, &put));
+    TEST_CHECK(http_router_add(router, "/x/<string>", HTTP_ROUTER_METHOD_GET, 0, &get));
+    TEST_CHECK(_test_match(router, HTTP_ROUTER_METHOD_PUT, "/x/a", &match) && match.data == &put);
+    TEST_CHECK(match.group_cnt == 1);
+    TEST_CHECK(_test_match(router, HTTP_ROUTER_METHOD_GET, "/x/a", &match) && match.data == &get);
+    TEST_CHECK(!_test_match(router, HTTP_ROUTER_METHOD_POST, "/x/a", &match));
+    TEST_CHECK(match.allow == (METHOD_BIT(GET) | METHOD_BIT(HEAD) | METHOD_BIT(PUT)));
+    http_router_destroy(router);
+}
+
+static void _test_typed(void)
+{
+    int i, len, n, s, f, u, r;
+    char uri[512];
+    http_router_match_t match;
+    http_router_t* router = http_router_create(&s_posix_regex);
+
+    TEST_CHECK(http_router_add(router, "/n/<int>", HTTP_ROUTER_METHOD_ANY, 0, &n));
+    TEST_CHECK(http_router_add(router, "/n/<string>", HTTP_ROUTER_METHOD_ANY, 0, &s));
+    TEST_CHECK(http_router_add(router, "/f/<float>/x", HTTP_ROUTER_METHOD_ANY, 0, &f));
+    TEST_CHECK(http_router_add(router, "/u/<uuid>", HTTP_ROUTER_METHOD_ANY, 0, &u));
+    TEST_CHECK(http_router_add(router, "/r/(v[0-9])/<int>", HTTP_ROUTER_METHOD_ANY, 0, &r));
+
+    TEST_CHECK(_test_match(router, HTTP_ROUTER_METHOD_GET, "/n/9223372036854775807", &match));
+    TEST_CHECK(match.data == &n && match.types[0] == HTTP_ROUTER_PARAM_INT && match.values[0].i == INT64_MAX);
+
+    /* Out of int64_t range, so next route takes it as text. */
+    TEST_CHECK(_test_match(router, HTTP_ROUTER_METHOD_GET, "/n/9223372036854775808", &match));
+    TEST_CHECK(match.data == &s && match.types[0] == HTTP_ROUTER_PARAM_STRING);
+
+    TEST_CHECK(_test_match(router, HTTP_ROUTER_METHOD_GET, "/f/-1.5/x", &match));
+    TEST_CHECK(match.data == &f && match.types[0] == HTTP_ROUTER_PARAM_FLOAT && match.values[0].f == -1.5);
+
+    /* Beyond range of double. */
+    len = snprintf(uri, sizeof(uri), "/f/");
+    for (i = 0; i < 400; i++)
+    {
+        uri[len++] = '9';
+    }
+    snprintf(uri + len, sizeof(uri) - len, "/x");
+    TEST_CHECK(!_test_match(router, HTTP_ROUTER_METHOD_GET, uri, &match));
+
+    /* Hyphens are skipped, case does not matter. */
+    TEST_CHECK(_test_match(router, HTTP_ROUTER_METHOD_GET, "/u/0123abcd-4567-89ef-ABCD-0123456789ef", &match));
+    TEST_CHECK(match.data == &u && match.types[0] == HTTP_ROUTER_PARAM_UUID);
+    TEST_CHECK(match.values[0].uuid[0] == 0x01 && match.values[0].uuid[3] == 0xcd);
+    TEST_CHECK(match.values[0].uuid[8] == 0xab && match.values[0].uuid[9] == 0xcd);
+    TEST_CHECK(match.values[0].uuid[15] == 0xef);
+
+    /* Plain regex groups stay text, placeholders in a regex still convert. */
+    TEST_CHECK(_test_match(router, HTTP_ROUTER_METHOD_GET, "/r/v2/42", &match));
+    TEST_CHECK(match.data == &r && match.group_cnt == 2);
+    TEST_CHECK(match.types[0] == HTTP_ROUTER_PARAM_STRING);
+    TEST_CHECK(match.types[1] == HTTP_ROUTER_PARAM_INT && match.values[1].i == 42);
+    TEST_CHECK(!_test_match(router, HTTP_ROUTER_METHOD_GET, "/r/v2/99999999999999999999", &match));
+
+    http_router_destroy(router);
+}
+
+static void _test_method_names(void)
+{
+    TEST_CHECK(http_router_method("GET", 3) == HTTP_ROUTER_METHOD_GET);
+    TEST_CHECK(http_router_method("OPTIONS", 7) == HTTP_ROUTER_METHOD_OPTIONS);
+    TEST_CHECK(http_router_method("get", 3) == HTTP_ROUTER_METHOD_ANY);
+    TEST_CHECK(http_router_method("BREW", 4) == HTTP_ROUTER_METHOD_ANY);
+    TEST_CHECK(strcmp(http_router_method_name(HTTP_ROUTER_METHOD_DELETE), "DELETE") == 0);
+    TEST_CHECK(http_router_method_name(HTTP_ROUTER_METHOD_ANY) == NULL);
+}
+
+int main(void)
+{
+    _test_methods();
+    _test_priority();
+    _test_typed();
+    _test_method_names();
+    return 0;
+}